@@ -31,8 +31,8 @@
 
 #define INCOMPAT_SUPPORTED (BTRFS_INCOMPAT_FLAGS_MIXED_BACKREF | BTRFS_INCOMPAT_FLAGS_DEFAULT_SUBVOL | BTRFS_INCOMPAT_FLAGS_MIXED_GROUPS | \
                             BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO | BTRFS_INCOMPAT_FLAGS_BIG_METADATA | BTRFS_INCOMPAT_FLAGS_RAID56 | \
-                            BTRFS_INCOMPAT_FLAGS_EXTENDED_IREF | BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA | BTRFS_INCOMPAT_FLAGS_NO_HOLES)
-#define COMPAT_RO_SUPPORTED 0
+                            BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD | BTRFS_INCOMPAT_FLAGS_EXTENDED_IREF | BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA | BTRFS_INCOMPAT_FLAGS_NO_HOLES)
+#define COMPAT_RO_SUPPORTED (BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_TREE | BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_TREE_VALID)
 
 static WCHAR device_name[] = {'\\','B','t','r','f','s',0};
 static WCHAR dosdevice_name[] = {'\\','D','o','s','D','e','v','i','c','e','s','\\','B','t','r','f','s',0};
@@ -50,6 +50,7 @@ UINT32 mount_compress = 0;
 UINT32 mount_compress_force = 0;
 UINT32 mount_compress_type = 0;
 UINT32 mount_zlib_level = 3;
+UINT32 mount_zstd_level = 3;
 UINT32 mount_flush_interval = 30;
 UINT32 mount_max_inline = 2048;
 BOOL log_started = FALSE;
@@ -273,6 +274,8 @@ static void STDCALL DriverUnload(PDRIVER_OBJECT DriverObject) {
     
     free_cache();
     
+    free_compression_contexts();
+    
     IoUnregisterFileSystem(DriverObject->DeviceObject);
    
     dosdevice_nameW.Buffer = dosdevice_name;
@@ -605,6 +608,11 @@ static NTSTATUS STDCALL drv_flush_buffers(IN PDEVICE_OBJECT DeviceObject, IN PIR
         }
         
         Status = Irp->IoStatus.Status;
+        
+        if (NT_SUCCESS(Status) && !Vcb->readonly) {
+            Status = fsync_fcb(Vcb, fcb, Irp);
+            Irp->IoStatus.Status = Status;
+        }
     }
     
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
@@ -1023,10 +1031,11 @@ NTSTATUS create_root(device_extension* Vcb, UINT64 id, root** rootptr, BOOL no_t
         t->new_address = 0;
         t->has_new_address = FALSE;
         t->flags = tp.tree->flags;
+        t->write = FALSE;
         
         InsertTailList(&Vcb->trees, &t->list_entry);
         
-        t->write = TRUE;
+        mark_tree_dirty(t);
         Vcb->need_write = TRUE;
     }
     
@@ -1218,6 +1227,7 @@ static NTSTATUS STDCALL set_label(device_extension* Vcb, FILE_FS_LABEL_INFORMATI
 //     test_space_list(Vcb);
     
     Vcb->need_write = TRUE;
+    volume_dirtied(Vcb, FALSE); // the superblock's the only thing that's changed, so nothing else will wake the flush thread
     
 release:  
     ExReleaseResourceLite(&Vcb->tree_lock);
@@ -1730,6 +1740,8 @@ void mark_fcb_dirty(fcb* fcb) {
         dirt->fcb = fcb;
         
         ExInterlockedInsertTailList(&fcb->Vcb->dirty_fcbs, &dirt->list_entry, &fcb->Vcb->dirty_fcbs_lock);
+        
+        volume_dirtied(fcb->Vcb, InterlockedIncrement(&fcb->Vcb->dirty.fcbs) == FLUSH_DIRTY_FCBS);
     }
     
     fcb->Vcb->need_write = TRUE;
@@ -1753,6 +1765,7 @@ void mark_fileref_dirty(file_ref* fileref) {
     }
     
     fileref->fcb->Vcb->need_write = TRUE;
+    volume_dirtied(fileref->fcb->Vcb, FALSE);
 }
 
 void _free_fcb(fcb* fcb, const char* func, const char* file, unsigned int line) {
@@ -1976,12 +1989,15 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
     LIST_ENTRY rollback;
     NTSTATUS Status;
     LIST_ENTRY* le;
-    LARGE_INTEGER time;
     
     Vcb->removing = TRUE;
     
     RemoveEntryList(&Vcb->list_entry);
     
+    print_compression_stats(Vcb);
+    print_commit_stats(Vcb);
+    print_delayed_ref_stats(Vcb);
+    
     Status = registry_mark_volume_unmounted(&Vcb->superblock.uuid);
     if (!NT_SUCCESS(Status))
         WARN("registry_mark_volume_unmounted returned %08x\n", Status);
@@ -2001,6 +2017,9 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
         ExReleaseResourceLite(&Vcb->tree_lock);
     }
     
+    clear_log(Vcb);
+    free_delayed_refs(Vcb);
+    
     for (i = 0; i < Vcb->threads.num_threads; i++) {
         Vcb->threads.threads[i].quit = TRUE;
         KeSetEvent(&Vcb->threads.threads[i].event, 0, FALSE);
@@ -2012,8 +2031,7 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
     
     ExFreePool(Vcb->threads.threads);
     
-    time.QuadPart = 0;
-    KeSetTimer(&Vcb->flush_thread_timer, time, NULL); // trigger the timer early
+    KeSetEvent(&Vcb->flush_thread_event, 0, FALSE);
     KeWaitForSingleObject(&Vcb->flush_thread_finished, Executive, KernelMode, FALSE, NULL);
     
     free_fcb(Vcb->volume_fcb);
@@ -2042,6 +2060,15 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
         ExFreePool(r);
     }
     
+    while (!IsListEmpty(&Vcb->drop_roots)) {
+        LIST_ENTRY* le = RemoveHeadList(&Vcb->drop_roots);
+        root* r = CONTAINING_RECORD(le, root, list_entry);
+
+        ExDeleteResourceLite(&r->nonpaged->load_tree_lock);
+        ExFreePool(r->nonpaged);
+        ExFreePool(r);
+    }
+    
     while (!IsListEmpty(&Vcb->chunks)) {
         chunk* c;
         
@@ -2062,6 +2089,8 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
             ExFreePool(s);
         }
         
+        free_space_bitmaps(c);
+        
         if (c->devices)
             ExFreePool(c->devices);
         
@@ -2095,6 +2124,9 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
     
     ExFreePool(Vcb->devices);
     
+    if (Vcb->log_superblock)
+        ExFreePool(Vcb->log_superblock);
+    
     ExDeleteResourceLite(&Vcb->fcb_lock);
     ExDeleteResourceLite(&Vcb->load_lock);
     ExDeleteResourceLite(&Vcb->tree_lock);
@@ -2675,6 +2707,10 @@ static NTSTATUS STDCALL add_root(device_extension* Vcb, UINT64 id, UINT64 addr,
         case BTRFS_ROOT_UUID:
             Vcb->uuid_root = r;
             break;
+            
+        case BTRFS_ROOT_FREE_SPACE:
+            Vcb->free_space_root = r;
+            break;
     }
     
     return STATUS_SUCCESS;
@@ -2712,6 +2748,32 @@ static NTSTATUS STDCALL look_for_roots(device_extension* Vcb, PIRP Irp) {
                     ERR("add_root returned %08x\n", Status);
                     return Status;
                 }
+                
+                // Subvolume which was part way through being deleted - the flush thread will carry on with it, skipping
+                // everything before drop_progress. We can only do this if the item's new enough to have drop_level.
+                if (tp.item->key.obj_id >= 0x100 && tp.item->key.obj_id < 0xFFFFFFFFFFFFFF00 &&
+                    tp.item->size > offsetof(ROOT_ITEM, drop_level) && ri->num_references == 0) {
+                    root* r = CONTAINING_RECORD(Vcb->roots.Blink, root, list_entry);
+                    
+                    if (ri->drop_progress.obj_id != 0 && (ri->drop_level == 0 || ri->drop_level > ri->root_level)) {
+                        ERR("root %llx: invalid drop_level %x for drop_progress (%llx,%x,%llx), not resuming deletion\n", r->id, ri->drop_level,
+                            ri->drop_progress.obj_id, ri->drop_progress.obj_type, ri->drop_progress.offset);
+                    } else {
+                        TRACE("root %llx is being deleted, dropped up to (%llx,%x,%llx) at level %x\n", r->id, ri->drop_progress.obj_id,
+                              ri->drop_progress.obj_type, ri->drop_progress.offset, ri->drop_level);
+                        
+                        if (ri->drop_progress.obj_id == 0) {
+                            // drop_progress doesn't mean anything until the first key's been recorded
+                            r->root_item.drop_progress.obj_id = 0;
+                            r->root_item.drop_progress.obj_type = 0;
+                            r->root_item.drop_progress.offset = 0;
+                            r->root_item.drop_level = 0;
+                        }
+                        
+                        RemoveEntryList(&r->list_entry);
+                        InsertTailList(&Vcb->drop_roots, &r->list_entry);
+                    }
+                }
             }
         }
     
@@ -3033,9 +3095,12 @@ static NTSTATUS STDCALL load_chunk_root(device_extension* Vcb, PIRP Irp) {
                 ExInitializeResourceLite(&c->changed_extents_lock);
                 
                 InitializeListHead(&c->space);
-                InitializeListHead(&c->space_size);
+                c->space_tree = NULL;
+                InitializeListHead(&c->bitmaps);
                 InitializeListHead(&c->deleting);
                 InitializeListHead(&c->changed_extents);
+                
+                c->cache_loaded = FALSE;
 
                 InsertTailList(&Vcb->chunks, &c->list_entry);
                 
@@ -3167,16 +3232,7 @@ static NTSTATUS STDCALL find_chunk_usage(device_extension* Vcb, PIRP Irp) {
 //             return (addr - c->offset) + cis->offset;
 //         }
         
-        // FIXME - make sure we free occasionally after doing one of these, or we
-        // might use up a lot of memory with a big disk.
-        
-        Status = load_free_space_cache(Vcb, c, Irp);
-        if (!NT_SUCCESS(Status)) {
-            ERR("load_free_space_cache returned %08x\n", Status);
-            return Status;
-        }        
-        
-        protect_superblocks(Vcb, c);
+        // The free space itself gets loaded by load_cache_chunk, the first time we try to allocate from the chunk.
 
         le = le->Flink;
     }
@@ -3433,6 +3489,34 @@ BOOL add_thread_job(device_extension* Vcb, PIRP Irp) {
     }
     
     tj->Irp = Irp;
+    tj->func = NULL;
+    tj->thread = threadnum;
+    tj->started = FALSE;
+    
+    InterlockedIncrement(&Vcb->threads.pending_jobs);
+    
+    ExInterlockedInsertTailList(&Vcb->threads.threads[threadnum].jobs, &tj->list_entry, &Vcb->threads.threads[threadnum].spin_lock);
+    KeSetEvent(&Vcb->threads.threads[threadnum].event, 0, FALSE);
+    
+    return TRUE;
+}
+
+// The caller fills in tj->func and tj->context, and has to keep tj around until either the function
+// has run or cancel_thread_job has succeeded.
+BOOL add_thread_func_job(device_extension* Vcb, thread_job* tj) {
+    ULONG threadnum;
+    
+    threadnum = InterlockedIncrement(&Vcb->threads.next_thread) % Vcb->threads.num_threads;
+    
+    if (Vcb->threads.pending_jobs >= Vcb->threads.num_threads)
+        return FALSE;
+    
+    if (Vcb->threads.threads[threadnum].quit)
+        return FALSE;
+    
+    tj->Irp = NULL;
+    tj->thread = threadnum;
+    tj->started = FALSE;
     
     InterlockedIncrement(&Vcb->threads.pending_jobs);
     
@@ -3442,6 +3526,27 @@ BOOL add_thread_job(device_extension* Vcb, PIRP Irp) {
     return TRUE;
 }
 
+// Returns TRUE if the job was taken off the queue before a thread got to it.
+BOOL cancel_thread_job(device_extension* Vcb, thread_job* tj) {
+    drv_thread* thread = &Vcb->threads.threads[tj->thread];
+    BOOL cancelled = FALSE;
+    KIRQL irql;
+    
+    KeAcquireSpinLock(&thread->spin_lock, &irql);
+    
+    if (!tj->started) {
+        RemoveEntryList(&tj->list_entry);
+        cancelled = TRUE;
+    }
+    
+    KeReleaseSpinLock(&thread->spin_lock, irql);
+    
+    if (cancelled)
+        InterlockedDecrement(&Vcb->threads.pending_jobs);
+    
+    return cancelled;
+}
+
 static BOOL raid_generations_okay(device_extension* Vcb) {
     UINT64 i;
     
@@ -3481,9 +3586,12 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     traverse_ptr tp;
     fcb* root_fcb = NULL;
     ccb* root_ccb = NULL;
+    LARGE_INTEGER time1, time2, freq;
     
     TRACE("mount_vol called\n");
     
+    time1 = KeQueryPerformanceCounter(&freq);
+    
     if (DeviceObject != devobj)
     {
         Status = STATUS_INVALID_DEVICE_REQUEST;
@@ -3612,9 +3720,29 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
         Vcb->readonly = TRUE;
     }
     
+    // the free space tree is no use to us if Linux didn't finish building it
+    if (Vcb->superblock.compat_ro_flags & BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_TREE && !(Vcb->superblock.compat_ro_flags & BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_TREE_VALID)) {
+        WARN("mounting read-only because free space tree is not valid\n");
+        Vcb->readonly = TRUE;
+    }
+    
     if (Vcb->options.readonly)
         Vcb->readonly = TRUE;
     
+    // This is what fsync writes back out, with a pointer to its log tree - see tree-log.c.
+    if (!Vcb->readonly) {
+        Vcb->log_superblock = ExAllocatePoolWithTag(NonPagedPool, sizeof(superblock), ALLOC_TAG);
+        if (!Vcb->log_superblock) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
+        }
+        
+        RtlCopyMemory(Vcb->log_superblock, &Vcb->superblock, sizeof(superblock));
+        Vcb->log_superblock->log_tree_addr = 0;
+        Vcb->log_superblock->log_root_level = 0;
+    }
+    
     Vcb->superblock.generation++;
     Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_MIXED_BACKREF;
     
@@ -3664,15 +3792,28 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     InitializeListHead(&Vcb->chunks);
     InitializeListHead(&Vcb->chunks_changed);
     InitializeListHead(&Vcb->trees);
+    
+    for (i = 0; i < BTRFS_MAX_LEVEL; i++) {
+        InitializeListHead(&Vcb->dirty_trees[i]);
+    }
+    
     InitializeListHead(&Vcb->all_fcbs);
     InitializeListHead(&Vcb->dirty_fcbs);
     InitializeListHead(&Vcb->dirty_filerefs);
     InitializeListHead(&Vcb->shared_extents);
+    InitializeListHead(&Vcb->delayed_refs);
+    Vcb->delayed_ref_tree = NULL;
     InitializeListHead(&Vcb->sector_checksums);
+    InitializeListHead(&Vcb->log_roots);
+    InitializeListHead(&Vcb->log_blocks);
     
     KeInitializeSpinLock(&Vcb->dirty_fcbs_lock);
     KeInitializeSpinLock(&Vcb->dirty_filerefs_lock);
+    KeInitializeSpinLock(&Vcb->commit.lock);
+    
+    KeInitializeEvent(&Vcb->flush_thread_event, SynchronizationEvent, FALSE);
     KeInitializeSpinLock(&Vcb->shared_extents_lock);
+    KeInitializeSpinLock(&Vcb->clusters_lock);
     
     InitializeListHead(&Vcb->DirNotifyList);
 
@@ -3718,6 +3859,10 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
         goto exit;
     }
     
+    if ((Vcb->superblock.compat_ro_flags & (BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_TREE | BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_TREE_VALID)) !=
+        (BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_TREE | BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_TREE_VALID))
+        Vcb->free_space_root = NULL;
+    
     if (!Vcb->readonly) {
         Status = find_chunk_usage(Vcb, Irp);
         if (!NT_SUCCESS(Status)) {
@@ -3727,7 +3872,7 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     }
     
     // We've already increased the generation by one
-    if (!Vcb->readonly && Vcb->superblock.generation - 1 != Vcb->superblock.cache_generation) {
+    if (!Vcb->readonly && !Vcb->free_space_root && Vcb->superblock.generation - 1 != Vcb->superblock.cache_generation) {
         WARN("generation was %llx, free-space cache generation was %llx; clearing cache...\n", Vcb->superblock.generation - 1, Vcb->superblock.cache_generation);
         Status = clear_free_space_cache(Vcb, Irp);
         if (!NT_SUCCESS(Status)) {
@@ -3839,6 +3984,18 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
         }
     }
     
+    if (Vcb->superblock.log_tree_addr != 0) {
+        if (Vcb->readonly)
+            WARN("not replaying log tree, as volume is read-only\n");
+        else {
+            Status = replay_log(Vcb, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("replay_log returned %08x\n", Status);
+                goto exit;
+            }
+        }
+    }
+    
 //     root_test(Vcb);
     
     KeInitializeSpinLock(&Vcb->FcbListLock);
@@ -3853,6 +4010,7 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     Vcb->Vpb = NewDeviceObject->Vpb;
     
     KeInitializeEvent(&Vcb->flush_thread_finished, NotificationEvent, FALSE);
+    KeInitializeEvent(&Vcb->commit.finished, NotificationEvent, FALSE);
     
     Status = PsCreateSystemThread(&Vcb->flush_thread_handle, 0, NULL, NULL, NULL, flush_thread, NewDeviceObject);
     if (!NT_SUCCESS(Status)) {
@@ -3870,6 +4028,10 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     if (!NT_SUCCESS(Status))
         WARN("registry_mark_volume_mounted returned %08x\n", Status);
     
+    time2 = KeQueryPerformanceCounter(NULL);
+    
+    TRACE("mount took %llu ms\n", (time2.QuadPart - time1.QuadPart) * 1000 / freq.QuadPart);
+    
     Status = STATUS_SUCCESS;
 
 exit:
@@ -3898,6 +4060,9 @@ exit:
 
             if (Vcb->devices)
                 ExFreePoolWithTag(Vcb->devices, ALLOC_TAG);
+            
+            if (Vcb->log_superblock)
+                ExFreePool(Vcb->log_superblock);
 
             RemoveEntryList(&Vcb->list_entry);
         }
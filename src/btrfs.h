@@ -19,6 +19,7 @@ static const UINT64 superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0x4
 #define TYPE_INODE_REF         0x0C
 #define TYPE_INODE_EXTREF      0x0D
 #define TYPE_XATTR_ITEM        0x18
+#define TYPE_ORPHAN_INODE      0x30
 #define TYPE_DIR_ITEM          0x54
 #define TYPE_DIR_INDEX         0x60
 #define TYPE_EXTENT_DATA       0x6C
@@ -34,6 +35,9 @@ static const UINT64 superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0x4
 #define TYPE_SHARED_BLOCK_REF  0xB6
 #define TYPE_SHARED_DATA_REF   0xB8
 #define TYPE_BLOCK_GROUP_ITEM  0xC0
+#define TYPE_FREE_SPACE_INFO   0xC6
+#define TYPE_FREE_SPACE_EXTENT 0xC7
+#define TYPE_FREE_SPACE_BITMAP 0xC8
 #define TYPE_DEV_EXTENT        0xCC
 #define TYPE_DEV_ITEM          0xD8
 #define TYPE_CHUNK_ITEM        0xE4
@@ -46,10 +50,14 @@ static const UINT64 superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0x4
 #define BTRFS_ROOT_FSTREE       5
 #define BTRFS_ROOT_CHECKSUM     7
 #define BTRFS_ROOT_UUID         9
+#define BTRFS_ROOT_FREE_SPACE   0xa
+
+#define BTRFS_MAX_LEVEL         8
 
 #define BTRFS_COMPRESSION_NONE  0
 #define BTRFS_COMPRESSION_ZLIB  1
 #define BTRFS_COMPRESSION_LZO   2
+#define BTRFS_COMPRESSION_ZSTD  3
 
 #define BTRFS_ENCRYPTION_NONE   0
 
@@ -71,6 +79,8 @@ static const UINT64 superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0x4
 
 #define FREE_SPACE_CACHE_ID     0xFFFFFFFFFFFFFFF5
 #define EXTENT_CSUM_ID          0xFFFFFFFFFFFFFFF6
+#define TREE_LOG_ID             0xFFFFFFFFFFFFFFFA
+#define ORPHAN_ID               0xFFFFFFFFFFFFFFFB
 
 #define BTRFS_INODE_NODATASUM   0x001
 #define BTRFS_INODE_NODATACOW   0x002
@@ -87,13 +97,14 @@ static const UINT64 superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0x4
 
 #define BTRFS_SUBVOL_READONLY   0x1
 
-#define BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_CACHE  0x1
+#define BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_TREE         0x1
+#define BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_TREE_VALID   0x2
 
 #define BTRFS_INCOMPAT_FLAGS_MIXED_BACKREF      0x0001
 #define BTRFS_INCOMPAT_FLAGS_DEFAULT_SUBVOL     0x0002
 #define BTRFS_INCOMPAT_FLAGS_MIXED_GROUPS       0x0004
 #define BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO       0x0008
-#define BTRFS_INCOMPAT_FLAGS_COMPRESS_LZOV2     0x0010
+#define BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD      0x0010
 #define BTRFS_INCOMPAT_FLAGS_BIG_METADATA       0x0020
 #define BTRFS_INCOMPAT_FLAGS_EXTENDED_IREF      0x0040
 #define BTRFS_INCOMPAT_FLAGS_RAID56             0x0080
@@ -417,6 +428,13 @@ typedef struct {
     UINT64 num_bitmaps;
 } FREE_SPACE_ITEM;
 
+#define FREE_SPACE_USING_BITMAPS 1
+
+typedef struct {
+    UINT32 count;
+    UINT32 flags;
+} FREE_SPACE_INFO;
+
 typedef struct {
     UINT64 dir;
     UINT64 index;
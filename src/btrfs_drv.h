@@ -48,6 +48,7 @@
 
 #define ALLOC_TAG 0x7442484D //'MHBt'
 #define ALLOC_TAG_ZLIB 0x7A42484D //'MHBz'
+#define ALLOC_TAG_ZSTD 0x7342484D //'MHBs'
 
 #define STDCALL __stdcall
 
@@ -68,6 +69,8 @@
 
 #define READ_AHEAD_GRANULARITY COMPRESSED_EXTENT_SIZE // really ought to be a multiple of COMPRESSED_EXTENT_SIZE
 
+#define MAX_CSUM_SIZE (4096 - sizeof(tree_header) - sizeof(leaf_node))
+
 #ifdef _MSC_VER
 #define try __try
 #define except __except
@@ -109,6 +112,7 @@ typedef struct {
     ULONG datalen;
     BOOL unique;
     BOOL ignore;
+    BOOL inserted;
     
     LIST_ENTRY list_entry;
 } extent;
@@ -152,6 +156,9 @@ typedef struct _fcb {
     SHARE_ACCESS share_access;
     WCHAR* debug_desc;
     LIST_ENTRY extents;
+    UINT64 alloc_hint;
+    UINT8 compress_failures;
+    UINT8 compress_skip;
     UINT64 last_dir_index;
     ANSI_STRING reparse_xattr;
     LIST_ENTRY hardlinks;
@@ -294,6 +301,7 @@ typedef struct _tree {
     BOOL has_new_address;
     UINT64 flags;
     BOOL write;
+    LIST_ENTRY list_entry_dirty;
 } tree;
 
 typedef struct {
@@ -322,13 +330,30 @@ typedef struct _root_cache {
     struct _root_cache* next;
 } root_cache;
 
-typedef struct {
+typedef struct _space {
     UINT64 address;
     UINT64 size;
     LIST_ENTRY list_entry;
-    LIST_ENTRY list_entry_size;
+    
+    // Chunks also keep their free space in a treap ordered by address, so that we can find
+    // where an entry goes and the first entry big enough for an allocation in O(log n).
+    struct _space* parent;
+    struct _space* left;
+    struct _space* right;
+    UINT64 max_size; // largest size in this subtree
+    UINT32 priority;
 } space;
 
+// Heavily fragmented regions of a chunk are kept as bitmaps rather than as space entries. Each
+// bitmap is one sector long, and so covers sector_size * 8 sectors - the same as the bitmaps
+// in the v1 free space cache.
+typedef struct {
+    UINT64 address;
+    ULONG* bits; // set bits are free sectors
+    UINT32 free;
+    LIST_ENTRY list_entry;
+} space_bitmap;
+
 typedef struct {
     PDEVICE_OBJECT devobj;
     DEV_ITEM devitem;
@@ -347,17 +372,107 @@ typedef struct {
     device** devices;
     fcb* cache;
     LIST_ENTRY space;
-    LIST_ENTRY space_size;
+    space* space_tree;
+    LIST_ENTRY bitmaps;
     LIST_ENTRY deleting;
     LIST_ENTRY changed_extents;
     ERESOURCE lock;
     ERESOURCE changed_extents_lock;
     BOOL created;
+    BOOL cache_loaded;
     
     LIST_ENTRY list_entry;
     LIST_ENTRY list_entry_changed;
 } chunk;
 
+#define ALLOC_CLUSTERS      8
+#define ALLOC_CLUSTER_SIZE  0x800000 // 8 MB
+
+typedef struct {
+    UINT64 address;
+    UINT64 end;
+} alloc_cluster;
+
+typedef struct {
+    LONG64 parts_compressed;
+    LONG64 parts_incompressible;
+    LONG64 parts_rejected;
+    LONG64 parts_skipped;
+    LONG64 bytes_in;
+    LONG64 bytes_out;
+    LONG64 wasted_time;
+    LONG64 heuristic_time;
+} compression_stats;
+
+#define COMMIT_REASON_NONE      0
+#define COMMIT_REASON_AGE       1
+#define COMMIT_REASON_METADATA  2
+#define COMMIT_REASON_FCBS      3
+#define COMMIT_REASON_CHECKSUMS 4
+#define COMMIT_REASON_FSYNC     5
+#define COMMIT_REASON_CLEANER   6
+#define COMMIT_REASONS          7
+
+// The flush thread commits once any of these is exceeded, or once the oldest change is flush_interval seconds old.
+// Writers have to wait for a commit if we get to THROTTLE_FACTOR times any of them.
+#define FLUSH_DIRTY_METADATA    0x2000000 // 32 MB
+#define FLUSH_DIRTY_FCBS        1024
+#define FLUSH_DIRTY_CHECKSUMS   0x40000 // 1 GB, with 4 KB sectors
+#define THROTTLE_FACTOR         4
+
+// Deleted subvolumes are freed this many tree blocks per commit - fewer if the commit has other work in it.
+#define DROP_ROOT_BATCH         1024
+#define DROP_ROOT_BATCH_BUSY    64
+#define DROP_ROOT_INTERVAL      10000000 // 1 second, in 100ns units
+
+typedef struct {
+    LONG trees;
+    LONG fcbs;
+    LONG checksums;
+    UINT64 since;
+} dirty_stats;
+
+typedef struct {
+    LONG64 commits[COMMIT_REASONS];
+    LONG64 throttled;
+} commit_stats;
+
+// Tree block refs queued by insert_tree_extent and reduce_tree_extent, and applied to the extent tree at commit.
+typedef struct _delayed_ref {
+    UINT64 address;
+    UINT64 root;
+    UINT8 level;
+    signed int count;
+    LIST_ENTRY list_entry;
+    
+    // also kept in a treap ordered by address, like the chunks' free space, so we can find a block's ref in O(log n)
+    struct _delayed_ref* parent;
+    struct _delayed_ref* left;
+    struct _delayed_ref* right;
+    UINT32 priority;
+} delayed_ref;
+
+typedef struct {
+    LONG64 queued;
+    LONG64 cancelled;
+    LONG64 applied;
+    LONG64 data_cancelled;
+} delayed_ref_stats;
+
+#define GROUP_COMMIT_MAX_WAIT   150000 // 15 ms, in 100ns units
+
+typedef struct {
+    KSPIN_LOCK lock;
+    KEVENT finished;
+    BOOL running;
+    UINT64 started;
+    UINT64 done;
+    NTSTATUS status;
+    ULONG joined;
+    ULONG last_batch;
+    UINT64 avg_time;
+} group_commit;
+
 typedef struct {
     UINT64 address;
     UINT64 size;
@@ -398,6 +513,10 @@ typedef struct {
 
 typedef struct {
     PIRP Irp;
+    void (*func)(void* context); // if set, called instead of dispatching Irp; the job belongs to the caller
+    void* context;
+    ULONG thread;
+    BOOL started;
     LIST_ENTRY list_entry;
 } thread_job;
 
@@ -424,6 +543,7 @@ typedef struct {
     UINT8 compress_type;
     BOOL readonly;
     UINT32 zlib_level;
+    UINT32 zstd_level;
     UINT32 flush_interval;
     UINT32 max_inline;
     UINT64 subvol_id;
@@ -469,11 +589,13 @@ typedef struct _device_extension {
     root* checksum_root;
     root* dev_root;
     root* uuid_root;
+    root* free_space_root;
     BOOL log_to_phys_loaded;
     LIST_ENTRY sys_chunks;
     LIST_ENTRY chunks;
     LIST_ENTRY chunks_changed;
     LIST_ENTRY trees;
+    LIST_ENTRY dirty_trees[BTRFS_MAX_LEVEL];
     LIST_ENTRY all_fcbs;
     LIST_ENTRY dirty_fcbs;
     KSPIN_LOCK dirty_fcbs_lock;
@@ -481,12 +603,24 @@ typedef struct _device_extension {
     KSPIN_LOCK dirty_filerefs_lock;
     ERESOURCE checksum_lock;
     ERESOURCE chunk_lock;
+    alloc_cluster clusters[ALLOC_CLUSTERS];
+    KSPIN_LOCK clusters_lock;
+    compression_stats comp_stats;
+    dirty_stats dirty;
+    commit_stats commits;
+    LIST_ENTRY delayed_refs;
+    delayed_ref* delayed_ref_tree;
+    delayed_ref_stats ref_stats;
     LIST_ENTRY sector_checksums;
+    LIST_ENTRY log_roots;
+    LIST_ENTRY log_blocks;
+    superblock* log_superblock;
     LIST_ENTRY shared_extents;
     KSPIN_LOCK shared_extents_lock;
     HANDLE flush_thread_handle;
-    KTIMER flush_thread_timer;
+    KEVENT flush_thread_event;
     KEVENT flush_thread_finished;
+    group_commit commit;
     drv_threads threads;
     PFILE_OBJECT root_file;
     LIST_ENTRY list_entry;
@@ -588,6 +722,28 @@ static __inline void insert_into_ordered_list(LIST_ENTRY* list, ordered_list* in
     InsertTailList(list, &ins->list_entry);
 }
 
+// Called whenever something changes which the next commit will have to write. The flush thread gets woken
+// up by the first change after a commit, so it knows how long to sleep for, and by any which takes us over a limit.
+static __inline void volume_dirtied(device_extension* Vcb, BOOL over_limit) {
+    if (Vcb->dirty.since == 0) {
+        Vcb->dirty.since = KeQueryInterruptTime();
+        over_limit = TRUE;
+    }
+    
+    if (over_limit)
+        KeSetEvent(&Vcb->flush_thread_event, 0, FALSE);
+}
+
+// Dirty trees are kept in a list for each level, so that flushing only has to look at the trees it's writing.
+static __inline void mark_tree_dirty(tree* t) {
+    if (!t->write) {
+        t->write = TRUE;
+        InsertTailList(&t->Vcb->dirty_trees[t->header.level], &t->list_entry_dirty);
+        
+        volume_dirtied(t->Vcb, (UINT64)InterlockedIncrement(&t->Vcb->dirty.trees) * t->Vcb->superblock.node_size == FLUSH_DIRTY_METADATA);
+    }
+}
+
 static __inline void get_raid0_offset(UINT64 off, UINT64 stripe_length, UINT16 num_stripes, UINT64* stripeoff, UINT16* stripe) {
     UINT64 initoff, startoff;
     
@@ -624,6 +780,8 @@ void send_notification_fcb(file_ref* fileref, ULONG filter_match, ULONG action);
 WCHAR* file_desc(PFILE_OBJECT FileObject);
 WCHAR* file_desc_fileref(file_ref* fileref);
 BOOL add_thread_job(device_extension* Vcb, PIRP Irp);
+BOOL add_thread_func_job(device_extension* Vcb, thread_job* tj);
+BOOL cancel_thread_job(device_extension* Vcb, thread_job* tj);
 NTSTATUS part0_passthrough(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
 void mark_fcb_dirty(fcb* fcb);
 void mark_fileref_dirty(file_ref* fileref);
@@ -645,6 +803,7 @@ extern UINT32 mount_compress;
 extern UINT32 mount_compress_force;
 extern UINT32 mount_compress_type;
 extern UINT32 mount_zlib_level;
+extern UINT32 mount_zstd_level;
 extern UINT32 mount_flush_interval;
 extern UINT32 mount_max_inline;
 
@@ -697,10 +856,11 @@ void STDCALL init_fast_io_dispatch(FAST_IO_DISPATCH** fiod);
 
 // in crc32c.c
 UINT32 STDCALL calc_crc32c(UINT32 seed, UINT8* msg, ULONG msglen);
+void STDCALL calc_sector_crc32c(UINT8* data, ULONG sector_size, ULONG num_sectors, UINT32* csums);
 
 typedef struct {
     LIST_ENTRY* list;
-    LIST_ENTRY* list_size;
+    space** tree;
     UINT64 address;
     UINT64 length;
     chunk* chunk;
@@ -717,7 +877,8 @@ enum rollback_type {
     ROLLBACK_INSERT_EXTENT,
     ROLLBACK_DELETE_EXTENT,
     ROLLBACK_ADD_SPACE,
-    ROLLBACK_SUBTRACT_SPACE
+    ROLLBACK_SUBTRACT_SPACE,
+    ROLLBACK_DELAYED_REF
 };
 
 // in treefuncs.c
@@ -767,12 +928,16 @@ void free_write_data_stripes(write_data_context* wtc);
 NTSTATUS STDCALL drv_write(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
 BOOL insert_extent_chunk(device_extension* Vcb, fcb* fcb, chunk* c, UINT64 start_data, UINT64 length, BOOL prealloc, void* data, LIST_ENTRY* changed_sector_list,
                          PIRP Irp, LIST_ENTRY* rollback, UINT8 compression, UINT64 decoded_size);
+BOOL insert_extent_clustered(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT64 length, BOOL prealloc, void* data, LIST_ENTRY* changed_sector_list,
+                             PIRP Irp, LIST_ENTRY* rollback, UINT8 compression, UINT64 decoded_size);
 NTSTATUS insert_extent(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT64 length, void* data, LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback);
 NTSTATUS update_changed_extent_ref(device_extension* Vcb, chunk* c, UINT64 address, UINT64 size, UINT64 root, UINT64 objid, UINT64 offset,
                                    signed long long count, BOOL no_csum, UINT64 new_size, PIRP Irp);
 NTSTATUS do_write_file(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback);
 NTSTATUS write_compressed(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback);
 BOOL find_address_in_chunk(device_extension* Vcb, chunk* c, UINT64 length, UINT64* address);
+BOOL add_extent_to_fcb(fcb* fcb, UINT64 offset, EXTENT_DATA* ed, ULONG edsize, BOOL unique, LIST_ENTRY* rollback);
+void add_changed_extent_ref(chunk* c, UINT64 address, UINT64 size, UINT64 root, UINT64 objid, UINT64 offset, UINT32 count, BOOL no_csum);
 
 // in dirctrl.c
 NTSTATUS STDCALL drv_directory_control(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
@@ -822,31 +987,59 @@ void STDCALL flush_thread(void* context);
 NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback);
 NTSTATUS get_tree_new_address(device_extension* Vcb, tree* t, PIRP Irp, LIST_ENTRY* rollback);
 void flush_fcb(fcb* fcb, BOOL cache, PIRP Irp, LIST_ENTRY* rollback);
+NTSTATUS STDCALL write_superblock(device_extension* Vcb, superblock* sb, device* device);
+NTSTATUS commit_transaction(device_extension* Vcb, UINT8 reason, PIRP Irp);
+void throttle_writes(device_extension* Vcb, PIRP Irp);
+void print_commit_stats(device_extension* Vcb);
+NTSTATUS add_delayed_ref(device_extension* Vcb, UINT64 address, UINT8 level, UINT64 root, signed int count, LIST_ENTRY* rollback);
+void free_delayed_refs(device_extension* Vcb);
+void print_delayed_ref_stats(device_extension* Vcb);
+
+// in tree-log.c
+NTSTATUS fsync_fcb(device_extension* Vcb, fcb* fcb, PIRP Irp);
+NTSTATUS replay_log(device_extension* Vcb, PIRP Irp);
+void clear_log(device_extension* Vcb);
+BOOL chunk_has_log_blocks(device_extension* Vcb, chunk* c);
 
 // in read.c
 NTSTATUS STDCALL drv_read(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 NTSTATUS STDCALL read_data(device_extension* Vcb, UINT64 addr, UINT32 length, UINT32* csum, BOOL is_tree, UINT8* buf, chunk** pc, PIRP Irp);
 NTSTATUS STDCALL read_file(fcb* fcb, UINT8* data, UINT64 start, UINT64 length, ULONG* pbr, PIRP Irp);
 NTSTATUS do_read(PIRP Irp, BOOL wait, ULONG* bytes_read);
+NTSTATUS load_csum(device_extension* Vcb, UINT64 start, UINT64 length, UINT32** pcsum, PIRP Irp);
 
 // in pnp.c
 NTSTATUS STDCALL drv_pnp(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 
 // in free-space.c
 NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp);
+NTSTATUS load_cache_chunk(device_extension* Vcb, chunk* c, PIRP Irp);
 NTSTATUS clear_free_space_cache(device_extension* Vcb, PIRP Irp);
 NTSTATUS allocate_cache(device_extension* Vcb, BOOL* changed, PIRP Irp, LIST_ENTRY* rollback);
 NTSTATUS update_chunk_caches(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback);
-NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 offset, UINT64 size);
+NTSTATUS update_free_space_tree(device_extension* Vcb, BOOL* changed, PIRP Irp, LIST_ENTRY* rollback);
+NTSTATUS remove_free_space_tree_chunk(device_extension* Vcb, chunk* c, PIRP Irp, LIST_ENTRY* rollback);
+void merge_deleted_space(device_extension* Vcb);
+NTSTATUS add_space_entry(LIST_ENTRY* list, space** tree, UINT64 offset, UINT64 size);
 void _space_list_add(device_extension* Vcb, chunk* c, BOOL deleting, UINT64 address, UINT64 length, LIST_ENTRY* rollback, const char* func);
-void _space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func);
+void _space_list_add2(LIST_ENTRY* list, space** tree, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func);
 void _space_list_subtract(device_extension* Vcb, chunk* c, BOOL deleting, UINT64 address, UINT64 length, LIST_ENTRY* rollback, const char* func);
-void _space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func);
+void _space_list_subtract2(LIST_ENTRY* list, space** tree, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func);
+void space_tree_insert(space** tree, space* s);
+void space_tree_remove(space** tree, space* s);
+void space_tree_update(space* s);
+space* space_tree_find(space* tree, UINT64 address);
+space* space_tree_first_fit(space* tree, UINT64 length);
+BOOL find_space_in_bitmaps(device_extension* Vcb, chunk* c, UINT64 length, UINT64* address);
+BOOL is_space_free(device_extension* Vcb, chunk* c, UINT64 address, UINT64 length);
+UINT64 free_space_at(device_extension* Vcb, chunk* c, UINT64 address, UINT64 length);
+void free_space_bitmaps(chunk* c);
+ULONG find_bitmap_run(ULONG* bits, ULONG start, ULONG end, BOOL set, ULONG* runstart);
 
 #define space_list_add(Vcb, c, deleting, address, length, rollback) _space_list_add(Vcb, c, deleting, address, length, rollback, funcname)
-#define space_list_add2(list, list_size, address, length, rollback) _space_list_add2(list, list_size, address, length, NULL, rollback, funcname)
+#define space_list_add2(list, tree, address, length, rollback) _space_list_add2(list, tree, address, length, NULL, rollback, funcname)
 #define space_list_subtract(Vcb, c, deleting, address, length, rollback) _space_list_subtract(Vcb, c, deleting, address, length, rollback, funcname)
-#define space_list_subtract2(list, list_size, address, length, rollback) _space_list_subtract2(list, list_size, address, length, NULL, rollback, funcname)
+#define space_list_subtract2(list, tree, address, length, rollback) _space_list_subtract2(list, tree, address, length, NULL, rollback, funcname)
 
 // in extent-tree.c
 NTSTATUS increase_extent_refcount_data(device_extension* Vcb, UINT64 address, UINT64 size, UINT64 root, UINT64 inode, UINT64 offset, UINT32 refcount, PIRP Irp, LIST_ENTRY* rollback);
@@ -871,6 +1064,12 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb);
 // in compress.c
 NTSTATUS decompress(UINT8 type, UINT8* inbuf, UINT64 inlen, UINT8* outbuf, UINT64 outlen);
 NTSTATUS write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, BOOL* compressed, LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback);
+NTSTATUS write_compressed_parallel(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback);
+EXTENT_DATA* compress_inline_extent(fcb* fcb, EXTENT_DATA* ed, UINT32* size);
+NTSTATUS write_compressed_raw(fcb* fcb, UINT64 start_data, UINT64 decoded_size, UINT8 compression, void* data, UINT32 length,
+                              LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback);
+void print_compression_stats(device_extension* Vcb);
+void free_compression_contexts();
 
 #define fast_io_possible(fcb) (!FsRtlAreThereCurrentFileLocks(&fcb->lock) && !fcb->Vcb->readonly ? FastIoIsPossible : FastIoIsQuestionable)
 
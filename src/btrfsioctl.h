@@ -8,6 +8,8 @@
 #define FSCTL_BTRFS_CREATE_SNAPSHOT CTL_CODE(FILE_DEVICE_UNKNOWN, 0x82b, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
 #define FSCTL_BTRFS_GET_INODE_INFO CTL_CODE(FILE_DEVICE_UNKNOWN, 0x82c, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
 #define FSCTL_BTRFS_SET_INODE_INFO CTL_CODE(FILE_DEVICE_UNKNOWN, 0x82d, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_READ_COMPRESSED CTL_CODE(FILE_DEVICE_UNKNOWN, 0x82e, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_WRITE_COMPRESSED CTL_CODE(FILE_DEVICE_UNKNOWN, 0x82f, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
 
 typedef struct {
     UINT64 subvol;
@@ -33,6 +35,7 @@ typedef struct {
     UINT64 flags;
     UINT32 inline_length;
     UINT64 disk_size[3];
+    UINT64 disk_size_zstd; // only returned if the buffer's big enough, so older callers still work
 } btrfs_inode_info;
 
 typedef struct {
@@ -46,4 +49,24 @@ typedef struct {
     BOOL mode_changed;
 } btrfs_set_inode_info;
 
+typedef struct {
+    UINT64 offset;
+} btrfs_read_compressed;
+
+// Returned by FSCTL_BTRFS_READ_COMPRESSED for the extent covering the requested offset, and passed to
+// FSCTL_BTRFS_WRITE_COMPRESSED. If compression is 0, there's no data, and the range should be read normally.
+// If the buffer is too small for the data, only the header is returned, with STATUS_BUFFER_OVERFLOW.
+// For the last extent of a file, num_bytes stops at the end of the file rather than the end of the sector;
+// writing it back extends the file to offset + num_bytes.
+typedef struct {
+    UINT64 offset;
+    UINT64 num_bytes;
+    UINT64 decoded_size;
+    UINT64 extent_offset;
+    UINT8 type;
+    UINT8 compression;
+    UINT32 length;
+    UINT8 data[1];
+} btrfs_compressed_extent;
+
 #endif
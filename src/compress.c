@@ -35,8 +35,25 @@
 #include "zlib/inftrees.h"
 #include "zlib/inflate.h"
 
+#define ZSTD_STATIC_LINKING_ONLY
+
+#include "zstd/zstd.h"
+#include "zstd/zstd_errors.h"
+
 #define LINUX_PAGE_SIZE 4096
 
+// Linux limits zstd to a 128 KB window, the largest an extent can be, so we do the same.
+#define ZSTD_BTRFS_MAX_WINDOWLOG 17
+
+// We look at 16 bytes out of every 256 to guess whether data will compress.
+#define HEURISTIC_SAMPLE_SIZE       16
+#define HEURISTIC_SAMPLE_STRIDE     256
+
+// After this many extents in a row which didn't compress, we start skipping some, doubling
+// the number each time up to the maximum.
+#define COMPRESS_BACKOFF_THRESHOLD  4
+#define COMPRESS_BACKOFF_MAX        64
+
 typedef struct {
     UINT8* in;
     UINT32 inlen;
@@ -48,6 +65,42 @@ typedef struct {
     void* wrkmem;
 } lzo_stream;
 
+typedef struct {
+    UINT8* data;
+    UINT32 length;
+    UINT8* comp_data;
+    UINT32 comp_length;
+    UINT8 compression;
+    BOOL skip;
+    BOOL inline_extent;
+    NTSTATUS Status;
+} comp_part;
+
+typedef struct {
+    device_extension* Vcb;
+    UINT8 type;
+    comp_part* parts;
+    ULONG num_parts;
+    LONG next_part;
+    LONG refcount;
+    KEVENT event;
+} comp_batch;
+
+// Setting up a deflate stream means allocating a few hundred KB, so rather than doing it for every extent
+// we keep a few of each sort of context around, one per CPU, and reset them when we reuse them.
+#define CODEC_CACHE_SLOTS 32
+
+typedef struct {
+    z_stream stream;
+    int level;
+} deflate_context;
+
+static deflate_context* deflate_cache[CODEC_CACHE_SLOTS];
+static z_stream* inflate_cache[CODEC_CACHE_SLOTS];
+static void* lzo_wrkmem_cache[CODEC_CACHE_SLOTS];
+static ZSTD_CCtx* zstd_cctx_cache[CODEC_CACHE_SLOTS];
+static ZSTD_DCtx* zstd_dctx_cache[CODEC_CACHE_SLOTS];
+
 #define LZO1X_MEM_COMPRESS ((UINT32) (16384L * sizeof(UINT8*)))
 
 #define M1_MAX_OFFSET 0x0400
@@ -78,7 +131,28 @@ typedef struct {
         
 #define LZO_BYTE(x) ((unsigned char) (x))
 
-static UINT8 lzo_nextbyte(lzo_stream* stream) {
+// Unaligned loads and stores are fine on x86 and amd64, and the compiler turns these into single instructions.
+static __inline UINT32 lzo_load32(const UINT8* p) {
+    UINT32 v;
+    
+    RtlCopyMemory(&v, p, sizeof(UINT32));
+    
+    return v;
+}
+
+static __inline UINT64 lzo_load64(const UINT8* p) {
+    UINT64 v;
+    
+    RtlCopyMemory(&v, p, sizeof(UINT64));
+    
+    return v;
+}
+
+static __inline void lzo_store64(UINT8* p, UINT64 v) {
+    RtlCopyMemory(p, &v, sizeof(UINT64));
+}
+
+static __inline UINT8 lzo_nextbyte(lzo_stream* stream) {
     UINT8 c;
     
     if (stream->inpos >= stream->inlen) {
@@ -92,7 +166,7 @@ static UINT8 lzo_nextbyte(lzo_stream* stream) {
     return c;
 }
 
-static int lzo_len(lzo_stream* stream, int byte, int mask) {
+static __inline int lzo_len(lzo_stream* stream, int byte, int mask) {
     int len = byte & mask;
     
     if (len == 0) {
@@ -119,15 +193,14 @@ static void lzo_copy(lzo_stream* stream, int len) {
         return;
     }
     
-    do {
-        stream->out[stream->outpos] = stream->in[stream->inpos];
-        stream->inpos++;
-        stream->outpos++;
-        len--;
-    } while (len > 0);
+    RtlCopyMemory(&stream->out[stream->outpos], &stream->in[stream->inpos], len);
+    stream->inpos += len;
+    stream->outpos += len;
 }
 
 static void lzo_copyback(lzo_stream* stream, int back, int len) {
+    UINT8 *dst, *src;
+    
     if (stream->outpos < back) {
         stream->error = TRUE;
         return;
@@ -138,11 +211,33 @@ static void lzo_copyback(lzo_stream* stream, int back, int len) {
         return;
     }
     
-    do {
-        stream->out[stream->outpos] = stream->out[stream->outpos - back];
-        stream->outpos++;
-        len--;
-    } while (len > 0);
+    dst = &stream->out[stream->outpos];
+    src = dst - back;
+    stream->outpos += len;
+    
+    if (back >= len) // no overlap
+        RtlCopyMemory(dst, src, len);
+    else if (back == 1) // run of the same byte
+        RtlFillMemory(dst, len, *src);
+    else {
+        // The source and destination overlap, so the bytes we copy may have only just been written. Doing it eight
+        // at a time is still safe as long as each chunk is read from before where it's written to.
+        if (back >= sizeof(UINT64)) {
+            while (len >= sizeof(UINT64)) {
+                lzo_store64(dst, lzo_load64(src));
+                dst += sizeof(UINT64);
+                src += sizeof(UINT64);
+                len -= sizeof(UINT64);
+            }
+        }
+        
+        while (len > 0) {
+            *dst = *src;
+            dst++;
+            src++;
+            len--;
+        }
+    }
 }
 
 static NTSTATUS do_lzo_decompress(lzo_stream* stream) {
@@ -269,7 +364,7 @@ static NTSTATUS lzo_decompress(UINT8* inbuf, UINT64 inlen, UINT8* outbuf, UINT64
         stream.inlen = partlen;
         stream.inpos = 0;
         stream.out = &outbuf[outoff];
-        stream.outlen = LINUX_PAGE_SIZE;
+        stream.outlen = (UINT32)min(LINUX_PAGE_SIZE, outlen - outoff); // inline extents can be less than a page
         stream.outpos = 0;
         
         Status = do_lzo_decompress(&stream);
@@ -286,7 +381,7 @@ static NTSTATUS lzo_decompress(UINT8* inbuf, UINT64 inlen, UINT8* outbuf, UINT64
         
         if (LINUX_PAGE_SIZE - (inoff % LINUX_PAGE_SIZE) < sizeof(UINT32))
             inoff = ((inoff / LINUX_PAGE_SIZE) + 1) * LINUX_PAGE_SIZE;
-    } while (inoff < extlen);
+    } while (inoff < extlen && outoff < outlen);
     
     return STATUS_SUCCESS;
 }
@@ -299,45 +394,285 @@ static void zlib_free(void* opaque, void* ptr) {
     ExFreePool(ptr);
 }
 
-static NTSTATUS zlib_decompress(UINT8* inbuf, UINT64 inlen, UINT8* outbuf, UINT64 outlen) {
-    z_stream c_stream;
+static void* zstd_malloc(void* opaque, size_t size) {
+    return ExAllocatePoolWithTag(PagedPool, size, ALLOC_TAG_ZSTD);
+}
+
+static void zstd_free(void* opaque, void* address) {
+    ExFreePool(address);
+}
+
+static ZSTD_customMem zstd_mem = { zstd_malloc, zstd_free, NULL };
+
+static __inline void* get_cached_context(void** cache) {
+    return InterlockedExchangePointer(&cache[KeGetCurrentProcessorNumber() % CODEC_CACHE_SLOTS], NULL);
+}
+
+// Returns FALSE if the slot's already taken, in which case the caller should free the context itself.
+static __inline BOOL put_cached_context(void** cache, void* ctx) {
+    return InterlockedCompareExchangePointer(&cache[KeGetCurrentProcessorNumber() % CODEC_CACHE_SLOTS], ctx, NULL) == NULL;
+}
+
+static deflate_context* get_deflate_context(int level) {
+    deflate_context* ctx = get_cached_context((void**)deflate_cache);
     int ret;
+    
+    if (ctx) {
+        if (ctx->level == level && deflateReset(&ctx->stream) == Z_OK)
+            return ctx;
+        
+        deflateEnd(&ctx->stream);
+        ExFreePool(ctx);
+    }
+    
+    ctx = ExAllocatePoolWithTag(PagedPool, sizeof(deflate_context), ALLOC_TAG);
+    if (!ctx) {
+        ERR("out of memory\n");
+        return NULL;
+    }
+    
+    ctx->stream.zalloc = zlib_alloc;
+    ctx->stream.zfree = zlib_free;
+    ctx->stream.opaque = (voidpf)0;
+    ctx->level = level;
+    
+    ret = deflateInit(&ctx->stream, level);
+    
+    if (ret != Z_OK) {
+        ERR("deflateInit returned %08x\n", ret);
+        ExFreePool(ctx);
+        return NULL;
+    }
+    
+    return ctx;
+}
 
-    c_stream.zalloc = zlib_alloc;
-    c_stream.zfree = zlib_free;
-    c_stream.opaque = (voidpf)0;
+static void put_deflate_context(deflate_context* ctx) {
+    if (!put_cached_context((void**)deflate_cache, ctx)) {
+        deflateEnd(&ctx->stream);
+        ExFreePool(ctx);
+    }
+}
 
-    ret = inflateInit(&c_stream);
+static z_stream* get_inflate_context() {
+    z_stream* ctx = get_cached_context((void**)inflate_cache);
+    int ret;
+    
+    if (ctx) {
+        if (inflateReset(ctx) == Z_OK)
+            return ctx;
+        
+        inflateEnd(ctx);
+        ExFreePool(ctx);
+    }
+    
+    ctx = ExAllocatePoolWithTag(PagedPool, sizeof(z_stream), ALLOC_TAG);
+    if (!ctx) {
+        ERR("out of memory\n");
+        return NULL;
+    }
+    
+    ctx->zalloc = zlib_alloc;
+    ctx->zfree = zlib_free;
+    ctx->opaque = (voidpf)0;
+    ctx->next_in = NULL;
+    ctx->avail_in = 0;
+    
+    ret = inflateInit(ctx);
     
     if (ret != Z_OK) {
         ERR("inflateInit returned %08x\n", ret);
-        return STATUS_INTERNAL_ERROR;
+        ExFreePool(ctx);
+        return NULL;
+    }
+    
+    return ctx;
+}
+
+static void put_inflate_context(z_stream* ctx) {
+    if (!put_cached_context((void**)inflate_cache, ctx)) {
+        inflateEnd(ctx);
+        ExFreePool(ctx);
+    }
+}
+
+static ZSTD_CCtx* get_zstd_cctx(int level) {
+    ZSTD_CCtx* cctx = get_cached_context((void**)zstd_cctx_cache);
+    size_t ret;
+    
+    if (cctx)
+        ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+    else {
+        cctx = ZSTD_createCCtx_advanced(zstd_mem);
+        if (!cctx) {
+            ERR("ZSTD_createCCtx_advanced failed\n");
+            return NULL;
+        }
+    }
+    
+    ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    if (ZSTD_isError(ret)) {
+        ERR("ZSTD_CCtx_setParameter returned %s\n", ZSTD_getErrorName(ret));
+        ZSTD_freeCCtx(cctx);
+        return NULL;
+    }
+    
+    ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, ZSTD_BTRFS_MAX_WINDOWLOG);
+    if (ZSTD_isError(ret)) {
+        ERR("ZSTD_CCtx_setParameter returned %s\n", ZSTD_getErrorName(ret));
+        ZSTD_freeCCtx(cctx);
+        return NULL;
     }
+    
+    return cctx;
+}
+
+static void put_zstd_cctx(ZSTD_CCtx* cctx) {
+    if (!put_cached_context((void**)zstd_cctx_cache, cctx))
+        ZSTD_freeCCtx(cctx);
+}
 
-    c_stream.next_in = inbuf;
-    c_stream.avail_in = inlen;
+static ZSTD_DCtx* get_zstd_dctx() {
+    ZSTD_DCtx* dctx = get_cached_context((void**)zstd_dctx_cache);
+    size_t ret;
     
-    c_stream.next_out = outbuf;
-    c_stream.avail_out = outlen;
+    if (dctx) {
+        ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+        return dctx;
+    }
+    
+    dctx = ZSTD_createDCtx_advanced(zstd_mem);
+    if (!dctx) {
+        ERR("ZSTD_createDCtx_advanced failed\n");
+        return NULL;
+    }
+    
+    ret = ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, ZSTD_BTRFS_MAX_WINDOWLOG);
+    if (ZSTD_isError(ret)) {
+        ERR("ZSTD_DCtx_setParameter returned %s\n", ZSTD_getErrorName(ret));
+        ZSTD_freeDCtx(dctx);
+        return NULL;
+    }
+    
+    return dctx;
+}
+
+static void put_zstd_dctx(ZSTD_DCtx* dctx) {
+    if (!put_cached_context((void**)zstd_dctx_cache, dctx))
+        ZSTD_freeDCtx(dctx);
+}
+
+void free_compression_contexts() {
+    ULONG i;
+    
+    for (i = 0; i < CODEC_CACHE_SLOTS; i++) {
+        if (deflate_cache[i]) {
+            deflateEnd(&deflate_cache[i]->stream);
+            ExFreePool(deflate_cache[i]);
+            deflate_cache[i] = NULL;
+        }
+        
+        if (inflate_cache[i]) {
+            inflateEnd(inflate_cache[i]);
+            ExFreePool(inflate_cache[i]);
+            inflate_cache[i] = NULL;
+        }
+        
+        if (lzo_wrkmem_cache[i]) {
+            ExFreePool(lzo_wrkmem_cache[i]);
+            lzo_wrkmem_cache[i] = NULL;
+        }
+        
+        if (zstd_cctx_cache[i]) {
+            ZSTD_freeCCtx(zstd_cctx_cache[i]);
+            zstd_cctx_cache[i] = NULL;
+        }
+        
+        if (zstd_dctx_cache[i]) {
+            ZSTD_freeDCtx(zstd_dctx_cache[i]);
+            zstd_dctx_cache[i] = NULL;
+        }
+    }
+}
+
+static NTSTATUS zlib_decompress(UINT8* inbuf, UINT64 inlen, UINT8* outbuf, UINT64 outlen) {
+    z_stream* c_stream;
+    int ret;
+
+    c_stream = get_inflate_context();
+    if (!c_stream) {
+        ERR("get_inflate_context failed\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    c_stream->next_in = inbuf;
+    c_stream->avail_in = inlen;
+    
+    c_stream->next_out = outbuf;
+    c_stream->avail_out = outlen;
     
     do {
-        ret = inflate(&c_stream, Z_NO_FLUSH);
+        ret = inflate(c_stream, Z_NO_FLUSH);
         
         if (ret != Z_OK && ret != Z_STREAM_END) {
             ERR("inflate returned %08x\n", ret);
-            inflateEnd(&c_stream);
+            inflateEnd(c_stream);
+            ExFreePool(c_stream);
             return STATUS_INTERNAL_ERROR;
         }
     } while (ret != Z_STREAM_END);
 
-    ret = inflateEnd(&c_stream);
+    put_inflate_context(c_stream);
     
-    if (ret != Z_OK) {
-        ERR("inflateEnd returned %08x\n", ret);
-        return STATUS_INTERNAL_ERROR;
+    // FIXME - if we're short, should we zero the end of outbuf so we don't leak information into userspace?
+    
+    return STATUS_SUCCESS;
+}
+
+// The extent is a single zstd frame, padded out with zeroes to the end of the sector, so we stop when
+// we hit the end of the frame rather than the end of the input.
+static NTSTATUS zstd_decompress(UINT8* inbuf, UINT64 inlen, UINT8* outbuf, UINT64 outlen) {
+    ZSTD_DCtx* dctx;
+    ZSTD_inBuffer input;
+    ZSTD_outBuffer output;
+    size_t ret;
+    
+    dctx = get_zstd_dctx();
+    if (!dctx) {
+        ERR("get_zstd_dctx failed\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
     
-    // FIXME - if we're short, should we zero the end of outbuf so we don't leak information into userspace?
+    input.src = inbuf;
+    input.size = inlen;
+    input.pos = 0;
+    
+    output.dst = outbuf;
+    output.size = outlen;
+    output.pos = 0;
+    
+    do {
+        size_t inpos = input.pos, outpos = output.pos;
+        
+        ret = ZSTD_decompressStream(dctx, &output, &input);
+        
+        if (ZSTD_isError(ret)) {
+            ERR("ZSTD_decompressStream returned %s\n", ZSTD_getErrorName(ret));
+            ZSTD_freeDCtx(dctx);
+            return STATUS_INTERNAL_ERROR;
+        }
+        
+        if (input.pos == inpos && output.pos == outpos) {
+            ERR("zstd frame truncated\n");
+            ZSTD_freeDCtx(dctx);
+            return STATUS_INTERNAL_ERROR;
+        }
+    } while (ret != 0 && output.pos < output.size);
+    
+    put_zstd_dctx(dctx);
+    
+    if (output.pos < output.size)
+        RtlZeroMemory(outbuf + output.pos, output.size - output.pos);
     
     return STATUS_SUCCESS;
 }
@@ -347,145 +682,100 @@ NTSTATUS decompress(UINT8 type, UINT8* inbuf, UINT64 inlen, UINT8* outbuf, UINT6
         return zlib_decompress(inbuf, inlen, outbuf, outlen);
     else if (type == BTRFS_COMPRESSION_LZO)
         return lzo_decompress(inbuf, inlen, outbuf, outlen);
+    else if (type == BTRFS_COMPRESSION_ZSTD)
+        return zstd_decompress(inbuf, inlen, outbuf, outlen);
     else {
         ERR("unsupported compression type %x\n", type);
         return STATUS_NOT_SUPPORTED;
     }
 }
 
-static NTSTATUS zlib_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, BOOL* compressed, LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback) {
-    NTSTATUS Status;
-    UINT8 compression;
-    UINT64 comp_length;
-    UINT8* comp_data;
+// Regular extents take up whole sectors, so compressing one is only worthwhile if it saves at least a sector. Inline
+// extents go in the tree as they are, so any saving will do.
+static BOOL finish_compressed_part(device_extension* Vcb, comp_part* part, UINT32 cl, UINT8 compression) {
+    if (part->inline_extent) {
+        if (cl >= part->length)
+            return FALSE;
+        
+        part->comp_length = cl;
+    } else {
+        if (cl + Vcb->superblock.sector_size > part->length)
+            return FALSE;
+        
+        part->comp_length = sector_align(cl, Vcb->superblock.sector_size);
+        
+        RtlZeroMemory(part->comp_data + cl, part->comp_length - cl);
+    }
+    
+    part->compression = compression;
+    
+    return TRUE;
+}
+
+static NTSTATUS zlib_compress_part(device_extension* Vcb, comp_part* part) {
     UINT32 out_left;
-    LIST_ENTRY* le;
-    chunk* c;
-    z_stream c_stream;
+    deflate_context* ctx;
     int ret;
     
-    comp_data = ExAllocatePoolWithTag(PagedPool, end_data - start_data, ALLOC_TAG);
-    if (!comp_data) {
+    part->comp_data = ExAllocatePoolWithTag(PagedPool, part->length, ALLOC_TAG);
+    if (!part->comp_data) {
         ERR("out of memory\n");
         return STATUS_INSUFFICIENT_RESOURCES;
     }
     
-    Status = excise_extents(fcb->Vcb, fcb, start_data, end_data, Irp, rollback);
-    if (!NT_SUCCESS(Status)) {
-        ERR("excise_extents returned %08x\n", Status);
-        ExFreePool(comp_data);
-        return Status;
-    }
-    
-    c_stream.zalloc = zlib_alloc;
-    c_stream.zfree = zlib_free;
-    c_stream.opaque = (voidpf)0;
-
-    ret = deflateInit(&c_stream, fcb->Vcb->options.zlib_level);
-    
-    if (ret != Z_OK) {
-        ERR("deflateInit returned %08x\n", ret);
-        ExFreePool(comp_data);
+    ctx = get_deflate_context(Vcb->options.zlib_level);
+    if (!ctx) {
+        ERR("get_deflate_context failed\n");
+        ExFreePool(part->comp_data);
+        part->comp_data = NULL;
         return STATUS_INTERNAL_ERROR;
     }
     
-    c_stream.avail_in = end_data - start_data;
-    c_stream.next_in = data;
-    c_stream.avail_out = end_data - start_data;
-    c_stream.next_out = comp_data;
+    ctx->stream.avail_in = part->length;
+    ctx->stream.next_in = part->data;
+    ctx->stream.avail_out = part->length;
+    ctx->stream.next_out = part->comp_data;
     
     do {
-        ret = deflate(&c_stream, Z_FINISH);
+        ret = deflate(&ctx->stream, Z_FINISH);
         
         if (ret == Z_STREAM_ERROR) {
             ERR("deflate returned %x\n", ret);
-            ExFreePool(comp_data);
+            deflateEnd(&ctx->stream);
+            ExFreePool(ctx);
+            ExFreePool(part->comp_data);
+            part->comp_data = NULL;
             return STATUS_INTERNAL_ERROR;
         }
-    } while (c_stream.avail_in > 0 && c_stream.avail_out > 0);
+    } while (ctx->stream.avail_in > 0 && ctx->stream.avail_out > 0);
     
-    out_left = c_stream.avail_out;
+    out_left = ctx->stream.avail_out;
     
-    ret = deflateEnd(&c_stream);
+    put_deflate_context(ctx);
     
-    if (ret != Z_OK) {
-        ERR("deflateEnd returned %08x\n", ret);
-        ExFreePool(comp_data);
-        return STATUS_INTERNAL_ERROR;
+    if (!finish_compressed_part(Vcb, part, part->length - out_left, BTRFS_COMPRESSION_ZLIB)) {
+        ExFreePool(part->comp_data);
+        part->comp_data = NULL;
     }
     
-    if (out_left < fcb->Vcb->superblock.sector_size) { // compressed extent would be larger than or same size as uncompressed extent
-        ExFreePool(comp_data);
-        
-        comp_length = end_data - start_data;
-        comp_data = data;
-        compression = BTRFS_COMPRESSION_NONE;
-        
-        *compressed = FALSE;
-    } else {
-        UINT32 cl;
-        
-        compression = BTRFS_COMPRESSION_ZLIB;
-        cl = end_data - start_data - out_left;
-        comp_length = sector_align(cl, fcb->Vcb->superblock.sector_size);
-        
-        RtlZeroMemory(comp_data + cl, comp_length - cl);
-        
-        *compressed = TRUE;
-    }
-    
-    ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, TRUE);
-    
-    le = fcb->Vcb->chunks.Flink;
-    while (le != &fcb->Vcb->chunks) {
-        c = CONTAINING_RECORD(le, chunk, list_entry);
-        
-        ExAcquireResourceExclusiveLite(&c->lock, TRUE);
-        
-        if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-            if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, changed_sector_list, Irp, rollback, compression, end_data - start_data)) {
-                ExReleaseResourceLite(&c->lock);
-                ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
-                
-                if (compression != BTRFS_COMPRESSION_NONE)
-                    ExFreePool(comp_data);
-                
-                return STATUS_SUCCESS;
-            }
-        }
-        
-        ExReleaseResourceLite(&c->lock);
+    return STATUS_SUCCESS;
+}
 
-        le = le->Flink;
-    }
-    
-    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+// Returns how many bytes at ip match those at m_pos, comparing eight at a time.
+static __inline UINT32 lzo_match_len(const UINT8* m_pos, const UINT8* ip, const UINT8* in_end) {
+    const UINT8* start = ip;
     
-    ExAcquireResourceExclusiveLite(&fcb->Vcb->chunk_lock, TRUE);
+    while (ip + sizeof(UINT64) <= in_end && lzo_load64(m_pos) == lzo_load64(ip)) {
+        m_pos += sizeof(UINT64);
+        ip += sizeof(UINT64);
+    }
     
-    if ((c = alloc_chunk(fcb->Vcb, fcb->Vcb->data_flags))) {
-        ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
-        
-        ExAcquireResourceExclusiveLite(&c->lock, TRUE);
-        
-        if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-            if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, changed_sector_list, Irp, rollback, compression, end_data - start_data)) {
-                ExReleaseResourceLite(&c->lock);
-                
-                if (compression != BTRFS_COMPRESSION_NONE)
-                    ExFreePool(comp_data);
-                
-                return STATUS_SUCCESS;
-            }
-        }
-        
-        ExReleaseResourceLite(&c->lock);
-    } else
-        ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+    while (ip < in_end && *m_pos == *ip) {
+        m_pos++;
+        ip++;
+    }
     
-    WARN("couldn't find any data chunks with %llx bytes free\n", comp_length);
-
-    return STATUS_DISK_FULL;
+    return (UINT32)(ip - start);
 }
 
 static NTSTATUS lzo_do_compress(const UINT8* in, UINT32 in_len, UINT8* out, UINT32* out_len, void* wrkmem) {
@@ -516,7 +806,7 @@ static NTSTATUS lzo_do_compress(const UINT8* in, UINT32 in_len, UINT8* out, UINT
         m_pos = dict[dindex];
         UPDATE_I(dict, cycle, dindex, ip);
 
-        if (!LZO_CHECK_MPOS_NON_DET(m_pos, m_off, in, ip, M4_MAX_OFFSET) && m_pos[0] == ip[0] && m_pos[1] == ip[1] && m_pos[2] == ip[2]) {
+        if (!LZO_CHECK_MPOS_NON_DET(m_pos, m_off, in, ip, M4_MAX_OFFSET) && ((lzo_load32(m_pos) ^ lzo_load32(ip)) & 0xffffff) == 0) {
             lit = ip - ii;
             m_pos += 3;
             if (m_off <= M2_MAX_OFFSET)
@@ -570,9 +860,9 @@ match:
                 *op++ = LZO_BYTE(tt);
             }
             
-            do {
-                *op++ = *ii++;
-            } while (--t > 0);
+            RtlCopyMemory(op, ii, t);
+            op += t;
+            ii += t;
         }
 
 
@@ -582,14 +872,10 @@ code_match:
             return STATUS_INTERNAL_ERROR;
         
         ip += 3;
-        if (*m_pos++ != *ip++ || *m_pos++ != *ip++ || *m_pos++ != *ip++ ||
-            *m_pos++ != *ip++ || *m_pos++ != *ip++ || *m_pos++ != *ip++) {
-            --ip;
-            m_len = ip - ii;
+        m_len = 3 + lzo_match_len(m_pos, ip, in_end);
+        ip = ii + m_len;
         
-            if (m_len < 3 || m_len > 8)
-                return STATUS_INTERNAL_ERROR;
-
+        if (m_len <= 8) {
             if (m_off <= M2_MAX_OFFSET) {
                 m_off -= 1;
                 *op++ = LZO_BYTE(((m_len - 1) << 5) | ((m_off & 7) << 2));
@@ -608,15 +894,6 @@ code_match:
                 goto m3_m4_offset;
             }
         } else {
-            const UINT8* end;
-            end = in_end;
-            while (ip < end && *m_pos == *ip)
-                m_pos++, ip++;
-            m_len = (ip - ii);
-            
-            if (m_len < 3)
-                return STATUS_INTERNAL_ERROR;
-
             if (m_off <= M3_MAX_OFFSET) {
                 m_off -= 1;
                 if (m_len <= 33)
@@ -686,9 +963,9 @@ m3_m4_offset:
             *op++ = LZO_BYTE(tt);
         }
         
-        do {
-            *op++ = *ii++;
-        } while (--t > 0);
+        RtlCopyMemory(op, ii, t);
+        op += t;
+        ii += t;
     }
 
     *out_len = op - out;
@@ -709,7 +986,7 @@ static NTSTATUS lzo1x_1_compress(lzo_stream* stream) {
         do {
             *op++ = stream->in[stream->inpos];
             stream->inpos++;
-        } while (stream->inlen < stream->inpos);
+        } while (stream->inpos < stream->inlen);
         stream->outlen = op - stream->out;
     } else
         Status = lzo_do_compress(stream->in, stream->inlen, stream->out, &stream->outlen, stream->wrkmem);
@@ -729,19 +1006,13 @@ static __inline UINT32 lzo_max_outlen(UINT32 inlen) {
     return inlen + (inlen / 16) + 64 + 3; // formula comes from LZO.FAQ
 }
 
-static NTSTATUS lzo_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, BOOL* compressed, LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback) {
+static NTSTATUS lzo_compress_part(device_extension* Vcb, comp_part* part) {
     NTSTATUS Status;
-    UINT8 compression;
-    UINT64 comp_length;
     ULONG comp_data_len, num_pages, i;
-    UINT8* comp_data;
-    BOOL skip_compression = FALSE;
     lzo_stream stream;
     UINT32* out_size;
-    LIST_ENTRY* le;
-    chunk* c;
     
-    num_pages = (sector_align(end_data - start_data, LINUX_PAGE_SIZE)) / LINUX_PAGE_SIZE;
+    num_pages = (sector_align(part->length, LINUX_PAGE_SIZE)) / LINUX_PAGE_SIZE;
     
     // Four-byte overall header
     // Another four-byte header page
@@ -749,42 +1020,38 @@ static NTSTATUS lzo_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end
     // Plus another four bytes for possible padding
     comp_data_len = sizeof(UINT32) + ((lzo_max_outlen(LINUX_PAGE_SIZE) + (2 * sizeof(UINT32))) * num_pages);
     
-    comp_data = ExAllocatePoolWithTag(PagedPool, comp_data_len, ALLOC_TAG);
-    if (!comp_data) {
+    part->comp_data = ExAllocatePoolWithTag(PagedPool, comp_data_len, ALLOC_TAG);
+    if (!part->comp_data) {
         ERR("out of memory\n");
         return STATUS_INSUFFICIENT_RESOURCES;
     }
     
-    stream.wrkmem = ExAllocatePoolWithTag(PagedPool, LZO1X_MEM_COMPRESS, ALLOC_TAG);
+    stream.wrkmem = get_cached_context(lzo_wrkmem_cache);
+    
+    if (!stream.wrkmem)
+        stream.wrkmem = ExAllocatePoolWithTag(PagedPool, LZO1X_MEM_COMPRESS, ALLOC_TAG);
+    
     if (!stream.wrkmem) {
         ERR("out of memory\n");
-        ExFreePool(comp_data);
+        ExFreePool(part->comp_data);
+        part->comp_data = NULL;
         return STATUS_INSUFFICIENT_RESOURCES;
     }
     
-    Status = excise_extents(fcb->Vcb, fcb, start_data, end_data, Irp, rollback);
-    if (!NT_SUCCESS(Status)) {
-        ERR("excise_extents returned %08x\n", Status);
-        ExFreePool(comp_data);
-        ExFreePool(stream.wrkmem);
-        return Status;
-    }
-    
-    out_size = (UINT32*)comp_data;
+    out_size = (UINT32*)part->comp_data;
     *out_size = sizeof(UINT32);
     
-    stream.in = data;
-    stream.out = comp_data + (2 * sizeof(UINT32));
+    stream.in = part->data;
+    stream.out = part->comp_data + (2 * sizeof(UINT32));
     
     for (i = 0; i < num_pages; i++) {
         UINT32* pagelen = (UINT32*)(stream.out - sizeof(UINT32));
         
-        stream.inlen = min(LINUX_PAGE_SIZE, end_data - start_data - (i * LINUX_PAGE_SIZE));
+        stream.inlen = min(LINUX_PAGE_SIZE, part->length - (i * LINUX_PAGE_SIZE));
         
         Status = lzo1x_1_compress(&stream);
         if (!NT_SUCCESS(Status)) {
             ERR("lzo1x_1_compress returned %08x\n", Status);
-            skip_compression = TRUE;
             break;
         }
         
@@ -801,52 +1068,262 @@ static NTSTATUS lzo_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end
         }
     }
     
-    ExFreePool(stream.wrkmem);
+    if (!put_cached_context(lzo_wrkmem_cache, stream.wrkmem))
+        ExFreePool(stream.wrkmem);
+    
+    if (i < num_pages || !finish_compressed_part(Vcb, part, *out_size, BTRFS_COMPRESSION_LZO)) {
+        ExFreePool(part->comp_data);
+        part->comp_data = NULL;
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS zstd_compress_part(device_extension* Vcb, comp_part* part) {
+    ZSTD_CCtx* cctx;
+    size_t ret;
+    
+    part->comp_data = ExAllocatePoolWithTag(PagedPool, part->length, ALLOC_TAG);
+    if (!part->comp_data) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    cctx = get_zstd_cctx(Vcb->options.zstd_level);
+    if (!cctx) {
+        ERR("get_zstd_cctx failed\n");
+        ExFreePool(part->comp_data);
+        part->comp_data = NULL;
+        return STATUS_INTERNAL_ERROR;
+    }
+    
+    ret = ZSTD_compress2(cctx, part->comp_data, part->length, part->data, part->length);
+    
+    put_zstd_cctx(cctx);
     
-    if (skip_compression || *out_size >= end_data - start_data - fcb->Vcb->superblock.sector_size) { // compressed extent would be larger than or same size as uncompressed extent
-        ExFreePool(comp_data);
+    if (ZSTD_isError(ret)) {
+        ExFreePool(part->comp_data);
+        part->comp_data = NULL;
         
-        comp_length = end_data - start_data;
-        comp_data = data;
-        compression = BTRFS_COMPRESSION_NONE;
+        // the output buffer is the same size as the input, so this just means the data didn't compress
+        if (ZSTD_getErrorCode(ret) == ZSTD_error_dstSize_tooSmall)
+            return STATUS_SUCCESS;
         
-        *compressed = FALSE;
-    } else {
-        compression = BTRFS_COMPRESSION_LZO;
-        comp_length = sector_align(*out_size, fcb->Vcb->superblock.sector_size);
+        ERR("ZSTD_compress2 returned %s\n", ZSTD_getErrorName(ret));
+        return STATUS_INTERNAL_ERROR;
+    }
+    
+    if (!finish_compressed_part(Vcb, part, (UINT32)ret, BTRFS_COMPRESSION_ZSTD)) {
+        ExFreePool(part->comp_data);
+        part->comp_data = NULL;
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+static UINT8 get_compression_type(fcb* fcb) {
+    UINT8 type;
+    
+    if (fcb->Vcb->options.compress_type != 0)
+        type = fcb->Vcb->options.compress_type;
+    else {
+        if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD)
+            type = BTRFS_COMPRESSION_ZSTD;
+        else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO)
+            type = BTRFS_COMPRESSION_LZO;
+        else
+            type = BTRFS_COMPRESSION_ZLIB;
+    }
+    
+    if (type == BTRFS_COMPRESSION_LZO)
+        fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO;
+    else if (type == BTRFS_COMPRESSION_ZSTD)
+        fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD;
+    
+    return type;
+}
+
+// floor(log2(v^4)), i.e. log2(v) to within a quarter
+static UINT32 log2_4(UINT64 v) {
+    UINT32 r = 0;
+    
+    v = v * v * v * v;
+    
+    while (v >>= 1) {
+        r++;
+    }
+    
+    return r;
+}
+
+// A quick look at a sample of the data, to spot things like media files and archives which aren't going to
+// compress, before we waste time running them through zlib or LZO. This is more or less what Linux does.
+static BOOL data_looks_compressible(UINT8* data, UINT32 length) {
+    UINT32 hist[256], i, j, samples = 0, distinct = 0, coreset, sum, logsamples;
+    UINT64 entropy;
+    
+    if (length < 2 * HEURISTIC_SAMPLE_STRIDE)
+        return TRUE;
+    
+    // the same few bytes over and over again, e.g. zeroes
+    if (RtlCompareMemory(data, data + HEURISTIC_SAMPLE_SIZE, length - HEURISTIC_SAMPLE_SIZE) == length - HEURISTIC_SAMPLE_SIZE)
+        return TRUE;
+    
+    RtlZeroMemory(hist, sizeof(hist));
+    
+    for (i = 0; i + HEURISTIC_SAMPLE_SIZE <= length; i += HEURISTIC_SAMPLE_STRIDE) {
+        for (j = 0; j < HEURISTIC_SAMPLE_SIZE; j++) {
+            hist[data[i + j]]++;
+        }
         
-        RtlZeroMemory(comp_data + *out_size, comp_length - *out_size);
+        samples += HEURISTIC_SAMPLE_SIZE;
+    }
+    
+    for (i = 0; i < 256; i++) {
+        if (hist[i] > 0)
+            distinct++;
+    }
+    
+    // text and the like only uses a few different byte values
+    if (distinct <= 64)
+        return TRUE;
+    
+    // sort the histogram in descending order, and see how many byte values make up 90% of the sample
+    for (i = 1; i < 256; i++) {
+        UINT32 v = hist[i];
+        
+        for (j = i; j > 0 && hist[j - 1] < v; j--) {
+            hist[j] = hist[j - 1];
+        }
+        
+        hist[j] = v;
+    }
+    
+    sum = 0;
+    for (coreset = 0; coreset < distinct; coreset++) {
+        sum += hist[coreset];
         
-        *compressed = TRUE;
+        if (sum * 10 >= samples * 9)
+            break;
+    }
+    
+    if (coreset < 64)
+        return TRUE;
+    
+    if (coreset >= 200)
+        return FALSE;
+    
+    // Shannon entropy, as a percentage of the maximum of eight bits per byte
+    logsamples = log2_4(samples);
+    entropy = 0;
+    
+    for (i = 0; i < distinct; i++) {
+        entropy += (UINT64)hist[i] * (logsamples - log2_4(hist[i]));
     }
     
-    ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, TRUE);
+    return entropy * 100 / ((UINT64)samples * 8 * 4) < 80;
+}
+
+// If the data doesn't compress, part->comp_data is left as NULL and the part gets written uncompressed.
+static NTSTATUS compress_part(device_extension* Vcb, UINT8 type, comp_part* part) {
+    NTSTATUS Status;
+    LARGE_INTEGER time1, time2;
+    
+    part->comp_data = NULL;
+    part->comp_length = part->length;
+    part->compression = BTRFS_COMPRESSION_NONE;
+    
+    if (part->skip) {
+        InterlockedIncrement64(&Vcb->comp_stats.parts_skipped);
+        return STATUS_SUCCESS;
+    }
     
-    le = fcb->Vcb->chunks.Flink;
-    while (le != &fcb->Vcb->chunks) {
-        c = CONTAINING_RECORD(le, chunk, list_entry);
+    if (!Vcb->options.compress_force) {
+        BOOL b;
         
-        ExAcquireResourceExclusiveLite(&c->lock, TRUE);
+        time1 = KeQueryPerformanceCounter(NULL);
+        b = data_looks_compressible(part->data, part->length);
+        time2 = KeQueryPerformanceCounter(NULL);
         
-        if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-            if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, changed_sector_list, Irp, rollback, compression, end_data - start_data)) {
-                ExReleaseResourceLite(&c->lock);
-                ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
-                
-                if (compression != BTRFS_COMPRESSION_NONE)
-                    ExFreePool(comp_data);
-                
-                return STATUS_SUCCESS;
-            }
-        }
+        InterlockedExchangeAdd64(&Vcb->comp_stats.heuristic_time, time2.QuadPart - time1.QuadPart);
         
-        ExReleaseResourceLite(&c->lock);
+        if (!b) {
+            InterlockedIncrement64(&Vcb->comp_stats.parts_rejected);
+            return STATUS_SUCCESS;
+        }
+    }
+    
+    time1 = KeQueryPerformanceCounter(NULL);
+    
+    if (type == BTRFS_COMPRESSION_LZO)
+        Status = lzo_compress_part(Vcb, part);
+    else if (type == BTRFS_COMPRESSION_ZSTD)
+        Status = zstd_compress_part(Vcb, part);
+    else
+        Status = zlib_compress_part(Vcb, part);
+    
+    time2 = KeQueryPerformanceCounter(NULL);
+    
+    if (part->compression != BTRFS_COMPRESSION_NONE) {
+        InterlockedIncrement64(&Vcb->comp_stats.parts_compressed);
+        InterlockedExchangeAdd64(&Vcb->comp_stats.bytes_in, part->length);
+        InterlockedExchangeAdd64(&Vcb->comp_stats.bytes_out, part->comp_length);
+    } else {
+        InterlockedIncrement64(&Vcb->comp_stats.parts_incompressible);
+        InterlockedExchangeAdd64(&Vcb->comp_stats.wasted_time, time2.QuadPart - time1.QuadPart);
+    }
+    
+    return Status;
+}
 
-        le = le->Flink;
+// Called in file order once each part has been written, to decide whether the next few are worth trying.
+static void update_compression_backoff(fcb* fcb, comp_part* part) {
+    if (part->skip || fcb->Vcb->options.compress_force)
+        return;
+    
+    if (part->compression != BTRFS_COMPRESSION_NONE) {
+        fcb->compress_failures = 0;
+        return;
     }
     
-    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+    if (fcb->compress_failures < 0xff)
+        fcb->compress_failures++;
+    
+    if (fcb->compress_failures >= COMPRESS_BACKOFF_THRESHOLD)
+        fcb->compress_skip = (UINT8)min(1 << min(fcb->compress_failures - COMPRESS_BACKOFF_THRESHOLD, 6), COMPRESS_BACKOFF_MAX);
+}
 
+void print_compression_stats(device_extension* Vcb) {
+    LARGE_INTEGER freq;
+    compression_stats* cs = &Vcb->comp_stats;
+    UINT64 saved = 0;
+    
+    KeQueryPerformanceCounter(&freq);
+    
+    // what we'd have spent compressing the rejected parts, going by the ones we did try which didn't compress
+    if (cs->parts_incompressible > 0)
+        saved = (cs->wasted_time / cs->parts_incompressible) * (cs->parts_rejected + cs->parts_skipped);
+    
+    TRACE("compression: %llu extents compressed (%llx bytes to %llx), %llu incompressible, %llu rejected by heuristic, %llu skipped\n",
+          cs->parts_compressed, cs->bytes_in, cs->bytes_out, cs->parts_incompressible, cs->parts_rejected, cs->parts_skipped);
+    TRACE("compression: %llu ms wasted on incompressible data, %llu ms spent in heuristic, about %llu ms saved\n",
+          cs->wasted_time * 1000 / freq.QuadPart, cs->heuristic_time * 1000 / freq.QuadPart, saved * 1000 / freq.QuadPart);
+}
+
+static NTSTATUS write_compressed_part(fcb* fcb, UINT64 start_data, comp_part* part, LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    UINT8* comp_data = part->comp_data ? part->comp_data : part->data;
+    chunk* c;
+    
+    Status = excise_extents(fcb->Vcb, fcb, start_data, start_data + part->length, Irp, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("excise_extents returned %08x\n", Status);
+        return Status;
+    }
+    
+    if (insert_extent_clustered(fcb->Vcb, fcb, start_data, part->comp_length, FALSE, comp_data, changed_sector_list, Irp, rollback, part->compression, part->length))
+        return STATUS_SUCCESS;
+    
     ExAcquireResourceExclusiveLite(&fcb->Vcb->chunk_lock, TRUE);
     
     if ((c = alloc_chunk(fcb->Vcb, fcb->Vcb->data_flags))) {
@@ -854,13 +1331,9 @@ static NTSTATUS lzo_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end
         
         ExAcquireResourceExclusiveLite(&c->lock, TRUE);
         
-        if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-            if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, changed_sector_list, Irp, rollback, compression, end_data - start_data)) {
+        if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= part->comp_length) {
+            if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, part->comp_length, FALSE, comp_data, changed_sector_list, Irp, rollback, part->compression, part->length)) {
                 ExReleaseResourceLite(&c->lock);
-                
-                if (compression != BTRFS_COMPRESSION_NONE)
-                    ExFreePool(comp_data);
-                
                 return STATUS_SUCCESS;
             }
         }
@@ -869,26 +1342,258 @@ static NTSTATUS lzo_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end
     } else
         ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
     
-    WARN("couldn't find any data chunks with %llx bytes free\n", comp_length);
+    WARN("couldn't find any data chunks with %llx bytes free\n", part->comp_length);
 
     return STATUS_DISK_FULL;
 }
 
-NTSTATUS write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, BOOL* compressed, LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback) {
-    UINT8 type;
+// Called when an inline extent is written to the tree. If compressing it would make it smaller, returns a new
+// EXTENT_DATA holding the compressed data, which is then the caller's to free; otherwise returns NULL. We also
+// try if the extent's too big for max_inline, which happens when Linux has written it compressed.
+EXTENT_DATA* compress_inline_extent(fcb* fcb, EXTENT_DATA* ed, UINT32* size) {
+    NTSTATUS Status;
+    comp_part part;
+    EXTENT_DATA* ned;
+    
+    if (ed->compression != BTRFS_COMPRESSION_NONE || ed->encryption != BTRFS_ENCRYPTION_NONE ||
+        ed->encoding != BTRFS_ENCODING_NONE || ed->decoded_size == 0)
+        return NULL;
+    
+    if (!write_fcb_compressed(fcb) && ed->decoded_size <= fcb->Vcb->options.max_inline)
+        return NULL;
+    
+    part.data = ed->data;
+    part.length = (UINT32)ed->decoded_size;
+    part.skip = FALSE;
+    part.inline_extent = TRUE;
+    
+    Status = compress_part(fcb->Vcb, get_compression_type(fcb), &part);
+    if (!NT_SUCCESS(Status)) {
+        ERR("compress_part returned %08x\n", Status);
+        return NULL;
+    }
+    
+    if (part.compression == BTRFS_COMPRESSION_NONE)
+        return NULL;
+    
+    *size = sizeof(EXTENT_DATA) - 1 + part.comp_length;
+    
+    ned = ExAllocatePoolWithTag(PagedPool, *size, ALLOC_TAG);
+    if (!ned) {
+        ERR("out of memory\n");
+        ExFreePool(part.comp_data);
+        return NULL;
+    }
+    
+    RtlCopyMemory(ned, ed, sizeof(EXTENT_DATA) - 1);
+    ned->compression = part.compression;
+    RtlCopyMemory(ned->data, part.comp_data, part.comp_length);
+    
+    ExFreePool(part.comp_data);
+    
+    return ned;
+}
 
-    if (fcb->Vcb->options.compress_type != 0)
-        type = fcb->Vcb->options.compress_type;
-    else {
-        if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO)
-            type = BTRFS_COMPRESSION_LZO;
-        else
-            type = BTRFS_COMPRESSION_ZLIB;
+NTSTATUS write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, BOOL* compressed, LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    comp_part part;
+    
+    part.data = data;
+    part.length = end_data - start_data;
+    part.skip = FALSE;
+    part.inline_extent = FALSE;
+    
+    Status = compress_part(fcb->Vcb, get_compression_type(fcb), &part);
+    if (!NT_SUCCESS(Status)) {
+        ERR("compress_part returned %08x\n", Status);
+        return Status;
     }
     
-    if (type == BTRFS_COMPRESSION_LZO) {
+    *compressed = part.compression != BTRFS_COMPRESSION_NONE;
+    
+    Status = write_compressed_part(fcb, start_data, &part, changed_sector_list, Irp, rollback);
+    if (!NT_SUCCESS(Status))
+        ERR("write_compressed_part returned %08x\n", Status);
+    
+    if (NT_SUCCESS(Status))
+        update_compression_backoff(fcb, &part);
+    
+    if (part.comp_data)
+        ExFreePool(part.comp_data);
+    
+    return Status;
+}
+
+// Writes data which is already compressed, e.g. from FSCTL_BTRFS_WRITE_COMPRESSED, as a new extent at start_data.
+NTSTATUS write_compressed_raw(fcb* fcb, UINT64 start_data, UINT64 decoded_size, UINT8 compression, void* data, UINT32 length,
+                              LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    comp_part part;
+    
+    if (compression == BTRFS_COMPRESSION_LZO)
         fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO;
-        return lzo_write_compressed_bit(fcb, start_data, end_data, data, compressed, changed_sector_list, Irp, rollback);
+    else if (compression == BTRFS_COMPRESSION_ZSTD)
+        fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD;
+    
+    part.data = NULL;
+    part.length = (UINT32)decoded_size;
+    part.compression = compression;
+    part.comp_length = sector_align(length, fcb->Vcb->superblock.sector_size);
+    
+    part.comp_data = ExAllocatePoolWithTag(PagedPool, part.comp_length, ALLOC_TAG);
+    if (!part.comp_data) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    RtlCopyMemory(part.comp_data, data, length);
+    RtlZeroMemory(part.comp_data + length, part.comp_length - length);
+    
+    Status = write_compressed_part(fcb, start_data, &part, changed_sector_list, Irp, rollback);
+    if (!NT_SUCCESS(Status))
+        ERR("write_compressed_part returned %08x\n", Status);
+    
+    ExFreePool(part.comp_data);
+    
+    return Status;
+}
+
+static void compress_parts(comp_batch* batch) {
+    LONG i;
+    
+    while ((i = InterlockedIncrement(&batch->next_part) - 1) < (LONG)batch->num_parts) {
+        batch->parts[i].Status = compress_part(batch->Vcb, batch->type, &batch->parts[i]);
+    }
+}
+
+static void compress_parts_job(void* context) {
+    comp_batch* batch = context;
+    
+    compress_parts(batch);
+    
+    if (InterlockedDecrement(&batch->refcount) == 0)
+        KeSetEvent(&batch->event, 0, FALSE);
+}
+
+// Compresses a run of parts at the same time, by handing them out to the worker threads as well as doing them
+// ourselves. We then allocate and write them in order, so the file's extents stay contiguous. Anything queued
+// to a thread which hasn't got round to it by the time we've finished gets cancelled - this thread might well
+// be one of the worker threads itself, so we can't just wait for it.
+static NTSTATUS write_compressed_batch(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, UINT8 type, LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    device_extension* Vcb = fcb->Vcb;
+    comp_batch batch;
+    thread_job* jobs;
+    ULONG i, num_jobs, submitted = 0;
+    
+    batch.Vcb = Vcb;
+    batch.type = type;
+    batch.num_parts = sector_align(end_data - start_data, COMPRESSED_EXTENT_SIZE) / COMPRESSED_EXTENT_SIZE;
+    batch.next_part = 0;
+    batch.refcount = 1;
+    KeInitializeEvent(&batch.event, NotificationEvent, FALSE);
+    
+    batch.parts = ExAllocatePoolWithTag(PagedPool, sizeof(comp_part) * batch.num_parts, ALLOC_TAG);
+    if (!batch.parts) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    for (i = 0; i < batch.num_parts; i++) {
+        batch.parts[i].data = (UINT8*)data + (i * COMPRESSED_EXTENT_SIZE);
+        batch.parts[i].length = min(COMPRESSED_EXTENT_SIZE, end_data - start_data - (i * COMPRESSED_EXTENT_SIZE));
+        batch.parts[i].comp_data = NULL;
+        batch.parts[i].skip = FALSE;
+        batch.parts[i].inline_extent = FALSE;
+        
+        if (fcb->compress_skip > 0) {
+            batch.parts[i].skip = TRUE;
+            fcb->compress_skip--;
+        }
+    }
+    
+    num_jobs = min(batch.num_parts - 1, Vcb->threads.num_threads);
+    
+    if (num_jobs > 0) {
+        jobs = ExAllocatePoolWithTag(NonPagedPool, sizeof(thread_job) * num_jobs, ALLOC_TAG);
+        if (!jobs) {
+            ERR("out of memory\n");
+            ExFreePool(batch.parts);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        
+        for (i = 0; i < num_jobs; i++) {
+            jobs[i].func = compress_parts_job;
+            jobs[i].context = &batch;
+            
+            InterlockedIncrement(&batch.refcount);
+            
+            if (!add_thread_func_job(Vcb, &jobs[i])) {
+                InterlockedDecrement(&batch.refcount);
+                break;
+            }
+            
+            submitted++;
+        }
     } else
-        return zlib_write_compressed_bit(fcb, start_data, end_data, data, compressed, changed_sector_list, Irp, rollback);
+        jobs = NULL;
+    
+    compress_parts(&batch);
+    
+    for (i = 0; i < submitted; i++) {
+        if (cancel_thread_job(Vcb, &jobs[i]))
+            InterlockedDecrement(&batch.refcount);
+    }
+    
+    if (InterlockedDecrement(&batch.refcount) != 0)
+        KeWaitForSingleObject(&batch.event, Executive, KernelMode, FALSE, NULL);
+    
+    if (jobs)
+        ExFreePool(jobs);
+    
+    Status = STATUS_SUCCESS;
+    
+    for (i = 0; i < batch.num_parts; i++) {
+        if (NT_SUCCESS(Status)) {
+            if (!NT_SUCCESS(batch.parts[i].Status)) {
+                ERR("compress_part returned %08x\n", batch.parts[i].Status);
+                Status = batch.parts[i].Status;
+            } else {
+                Status = write_compressed_part(fcb, start_data + (i * COMPRESSED_EXTENT_SIZE), &batch.parts[i], changed_sector_list, Irp, rollback);
+                if (!NT_SUCCESS(Status))
+                    ERR("write_compressed_part returned %08x\n", Status);
+                else
+                    update_compression_backoff(fcb, &batch.parts[i]);
+            }
+        }
+        
+        if (batch.parts[i].comp_data)
+            ExFreePool(batch.parts[i].comp_data);
+    }
+    
+    ExFreePool(batch.parts);
+    
+    return Status;
+}
+
+NTSTATUS write_compressed_parallel(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    UINT8 type = get_compression_type(fcb);
+    UINT64 batch_size = (UINT64)COMPRESSED_EXTENT_SIZE * max(fcb->Vcb->threads.num_threads, 1) * 2;
+    UINT64 off = 0;
+    
+    // limit how much memory we use for compressed buffers at any one time
+    while (start_data + off < end_data) {
+        UINT64 end = min(start_data + off + batch_size, end_data);
+        
+        Status = write_compressed_batch(fcb, start_data + off, end, (UINT8*)data + off, type, changed_sector_list, Irp, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("write_compressed_batch returned %08x\n", Status);
+            return Status;
+        }
+        
+        off = end - start_data;
+    }
+    
+    return STATUS_SUCCESS;
 }
@@ -72,7 +72,7 @@ static UINT32 crc32c_hw(const void *input, int len, UINT32 crc) {
         crc = _mm_crc32_u8(crc, *buf);
     }
 
-#ifdef __x86_64__
+#if defined(__x86_64__) || defined(_M_AMD64)
     CALC_CRC(_mm_crc32_u64, crc, UINT64, buf, len);
 #endif
     CALC_CRC(_mm_crc32_u32, crc, UINT32, buf, len);
@@ -98,3 +98,47 @@ UINT32 __stdcall calc_crc32c(UINT32 seed, UINT8* msg, ULONG msglen) {
     
     return rem;
 }
+
+// The crc32 instruction takes three cycles but can start a new one every cycle, so rather than doing one sector
+// at a time we interleave three of them, which keeps the unit busy. Sector sizes are always a multiple of eight.
+static void crc32c_hw_3way(const UINT8* buf, ULONG sector_size, UINT32* csums) {
+    const UINT8* buf1 = buf + sector_size;
+    const UINT8* buf2 = buf1 + sector_size;
+    ULONG i;
+#if defined(__x86_64__) || defined(_M_AMD64)
+    UINT64 crc0 = 0xffffffff, crc1 = 0xffffffff, crc2 = 0xffffffff;
+    
+    for (i = 0; i < sector_size; i += sizeof(UINT64)) {
+        crc0 = _mm_crc32_u64(crc0, *(UINT64*)(buf + i));
+        crc1 = _mm_crc32_u64(crc1, *(UINT64*)(buf1 + i));
+        crc2 = _mm_crc32_u64(crc2, *(UINT64*)(buf2 + i));
+    }
+#else
+    UINT32 crc0 = 0xffffffff, crc1 = 0xffffffff, crc2 = 0xffffffff;
+    
+    for (i = 0; i < sector_size; i += sizeof(UINT32)) {
+        crc0 = _mm_crc32_u32(crc0, *(UINT32*)(buf + i));
+        crc1 = _mm_crc32_u32(crc1, *(UINT32*)(buf1 + i));
+        crc2 = _mm_crc32_u32(crc2, *(UINT32*)(buf2 + i));
+    }
+#endif
+    
+    csums[0] = ~(UINT32)crc0;
+    csums[1] = ~(UINT32)crc1;
+    csums[2] = ~(UINT32)crc2;
+}
+
+// Data checksums for a run of sectors, in the form they go in the checksum tree.
+void __stdcall calc_sector_crc32c(UINT8* data, ULONG sector_size, ULONG num_sectors, UINT32* csums) {
+    ULONG i = 0;
+    
+    if (have_sse42 && sector_size % sizeof(UINT64) == 0) {
+        for (; i + 3 <= num_sectors; i += 3) {
+            crc32c_hw_3way(data + (i * sector_size), sector_size, &csums[i]);
+        }
+    }
+    
+    for (; i < num_sectors; i++) {
+        csums[i] = ~calc_crc32c(0xffffffff, data + (i * sector_size), sector_size);
+    }
+}
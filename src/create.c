@@ -1327,7 +1327,23 @@ NTSTATUS open_fcb(device_extension* Vcb, root* subvol, UINT64 inode, UINT8 type,
                     return STATUS_INSUFFICIENT_RESOURCES;
                 }
                 
-                ext->data = ExAllocatePoolWithTag(PagedPool, tp.item->size, ALLOC_TAG);
+                // Compressed inline extents are kept decompressed in memory, so that nothing else has to worry about
+                // them - flush_fcb compresses them again when they get written back.
+                if (ed->type == EXTENT_TYPE_INLINE && ed->compression != BTRFS_COMPRESSION_NONE) {
+                    if (ed->decoded_size > fcb->Vcb->superblock.node_size) {
+                        ERR("(%llx,%x,%llx) had decoded_size of %llx, expected no more than %x\n", tp.item->key.obj_id, tp.item->key.obj_type,
+                            tp.item->key.offset, ed->decoded_size, fcb->Vcb->superblock.node_size);
+                        
+                        ExFreePool(ext);
+                        free_fcb(fcb);
+                        return STATUS_INTERNAL_ERROR;
+                    }
+                    
+                    ext->datalen = sizeof(EXTENT_DATA) - 1 + (UINT32)ed->decoded_size;
+                } else
+                    ext->datalen = tp.item->size;
+                
+                ext->data = ExAllocatePoolWithTag(PagedPool, ext->datalen, ALLOC_TAG);
                 if (!ext->data) {
                     ERR("out of memory\n");
                     ExFreePool(ext);
@@ -1336,10 +1352,25 @@ NTSTATUS open_fcb(device_extension* Vcb, root* subvol, UINT64 inode, UINT8 type,
                 }
                 
                 ext->offset = tp.item->key.offset;
-                RtlCopyMemory(ext->data, tp.item->data, tp.item->size);
-                ext->datalen = tp.item->size;
+                
+                if (ed->type == EXTENT_TYPE_INLINE && ed->compression != BTRFS_COMPRESSION_NONE) {
+                    RtlCopyMemory(ext->data, ed, sizeof(EXTENT_DATA) - 1);
+                    ext->data->compression = BTRFS_COMPRESSION_NONE;
+                    
+                    Status = decompress(ed->compression, ed->data, tp.item->size - (sizeof(EXTENT_DATA) - 1), ext->data->data, ed->decoded_size);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("decompress returned %08x\n", Status);
+                        ExFreePool(ext->data);
+                        ExFreePool(ext);
+                        free_fcb(fcb);
+                        return Status;
+                    }
+                } else
+                    RtlCopyMemory(ext->data, tp.item->data, tp.item->size);
+                
                 ext->unique = unique;
                 ext->ignore = FALSE;
+                ext->inserted = FALSE;
                 
                 InsertTailList(&fcb->extents, &ext->list_entry);
             }
@@ -17,8 +17,6 @@
 
 #include "btrfs_drv.h"
 
-#define MAX_CSUM_SIZE (4096 - sizeof(tree_header) - sizeof(leaf_node))
-
 // #define DEBUG_WRITE_LOOPS
 
 typedef struct {
@@ -46,6 +44,12 @@ typedef struct {
     LIST_ENTRY list_entry;
 } tree_write;
 
+// The largest single write we'll build out of adjacent tree nodes
+#define MAX_TREE_WRITE_RUN 0x100000
+
+// How much tree data we let each batch of writes have outstanding at commit
+#define MAX_TREE_WRITE_BATCH 0x800000
+
 static NTSTATUS STDCALL write_completion(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID conptr) {
     write_context* context = conptr;
     
@@ -175,12 +179,13 @@ static void clean_space_cache(device_extension* Vcb) {
 static BOOL trees_consistent(device_extension* Vcb, LIST_ENTRY* rollback) {
     ULONG maxsize = Vcb->superblock.node_size - sizeof(tree_header);
     LIST_ENTRY* le;
+    UINT8 level;
     
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
-        
-        if (t->write) {
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
+            
             if (t->header.num_items == 0 && t->parent) {
 #ifdef DEBUG_WRITE_LOOPS
                 ERR("empty tree found, looping again\n");
@@ -201,9 +206,9 @@ static BOOL trees_consistent(device_extension* Vcb, LIST_ENTRY* rollback) {
 #endif
                 return FALSE;
             }
+            
+            le = le->Flink;
         }
-        
-        le = le->Flink;
     }
     
     return TRUE;
@@ -213,33 +218,25 @@ static NTSTATUS add_parents(device_extension* Vcb, LIST_ENTRY* rollback) {
     UINT8 level;
     LIST_ENTRY* le;
     
-    for (level = 0; level <= 255; level++) {
-        BOOL nothing_found = TRUE;
-        
+    // A parent is always one level above its child, so it gets picked up when we reach its level.
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
         TRACE("level = %u\n", level);
         
-        le = Vcb->trees.Flink;
-        while (le != &Vcb->trees) {
-            tree* t = CONTAINING_RECORD(le, tree, list_entry);
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
             
-            if (t->write && t->header.level == level) {
-                TRACE("tree %p: root = %llx, level = %x, parent = %p\n", t, t->header.tree_id, t->header.level, t->parent);
-                
-                nothing_found = FALSE;
-                
-                if (t->parent) {
-                    if (!t->parent->write)
-                        TRACE("adding tree %p (level %x)\n", t->parent, t->header.level);
-                        
-                    t->parent->write = TRUE;
-                }
+            TRACE("tree %p: root = %llx, level = %x, parent = %p\n", t, t->header.tree_id, t->header.level, t->parent);
+            
+            if (t->parent) {
+                if (!t->parent->write)
+                    TRACE("adding tree %p (level %x)\n", t->parent, t->header.level);
+                    
+                mark_tree_dirty(t->parent);
             }
             
             le = le->Flink;
         }
-        
-        if (nothing_found)
-            break;
     }
 
     return STATUS_SUCCESS;
@@ -248,11 +245,189 @@ static NTSTATUS add_parents(device_extension* Vcb, LIST_ENTRY* rollback) {
 static void add_parents_to_cache(device_extension* Vcb, tree* t) {
     while (t->parent) {
         t = t->parent;
-        t->write = TRUE;
+        mark_tree_dirty(t);
+    }
+}
+
+static UINT32 delayed_ref_priority(UINT64 address) {
+    return (UINT32)((address * 0x9e3779b97f4a7c15) >> 32);
+}
+
+// Moves dr above its parent, keeping the tree ordered by address.
+static void delayed_ref_tree_rotate(delayed_ref** tree, delayed_ref* dr) {
+    delayed_ref* p = dr->parent;
+    delayed_ref* g = p->parent;
+    
+    if (p->left == dr) {
+        p->left = dr->right;
+        
+        if (p->left)
+            p->left->parent = p;
+        
+        dr->right = p;
+    } else {
+        p->right = dr->left;
+        
+        if (p->right)
+            p->right->parent = p;
+        
+        dr->left = p;
+    }
+    
+    p->parent = dr;
+    dr->parent = g;
+    
+    if (!g)
+        *tree = dr;
+    else if (g->left == p)
+        g->left = dr;
+    else
+        g->right = dr;
+}
+
+static void delayed_ref_tree_insert(delayed_ref** tree, delayed_ref* dr) {
+    delayed_ref *p = NULL, **link = tree;
+    
+    while (*link) {
+        p = *link;
+        link = dr->address < p->address ? &p->left : &p->right;
+    }
+    
+    dr->parent = p;
+    dr->left = dr->right = NULL;
+    dr->priority = delayed_ref_priority(dr->address);
+    *link = dr;
+    
+    while (dr->parent && dr->parent->priority < dr->priority) {
+        delayed_ref_tree_rotate(tree, dr);
+    }
+}
+
+static void delayed_ref_tree_remove(delayed_ref** tree, delayed_ref* dr) {
+    delayed_ref* child;
+    
+    while (dr->left && dr->right) {
+        delayed_ref_tree_rotate(tree, dr->left->priority > dr->right->priority ? dr->left : dr->right);
+    }
+    
+    child = dr->left ? dr->left : dr->right;
+    
+    if (child)
+        child->parent = dr->parent;
+    
+    if (!dr->parent)
+        *tree = child;
+    else if (dr->parent->left == dr)
+        dr->parent->left = child;
+    else
+        dr->parent->right = child;
+}
+
+// returns the ref with the highest address less than or equal to address
+static delayed_ref* delayed_ref_tree_find(delayed_ref* tree, UINT64 address) {
+    delayed_ref* ret = NULL;
+    
+    while (tree) {
+        if (tree->address <= address) {
+            ret = tree;
+            tree = tree->right;
+        } else
+            tree = tree->left;
+    }
+    
+    return ret;
+}
+
+static delayed_ref* find_delayed_ref(device_extension* Vcb, UINT64 address) {
+    delayed_ref* dr = delayed_ref_tree_find(Vcb->delayed_ref_tree, address);
+    
+    return dr && dr->address == address ? dr : NULL;
+}
+
+// Tree block refs don't go into the extent tree straight away - we keep them in a list sorted by address, and write
+// them out in one pass at commit. A block which is allocated and freed within the same transaction never reaches
+// the extent tree at all. The list and its treap are protected by tree_lock.
+NTSTATUS add_delayed_ref(device_extension* Vcb, UINT64 address, UINT8 level, UINT64 root, signed int count, LIST_ENTRY* rollback) {
+    delayed_ref *dr, *prev, *rdr;
+    
+    if (rollback) {
+        rdr = ExAllocatePoolWithTag(PagedPool, sizeof(delayed_ref), ALLOC_TAG);
+        if (!rdr) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        
+        rdr->address = address;
+        rdr->root = root;
+        rdr->level = level;
+        rdr->count = count;
+    } else
+        rdr = NULL;
+    
+    InterlockedIncrement64(&Vcb->ref_stats.queued);
+    
+    dr = delayed_ref_tree_find(Vcb->delayed_ref_tree, address);
+    
+    if (dr && dr->address == address) {
+        dr->count += count;
+        
+        if (dr->count == 0) {
+            // if we're rolled back, we need to put back the ref we've just cancelled out
+            if (rdr && count < 0) {
+                rdr->root = dr->root;
+                rdr->level = dr->level;
+            }
+            
+            RemoveEntryList(&dr->list_entry);
+            delayed_ref_tree_remove(&Vcb->delayed_ref_tree, dr);
+            ExFreePool(dr);
+            
+            InterlockedIncrement64(&Vcb->ref_stats.cancelled);
+        }
+        
+        goto end;
+    }
+    
+    // otherwise dr is the ref before this one, if there is one
+    prev = dr;
+    
+    dr = ExAllocatePoolWithTag(PagedPool, sizeof(delayed_ref), ALLOC_TAG);
+    if (!dr) {
+        ERR("out of memory\n");
+        
+        if (rdr)
+            ExFreePool(rdr);
+        
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    dr->address = address;
+    dr->root = root;
+    dr->level = level;
+    dr->count = count;
+    
+    InsertHeadList(prev ? &prev->list_entry : &Vcb->delayed_refs, &dr->list_entry);
+    delayed_ref_tree_insert(&Vcb->delayed_ref_tree, dr);
+    
+end:
+    if (rdr)
+        add_rollback(rollback, ROLLBACK_DELAYED_REF, rdr);
+    
+    return STATUS_SUCCESS;
+}
+
+void free_delayed_refs(device_extension* Vcb) {
+    while (!IsListEmpty(&Vcb->delayed_refs)) {
+        LIST_ENTRY* le = RemoveHeadList(&Vcb->delayed_refs);
+        delayed_ref* dr = CONTAINING_RECORD(le, delayed_ref, list_entry);
+        
+        ExFreePool(dr);
     }
+    
+    Vcb->delayed_ref_tree = NULL;
 }
 
-static BOOL insert_tree_extent_skinny(device_extension* Vcb, UINT8 level, UINT64 root_id, chunk* c, UINT64 address, PIRP Irp, LIST_ENTRY* rollback) {
+static BOOL insert_tree_extent_skinny(device_extension* Vcb, UINT8 level, UINT64 root_id, UINT64 address, PIRP Irp, LIST_ENTRY* rollback) {
     EXTENT_ITEM_SKINNY_METADATA* eism;
     traverse_ptr insert_tp;
     
@@ -274,35 +449,17 @@ static BOOL insert_tree_extent_skinny(device_extension* Vcb, UINT8 level, UINT64
         return FALSE;
     }
     
-    ExAcquireResourceExclusiveLite(&c->lock, TRUE);
-    
-    space_list_subtract(Vcb, c, FALSE, address, Vcb->superblock.node_size, rollback);
-
-    ExReleaseResourceLite(&c->lock);
-    
     add_parents_to_cache(Vcb, insert_tp.tree);
     
     return TRUE;
 }
 
-static BOOL insert_tree_extent(device_extension* Vcb, UINT8 level, UINT64 root_id, chunk* c, UINT64* new_address, PIRP Irp, LIST_ENTRY* rollback) {
-    UINT64 address;
+static BOOL insert_tree_extent_item(device_extension* Vcb, UINT8 level, UINT64 root_id, UINT64 address, PIRP Irp, LIST_ENTRY* rollback) {
     EXTENT_ITEM_TREE2* eit2;
     traverse_ptr insert_tp;
     
-    TRACE("(%p, %x, %llx, %p, %p, %p, %p)\n", Vcb, level, root_id, c, new_address, rollback);
-    
-    if (!find_address_in_chunk(Vcb, c, Vcb->superblock.node_size, &address))
-        return FALSE;
-    
-    if (Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA) {
-        BOOL b = insert_tree_extent_skinny(Vcb, level, root_id, c, address, Irp, rollback);
-        
-        if (b)
-            *new_address = address;
-        
-        return b;
-    }
+    if (Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA)
+        return insert_tree_extent_skinny(Vcb, level, root_id, address, Irp, rollback);
     
     eit2 = ExAllocatePoolWithTag(PagedPool, sizeof(EXTENT_ITEM_TREE2), ALLOC_TAG);
     if (!eit2) {
@@ -331,14 +488,33 @@ static BOOL insert_tree_extent(device_extension* Vcb, UINT8 level, UINT64 root_i
         ExFreePool(eit2);
         return FALSE;
     }
+
+    add_parents_to_cache(Vcb, insert_tp.tree);
+    
+    return TRUE;
+}
+
+static BOOL insert_tree_extent(device_extension* Vcb, UINT8 level, UINT64 root_id, chunk* c, UINT64* new_address, PIRP Irp, LIST_ENTRY* rollback) {
+    UINT64 address;
+    NTSTATUS Status;
+    
+    TRACE("(%p, %x, %llx, %p, %p, %p, %p)\n", Vcb, level, root_id, c, new_address, rollback);
+    
+    if (!find_address_in_chunk(Vcb, c, Vcb->superblock.node_size, &address))
+        return FALSE;
+    
+    // the extent item itself gets added by run_delayed_refs
+    Status = add_delayed_ref(Vcb, address, level, root_id, 1, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("add_delayed_ref returned %08x\n", Status);
+        return FALSE;
+    }
     
     ExAcquireResourceExclusiveLite(&c->lock, TRUE);
     
     space_list_subtract(Vcb, c, FALSE, address, Vcb->superblock.node_size, rollback);
     
     ExReleaseResourceLite(&c->lock);
-
-    add_parents_to_cache(Vcb, insert_tp.tree);
     
     *new_address = address;
     
@@ -429,10 +605,9 @@ NTSTATUS get_tree_new_address(device_extension* Vcb, tree* t, PIRP Irp, LIST_ENT
     return STATUS_DISK_FULL;
 }
 
-static BOOL reduce_tree_extent_skinny(device_extension* Vcb, UINT64 address, tree* t, PIRP Irp, LIST_ENTRY* rollback) {
+static BOOL remove_tree_extent_skinny(device_extension* Vcb, UINT64 address, PIRP Irp, LIST_ENTRY* rollback) {
     KEY searchkey;
     traverse_ptr tp;
-    chunk* c;
     NTSTATUS Status;
     
     searchkey.obj_id = address;
@@ -456,19 +631,6 @@ static BOOL reduce_tree_extent_skinny(device_extension* Vcb, UINT64 address, tre
     }
     
     delete_tree_item(Vcb, &tp, rollback);
-
-    c = get_chunk_from_address(Vcb, address);
-    
-    if (c) {
-        ExAcquireResourceExclusiveLite(&c->lock, TRUE);
-        
-        decrease_chunk_usage(c, Vcb->superblock.node_size);
-        
-        space_list_add(Vcb, c, TRUE, address, Vcb->superblock.node_size, rollback);
-        
-        ExReleaseResourceLite(&c->lock);
-    } else
-        ERR("could not find chunk for address %llx\n", address);
     
     return TRUE;
 }
@@ -599,20 +761,19 @@ static void convert_old_tree_extent(device_extension* Vcb, tree_data* td, tree*
     add_parents_to_cache(Vcb, tp2.tree);
 }
 
-static NTSTATUS reduce_tree_extent(device_extension* Vcb, UINT64 address, tree* t, PIRP Irp, LIST_ENTRY* rollback) {
+static NTSTATUS remove_tree_extent_item(device_extension* Vcb, UINT64 address, PIRP Irp, LIST_ENTRY* rollback) {
     KEY searchkey;
     traverse_ptr tp;
     EXTENT_ITEM* ei;
     EXTENT_ITEM_V0* eiv0;
-    chunk* c;
     NTSTATUS Status;
     
     // FIXME - deal with refcounts > 1
     
-    TRACE("(%p, %llx, %p)\n", Vcb, address, t);
+    TRACE("(%p, %llx)\n", Vcb, address);
     
     if (Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA) {
-        if (reduce_tree_extent_skinny(Vcb, address, t, Irp, rollback)) {
+        if (remove_tree_extent_skinny(Vcb, address, Irp, rollback)) {
             return STATUS_SUCCESS;
         }
     }
@@ -674,6 +835,46 @@ static NTSTATUS reduce_tree_extent(device_extension* Vcb, UINT64 address, tree*
             delete_tree_item(Vcb, &tp2, rollback);
         }
     }
+    
+    return STATUS_SUCCESS;
+}
+
+static BOOL is_new_tree_extent(device_extension* Vcb, UINT64 address) {
+    delayed_ref* dr = find_delayed_ref(Vcb, address);
+    
+    return dr && dr->count > 0;
+}
+
+static void free_tree_extent_space(device_extension* Vcb, UINT64 address, LIST_ENTRY* rollback) {
+    chunk* c = get_chunk_from_address(Vcb, address);
+    
+    if (c) {
+        ExAcquireResourceExclusiveLite(&c->lock, TRUE);
+        
+        decrease_chunk_usage(c, Vcb->superblock.node_size);
+        
+        space_list_add(Vcb, c, TRUE, address, Vcb->superblock.node_size, rollback);
+        
+        ExReleaseResourceLite(&c->lock);
+    } else
+        ERR("could not find chunk for address %llx\n", address);
+}
+
+static NTSTATUS reduce_tree_extent(device_extension* Vcb, UINT64 address, tree* t, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    BOOL new_extent;
+    
+    TRACE("(%p, %llx, %p)\n", Vcb, address, t);
+    
+    new_extent = is_new_tree_extent(Vcb, address);
+    
+    // If the block was allocated in this transaction, this cancels out its ref. Otherwise the extent item
+    // gets removed by run_delayed_refs.
+    Status = add_delayed_ref(Vcb, address, t ? t->header.level : 0, t ? t->header.tree_id : 0, -1, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("add_delayed_ref returned %08x\n", Status);
+        return Status;
+    }
      
     if (t && !(t->header.flags & HEADER_FLAG_MIXED_BACKREF)) {
         LIST_ENTRY* le;
@@ -706,472 +907,581 @@ static NTSTATUS reduce_tree_extent(device_extension* Vcb, UINT64 address, tree*
             le = le->Flink;
         }
     }
-
-    c = get_chunk_from_address(Vcb, address);
     
-    if (c) {
-        ExAcquireResourceExclusiveLite(&c->lock, TRUE);
-        
-        decrease_chunk_usage(c, tp.item->key.offset);
-        
-        space_list_add(Vcb, c, TRUE, address, tp.item->key.offset, rollback);
-        
-        ExReleaseResourceLite(&c->lock);
-    } else
-        ERR("could not find chunk for address %llx\n", address);
+    // Nothing else can be referring to a block we've only just allocated, so we can free it now. Otherwise we have
+    // to wait until run_delayed_refs has checked the refcount, as it might be shared with a snapshot.
+    if (new_extent)
+        free_tree_extent_space(Vcb, address, rollback);
     
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS allocate_tree_extents(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
-    LIST_ENTRY* le;
+// The list is kept sorted by address, so this is a single pass through the extent tree.
+static NTSTATUS run_delayed_refs(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     
     TRACE("(%p)\n", Vcb);
     
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
+    while (!IsListEmpty(&Vcb->delayed_refs)) {
+        LIST_ENTRY* le = RemoveHeadList(&Vcb->delayed_refs);
+        delayed_ref* dr = CONTAINING_RECORD(le, delayed_ref, list_entry);
+        signed int count = dr->count;
         
-        if (t->write && !t->has_new_address) {
-            chunk* c;
-            
-            Status = get_tree_new_address(Vcb, t, Irp, rollback);
+        delayed_ref_tree_remove(&Vcb->delayed_ref_tree, dr);
+        
+        // if we're rolled back, this puts the ref back on the list
+        dr->count = -count;
+        add_rollback(rollback, ROLLBACK_DELAYED_REF, dr);
+        
+        if (count > 0) {
+            if (!insert_tree_extent_item(Vcb, dr->level, dr->root, dr->address, Irp, rollback)) {
+                ERR("insert_tree_extent_item failed\n");
+                return STATUS_INTERNAL_ERROR;
+            }
+        } else {
+            Status = remove_tree_extent_item(Vcb, dr->address, Irp, rollback);
             if (!NT_SUCCESS(Status)) {
-                ERR("get_tree_new_address returned %08x\n", Status);
+                ERR("remove_tree_extent_item returned %08x\n", Status);
                 return Status;
             }
             
-            TRACE("allocated extent %llx\n", t->new_address);
-            
-            if (t->has_address) {
-                Status = reduce_tree_extent(Vcb, t->header.address, t, Irp, rollback);
-                
-                if (!NT_SUCCESS(Status)) {
-                    ERR("reduce_tree_extent returned %08x\n", Status);
-                    return Status;
-                }
-            }
-
-            c = get_chunk_from_address(Vcb, t->new_address);
-            
-            if (c) {
-                increase_chunk_usage(c, Vcb->superblock.node_size);
-            } else {
-                ERR("could not find chunk for address %llx\n", t->new_address);
-                return STATUS_INTERNAL_ERROR;
-            }
+            // the extent item's gone, so now we know nothing else is using the block
+            free_tree_extent_space(Vcb, dr->address, rollback);
         }
         
-        le = le->Flink;
+        InterlockedIncrement64(&Vcb->ref_stats.applied);
     }
     
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS update_root_root(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
+static NTSTATUS allocate_tree_extents(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
     LIST_ENTRY* le;
+    UINT8 level;
     NTSTATUS Status;
     
     TRACE("(%p)\n", Vcb);
     
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
-        
-        if (t->write && !t->parent) {
-            if (t->root != Vcb->root_root && t->root != Vcb->chunk_root) {
-                KEY searchkey;
-                traverse_ptr tp;
-                
-                searchkey.obj_id = t->root->id;
-                searchkey.obj_type = TYPE_ROOT_ITEM;
-                searchkey.offset = 0xffffffffffffffff;
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
+            
+            if (!t->has_new_address) {
+                chunk* c;
                 
-                Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
+                Status = get_tree_new_address(Vcb, t, Irp, rollback);
                 if (!NT_SUCCESS(Status)) {
-                    ERR("error - find_item returned %08x\n", Status);
+                    ERR("get_tree_new_address returned %08x\n", Status);
                     return Status;
                 }
                 
-                if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
-                    ERR("could not find ROOT_ITEM for tree %llx\n", searchkey.obj_id);
-                    int3;
-                    return STATUS_INTERNAL_ERROR;
-                }
-                
-                TRACE("updating the address for root %llx to %llx\n", searchkey.obj_id, t->new_address);
+                TRACE("allocated extent %llx\n", t->new_address);
                 
-                t->root->root_item.block_number = t->new_address;
-                t->root->root_item.root_level = t->header.level;
-                t->root->root_item.generation = Vcb->superblock.generation;
-                t->root->root_item.generation2 = Vcb->superblock.generation;
-                
-                if (tp.item->size < sizeof(ROOT_ITEM)) { // if not full length, delete and create new entry
-                    ROOT_ITEM* ri = ExAllocatePoolWithTag(PagedPool, sizeof(ROOT_ITEM), ALLOC_TAG);
-                    
-                    if (!ri) {
-                        ERR("out of memory\n");
-                        return STATUS_INSUFFICIENT_RESOURCES;
-                    }
-                    
-                    RtlCopyMemory(ri, &t->root->root_item, sizeof(ROOT_ITEM));
+                if (t->has_address) {
+                    Status = reduce_tree_extent(Vcb, t->header.address, t, Irp, rollback);
                     
-                    delete_tree_item(Vcb, &tp, rollback);
-                    
-                    if (!insert_tree_item(Vcb, Vcb->root_root, searchkey.obj_id, searchkey.obj_type, 0, ri, sizeof(ROOT_ITEM), NULL, Irp, rollback)) {
-                        ERR("insert_tree_item failed\n");
-                        return STATUS_INTERNAL_ERROR;
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("reduce_tree_extent returned %08x\n", Status);
+                        return Status;
                     }
-                } else
-                    RtlCopyMemory(tp.item->data, &t->root->root_item, sizeof(ROOT_ITEM));
+                }
+
+                c = get_chunk_from_address(Vcb, t->new_address);
+                
+                if (c) {
+                    increase_chunk_usage(c, Vcb->superblock.node_size);
+                } else {
+                    ERR("could not find chunk for address %llx\n", t->new_address);
+                    return STATUS_INTERNAL_ERROR;
+                }
             }
             
-            t->root->treeholder.address = t->new_address;
+            le = le->Flink;
         }
-        
-        le = le->Flink;
-    }
-    
-    Status = update_chunk_caches(Vcb, Irp, rollback);
-    if (!NT_SUCCESS(Status)) {
-        ERR("update_chunk_caches returned %08x\n", Status);
-        return Status;
     }
     
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
+static NTSTATUS update_root_root(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
+    LIST_ENTRY* le;
     UINT8 level;
-    UINT8 *data, *body;
-    UINT32 crc32;
     NTSTATUS Status;
-    LIST_ENTRY* le;
-    write_data_context* wtc;
-    LIST_ENTRY tree_writes;
-    tree_write* tw;
-    chunk* c;
     
     TRACE("(%p)\n", Vcb);
     
-    InitializeListHead(&tree_writes);
-
-    for (level = 0; level <= 255; level++) {
-        BOOL nothing_found = TRUE;
-        
-        TRACE("level = %u\n", level);
-        
-        le = Vcb->trees.Flink;
-        while (le != &Vcb->trees) {
-            tree* t = CONTAINING_RECORD(le, tree, list_entry);
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
             
-            if (t->write && t->header.level == level) {
-                KEY firstitem, searchkey;
-                LIST_ENTRY* le2;
-                traverse_ptr tp;
-                EXTENT_ITEM_TREE* eit;
-                
-                if (!t->has_new_address) {
-                    ERR("error - tried to write tree with no new address\n");
-                    int3;
-                }
-                
-                le2 = t->itemlist.Flink;
-                while (le2 != &t->itemlist) {
-                    tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
-                    if (!td->ignore) {
-                        firstitem = td->key;
-                        break;
-                    }
-                    le2 = le2->Flink;
-                }
-                
-                if (t->parent) {
-                    t->paritem->key = firstitem;
-                    t->paritem->treeholder.address = t->new_address;
-                    t->paritem->treeholder.generation = Vcb->superblock.generation;
-                }
-                
-                if (!(Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA)) {
-                    searchkey.obj_id = t->new_address;
-                    searchkey.obj_type = TYPE_EXTENT_ITEM;
-                    searchkey.offset = Vcb->superblock.node_size;
+            if (!t->parent) {
+                if (t->root != Vcb->root_root && t->root != Vcb->chunk_root) {
+                    KEY searchkey;
+                    traverse_ptr tp;
                     
-                    Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE, Irp);
+                    searchkey.obj_id = t->root->id;
+                    searchkey.obj_type = TYPE_ROOT_ITEM;
+                    searchkey.offset = 0xffffffffffffffff;
+                    
+                    Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
                     if (!NT_SUCCESS(Status)) {
                         ERR("error - find_item returned %08x\n", Status);
                         return Status;
                     }
                     
-                    if (keycmp(&searchkey, &tp.item->key)) {
-//                         traverse_ptr next_tp;
-//                         BOOL b;
-//                         tree_data* paritem;
-                        
-                        ERR("could not find %llx,%x,%llx in extent_root (found %llx,%x,%llx instead)\n", searchkey.obj_id, searchkey.obj_type, searchkey.offset, tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset);
-                        
-//                         searchkey.obj_id = 0;
-//                         searchkey.obj_type = 0;
-//                         searchkey.offset = 0;
-//                         
-//                         find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE);
-//                         
-//                         paritem = NULL;
-//                         do {
-//                             if (tp.tree->paritem != paritem) {
-//                                 paritem = tp.tree->paritem;
-//                                 ERR("paritem: %llx,%x,%llx\n", paritem->key.obj_id, paritem->key.obj_type, paritem->key.offset);
-//                             }
-//                             
-//                             ERR("%llx,%x,%llx\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset);
-//                             
-//                             b = find_next_item(Vcb, &tp, &next_tp, NULL, FALSE);
-//                             if (b) {
-//                                 free_traverse_ptr(&tp);
-//                                 tp = next_tp;
-//                             }
-//                         } while (b);
-//                         
-//                         free_traverse_ptr(&tp);
-                        
+                    if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
+                        ERR("could not find ROOT_ITEM for tree %llx\n", searchkey.obj_id);
+                        int3;
                         return STATUS_INTERNAL_ERROR;
                     }
                     
-                    if (tp.item->size < sizeof(EXTENT_ITEM_TREE)) {
-                        ERR("(%llx,%x,%llx) was %u bytes, expected at least %u\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, sizeof(EXTENT_ITEM_TREE));
-                        return STATUS_INTERNAL_ERROR;
-                    }
+                    TRACE("updating the address for root %llx to %llx\n", searchkey.obj_id, t->new_address);
                     
-                    eit = (EXTENT_ITEM_TREE*)tp.item->data;
-                    eit->firstitem = firstitem;
+                    t->root->root_item.block_number = t->new_address;
+                    t->root->root_item.root_level = t->header.level;
+                    t->root->root_item.generation = Vcb->superblock.generation;
+                    t->root->root_item.generation2 = Vcb->superblock.generation;
+                    
+                    if (tp.item->size < sizeof(ROOT_ITEM)) { // if not full length, delete and create new entry
+                        ROOT_ITEM* ri = ExAllocatePoolWithTag(PagedPool, sizeof(ROOT_ITEM), ALLOC_TAG);
+                        
+                        if (!ri) {
+                            ERR("out of memory\n");
+                            return STATUS_INSUFFICIENT_RESOURCES;
+                        }
+                        
+                        RtlCopyMemory(ri, &t->root->root_item, sizeof(ROOT_ITEM));
+                        
+                        delete_tree_item(Vcb, &tp, rollback);
+                        
+                        if (!insert_tree_item(Vcb, Vcb->root_root, searchkey.obj_id, searchkey.obj_type, 0, ri, sizeof(ROOT_ITEM), NULL, Irp, rollback)) {
+                            ERR("insert_tree_item failed\n");
+                            return STATUS_INTERNAL_ERROR;
+                        }
+                    } else
+                        RtlCopyMemory(tp.item->data, &t->root->root_item, sizeof(ROOT_ITEM));
                 }
                 
-                nothing_found = FALSE;
+                t->root->treeholder.address = t->new_address;
             }
             
             le = le->Flink;
         }
-        
-        if (nothing_found)
-            break;
     }
     
-    TRACE("allocated tree extents\n");
-    
-    wtc = ExAllocatePoolWithTag(NonPagedPool, sizeof(write_data_context), ALLOC_TAG);
-    if (!wtc) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
+    if (Vcb->free_space_root)
+        merge_deleted_space(Vcb);
+    else {
+        Status = update_chunk_caches(Vcb, Irp, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("update_chunk_caches returned %08x\n", Status);
+            return Status;
+        }
     }
     
-    KeInitializeEvent(&wtc->Event, NotificationEvent, FALSE);
-    InitializeListHead(&wtc->stripes);
-    wtc->tree = TRUE;
-    wtc->stripes_left = 0;
-    
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
+    return STATUS_SUCCESS;
+}
+
+static void write_tree_node(device_extension* Vcb, tree* t, UINT8* data) {
+    UINT8* body;
+    UINT32 crc32;
 #ifdef DEBUG_PARANOID
-        UINT32 num_items = 0, size = 0;
-        LIST_ENTRY* le2;
-        BOOL crash = FALSE;
+    UINT32 num_items = 0, size = 0;
+    LIST_ENTRY* le2;
+    BOOL crash = FALSE;
 #endif
 
-        if (t->write) {
 #ifdef DEBUG_PARANOID
-            le2 = t->itemlist.Flink;
-            while (le2 != &t->itemlist) {
-                tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
-                if (!td->ignore) {
-                    num_items++;
-                    
-                    if (t->header.level == 0)
-                        size += td->size;
-                }
-                le2 = le2->Flink;
-            }
+    le2 = t->itemlist.Flink;
+    while (le2 != &t->itemlist) {
+        tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
+        if (!td->ignore) {
+            num_items++;
             
             if (t->header.level == 0)
-                size += num_items * sizeof(leaf_node);
-            else
-                size += num_items * sizeof(internal_node);
-            
-            if (num_items != t->header.num_items) {
-                ERR("tree %llx, level %x: num_items was %x, expected %x\n", t->root->id, t->header.level, num_items, t->header.num_items);
-                crash = TRUE;
+                size += td->size;
+        }
+        le2 = le2->Flink;
+    }
+    
+    if (t->header.level == 0)
+        size += num_items * sizeof(leaf_node);
+    else
+        size += num_items * sizeof(internal_node);
+    
+    if (num_items != t->header.num_items) {
+        ERR("tree %llx, level %x: num_items was %x, expected %x\n", t->root->id, t->header.level, num_items, t->header.num_items);
+        crash = TRUE;
+    }
+    
+    if (size != t->size) {
+        ERR("tree %llx, level %x: size was %x, expected %x\n", t->root->id, t->header.level, size, t->size);
+        crash = TRUE;
+    }
+    
+    if (t->header.num_items == 0 && t->parent) {
+        ERR("tree %llx, level %x: tried to write empty tree with parent\n", t->root->id, t->header.level);
+        crash = TRUE;
+    }
+    
+    if (t->size > Vcb->superblock.node_size - sizeof(tree_header)) {
+        ERR("tree %llx, level %x: tried to write overlarge tree (%x > %x)\n", t->root->id, t->header.level, t->size, Vcb->superblock.node_size - sizeof(tree_header));
+        crash = TRUE;
+    }
+    
+    if (crash) {
+        ERR("tree %p\n", t);
+        le2 = t->itemlist.Flink;
+        while (le2 != &t->itemlist) {
+            tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
+            if (!td->ignore) {
+                ERR("%llx,%x,%llx inserted=%u\n", td->key.obj_id, td->key.obj_type, td->key.offset, td->inserted);
             }
-            
-            if (size != t->size) {
-                ERR("tree %llx, level %x: size was %x, expected %x\n", t->root->id, t->header.level, size, t->size);
-                crash = TRUE;
+            le2 = le2->Flink;
+        }
+        int3;
+    }
+#endif
+    t->header.address = t->new_address;
+    t->header.generation = Vcb->superblock.generation;
+    t->header.flags |= HEADER_FLAG_MIXED_BACKREF;
+    t->has_address = TRUE;
+    
+    body = data + sizeof(tree_header);
+    
+    RtlCopyMemory(data, &t->header, sizeof(tree_header));
+    RtlZeroMemory(body, Vcb->superblock.node_size - sizeof(tree_header));
+    
+    if (t->header.level == 0) {
+        leaf_node* itemptr = (leaf_node*)body;
+        int i = 0;
+        LIST_ENTRY* le2;
+        UINT8* dataptr = data + Vcb->superblock.node_size;
+        
+        le2 = t->itemlist.Flink;
+        while (le2 != &t->itemlist) {
+            tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
+            if (!td->ignore) {
+                dataptr = dataptr - td->size;
+                
+                itemptr[i].key = td->key;
+                itemptr[i].offset = (UINT8*)dataptr - (UINT8*)body;
+                itemptr[i].size = td->size;
+                i++;
+                
+                if (td->size > 0)
+                    RtlCopyMemory(dataptr, td->data, td->size);
             }
             
-            if (t->header.num_items == 0 && t->parent) {
-                ERR("tree %llx, level %x: tried to write empty tree with parent\n", t->root->id, t->header.level);
-                crash = TRUE;
+            le2 = le2->Flink;
+        }
+    } else {
+        internal_node* itemptr = (internal_node*)body;
+        int i = 0;
+        LIST_ENTRY* le2;
+        
+        le2 = t->itemlist.Flink;
+        while (le2 != &t->itemlist) {
+            tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
+            if (!td->ignore) {
+                itemptr[i].key = td->key;
+                itemptr[i].address = td->treeholder.address;
+                itemptr[i].generation = td->treeholder.generation;
+                i++;
             }
             
-            if (t->size > Vcb->superblock.node_size - sizeof(tree_header)) {
-                ERR("tree %llx, level %x: tried to write overlarge tree (%x > %x)\n", t->root->id, t->header.level, t->size, Vcb->superblock.node_size - sizeof(tree_header));
-                crash = TRUE;
-            }
+            le2 = le2->Flink;
+        }
+    }
+    
+    crc32 = calc_crc32c(0xffffffff, (UINT8*)&((tree_header*)data)->fs_uuid, Vcb->superblock.node_size - sizeof(((tree_header*)data)->csum));
+    crc32 = ~crc32;
+    *((UINT32*)data) = crc32;
+    TRACE("setting crc32 to %08x\n", crc32);
+}
+
+// Sort the dirty trees by the address they're going to be written to, so that neighbouring nodes can be merged into a single write.
+// This is a heapsort, as we don't want to recurse on the kernel stack.
+static void sort_trees_by_address(tree** trees, ULONG num_trees) {
+    ULONG i, j, k, n;
+    tree* t;
+    
+    if (num_trees < 2)
+        return;
+    
+    for (i = num_trees / 2; i > 0; i--) {
+        j = i - 1;
+        t = trees[j];
+        
+        while ((k = (j * 2) + 1) < num_trees) {
+            if (k + 1 < num_trees && trees[k + 1]->new_address > trees[k]->new_address)
+                k++;
             
-            if (crash) {
-                ERR("tree %p\n", t);
-                le2 = t->itemlist.Flink;
-                while (le2 != &t->itemlist) {
-                    tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
-                    if (!td->ignore) {
-                        ERR("%llx,%x,%llx inserted=%u\n", td->key.obj_id, td->key.obj_type, td->key.offset, td->inserted);
-                    }
-                    le2 = le2->Flink;
-                }
-                int3;
-            }
-#endif
-            t->header.address = t->new_address;
-            t->header.generation = Vcb->superblock.generation;
-            t->header.flags |= HEADER_FLAG_MIXED_BACKREF;
-            t->has_address = TRUE;
+            if (trees[k]->new_address <= t->new_address)
+                break;
             
-            data = ExAllocatePoolWithTag(NonPagedPool, Vcb->superblock.node_size, ALLOC_TAG);
-            if (!data) {
-                ERR("out of memory\n");
-                Status = STATUS_INSUFFICIENT_RESOURCES;
-                goto end;
-            }
+            trees[j] = trees[k];
+            j = k;
+        }
+        
+        trees[j] = t;
+    }
+    
+    for (n = num_trees - 1; n > 0; n--) {
+        t = trees[n];
+        trees[n] = trees[0];
+        j = 0;
+        
+        while ((k = (j * 2) + 1) < n) {
+            if (k + 1 < n && trees[k + 1]->new_address > trees[k]->new_address)
+                k++;
+            
+            if (trees[k]->new_address <= t->new_address)
+                break;
             
-            body = data + sizeof(tree_header);
+            trees[j] = trees[k];
+            j = k;
+        }
+        
+        trees[j] = t;
+    }
+}
+
+static void launch_tree_writes(write_data_context* wtc) {
+    LIST_ENTRY* le;
+    
+    le = wtc->stripes.Flink;
+    while (le != &wtc->stripes) {
+        write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
+        
+        if (stripe->status != WriteDataStatus_Ignore)
+            IoCallDriver(stripe->device->devobj, stripe->Irp);
+        
+        le = le->Flink;
+    }
+}
+
+static NTSTATUS wait_for_tree_writes(write_data_context* wtc) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    LIST_ENTRY* le;
+    
+    if (IsListEmpty(&wtc->stripes))
+        return STATUS_SUCCESS;
+    
+    KeWaitForSingleObject(&wtc->Event, Executive, KernelMode, FALSE, NULL);
+    
+    le = wtc->stripes.Flink;
+    while (le != &wtc->stripes) {
+        write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
+        
+        if (stripe->status != WriteDataStatus_Ignore && !NT_SUCCESS(stripe->iosb.Status)) {
+            Status = stripe->iosb.Status;
+            break;
+        }
+        
+        le = le->Flink;
+    }
+    
+    free_write_data_stripes(wtc);
+    
+    // get the context ready for the next batch
+    InitializeListHead(&wtc->stripes);
+    KeClearEvent(&wtc->Event);
+    wtc->stripes_left = 0;
+    
+    return Status;
+}
+
+static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
+    UINT8 level;
+    UINT8* data;
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    write_data_context* wtc[2] = { NULL, NULL };
+    BOOL in_flight[2] = { FALSE, FALSE };
+    LIST_ENTRY tree_writes;
+    tree_write* tw;
+    chunk* c;
+    tree** trees = NULL;
+    ULONG num_trees, i, j, k, cur;
+    UINT32 batch_length;
+    
+    TRACE("(%p)\n", Vcb);
+    
+    InitializeListHead(&tree_writes);
+
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        TRACE("level = %u\n", level);
+        
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
+            KEY firstitem, searchkey;
+            LIST_ENTRY* le2;
+            traverse_ptr tp;
+            EXTENT_ITEM_TREE* eit;
             
-            RtlCopyMemory(data, &t->header, sizeof(tree_header));
-            RtlZeroMemory(body, Vcb->superblock.node_size - sizeof(tree_header));
+            if (!t->has_new_address) {
+                ERR("error - tried to write tree with no new address\n");
+                int3;
+            }
             
-            if (t->header.level == 0) {
-                leaf_node* itemptr = (leaf_node*)body;
-                int i = 0;
-                LIST_ENTRY* le2;
-                UINT8* dataptr = data + Vcb->superblock.node_size;
-                
-                le2 = t->itemlist.Flink;
-                while (le2 != &t->itemlist) {
-                    tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
-                    if (!td->ignore) {
-                        dataptr = dataptr - td->size;
-                        
-                        itemptr[i].key = td->key;
-                        itemptr[i].offset = (UINT8*)dataptr - (UINT8*)body;
-                        itemptr[i].size = td->size;
-                        i++;
-                        
-                        if (td->size > 0)
-                            RtlCopyMemory(dataptr, td->data, td->size);
-                    }
-                    
-                    le2 = le2->Flink;
-                }
-            } else {
-                internal_node* itemptr = (internal_node*)body;
-                int i = 0;
-                LIST_ENTRY* le2;
-                
-                le2 = t->itemlist.Flink;
-                while (le2 != &t->itemlist) {
-                    tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
-                    if (!td->ignore) {
-                        itemptr[i].key = td->key;
-                        itemptr[i].address = td->treeholder.address;
-                        itemptr[i].generation = td->treeholder.generation;
-                        i++;
-                    }
-                    
-                    le2 = le2->Flink;
+            le2 = t->itemlist.Flink;
+            while (le2 != &t->itemlist) {
+                tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
+                if (!td->ignore) {
+                    firstitem = td->key;
+                    break;
                 }
+                le2 = le2->Flink;
             }
             
-            crc32 = calc_crc32c(0xffffffff, (UINT8*)&((tree_header*)data)->fs_uuid, Vcb->superblock.node_size - sizeof(((tree_header*)data)->csum));
-            crc32 = ~crc32;
-            *((UINT32*)data) = crc32;
-            TRACE("setting crc32 to %08x\n", crc32);
-            
-            tw = ExAllocatePoolWithTag(PagedPool, sizeof(tree_write), ALLOC_TAG);
-            if (!tw) {
-                ERR("out of memory\n");
-                return STATUS_INSUFFICIENT_RESOURCES;
+            if (t->parent) {
+                t->paritem->key = firstitem;
+                t->paritem->treeholder.address = t->new_address;
+                t->paritem->treeholder.generation = Vcb->superblock.generation;
             }
             
-            tw->address = t->new_address;
-            tw->length = Vcb->superblock.node_size;
-            tw->data = data;
-            tw->overlap = FALSE;
-            
-            if (IsListEmpty(&tree_writes))
-                InsertTailList(&tree_writes, &tw->list_entry);
-            else {
-                LIST_ENTRY* le2;
-                BOOL inserted = FALSE;
+            if (!(Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA)) {
+                searchkey.obj_id = t->new_address;
+                searchkey.obj_type = TYPE_EXTENT_ITEM;
+                searchkey.offset = Vcb->superblock.node_size;
+                
+                Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE, Irp);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("error - find_item returned %08x\n", Status);
+                    return Status;
+                }
                 
-                le2 = tree_writes.Flink;
-                while (le2 != &tree_writes) {
-                    tree_write* tw2 = CONTAINING_RECORD(le2, tree_write, list_entry);
+                if (keycmp(&searchkey, &tp.item->key)) {
+//                         traverse_ptr next_tp;
+//                         BOOL b;
+//                         tree_data* paritem;
                     
-                    if (tw2->address > tw->address) {
-                        InsertHeadList(le2->Blink, &tw->list_entry);
-                        inserted = TRUE;
-                        break;
-                    }
+                    ERR("could not find %llx,%x,%llx in extent_root (found %llx,%x,%llx instead)\n", searchkey.obj_id, searchkey.obj_type, searchkey.offset, tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset);
                     
-                    le2 = le2->Flink;
+//                         searchkey.obj_id = 0;
+//                         searchkey.obj_type = 0;
+//                         searchkey.offset = 0;
+//                         
+//                         find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE);
+//                         
+//                         paritem = NULL;
+//                         do {
+//                             if (tp.tree->paritem != paritem) {
+//                                 paritem = tp.tree->paritem;
+//                                 ERR("paritem: %llx,%x,%llx\n", paritem->key.obj_id, paritem->key.obj_type, paritem->key.offset);
+//                             }
+//                             
+//                             ERR("%llx,%x,%llx\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset);
+//                             
+//                             b = find_next_item(Vcb, &tp, &next_tp, NULL, FALSE);
+//                             if (b) {
+//                                 free_traverse_ptr(&tp);
+//                                 tp = next_tp;
+//                             }
+//                         } while (b);
+//                         
+//                         free_traverse_ptr(&tp);
+                    
+                    return STATUS_INTERNAL_ERROR;
+                }
+                
+                if (tp.item->size < sizeof(EXTENT_ITEM_TREE)) {
+                    ERR("(%llx,%x,%llx) was %u bytes, expected at least %u\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, sizeof(EXTENT_ITEM_TREE));
+                    return STATUS_INTERNAL_ERROR;
                 }
                 
-                if (!inserted)
-                    InsertTailList(&tree_writes, &tw->list_entry);
+                eit = (EXTENT_ITEM_TREE*)tp.item->data;
+                eit->firstitem = firstitem;
             }
+            
+            le = le->Flink;
         }
-
-        le = le->Flink;
     }
     
-    Status = STATUS_SUCCESS;
+    TRACE("allocated tree extents\n");
+    
+    num_trees = 0;
+    
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            num_trees++;
+            le = le->Flink;
+        }
+    }
+    
+    if (num_trees == 0)
+        return STATUS_SUCCESS;
+    
+    trees = ExAllocatePoolWithTag(PagedPool, sizeof(tree*) * num_trees, ALLOC_TAG);
+    if (!trees) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    i = 0;
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            trees[i] = CONTAINING_RECORD(le, tree, list_entry_dirty);
+            i++;
+            le = le->Flink;
+        }
+    }
+    
+    sort_trees_by_address(trees, num_trees);
+    
+    // Build each run of adjacent nodes straight into one buffer, so it goes to the disk as a single write.
     
-    // merge together runs
     c = NULL;
-    le = tree_writes.Flink;
-    while (le != &tree_writes) {
-        tw = CONTAINING_RECORD(le, tree_write, list_entry);
-        
-        if (!c || tw->address < c->offset || tw->address >= c->offset + c->chunk_item->size)
-            c = get_chunk_from_address(Vcb, tw->address);
-        else {
-            tree_write* tw2 = CONTAINING_RECORD(le->Blink, tree_write, list_entry);
+    i = 0;
+    while (i < num_trees) {
+        if (!c || trees[i]->new_address < c->offset || trees[i]->new_address >= c->offset + c->chunk_item->size) {
+            c = get_chunk_from_address(Vcb, trees[i]->new_address);
             
-            if (tw->address == tw2->address + tw2->length) {
-                data = ExAllocatePoolWithTag(NonPagedPool, tw2->length + tw->length, ALLOC_TAG);
-                
-                if (!data) {
-                    ERR("out of memory\n");
-                    Status = STATUS_INSUFFICIENT_RESOURCES;
-                    goto end;
-                }
-                
-                RtlCopyMemory(data, tw2->data, tw2->length);
-                RtlCopyMemory(&data[tw2->length], tw->data, tw->length);
-                
-                ExFreePool(tw2->data);
-                tw2->data = data;
-                tw2->length += tw->length;
-                
-                ExFreePool(tw->data);
-                RemoveEntryList(&tw->list_entry);
-                ExFreePool(tw);
-                
-                le = tw2->list_entry.Flink;
-                continue;
+            if (!c) {
+                ERR("could not find chunk for address %llx\n", trees[i]->new_address);
+                Status = STATUS_INTERNAL_ERROR;
+                goto end;
             }
         }
         
-        le = le->Flink;
+        j = i + 1;
+        while (j < num_trees && trees[j]->new_address == trees[j - 1]->new_address + Vcb->superblock.node_size &&
+               trees[j]->new_address < c->offset + c->chunk_item->size && (j - i + 1) * Vcb->superblock.node_size <= MAX_TREE_WRITE_RUN) {
+            j++;
+        }
+        
+        tw = ExAllocatePoolWithTag(PagedPool, sizeof(tree_write), ALLOC_TAG);
+        if (!tw) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+        
+        tw->address = trees[i]->new_address;
+        tw->length = (j - i) * Vcb->superblock.node_size;
+        tw->overlap = FALSE;
+        
+        tw->data = ExAllocatePoolWithTag(NonPagedPool, tw->length, ALLOC_TAG);
+        if (!tw->data) {
+            ERR("out of memory\n");
+            ExFreePool(tw);
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+        
+        InsertTailList(&tree_writes, &tw->list_entry);
+        
+        for (k = i; k < j; k++) {
+            write_tree_node(Vcb, trees[k], tw->data + ((k - i) * Vcb->superblock.node_size));
+        }
+        
+        i = j;
     }
     
     // mark RAID5 overlaps so we can do them one by one
@@ -1196,6 +1506,26 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
         le = le->Flink;
     }
     
+    for (i = 0; i < 2; i++) {
+        wtc[i] = ExAllocatePoolWithTag(NonPagedPool, sizeof(write_data_context), ALLOC_TAG);
+        if (!wtc[i]) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+        
+        KeInitializeEvent(&wtc[i]->Event, NotificationEvent, FALSE);
+        InitializeListHead(&wtc[i]->stripes);
+        wtc[i]->tree = TRUE;
+        wtc[i]->stripes_left = 0;
+    }
+    
+    // Writes are sent in batches of up to MAX_TREE_WRITE_BATCH bytes. While one batch is in flight we build the
+    // IRPs for the next, so the disks are kept busy without having the whole commit outstanding at once.
+    
+    cur = 0;
+    batch_length = 0;
+    
     le = tree_writes.Flink;
     while (le != &tree_writes) {
         tw = CONTAINING_RECORD(le, tree_write, list_entry);
@@ -1203,45 +1533,61 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
         if (!tw->overlap) {
             TRACE("address: %llx, size: %x, overlap = %u\n", tw->address, tw->length, tw->overlap);
             
-            Status = write_data(Vcb, tw->address, tw->data, TRUE, tw->length, wtc, NULL, NULL);
+            data = tw->data;
+            tw->data = NULL; // now owned by the stripes
+            
+            Status = write_data(Vcb, tw->address, data, TRUE, tw->length, wtc[cur], NULL, NULL);
             if (!NT_SUCCESS(Status)) {
                 ERR("write_data returned %08x\n", Status);
                 goto end;
             }
+            
+            batch_length += tw->length;
+            
+            if (batch_length >= MAX_TREE_WRITE_BATCH) {
+                launch_tree_writes(wtc[cur]);
+                in_flight[cur] = TRUE;
+                
+                cur ^= 1;
+                batch_length = 0;
+                
+                if (in_flight[cur]) {
+                    in_flight[cur] = FALSE;
+                    
+                    Status = wait_for_tree_writes(wtc[cur]);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("wait_for_tree_writes returned %08x\n", Status);
+                        goto end;
+                    }
+                }
+            }
         }
         
         le = le->Flink;
     }
     
-    if (wtc->stripes.Flink != &wtc->stripes) {
-        // launch writes and wait
-        le = wtc->stripes.Flink;
-        while (le != &wtc->stripes) {
-            write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
-            
-            if (stripe->status != WriteDataStatus_Ignore)
-                IoCallDriver(stripe->device->devobj, stripe->Irp);
+    launch_tree_writes(wtc[cur]);
+    in_flight[cur] = TRUE;
+    
+    Status = STATUS_SUCCESS;
+    
+    for (i = 0; i < 2; i++) {
+        if (in_flight[i]) {
+            NTSTATUS Status2;
             
-            le = le->Flink;
-        }
-        
-        KeWaitForSingleObject(&wtc->Event, Executive, KernelMode, FALSE, NULL);
-        
-        le = wtc->stripes.Flink;
-        while (le != &wtc->stripes) {
-            write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
+            in_flight[i] = FALSE;
             
-            if (stripe->status != WriteDataStatus_Ignore && !NT_SUCCESS(stripe->iosb.Status)) {
-                Status = stripe->iosb.Status;
-                break;
+            Status2 = wait_for_tree_writes(wtc[i]);
+            if (!NT_SUCCESS(Status2)) {
+                ERR("wait_for_tree_writes returned %08x\n", Status2);
+                Status = Status2;
             }
-            
-            le = le->Flink;
         }
-        
-        free_write_data_stripes(wtc);
     }
     
+    if (!NT_SUCCESS(Status))
+        goto end;
+    
     le = tree_writes.Flink;
     while (le != &tree_writes) {
         tw = CONTAINING_RECORD(le, tree_write, list_entry);
@@ -1260,15 +1606,31 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
     }
     
 end:
-    ExFreePool(wtc);
+    for (i = 0; i < 2; i++) {
+        if (wtc[i]) {
+            // if we're bailing out, we still have to wait for anything the disks are working on
+            if (in_flight[i])
+                wait_for_tree_writes(wtc[i]);
+            else
+                free_write_data_stripes(wtc[i]);
+            
+            ExFreePool(wtc[i]);
+        }
+    }
     
     while (!IsListEmpty(&tree_writes)) {
         le = RemoveHeadList(&tree_writes);
         tw = CONTAINING_RECORD(le, tree_write, list_entry);
         
+        if (tw->data)
+            ExFreePool(tw->data);
+        
         ExFreePool(tw);
     }
     
+    if (trees)
+        ExFreePool(trees);
+    
     return Status;
 }
 
@@ -1341,25 +1703,25 @@ static void update_backup_superblock(device_extension* Vcb, superblock_backup* s
     sb->num_devices = Vcb->superblock.num_devices;
 }
 
-static NTSTATUS STDCALL write_superblock(device_extension* Vcb, device* device) {
+NTSTATUS STDCALL write_superblock(device_extension* Vcb, superblock* sb, device* device) {
     NTSTATUS Status;
     unsigned int i = 0;
     UINT32 crc32;
     
-    RtlCopyMemory(&Vcb->superblock.dev_item, &device->devitem, sizeof(DEV_ITEM));
+    RtlCopyMemory(&sb->dev_item, &device->devitem, sizeof(DEV_ITEM));
     
     // FIXME - only write one superblock if on SSD (?)
     while (superblock_addrs[i] > 0 && device->length >= superblock_addrs[i] + sizeof(superblock)) {
         TRACE("writing superblock %u\n", i);
         
-        Vcb->superblock.sb_phys_addr = superblock_addrs[i];
+        sb->sb_phys_addr = superblock_addrs[i];
         
-        crc32 = calc_crc32c(0xffffffff, (UINT8*)&Vcb->superblock.uuid, (ULONG)sizeof(superblock) - sizeof(Vcb->superblock.checksum));
+        crc32 = calc_crc32c(0xffffffff, (UINT8*)&sb->uuid, (ULONG)sizeof(superblock) - sizeof(sb->checksum));
         crc32 = ~crc32;
         TRACE("crc32 is %08x\n", crc32);
-        RtlCopyMemory(&Vcb->superblock.checksum, &crc32, sizeof(UINT32));
+        RtlCopyMemory(&sb->checksum, &crc32, sizeof(UINT32));
         
-        Status = write_data_phys(device->devobj, superblock_addrs[i], &Vcb->superblock, sizeof(superblock));
+        Status = write_data_phys(device->devobj, superblock_addrs[i], sb, sizeof(superblock));
         
         if (!NT_SUCCESS(Status))
             break;
@@ -1378,25 +1740,28 @@ static NTSTATUS write_superblocks(device_extension* Vcb, PIRP Irp) {
     UINT64 i;
     NTSTATUS Status;
     LIST_ENTRY* le;
+    UINT8 level;
     
     TRACE("(%p)\n", Vcb);
     
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
-        
-        if (t->write && !t->parent) {
-            if (t->root == Vcb->root_root) {
-                Vcb->superblock.root_tree_addr = t->new_address;
-                Vcb->superblock.root_level = t->header.level;
-            } else if (t->root == Vcb->chunk_root) {
-                Vcb->superblock.chunk_tree_addr = t->new_address;
-                Vcb->superblock.chunk_root_generation = t->header.generation;
-                Vcb->superblock.chunk_root_level = t->header.level;
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
+            
+            if (!t->parent) {
+                if (t->root == Vcb->root_root) {
+                    Vcb->superblock.root_tree_addr = t->new_address;
+                    Vcb->superblock.root_level = t->header.level;
+                } else if (t->root == Vcb->chunk_root) {
+                    Vcb->superblock.chunk_tree_addr = t->new_address;
+                    Vcb->superblock.chunk_root_generation = t->header.generation;
+                    Vcb->superblock.chunk_root_level = t->header.level;
+                }
             }
+            
+            le = le->Flink;
         }
-        
-        le = le->Flink;
     }
     
     for (i = 0; i < BTRFS_NUM_BACKUP_ROOTS - 1; i++) {
@@ -1407,7 +1772,7 @@ static NTSTATUS write_superblocks(device_extension* Vcb, PIRP Irp) {
     
     for (i = 0; i < Vcb->superblock.num_devices; i++) {
         if (Vcb->devices[i].devobj) {
-            Status = write_superblock(Vcb, &Vcb->devices[i]);
+            Status = write_superblock(Vcb, &Vcb->superblock, &Vcb->devices[i]);
             if (!NT_SUCCESS(Status)) {
                 ERR("write_superblock returned %08x\n", Status);
                 return Status;
@@ -1461,7 +1826,8 @@ static NTSTATUS flush_changed_extent(device_extension* Vcb, chunk* c, changed_ex
                 ERR("decrease_extent_refcount_data returned %08x\n", Status);
                 return Status;
             }
-        }
+        } else
+            InterlockedIncrement64(&Vcb->ref_stats.data_cancelled);
         
         if (ce->size != ce->old_size && ce->old_count > 0) {
             KEY searchkey;
@@ -1549,85 +1915,245 @@ static NTSTATUS flush_changed_extent(device_extension* Vcb, chunk* c, changed_ex
     return STATUS_SUCCESS;
 }
 
-static void update_checksum_tree(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
-    LIST_ENTRY* le = Vcb->sector_checksums.Flink;
+typedef struct {
+    UINT64 start;
+    UINT64 end;
     changed_sector* cs;
-    traverse_ptr tp, next_tp;
+    ULONG seq;
+} csum_change;
+
+#define CSUM_RANGE_MAX  0x10000 // sectors - we only go over this if changes overlap
+
+static __inline BOOL csum_change_after(csum_change* a, csum_change* b, BOOL by_seq) {
+    if (!by_seq && a->start != b->start)
+        return a->start > b->start;
+    
+    return a->seq > b->seq;
+}
+
+// Heapsort, like sort_trees_by_address. Ties on address are broken by the order the changes were made in, so that
+// they always end up being applied in that order.
+static void sort_csum_changes(csum_change* changes, ULONG num_changes, BOOL by_seq) {
+    ULONG i, j, k, n;
+    csum_change cc;
+    
+    if (num_changes < 2)
+        return;
+    
+    for (i = num_changes / 2; i > 0; i--) {
+        j = i - 1;
+        cc = changes[j];
+        
+        while ((k = (j * 2) + 1) < num_changes) {
+            if (k + 1 < num_changes && csum_change_after(&changes[k + 1], &changes[k], by_seq))
+                k++;
+            
+            if (!csum_change_after(&changes[k], &cc, by_seq))
+                break;
+            
+            changes[j] = changes[k];
+            j = k;
+        }
+        
+        changes[j] = cc;
+    }
+    
+    for (n = num_changes - 1; n > 0; n--) {
+        cc = changes[n];
+        changes[n] = changes[0];
+        j = 0;
+        
+        while ((k = (j * 2) + 1) < n) {
+            if (k + 1 < n && csum_change_after(&changes[k + 1], &changes[k], by_seq))
+                k++;
+            
+            if (!csum_change_after(&changes[k], &cc, by_seq))
+                break;
+            
+            changes[j] = changes[k];
+            j = k;
+        }
+        
+        changes[j] = cc;
+    }
+}
+
+static __inline BOOL is_csum_item(tree_data* td) {
+    return td && !td->ignore && td->key.obj_id == EXTENT_CSUM_ID && td->key.obj_type == TYPE_EXTENT_CSUM;
+}
+
+// Moves the cursor to the last item at or before offset. If we can't tell that without leaving the leaf we're in,
+// we search for it from the top instead.
+static NTSTATUS seek_csum_cursor(device_extension* Vcb, traverse_ptr* tp, BOOL* valid, UINT64 offset, PIRP Irp) {
     KEY searchkey;
-    UINT32* data;
     NTSTATUS Status;
     
+    searchkey.obj_id = EXTENT_CSUM_ID;
+    searchkey.obj_type = TYPE_EXTENT_CSUM;
+    searchkey.offset = offset;
+    
+    if (*valid) {
+        LIST_ENTRY* le = tp->item->list_entry.Flink;
+        
+        while (le != &tp->tree->itemlist) {
+            tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
+            
+            if (!td->ignore) {
+                if (keycmp(&td->key, &searchkey) == 1)
+                    return STATUS_SUCCESS;
+                
+                tp->item = td;
+            }
+            
+            le = le->Flink;
+        }
+    }
+    
+    Status = find_item(Vcb, Vcb->checksum_root, tp, &searchkey, FALSE, Irp);
+    if (Status == STATUS_NOT_FOUND) { // tree is empty
+        *valid = FALSE;
+        return STATUS_SUCCESS;
+    } else if (!NT_SUCCESS(Status)) {
+        ERR("error - find_item returned %08x\n", Status);
+        return Status;
+    }
+    
+    *valid = TRUE;
+    
+    return STATUS_SUCCESS;
+}
+
+// Rather than searching the tree for every changed_sector, we sort them by address, merge them into ranges, and
+// then make one pass through the checksum tree, rewriting the items which overlap or touch each range in turn.
+static void update_checksum_tree(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
+    LIST_ENTRY* le;
+    changed_sector* cs;
+    csum_change* changes = NULL;
+    traverse_ptr tp, next_tp, first_tp;
+    BOOL valid = FALSE;
+    ULONG num_changes = 0, num_ranges = 0, num_items = 0, i, j, k;
+    UINT32* checksums = NULL;
+    ULONG* bmparr = NULL;
+    ULONG buflen = 0;
+    NTSTATUS Status;
+    LARGE_INTEGER time1, time2, freq;
+    
     if (!Vcb->checksum_root) {
         ERR("no checksum root\n");
         goto exit;
     }
     
+    // FIXME - create checksum_root if it doesn't exist at all
+    
+    time1 = KeQueryPerformanceCounter(&freq);
+    
+    le = Vcb->sector_checksums.Flink;
+    while (le != &Vcb->sector_checksums) {
+        num_changes++;
+        le = le->Flink;
+    }
+    
+    changes = ExAllocatePoolWithTag(PagedPool, sizeof(csum_change) * num_changes, ALLOC_TAG);
+    if (!changes) {
+        ERR("out of memory\n");
+        goto exit;
+    }
+    
+    i = 0;
+    le = Vcb->sector_checksums.Flink;
     while (le != &Vcb->sector_checksums) {
-        UINT64 startaddr, endaddr;
-        ULONG len;
-        UINT32* checksums;
-        RTL_BITMAP bmp;
-        ULONG* bmparr;
-        ULONG runlength, index;
-        
         cs = (changed_sector*)le;
         
-        searchkey.obj_id = EXTENT_CSUM_ID;
-        searchkey.obj_type = TYPE_EXTENT_CSUM;
-        searchkey.offset = cs->ol.key;
+        changes[i].start = cs->ol.key;
+        changes[i].end = cs->ol.key + ((UINT64)cs->length * Vcb->superblock.sector_size);
+        changes[i].cs = cs;
+        changes[i].seq = i;
         
-        // FIXME - create checksum_root if it doesn't exist at all
+        i++;
+        le = le->Flink;
+    }
+    
+    sort_csum_changes(changes, num_changes, FALSE);
+    
+    i = 0;
+    while (i < num_changes) {
+        UINT64 start = changes[i].start, end = changes[i].end;
+        ULONG len, runlength, index;
+        BOOL have_first = FALSE, all_deleted = changes[i].cs->deleted;
+        RTL_BITMAP bmp;
+        traverse_ptr last_tp;
         
-        Status = find_item(Vcb, Vcb->checksum_root, &tp, &searchkey, FALSE, Irp);
-        if (!NT_SUCCESS(Status)) { // tree is completely empty
-            // FIXME - do proper check here that tree is empty
-            if (!cs->deleted) {
-                checksums = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * cs->length, ALLOC_TAG);
-                if (!checksums) {
-                    ERR("out of memory\n");
-                    goto exit;
-                }
-                
-                RtlCopyMemory(checksums, cs->checksums, sizeof(UINT32) * cs->length);
-                
-                if (!insert_tree_item(Vcb, Vcb->checksum_root, EXTENT_CSUM_ID, TYPE_EXTENT_CSUM, cs->ol.key, checksums, sizeof(UINT32) * cs->length, NULL, Irp, rollback)) {
-                    ERR("insert_tree_item failed\n");
-                    ExFreePool(checksums);
-                    goto exit;
-                }
-            }
-        } else {
-            UINT32 tplen;
+        // merge everything which overlaps or touches, but stop at a gap once the range gets too big
+        j = i + 1;
+        while (j < num_changes && (changes[j].start < end ||
+               (changes[j].start == end && (end - start) / Vcb->superblock.sector_size < CSUM_RANGE_MAX))) {
+            end = max(end, changes[j].end);
             
-            // FIXME - check entry is TYPE_EXTENT_CSUM?
+            if (!changes[j].cs->deleted)
+                all_deleted = FALSE;
             
-            if (tp.item->key.offset < cs->ol.key && tp.item->key.offset + (tp.item->size * Vcb->superblock.sector_size / sizeof(UINT32)) >= cs->ol.key)
-                startaddr = tp.item->key.offset;
-            else
-                startaddr = cs->ol.key;
+            j++;
+        }
+        
+        num_ranges++;
+        
+        Status = seek_csum_cursor(Vcb, &tp, &valid, start, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("seek_csum_cursor returned %08x\n", Status);
+            goto exit;
+        }
+        
+        // extend the range to cover any items which overlap or touch it
+        if (valid) {
+            traverse_ptr cur_tp = tp;
             
-            searchkey.obj_id = EXTENT_CSUM_ID;
-            searchkey.obj_type = TYPE_EXTENT_CSUM;
-            searchkey.offset = cs->ol.key + (cs->length * Vcb->superblock.sector_size);
+            last_tp = tp;
             
-            Status = find_item(Vcb, Vcb->checksum_root, &tp, &searchkey, FALSE, Irp);
-            if (!NT_SUCCESS(Status)) {
-                ERR("error - find_item returned %08x\n", Status);
-                goto exit;
+            while (TRUE) {
+                if (is_csum_item(cur_tp.item)) {
+                    UINT64 item_end = cur_tp.item->key.offset + ((UINT64)cur_tp.item->size * Vcb->superblock.sector_size / sizeof(UINT32));
+                    
+                    if (cur_tp.item->key.offset > end)
+                        break;
+                    
+                    if (item_end >= start) {
+                        if (!have_first) {
+                            first_tp = cur_tp;
+                            have_first = TRUE;
+                        }
+                        
+                        start = min(start, cur_tp.item->key.offset);
+                        end = max(end, item_end);
+                    }
+                } else if (!cur_tp.item->ignore && (cur_tp.item->key.obj_id > EXTENT_CSUM_ID ||
+                           (cur_tp.item->key.obj_id == EXTENT_CSUM_ID && cur_tp.item->key.obj_type > TYPE_EXTENT_CSUM)))
+                    break;
+                
+                last_tp = cur_tp;
+                
+                if (!find_next_item(Vcb, &cur_tp, &next_tp, FALSE, Irp))
+                    break;
+                
+                cur_tp = next_tp;
             }
+        }
+        
+        // deleting checksums which aren't there is a no-op
+        if (!have_first && all_deleted) {
+            i = j;
+            continue;
+        }
+        
+        len = (ULONG)((end - start) / Vcb->superblock.sector_size);
+        
+        if (len > buflen) {
+            if (checksums)
+                ExFreePool(checksums);
             
-            tplen = tp.item->size / sizeof(UINT32);
-            
-            if (tp.item->key.offset + (tplen * Vcb->superblock.sector_size) >= cs->ol.key + (cs->length * Vcb->superblock.sector_size))
-                endaddr = tp.item->key.offset + (tplen * Vcb->superblock.sector_size);
-            else
-                endaddr = cs->ol.key + (cs->length * Vcb->superblock.sector_size);
-            
-            TRACE("cs starts at %llx (%x sectors)\n", cs->ol.key, cs->length);
-            TRACE("startaddr = %llx\n", startaddr);
-            TRACE("endaddr = %llx\n", endaddr);
+            if (bmparr)
+                ExFreePool(bmparr);
             
-            len = (endaddr - startaddr) / Vcb->superblock.sector_size;
+            bmparr = NULL;
             
             checksums = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * len, ALLOC_TAG);
             if (!checksums) {
@@ -1638,95 +2164,111 @@ static void update_checksum_tree(device_extension* Vcb, PIRP Irp, LIST_ENTRY* ro
             bmparr = ExAllocatePoolWithTag(PagedPool, sizeof(ULONG) * ((len/8)+1), ALLOC_TAG);
             if (!bmparr) {
                 ERR("out of memory\n");
-                ExFreePool(checksums);
-                goto exit;
-            }
-                
-            RtlInitializeBitMap(&bmp, bmparr, len);
-            RtlSetAllBits(&bmp);
-            
-            searchkey.obj_id = EXTENT_CSUM_ID;
-            searchkey.obj_type = TYPE_EXTENT_CSUM;
-            searchkey.offset = cs->ol.key;
-            
-            Status = find_item(Vcb, Vcb->checksum_root, &tp, &searchkey, FALSE, Irp);
-            if (!NT_SUCCESS(Status)) {
-                ERR("error - find_item returned %08x\n", Status);
                 goto exit;
             }
             
-            // set bit = free space, cleared bit = allocated sector
+            buflen = len;
+        }
+        
+        // set bit = we have a checksum for this sector
+        RtlInitializeBitMap(&bmp, bmparr, len);
+        RtlClearAllBits(&bmp);
+        
+        if (have_first) {
+            traverse_ptr cur_tp = first_tp;
             
-    //         ERR("start loop\n");
-            while (tp.item->key.offset < endaddr) {
-    //             ERR("%llx,%x,%llx\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset);
-                if (tp.item->key.offset >= startaddr) {
-                    if (tp.item->size > 0) {
-                        RtlCopyMemory(&checksums[(tp.item->key.offset - startaddr) / Vcb->superblock.sector_size], tp.item->data, tp.item->size);
-                        RtlClearBits(&bmp, (tp.item->key.offset - startaddr) / Vcb->superblock.sector_size, tp.item->size / sizeof(UINT32));
+            while (TRUE) {
+                if (is_csum_item(cur_tp.item)) {
+                    if (cur_tp.item->key.offset > end)
+                        break;
+                    
+                    if (cur_tp.item->size > 0) {
+                        RtlCopyMemory(&checksums[(cur_tp.item->key.offset - start) / Vcb->superblock.sector_size], cur_tp.item->data, cur_tp.item->size);
+                        RtlSetBits(&bmp, (ULONG)((cur_tp.item->key.offset - start) / Vcb->superblock.sector_size), cur_tp.item->size / sizeof(UINT32));
                     }
                     
-                    delete_tree_item(Vcb, &tp, rollback);
-                }
+                    delete_tree_item(Vcb, &cur_tp, rollback);
+                } else if (!cur_tp.item->ignore)
+                    break;
                 
-                if (find_next_item(Vcb, &tp, &next_tp, FALSE, Irp)) {
-                    tp = next_tp;
-                } else
+                if (!find_next_item(Vcb, &cur_tp, &next_tp, FALSE, Irp))
                     break;
+                
+                cur_tp = next_tp;
             }
-    //         ERR("end loop\n");
+        }
+        
+        // overlapping changes have to be applied in the order they were made
+        sort_csum_changes(&changes[i], j - i, TRUE);
+        
+        for (k = i; k < j; k++) {
+            ULONG off = (ULONG)((changes[k].start - start) / Vcb->superblock.sector_size);
             
-            if (cs->deleted) {
-                RtlSetBits(&bmp, (cs->ol.key - startaddr) / Vcb->superblock.sector_size, cs->length);
-            } else {
-                RtlCopyMemory(&checksums[(cs->ol.key - startaddr) / Vcb->superblock.sector_size], cs->checksums, cs->length * sizeof(UINT32));
-                RtlClearBits(&bmp, (cs->ol.key - startaddr) / Vcb->superblock.sector_size, cs->length);
+            if (changes[k].cs->deleted)
+                RtlClearBits(&bmp, off, changes[k].cs->length);
+            else {
+                RtlCopyMemory(&checksums[off], changes[k].cs->checksums, changes[k].cs->length * sizeof(UINT32));
+                RtlSetBits(&bmp, off, changes[k].cs->length);
             }
-            
-            runlength = RtlFindFirstRunClear(&bmp, &index);
-            
-            while (runlength != 0) {
-                do {
-                    ULONG rl;
-                    
-                    if (runlength * sizeof(UINT32) > MAX_CSUM_SIZE)
-                        rl = MAX_CSUM_SIZE / sizeof(UINT32);
-                    else
-                        rl = runlength;
-                    
-                    data = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * rl, ALLOC_TAG);
-                    if (!data) {
-                        ERR("out of memory\n");
-                        ExFreePool(bmparr);
-                        ExFreePool(checksums);
-                        goto exit;
-                    }
-                    
-                    RtlCopyMemory(data, &checksums[index], sizeof(UINT32) * rl);
-                    
-                    if (!insert_tree_item(Vcb, Vcb->checksum_root, EXTENT_CSUM_ID, TYPE_EXTENT_CSUM, startaddr + (index * Vcb->superblock.sector_size), data, sizeof(UINT32) * rl, NULL, Irp, rollback)) {
-                        ERR("insert_tree_item failed\n");
-                        ExFreePool(data);
-                        ExFreePool(bmparr);
-                        ExFreePool(checksums);
-                        goto exit;
-                    }
-                    
-                    runlength -= rl;
-                    index += rl;
-                } while (runlength > 0);
+        }
+        
+        runlength = find_bitmap_run(bmparr, 0, len, TRUE, &index);
+        
+        while (runlength != 0) {
+            do {
+                ULONG rl;
+                UINT32* data;
                 
-                runlength = RtlFindNextForwardRunClear(&bmp, index, &index);
-            }
+                if (runlength * sizeof(UINT32) > MAX_CSUM_SIZE)
+                    rl = MAX_CSUM_SIZE / sizeof(UINT32);
+                else
+                    rl = runlength;
+                
+                data = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * rl, ALLOC_TAG);
+                if (!data) {
+                    ERR("out of memory\n");
+                    goto exit;
+                }
+                
+                RtlCopyMemory(data, &checksums[index], sizeof(UINT32) * rl);
+                
+                if (!insert_tree_item(Vcb, Vcb->checksum_root, EXTENT_CSUM_ID, TYPE_EXTENT_CSUM, start + (index * Vcb->superblock.sector_size), data, sizeof(UINT32) * rl, NULL, Irp, rollback)) {
+                    ERR("insert_tree_item failed\n");
+                    ExFreePool(data);
+                    goto exit;
+                }
+                
+                num_items++;
+                
+                runlength -= rl;
+                index += rl;
+            } while (runlength > 0);
             
-            ExFreePool(bmparr);
-            ExFreePool(checksums);
+            runlength = find_bitmap_run(bmparr, index, len, TRUE, &index);
         }
         
-        le = le->Flink;
+        // the next range starts after this one, so the last item we looked at is where to carry on from
+        if (valid)
+            tp = last_tp;
+        
+        i = j;
     }
     
+    time2 = KeQueryPerformanceCounter(NULL);
+    
+    TRACE("%u checksum changes merged into %u ranges, %u items written in %llu ms\n", num_changes, num_ranges, num_items,
+          (time2.QuadPart - time1.QuadPart) * 1000 / freq.QuadPart);
+    
 exit:
+    if (bmparr)
+        ExFreePool(bmparr);
+    
+    if (checksums)
+        ExFreePool(checksums);
+    
+    if (changes)
+        ExFreePool(changes);
+    
     while (!IsListEmpty(&Vcb->sector_checksums)) {
         le = RemoveHeadList(&Vcb->sector_checksums);
         cs = (changed_sector*)le;
@@ -1928,6 +2470,7 @@ static NTSTATUS STDCALL split_tree_at(device_extension* Vcb, tree* t, tree_data*
     nt->new_address = 0;
     nt->has_new_address = FALSE;
     nt->flags = t->flags;
+    nt->write = FALSE;
     InitializeListHead(&nt->itemlist);
     
 //     ExInitializeResourceLite(&nt->nonpaged->load_tree_lock);
@@ -1973,7 +2516,7 @@ static NTSTATUS STDCALL split_tree_at(device_extension* Vcb, tree* t, tree_data*
     nt->size = t->size - size;
     t->size = size;
     t->header.num_items = numitems;
-    nt->write = TRUE;
+    mark_tree_dirty(nt);
     
     InterlockedIncrement(&Vcb->open_trees);
     InsertTailList(&Vcb->trees, &nt->list_entry);
@@ -2030,8 +2573,8 @@ static NTSTATUS STDCALL split_tree_at(device_extension* Vcb, tree* t, tree_data*
     
     TRACE("adding new tree parent\n");
     
-    if (nt->header.level == 255) {
-        ERR("cannot add parent to tree at level 255\n");
+    if (nt->header.level >= BTRFS_MAX_LEVEL - 1) {
+        ERR("cannot add parent to tree at level %u\n", nt->header.level);
         return STATUS_INTERNAL_ERROR;
     }
     
@@ -2057,6 +2600,7 @@ static NTSTATUS STDCALL split_tree_at(device_extension* Vcb, tree* t, tree_data*
 //     pt->nonpaged = ExAllocatePoolWithTag(NonPagedPool, sizeof(tree_nonpaged), ALLOC_TAG);
     pt->size = pt->header.num_items * sizeof(internal_node);
     pt->flags = t->flags;
+    pt->write = FALSE;
     InitializeListHead(&pt->itemlist);
     
 //     ExInitializeResourceLite(&pt->nonpaged->load_tree_lock);
@@ -2096,7 +2640,7 @@ static NTSTATUS STDCALL split_tree_at(device_extension* Vcb, tree* t, tree_data*
     InsertTailList(&pt->itemlist, &td->list_entry);
     nt->paritem = td;
     
-    pt->write = TRUE;
+    mark_tree_dirty(pt);
 
     t->root->treeholder.tree = pt;
     
@@ -2134,14 +2678,48 @@ end:
     return STATUS_SUCCESS;
 }
 
+// Returns TRUE if everything added to the tree in this transaction comes after everything which was there already.
+static BOOL tree_appended(tree* t) {
+    LIST_ENTRY* le;
+    BOOL found_new = FALSE, found_old = FALSE;
+    
+    le = t->itemlist.Blink;
+    while (le != &t->itemlist) {
+        tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
+        
+        if (!td->ignore) {
+            if (td->inserted) {
+                if (found_old)
+                    return FALSE;
+                
+                found_new = TRUE;
+            } else
+                found_old = TRUE;
+        }
+        
+        le = le->Blink;
+    }
+    
+    return found_new;
+}
+
 static NTSTATUS STDCALL split_tree(device_extension* Vcb, tree* t) {
     LIST_ENTRY* le;
-    UINT32 size, ds, numitems;
+    UINT32 size, ds, numitems, target, maxsize = Vcb->superblock.node_size - sizeof(tree_header);
     
     size = 0;
     numitems = 0;
     
-    // FIXME - naïve implementation: maximizes number of filled trees
+    // If new items have only been added to the end of the tree, we're probably looking at sequential inserts - new
+    // inodes, DIR_INDEXes, checksums, or a file being appended to. In that case we fill the first tree completely,
+    // so that only the second one carries on growing and we don't leave a trail of half-empty trees behind us.
+    // Otherwise we split down the middle, so that the next random insert doesn't cause another split straight away.
+    
+    if (tree_appended(t)) {
+        TRACE("splitting tree in %llx at end\n", t->root->id);
+        target = maxsize;
+    } else
+        target = t->size / 2;
     
     le = t->itemlist.Flink;
     while (le != &t->itemlist) {
@@ -2154,7 +2732,7 @@ static NTSTATUS STDCALL split_tree(device_extension* Vcb, tree* t) {
                 ds = sizeof(internal_node);
             
             // FIXME - move back if previous item was deleted item with same key
-            if (size + ds > Vcb->superblock.node_size - sizeof(tree_header))
+            if (size + ds > maxsize || (numitems > 0 && size >= target))
                 return split_tree_at(Vcb, t, td, numitems, size);
 
             size += ds;
@@ -2167,73 +2745,47 @@ static NTSTATUS STDCALL split_tree(device_extension* Vcb, tree* t) {
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, PIRP Irp, LIST_ENTRY* rollback) {
+// Moves all the items in src into t, and frees src. If before is TRUE, src is the tree to the left of t in their
+// parent, otherwise it's the one to the right.
+static NTSTATUS merge_trees(device_extension* Vcb, tree* t, tree* src, BOOL before, PIRP Irp, LIST_ENTRY* rollback) {
     LIST_ENTRY* le;
-    tree_data* nextparitem = NULL;
+    tree_data* srcparitem = src->paritem;
+    tree* par;
     NTSTATUS Status;
-    tree *next_tree, *par;
-    BOOL loaded;
-    
-    TRACE("trying to amalgamate tree in root %llx, level %x (size %u)\n", t->root->id, t->header.level, t->size);
-    
-    // FIXME - doesn't capture everything, as it doesn't ascend
-    // FIXME - write proper function and put it in treefuncs.c
-    le = t->paritem->list_entry.Flink;
-    while (le != &t->parent->itemlist) {
-        tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
-        
-        if (!td->ignore) {
-            nextparitem = td;
-            break;
-        }
-        
-        le = le->Flink;
-    }
-    
-    if (!nextparitem)
-        return STATUS_SUCCESS;
-    
-    // FIXME - loop, and capture more than one tree if we can
-    
-    TRACE("nextparitem: key = %llx,%x,%llx\n", nextparitem->key.obj_id, nextparitem->key.obj_type, nextparitem->key.offset);
-//     nextparitem = t->paritem;
-    
-//     ExAcquireResourceExclusiveLite(&t->parent->nonpaged->load_tree_lock, TRUE);
     
-    Status = do_load_tree(Vcb, &nextparitem->treeholder, t->root, t->parent, nextparitem, &loaded, NULL);
-    if (!NT_SUCCESS(Status)) {
-        ERR("do_load_tree returned %08x\n", Status);
-        return Status;
-    }
-    
-//     ExReleaseResourceLite(&t->parent->nonpaged->load_tree_lock);
+    TRACE("merging tree (size %u) into tree (size %u)\n", src->size, t->size);
     
-    next_tree = nextparitem->treeholder.tree;
+    t->header.num_items += src->header.num_items;
+    t->size += src->size;
     
-    if (t->size + next_tree->size <= Vcb->superblock.node_size - sizeof(tree_header)) {
-        // merge two trees into one
+    if (src->header.level > 0) {
+        le = src->itemlist.Flink;
         
-        t->header.num_items += next_tree->header.num_items;
-        t->size += next_tree->size;
-        
-        if (next_tree->header.level > 0) {
-            le = next_tree->itemlist.Flink;
+        while (le != &src->itemlist) {
+            tree_data* td2 = CONTAINING_RECORD(le, tree_data, list_entry);
             
-            while (le != &next_tree->itemlist) {
-                tree_data* td2 = CONTAINING_RECORD(le, tree_data, list_entry);
-                
-                if (td2->treeholder.tree)
-                    td2->treeholder.tree->parent = t;
-                
-                le = le->Flink;
-            }
+            if (td2->treeholder.tree)
+                td2->treeholder.tree->parent = t;
+            
+            le = le->Flink;
         }
+    }
+    
+    if (before) {
+        t->itemlist.Flink->Blink = src->itemlist.Blink;
+        t->itemlist.Flink->Blink->Flink = t->itemlist.Flink;
+        t->itemlist.Flink = src->itemlist.Flink;
+        t->itemlist.Flink->Blink = &t->itemlist;
         
-        t->itemlist.Blink->Flink = next_tree->itemlist.Flink;
+        // our first key is now src's
+        t->paritem->key = srcparitem->key;
+    } else {
+        t->itemlist.Blink->Flink = src->itemlist.Flink;
         t->itemlist.Blink->Flink->Blink = t->itemlist.Blink;
-        t->itemlist.Blink = next_tree->itemlist.Blink;
+        t->itemlist.Blink = src->itemlist.Blink;
         t->itemlist.Blink->Flink = &t->itemlist;
-        
+    }
+    
 //         // TESTING
 //         le = t->itemlist.Flink;
 //         while (le != &t->itemlist) {
@@ -2243,109 +2795,216 @@ static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, PIRP Irp, LI
 //             }
 //             le = le->Flink;
 //         }
+    
+    src->itemlist.Flink = src->itemlist.Blink = &src->itemlist;
+    
+    src->header.num_items = 0;
+    src->size = 0;
+    
+    if (src->has_new_address) { // delete associated EXTENT_ITEM
+        Status = reduce_tree_extent(Vcb, src->new_address, src, Irp, rollback);
         
-        next_tree->itemlist.Flink = next_tree->itemlist.Blink = &next_tree->itemlist;
+        if (!NT_SUCCESS(Status)) {
+            ERR("reduce_tree_extent returned %08x\n", Status);
+            return Status;
+        }
+    } else if (src->has_address) {
+        Status = reduce_tree_extent(Vcb, src->header.address, src, Irp, rollback);
         
-        next_tree->header.num_items = 0;
-        next_tree->size = 0;
+        if (!NT_SUCCESS(Status)) {
+            ERR("reduce_tree_extent returned %08x\n", Status);
+            return Status;
+        }
+    }
+    
+    if (!srcparitem->ignore) {
+        srcparitem->ignore = TRUE;
+        src->parent->header.num_items--;
+        src->parent->size -= sizeof(internal_node);
+    }
+    
+    par = src->parent;
+    while (par) {
+        mark_tree_dirty(par);
+        par = par->parent;
+    }
+    
+    RemoveEntryList(&srcparitem->list_entry);
+    ExFreePool(src->paritem);
+    src->paritem = NULL;
+    
+    src->root->root_item.bytes_used -= Vcb->superblock.node_size;
+    
+    free_tree(src);
+    
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, PIRP Irp, LIST_ENTRY* rollback) {
+    LIST_ENTRY* le;
+    tree_data *nextparitem, *prevparitem;
+    NTSTATUS Status;
+    tree *next_tree, *prev_tree, *par;
+    BOOL loaded, merged = FALSE;
+    UINT32 maxsize = Vcb->superblock.node_size - sizeof(tree_header);
+    ULONG avg_size;
+    KEY firstitem = {0, 0, 0};
+    
+    TRACE("trying to amalgamate tree in root %llx, level %x (size %u)\n", t->root->id, t->header.level, t->size);
+    
+    // FIXME - doesn't capture everything, as it doesn't ascend
+    // FIXME - write proper function and put it in treefuncs.c
+    
+    // swallow as many of the following trees as will fit
+    do {
+        nextparitem = NULL;
         
-        if (next_tree->has_new_address) { // delete associated EXTENT_ITEM
-            Status = reduce_tree_extent(Vcb, next_tree->new_address, next_tree, Irp, rollback);
+        le = t->paritem->list_entry.Flink;
+        while (le != &t->parent->itemlist) {
+            tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
             
-            if (!NT_SUCCESS(Status)) {
-                ERR("reduce_tree_extent returned %08x\n", Status);
-                return Status;
+            if (!td->ignore) {
+                nextparitem = td;
+                break;
             }
-        } else if (next_tree->has_address) {
-            Status = reduce_tree_extent(Vcb, next_tree->header.address, next_tree, Irp, rollback);
             
-            if (!NT_SUCCESS(Status)) {
-                ERR("reduce_tree_extent returned %08x\n", Status);
-                return Status;
-            }
+            le = le->Flink;
         }
         
-        if (!nextparitem->ignore) {
-            nextparitem->ignore = TRUE;
-            next_tree->parent->header.num_items--;
-            next_tree->parent->size -= sizeof(internal_node);
-        }
+        if (!nextparitem)
+            break;
+        
+        TRACE("nextparitem: key = %llx,%x,%llx\n", nextparitem->key.obj_id, nextparitem->key.obj_type, nextparitem->key.offset);
         
-        par = next_tree->parent;
-        while (par) {
-            par->write = TRUE;
-            par = par->parent;
+//         ExAcquireResourceExclusiveLite(&t->parent->nonpaged->load_tree_lock, TRUE);
+        
+        Status = do_load_tree(Vcb, &nextparitem->treeholder, t->root, t->parent, nextparitem, &loaded, NULL);
+        if (!NT_SUCCESS(Status)) {
+            ERR("do_load_tree returned %08x\n", Status);
+            return Status;
         }
         
-        RemoveEntryList(&nextparitem->list_entry);
-        ExFreePool(next_tree->paritem);
-        next_tree->paritem = NULL;
+//         ExReleaseResourceLite(&t->parent->nonpaged->load_tree_lock);
         
-        next_tree->root->root_item.bytes_used -= Vcb->superblock.node_size;
+        next_tree = nextparitem->treeholder.tree;
         
-        free_tree(next_tree);
-    } else {
-        // rebalance by moving items from second tree into first
-        ULONG avg_size = (t->size + next_tree->size) / 2;
-        KEY firstitem = {0, 0, 0};
+        if (t->size + next_tree->size > maxsize)
+            break;
         
-        TRACE("attempting rebalance\n");
+        Status = merge_trees(Vcb, t, next_tree, FALSE, Irp, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("merge_trees returned %08x\n", Status);
+            return Status;
+        }
         
-        le = next_tree->itemlist.Flink;
-        while (le != &next_tree->itemlist && t->size < avg_size && next_tree->header.num_items > 1) {
+        merged = TRUE;
+    } while (TRUE);
+    
+    if (!nextparitem) {
+        // We're the last tree in our parent, so see if the one before us will fit in. If it won't, we leave things
+        // alone - a small tree at the end is usually one which is being appended to.
+        
+        if (merged)
+            return STATUS_SUCCESS;
+        
+        prevparitem = NULL;
+        
+        le = t->paritem->list_entry.Blink;
+        while (le != &t->parent->itemlist) {
             tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
-            ULONG size;
             
             if (!td->ignore) {
-                if (next_tree->header.level == 0)
-                    size = sizeof(leaf_node) + td->size;
-                else
-                    size = sizeof(internal_node);
-            } else
-                size = 0;
-            
-            if (t->size + size < Vcb->superblock.node_size - sizeof(tree_header)) {
-                RemoveEntryList(&td->list_entry);
-                InsertTailList(&t->itemlist, &td->list_entry);
-                
-                if (next_tree->header.level > 0 && td->treeholder.tree)
-                    td->treeholder.tree->parent = t;
-                
-                if (!td->ignore) {
-                    next_tree->size -= size;
-                    t->size += size;
-                    next_tree->header.num_items--;
-                    t->header.num_items++;
-                }
-            } else
+                prevparitem = td;
                 break;
+            }
             
-            le = next_tree->itemlist.Flink;
+            le = le->Blink;
         }
         
-        le = next_tree->itemlist.Flink;
-        while (le != &next_tree->itemlist) {
-            tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
-            
-            if (!td->ignore) {
-                firstitem = td->key;
-                break;
+        if (!prevparitem)
+            return STATUS_SUCCESS;
+        
+        Status = do_load_tree(Vcb, &prevparitem->treeholder, t->root, t->parent, prevparitem, &loaded, NULL);
+        if (!NT_SUCCESS(Status)) {
+            ERR("do_load_tree returned %08x\n", Status);
+            return Status;
+        }
+        
+        prev_tree = prevparitem->treeholder.tree;
+        
+        if (t->size + prev_tree->size <= maxsize) {
+            Status = merge_trees(Vcb, t, prev_tree, TRUE, Irp, rollback);
+            if (!NT_SUCCESS(Status)) {
+                ERR("merge_trees returned %08x\n", Status);
+                return Status;
             }
-            
-            le = le->Flink;
         }
         
-//         ERR("firstitem = %llx,%x,%llx\n", firstitem.obj_id, firstitem.obj_type, firstitem.offset);
+        return STATUS_SUCCESS;
+    }
+    
+    if (merged && t->size >= maxsize / 2)
+        return STATUS_SUCCESS;
+    
+    // rebalance by moving items from second tree into first
+    avg_size = (t->size + next_tree->size) / 2;
+    
+    TRACE("attempting rebalance\n");
+    
+    le = next_tree->itemlist.Flink;
+    while (le != &next_tree->itemlist && t->size < avg_size && next_tree->header.num_items > 1) {
+        tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
+        ULONG size;
+        
+        if (!td->ignore) {
+            if (next_tree->header.level == 0)
+                size = sizeof(leaf_node) + td->size;
+            else
+                size = sizeof(internal_node);
+        } else
+            size = 0;
+        
+        if (t->size + size < Vcb->superblock.node_size - sizeof(tree_header)) {
+            RemoveEntryList(&td->list_entry);
+            InsertTailList(&t->itemlist, &td->list_entry);
+            
+            if (next_tree->header.level > 0 && td->treeholder.tree)
+                td->treeholder.tree->parent = t;
+            
+            if (!td->ignore) {
+                next_tree->size -= size;
+                t->size += size;
+                next_tree->header.num_items--;
+                t->header.num_items++;
+            }
+        } else
+            break;
         
-        // FIXME - once ascension is working, make this work with parent's parent, etc.
-        if (next_tree->paritem)
-            next_tree->paritem->key = firstitem;
+        le = next_tree->itemlist.Flink;
+    }
+    
+    le = next_tree->itemlist.Flink;
+    while (le != &next_tree->itemlist) {
+        tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
         
-        par = next_tree;
-        while (par) {
-            par->write = TRUE;
-            par = par->parent;
+        if (!td->ignore) {
+            firstitem = td->key;
+            break;
         }
+        
+        le = le->Flink;
+    }
+    
+//         ERR("firstitem = %llx,%x,%llx\n", firstitem.obj_id, firstitem.obj_type, firstitem.offset);
+    
+    // FIXME - once ascension is working, make this work with parent's parent, etc.
+    if (next_tree->paritem)
+        next_tree->paritem->key = firstitem;
+    
+    par = next_tree;
+    while (par) {
+        mark_tree_dirty(par);
+        par = par->parent;
     }
     
     return STATUS_SUCCESS;
@@ -2355,6 +3014,14 @@ static NTSTATUS update_extent_level(device_extension* Vcb, UINT64 address, tree*
     KEY searchkey;
     traverse_ptr tp;
     NTSTATUS Status;
+    delayed_ref* dr;
+    
+    // if the extent item hasn't been written yet, we only need to change its delayed ref
+    dr = find_delayed_ref(Vcb, address);
+    if (dr && dr->count > 0) {
+        dr->level = level;
+        return STATUS_SUCCESS;
+    }
     
     if (Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA) {
         searchkey.obj_id = address;
@@ -2453,105 +3120,103 @@ static NTSTATUS STDCALL do_splits(device_extension* Vcb, PIRP Irp, LIST_ENTRY* r
     
     max_level = 0;
     
-    for (level = 0; level <= 255; level++) {
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
         LIST_ENTRY *le, *nextle;
         
-        empty = TRUE;
+        empty = IsListEmpty(&Vcb->dirty_trees[level]);
         
         TRACE("doing level %u\n", level);
         
-        le = Vcb->trees.Flink;
+        le = Vcb->dirty_trees[level].Flink;
     
-        while (le != &Vcb->trees) {
-            t = CONTAINING_RECORD(le, tree, list_entry);
+        while (le != &Vcb->dirty_trees[level]) {
+            t = CONTAINING_RECORD(le, tree, list_entry_dirty);
             
             nextle = le->Flink;
             
-            if (t->write && t->header.level == level) {
-                empty = FALSE;
-                
-                if (t->header.num_items == 0) {
-                    if (t->parent) {
-                        LIST_ENTRY* le2;
-                        KEY firstitem = {0xcccccccccccccccc,0xcc,0xcccccccccccccccc};
-                        
-                        done_deletions = TRUE;
             
-                        le2 = t->itemlist.Flink;
-                        while (le2 != &t->itemlist) {
-                            tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
-                            firstitem = td->key;
-                            break;
-                        }
-                        
-                        TRACE("deleting tree in root %llx (first item was %llx,%x,%llx)\n",
-                              t->root->id, firstitem.obj_id, firstitem.obj_type, firstitem.offset);
-                        
-                        t->root->root_item.bytes_used -= Vcb->superblock.node_size;
+            if (t->header.num_items == 0) {
+                if (t->parent) {
+                    LIST_ENTRY* le2;
+                    KEY firstitem = {0xcccccccccccccccc,0xcc,0xcccccccccccccccc};
+                    
+                    done_deletions = TRUE;
+        
+                    le2 = t->itemlist.Flink;
+                    while (le2 != &t->itemlist) {
+                        tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
+                        firstitem = td->key;
+                        break;
+                    }
+                    
+                    TRACE("deleting tree in root %llx (first item was %llx,%x,%llx)\n",
+                          t->root->id, firstitem.obj_id, firstitem.obj_type, firstitem.offset);
+                    
+                    t->root->root_item.bytes_used -= Vcb->superblock.node_size;
+                    
+                    if (t->has_new_address) { // delete associated EXTENT_ITEM
+                        Status = reduce_tree_extent(Vcb, t->new_address, t, Irp, rollback);
                         
-                        if (t->has_new_address) { // delete associated EXTENT_ITEM
-                            Status = reduce_tree_extent(Vcb, t->new_address, t, Irp, rollback);
-                            
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("reduce_tree_extent returned %08x\n", Status);
-                                return Status;
-                            }
-                            
-                            t->has_new_address = FALSE;
-                        } else if (t->has_address) {
-                            Status = reduce_tree_extent(Vcb,t->header.address, t, Irp, rollback);
-                            
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("reduce_tree_extent returned %08x\n", Status);
-                                return Status;
-                            }
-                            
-                            t->has_address = FALSE;
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("reduce_tree_extent returned %08x\n", Status);
+                            return Status;
                         }
                         
-                        if (!t->paritem->ignore) {
-                            t->paritem->ignore = TRUE;
-                            t->parent->header.num_items--;
-                            t->parent->size -= sizeof(internal_node);
+                        t->has_new_address = FALSE;
+                    } else if (t->has_address) {
+                        Status = reduce_tree_extent(Vcb,t->header.address, t, Irp, rollback);
+                        
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("reduce_tree_extent returned %08x\n", Status);
+                            return Status;
                         }
                         
-                        RemoveEntryList(&t->paritem->list_entry);
-                        ExFreePool(t->paritem);
-                        t->paritem = NULL;
+                        t->has_address = FALSE;
+                    }
+                    
+                    if (!t->paritem->ignore) {
+                        t->paritem->ignore = TRUE;
+                        t->parent->header.num_items--;
+                        t->parent->size -= sizeof(internal_node);
+                    }
+                    
+                    RemoveEntryList(&t->paritem->list_entry);
+                    ExFreePool(t->paritem);
+                    t->paritem = NULL;
+                    
+                    free_tree(t);
+                } else if (t->header.level != 0) {
+                    if (t->has_new_address) {
+                        Status = update_extent_level(Vcb, t->new_address, t, 0, Irp, rollback);
                         
-                        free_tree(t);
-                    } else if (t->header.level != 0) {
-                        if (t->has_new_address) {
-                            Status = update_extent_level(Vcb, t->new_address, t, 0, Irp, rollback);
-                            
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("update_extent_level returned %08x\n", Status);
-                                return Status;
-                            }
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("update_extent_level returned %08x\n", Status);
+                            return Status;
                         }
-                        
-                        t->header.level = 0;
                     }
-                } else if (t->size > Vcb->superblock.node_size - sizeof(tree_header)) {
-                    TRACE("splitting overlarge tree (%x > %x)\n", t->size, Vcb->superblock.node_size - sizeof(tree_header));
-                    Status = split_tree(Vcb, t);
+                    
+                    t->header.level = 0;
+                    
+                    RemoveEntryList(&t->list_entry_dirty);
+                    InsertTailList(&Vcb->dirty_trees[0], &t->list_entry_dirty);
+                }
+            } else if (t->size > Vcb->superblock.node_size - sizeof(tree_header)) {
+                TRACE("splitting overlarge tree (%x > %x)\n", t->size, Vcb->superblock.node_size - sizeof(tree_header));
+                Status = split_tree(Vcb, t);
 
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("split_tree returned %08x\n", Status);
-                        return Status;
-                    }
+                if (!NT_SUCCESS(Status)) {
+                    ERR("split_tree returned %08x\n", Status);
+                    return Status;
                 }
             }
             
             le = nextle;
         }
         
-        if (!empty) {
+        if (!empty)
             max_level = level;
-        } else {
+        else
             TRACE("nothing found for level %u\n", level);
-            break;
-        }
     }
     
     min_size = (Vcb->superblock.node_size - sizeof(tree_header)) / 2;
@@ -2559,12 +3224,12 @@ static NTSTATUS STDCALL do_splits(device_extension* Vcb, PIRP Irp, LIST_ENTRY* r
     for (level = 0; level <= max_level; level++) {
         LIST_ENTRY* le;
         
-        le = Vcb->trees.Flink;
+        le = Vcb->dirty_trees[level].Flink;
     
-        while (le != &Vcb->trees) {
-            t = CONTAINING_RECORD(le, tree, list_entry);
+        while (le != &Vcb->dirty_trees[level]) {
+            t = CONTAINING_RECORD(le, tree, list_entry_dirty);
             
-            if (t->write && t->header.level == level && t->header.num_items > 0 && t->parent && t->size < min_size) {
+            if (t->header.num_items > 0 && t->parent && t->size < min_size) {
                 Status = try_tree_amalgamate(Vcb, t, Irp, rollback);
                 if (!NT_SUCCESS(Status)) {
                     ERR("try_tree_amalgamate returned %08x\n", Status);
@@ -2582,71 +3247,69 @@ static NTSTATUS STDCALL do_splits(device_extension* Vcb, PIRP Irp, LIST_ENTRY* r
         for (level = max_level; level > 0; level--) {
             LIST_ENTRY *le, *nextle;
             
-            le = Vcb->trees.Flink;
-            while (le != &Vcb->trees) {
+            le = Vcb->dirty_trees[level].Flink;
+            while (le != &Vcb->dirty_trees[level]) {
                 nextle = le->Flink;
-                t = CONTAINING_RECORD(le, tree, list_entry);
+                t = CONTAINING_RECORD(le, tree, list_entry_dirty);
                 
-                if (t->write && t->header.level == level) {
-                    if (!t->parent && t->header.num_items == 1) {
-                        LIST_ENTRY* le2 = t->itemlist.Flink;
-                        tree_data* td;
-                        tree* child_tree = NULL;
-
-                        while (le2 != &t->itemlist) {
-                            td = CONTAINING_RECORD(le2, tree_data, list_entry);
-                            if (!td->ignore)
-                                break;
-                            le2 = le2->Flink;
-                        }
-                        
-                        TRACE("deleting top-level tree in root %llx with one item\n", t->root->id);
-                        
-                        if (t->has_new_address) { // delete associated EXTENT_ITEM
-                            Status = reduce_tree_extent(Vcb, t->new_address, t, Irp, rollback);
-                            
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("reduce_tree_extent returned %08x\n", Status);
-                                return Status;
-                            }
-                            
-                            t->has_new_address = FALSE;
-                        } else if (t->has_address) {
-                            Status = reduce_tree_extent(Vcb,t->header.address, t, Irp, rollback);
-                            
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("reduce_tree_extent returned %08x\n", Status);
-                                return Status;
-                            }
-                            
-                            t->has_address = FALSE;
-                        }
+                if (!t->parent && t->header.num_items == 1) {
+                    LIST_ENTRY* le2 = t->itemlist.Flink;
+                    tree_data* td;
+                    tree* child_tree = NULL;
+
+                    while (le2 != &t->itemlist) {
+                        td = CONTAINING_RECORD(le2, tree_data, list_entry);
+                        if (!td->ignore)
+                            break;
+                        le2 = le2->Flink;
+                    }
+                    
+                    TRACE("deleting top-level tree in root %llx with one item\n", t->root->id);
+                    
+                    if (t->has_new_address) { // delete associated EXTENT_ITEM
+                        Status = reduce_tree_extent(Vcb, t->new_address, t, Irp, rollback);
                         
-                        if (!td->treeholder.tree) { // load first item if not already loaded
-                            KEY searchkey = {0,0,0};
-                            traverse_ptr tp;
-                            
-                            Status = find_item(Vcb, t->root, &tp, &searchkey, FALSE, Irp);
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("error - find_item returned %08x\n", Status);
-                                return Status;
-                            }
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("reduce_tree_extent returned %08x\n", Status);
+                            return Status;
                         }
                         
-                        child_tree = td->treeholder.tree;
+                        t->has_new_address = FALSE;
+                    } else if (t->has_address) {
+                        Status = reduce_tree_extent(Vcb,t->header.address, t, Irp, rollback);
                         
-                        if (child_tree) {
-                            child_tree->parent = NULL;
-                            child_tree->paritem = NULL;
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("reduce_tree_extent returned %08x\n", Status);
+                            return Status;
                         }
                         
-                        t->root->root_item.bytes_used -= Vcb->superblock.node_size;
-
-                        free_tree(t);
+                        t->has_address = FALSE;
+                    }
+                    
+                    if (!td->treeholder.tree) { // load first item if not already loaded
+                        KEY searchkey = {0,0,0};
+                        traverse_ptr tp;
                         
-                        if (child_tree)
-                            child_tree->root->treeholder.tree = child_tree;
+                        Status = find_item(Vcb, t->root, &tp, &searchkey, FALSE, Irp);
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("error - find_item returned %08x\n", Status);
+                            return Status;
+                        }
+                    }
+                    
+                    child_tree = td->treeholder.tree;
+                    
+                    if (child_tree) {
+                        child_tree->parent = NULL;
+                        child_tree->paritem = NULL;
                     }
+                    
+                    t->root->root_item.bytes_used -= Vcb->superblock.node_size;
+
+                    free_tree(t);
+                    
+                    if (child_tree)
+                        child_tree->root->treeholder.tree = child_tree;
                 }
                 
                 le = nextle;
@@ -2657,9 +3320,16 @@ static NTSTATUS STDCALL do_splits(device_extension* Vcb, PIRP Irp, LIST_ENTRY* r
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS remove_root_extents(device_extension* Vcb, root* r, tree_holder* th, UINT8 level, PIRP Irp, LIST_ENTRY* rollback) {
+// Frees the tree blocks under th, apart from those before r->root_item.drop_progress, which have gone already. end is the
+// first key after this part of the tree, or NULL if it runs to the end, and end_level is the level of the node it comes from.
+// We stop before starting on a new subtree if we've used up our allowance in left, and set finished to FALSE so our caller
+// knows to stop too.
+static NTSTATUS remove_root_extents(device_extension* Vcb, root* r, tree_holder* th, UINT8 level, KEY* end, UINT8 end_level, UINT32* left,
+                                    BOOL* finished, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     
+    *finished = FALSE;
+    
     if (level > 0) {
         if (!th->tree) {
             Status = load_tree(Vcb, th->address, r, &th->tree, NULL, NULL);
@@ -2677,11 +3347,38 @@ static NTSTATUS remove_root_extents(device_extension* Vcb, root* r, tree_holder*
                 tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
                 
                 if (!td->ignore) {
-                    Status = remove_root_extents(Vcb, r, &td->treeholder, th->tree->header.level - 1, Irp, rollback);
+                    LIST_ENTRY* le2 = le->Flink;
+                    KEY* child_end = end;
+                    UINT8 child_end_level = end_level;
+                    BOOL child_finished;
                     
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("remove_root_extents returned %08x\n", Status);
-                        return Status;
+                    while (le2 != &th->tree->itemlist) {
+                        tree_data* td2 = CONTAINING_RECORD(le2, tree_data, list_entry);
+                        
+                        if (!td2->ignore) {
+                            child_end = &td2->key;
+                            child_end_level = th->tree->header.level;
+                            break;
+                        }
+                        
+                        le2 = le2->Flink;
+                    }
+                    
+                    // skip anything we dealt with in an earlier transaction
+                    if (!child_end || keycmp(child_end, &r->root_item.drop_progress) > 0) {
+                        if (*left == 0)
+                            return STATUS_SUCCESS;
+                        
+                        Status = remove_root_extents(Vcb, r, &td->treeholder, th->tree->header.level - 1, child_end, child_end_level, left,
+                                                     &child_finished, Irp, rollback);
+                        
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("remove_root_extents returned %08x\n", Status);
+                            return Status;
+                        }
+                        
+                        if (!child_finished)
+                            return STATUS_SUCCESS;
                     }
                 }
                 
@@ -2690,6 +3387,9 @@ static NTSTATUS remove_root_extents(device_extension* Vcb, root* r, tree_holder*
         }
     }
     
+    // Everything underneath this block has gone, so it can go too. We don't check left here, as otherwise we might
+    // stop having freed the last leaf, with no way of knowing next time that it's gone.
+    
     if (!th->tree || th->tree->has_address) {
         Status = reduce_tree_extent(Vcb, th->address, NULL, Irp, rollback);
         
@@ -2699,20 +3399,105 @@ static NTSTATUS remove_root_extents(device_extension* Vcb, root* r, tree_holder*
         }
     }
     
+    if (*left > 0)
+        (*left)--;
+    
+    // Like Linux, drop_level is the level of the node containing drop_progress, which is never 0.
+    if (end) {
+        r->root_item.drop_progress = *end;
+        r->root_item.drop_level = end_level;
+    }
+    
+    *finished = TRUE;
+    
+    return STATUS_SUCCESS;
+}
+
+// Writes out the ROOT_ITEM of a subvolume we're part way through deleting, so that if we're unmounted we can carry on
+// where we left off. Like Linux, we also add an orphan item for the root, so it knows to do the same.
+static NTSTATUS save_drop_progress(device_extension* Vcb, root* r, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    KEY searchkey;
+    traverse_ptr tp;
+    ROOT_ITEM* ri;
+    
+    TRACE("root %llx dropped up to (%llx,%x,%llx) at level %x\n", r->id, r->root_item.drop_progress.obj_id, r->root_item.drop_progress.obj_type,
+          r->root_item.drop_progress.offset, r->root_item.drop_level);
+    
+    r->root_item.num_references = 0;
+    
+    searchkey.obj_id = r->id;
+    searchkey.obj_type = TYPE_ROOT_ITEM;
+    searchkey.offset = 0xffffffffffffffff;
+    
+    Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08x\n", Status);
+        return Status;
+    }
+    
+    if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
+        ERR("could not find ROOT_ITEM for tree %llx\n", searchkey.obj_id);
+        return STATUS_INTERNAL_ERROR;
+    }
+    
+    ri = ExAllocatePoolWithTag(PagedPool, sizeof(ROOT_ITEM), ALLOC_TAG);
+    if (!ri) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    RtlCopyMemory(ri, &r->root_item, sizeof(ROOT_ITEM));
+    
+    delete_tree_item(Vcb, &tp, rollback);
+    
+    if (!insert_tree_item(Vcb, Vcb->root_root, r->id, TYPE_ROOT_ITEM, tp.item->key.offset, ri, sizeof(ROOT_ITEM), NULL, Irp, rollback)) {
+        ERR("insert_tree_item failed\n");
+        ExFreePool(ri);
+        return STATUS_INTERNAL_ERROR;
+    }
+    
+    searchkey.obj_id = ORPHAN_ID;
+    searchkey.obj_type = TYPE_ORPHAN_INODE;
+    searchkey.offset = r->id;
+    
+    Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08x\n", Status);
+        return Status;
+    }
+    
+    if (keycmp(&tp.item->key, &searchkey)) {
+        if (!insert_tree_item(Vcb, Vcb->root_root, ORPHAN_ID, TYPE_ORPHAN_INODE, r->id, NULL, 0, NULL, Irp, rollback)) {
+            ERR("insert_tree_item failed\n");
+            return STATUS_INTERNAL_ERROR;
+        }
+    }
+    
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS drop_root(device_extension* Vcb, root* r, PIRP Irp, LIST_ENTRY* rollback) {
+static NTSTATUS drop_root(device_extension* Vcb, root* r, UINT32* left, BOOL* finished, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     KEY searchkey;
     traverse_ptr tp;
     
-    Status = remove_root_extents(Vcb, r, &r->treeholder, r->root_item.root_level, Irp, rollback);
+    Status = remove_root_extents(Vcb, r, &r->treeholder, r->root_item.root_level, NULL, 0, left, finished, Irp, rollback);
     if (!NT_SUCCESS(Status)) {
         ERR("remove_root_extents returned %08x\n", Status);
         return Status;
     }
     
+    if (!*finished) {
+        Status = save_drop_progress(Vcb, r, Irp, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("save_drop_progress returned %08x\n", Status);
+            return Status;
+        }
+        
+        return STATUS_SUCCESS;
+    }
+    
     // remove entry in uuid root (tree 9)
     if (Vcb->uuid_root) {
         RtlCopyMemory(&searchkey.obj_id, &r->root_item.uuid.uuid[0], sizeof(UINT64));
@@ -2749,6 +3534,21 @@ static NTSTATUS drop_root(device_extension* Vcb, root* r, PIRP Irp, LIST_ENTRY*
     else
         WARN("could not find (%llx,%x,%llx) in root_root\n", searchkey.obj_id, searchkey.obj_type, searchkey.offset);
     
+    // delete orphan item, if we took more than one transaction
+    
+    searchkey.obj_id = ORPHAN_ID;
+    searchkey.obj_type = TYPE_ORPHAN_INODE;
+    searchkey.offset = r->id;
+    
+    Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08x\n", Status);
+        return Status;
+    }
+    
+    if (!keycmp(&tp.item->key, &searchkey))
+        delete_tree_item(Vcb, &tp, rollback);
+    
     // delete items in tree cache
     
     free_trees_root(Vcb, r);
@@ -2756,21 +3556,36 @@ static NTSTATUS drop_root(device_extension* Vcb, root* r, PIRP Irp, LIST_ENTRY*
     return STATUS_SUCCESS;
 }
 
+// Deleted subvolumes are freed a bit at a time, so that getting rid of a big snapshot doesn't hold up everything
+// else while we've got tree_lock. If there's nothing else in this transaction we can afford to do more; the flush
+// thread commits by itself every DROP_ROOT_INTERVAL while the volume's quiet.
 static NTSTATUS drop_roots(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
     LIST_ENTRY *le = Vcb->drop_roots.Flink, *le2;
     NTSTATUS Status;
+    UINT32 left = Vcb->dirty.since == 0 ? DROP_ROOT_BATCH : DROP_ROOT_BATCH_BUSY;
+    BOOL finished;
     
-    while (le != &Vcb->drop_roots) {
+    while (le != &Vcb->drop_roots && left > 0) {
         root* r = CONTAINING_RECORD(le, root, list_entry);
         
         le2 = le->Flink;
         
-        Status = drop_root(Vcb, r, Irp, rollback);
+        Status = drop_root(Vcb, r, &left, &finished, Irp, rollback);
         if (!NT_SUCCESS(Status)) {
             ERR("drop_root(%llx) returned %08x\n", r->id, Status);
             return Status;
         }
         
+        if (finished) {
+            TRACE("finished dropping root %llx\n", r->id);
+            
+            RemoveEntryList(&r->list_entry);
+            
+            ExDeleteResourceLite(&r->nonpaged->load_tree_lock);
+            ExFreePool(r->nonpaged);
+            ExFreePool(r);
+        }
+        
         le = le2;
     }
     
@@ -3262,17 +4077,194 @@ static NTSTATUS insert_sparse_extent(fcb* fcb, UINT64 start, UINT64 length, PIRP
     ed->encoding = BTRFS_ENCODING_NONE;
     ed->type = EXTENT_TYPE_REGULAR;
     
-    ed2 = (EXTENT_DATA2*)ed->data;
-    ed2->address = 0;
-    ed2->size = 0;
-    ed2->offset = 0;
-    ed2->num_bytes = length;
+    ed2 = (EXTENT_DATA2*)ed->data;
+    ed2->address = 0;
+    ed2->size = 0;
+    ed2->offset = 0;
+    ed2->num_bytes = length;
+    
+    if (!insert_tree_item(fcb->Vcb, fcb->subvol, fcb->inode, TYPE_EXTENT_DATA, start, ed, sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2), NULL, Irp, rollback)) {
+        ERR("insert_tree_item failed\n");
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+typedef struct {
+    UINT64 start;
+    UINT64 end;
+    LIST_ENTRY list_entry;
+} extent_range;
+
+static __inline UINT64 get_extent_end(UINT64 offset, EXTENT_DATA* ed) {
+    if (ed->type == EXTENT_TYPE_INLINE)
+        return offset + ed->decoded_size;
+    else
+        return offset + ((EXTENT_DATA2*)ed->data)->num_bytes;
+}
+
+// Adds a range of the file whose EXTENT_DATAs need rewriting, merging it with any it overlaps or touches.
+// Ranges mostly arrive in order, so we look for our place from the end.
+static NTSTATUS add_extent_range(LIST_ENTRY* ranges, UINT64 start, UINT64 end) {
+    LIST_ENTRY* le = ranges->Blink;
+    extent_range* er;
+    
+    while (le != ranges) {
+        er = CONTAINING_RECORD(le, extent_range, list_entry);
+        
+        if (er->start <= start)
+            break;
+        
+        le = le->Blink;
+    }
+    
+    if (le != ranges && CONTAINING_RECORD(le, extent_range, list_entry)->end >= start) {
+        er = CONTAINING_RECORD(le, extent_range, list_entry);
+        er->end = max(er->end, end);
+    } else {
+        er = ExAllocatePoolWithTag(PagedPool, sizeof(extent_range), ALLOC_TAG);
+        if (!er) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        
+        er->start = start;
+        er->end = end;
+        
+        InsertHeadList(le, &er->list_entry);
+    }
+    
+    while (er->list_entry.Flink != ranges) {
+        extent_range* er2 = CONTAINING_RECORD(er->list_entry.Flink, extent_range, list_entry);
+        
+        if (er2->start > er->end)
+            break;
+        
+        er->end = max(er->end, er2->end);
+        
+        RemoveEntryList(&er2->list_entry);
+        ExFreePool(er2);
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+// Replaces the EXTENT_DATAs between start and end with ones for what's now in fcb->extents. If there's an item on disk
+// which straddles either end, we widen the range to take it in. *ple is where we got to in fcb->extents last time,
+// so that we don't have to walk the whole list for every range.
+static NTSTATUS rewrite_extent_range(fcb* fcb, UINT64 start, UINT64 end, UINT64 hole_end, LIST_ENTRY** ple, PIRP Irp, LIST_ENTRY* rollback) {
+    device_extension* Vcb = fcb->Vcb;
+    traverse_ptr tp, next_tp;
+    KEY searchkey;
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    UINT64 pos;
+    BOOL holes = !(Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_NO_HOLES);
+    
+    searchkey.obj_id = fcb->inode;
+    searchkey.obj_type = TYPE_EXTENT_DATA;
+    searchkey.offset = start;
+    
+    Status = find_item(Vcb, fcb->subvol, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("error - find_item returned %08x\n", Status);
+        return Status;
+    }
+    
+    while (TRUE) {
+        if (tp.item->key.obj_id == fcb->inode && tp.item->key.obj_type == TYPE_EXTENT_DATA) {
+            UINT64 item_end = tp.item->key.offset;
+            EXTENT_DATA* ed = (EXTENT_DATA*)tp.item->data;
+            
+            if (tp.item->key.offset >= end)
+                break;
+            
+            if (tp.item->size >= sizeof(EXTENT_DATA)) {
+                if (ed->type == EXTENT_TYPE_INLINE)
+                    item_end = get_extent_end(tp.item->key.offset, ed);
+                else if (tp.item->size >= sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2))
+                    item_end = get_extent_end(tp.item->key.offset, ed);
+            }
+            
+            if (tp.item->key.offset < start && item_end > start)
+                start = tp.item->key.offset;
+            
+            if (tp.item->key.offset >= start) {
+                end = max(end, item_end);
+                delete_tree_item(Vcb, &tp, rollback);
+            }
+        } else if (tp.item->key.obj_id > fcb->inode || (tp.item->key.obj_id == fcb->inode && tp.item->key.obj_type > TYPE_EXTENT_DATA))
+            break;
+        
+        if (!find_next_item(Vcb, &tp, &next_tp, FALSE, Irp))
+            break;
+        
+        tp = next_tp;
+    }
+    
+    pos = start;
+    
+    le = *ple;
+    while (le != &fcb->extents) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+        EXTENT_DATA* ed;
+        UINT32 edsize;
+        
+        if (ext->offset >= end)
+            break;
+        
+        if (ext->offset < start) {
+            pos = max(pos, get_extent_end(ext->offset, ext->data));
+            le = le->Flink;
+            continue;
+        }
+        
+        if (holes && ext->offset > pos) {
+            Status = insert_sparse_extent(fcb, pos, ext->offset - pos, Irp, rollback);
+            if (!NT_SUCCESS(Status)) {
+                ERR("insert_sparse_extent returned %08x\n", Status);
+                return Status;
+            }
+        }
+        
+        ed = NULL;
+        
+        if (ext->datalen >= sizeof(EXTENT_DATA) && ext->data->type == EXTENT_TYPE_INLINE)
+            ed = compress_inline_extent(fcb, ext->data, &edsize);
+        
+        if (!ed) {
+            ed = ExAllocatePoolWithTag(PagedPool, ext->datalen, ALLOC_TAG);
+            if (!ed) {
+                ERR("out of memory\n");
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            
+            RtlCopyMemory(ed, ext->data, ext->datalen);
+            edsize = ext->datalen;
+        }
+        
+        if (!insert_tree_item(Vcb, fcb->subvol, fcb->inode, TYPE_EXTENT_DATA, ext->offset, ed, edsize, NULL, Irp, rollback)) {
+            ERR("insert_tree_item failed\n");
+            ExFreePool(ed);
+            return STATUS_INTERNAL_ERROR;
+        }
+        
+        pos = get_extent_end(ext->offset, ext->data);
+        
+        le = le->Flink;
+    }
+    
+    *ple = le;
     
-    if (!insert_tree_item(fcb->Vcb, fcb->subvol, fcb->inode, TYPE_EXTENT_DATA, start, ed, sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2), NULL, Irp, rollback)) {
-        ERR("insert_tree_item failed\n");
-        return STATUS_INTERNAL_ERROR;
+    if (holes && min(end, hole_end) > pos) {
+        Status = insert_sparse_extent(fcb, pos, min(end, hole_end) - pos, Irp, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("insert_sparse_extent returned %08x\n", Status);
+            return Status;
+        }
     }
-
+    
     return STATUS_SUCCESS;
 }
 
@@ -3321,16 +4313,29 @@ void flush_fcb(fcb* fcb, BOOL cache, PIRP Irp, LIST_ENTRY* rollback) {
         BOOL b;
         traverse_ptr next_tp;
         LIST_ENTRY* le;
+        LIST_ENTRY ranges;
         BOOL prealloc = FALSE, extents_inline = FALSE;
-        UINT64 last_end;
+        UINT64 last_end = 0;
         
-        // delete ignored extent items
+        // Rather than rewriting every EXTENT_DATA, we only touch the parts of the file where extents have been
+        // added or removed since the last flush.
+        InitializeListHead(&ranges);
+        
+        // free ignored extents, remembering where their items were if they made it to disk
         le = fcb->extents.Flink;
         while (le != &fcb->extents) {
             LIST_ENTRY* le2 = le->Flink;
             extent* ext = CONTAINING_RECORD(le, extent, list_entry);
             
             if (ext->ignore) {
+                if (!ext->inserted) {
+                    Status = add_extent_range(&ranges, ext->offset, get_extent_end(ext->offset, ext->data));
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("add_extent_range returned %08x\n", Status);
+                        goto free_ranges;
+                    }
+                }
+                
                 RemoveEntryList(&ext->list_entry);
                 ExFreePool(ext->data);
                 ExFreePool(ext);
@@ -3357,6 +4362,7 @@ void flush_fcb(fcb* fcb, BOOL cache, PIRP Irp, LIST_ENTRY* rollback) {
                     
                         ext->data->generation = fcb->Vcb->superblock.generation;
                         ed2->num_bytes += ned2->num_bytes;
+                        ext->inserted = TRUE;
                     
                         RemoveEntryList(&nextext->list_entry);
                         ExFreePool(nextext->data);
@@ -3371,7 +4377,7 @@ void flush_fcb(fcb* fcb, BOOL cache, PIRP Irp, LIST_ENTRY* rollback) {
                                                                fcb->inode_item.flags & BTRFS_INODE_NODATASUM, ed2->size, Irp);
                             if (!NT_SUCCESS(Status)) {
                                 ERR("update_changed_extent_ref returned %08x\n", Status);
-                                goto end;
+                                goto free_ranges;
                             }
                         }
                     
@@ -3383,92 +4389,95 @@ void flush_fcb(fcb* fcb, BOOL cache, PIRP Irp, LIST_ENTRY* rollback) {
             le = le2;
         }
         
-        // delete existing EXTENT_DATA items
-        
-        searchkey.obj_id = fcb->inode;
-        searchkey.obj_type = TYPE_EXTENT_DATA;
-        searchkey.offset = 0;
-        
-        Status = find_item(fcb->Vcb, fcb->subvol, &tp, &searchkey, FALSE, Irp);
-        if (!NT_SUCCESS(Status)) {
-            ERR("error - find_item returned %08x\n", Status);
-            goto end;
+        le = fcb->extents.Flink;
+        while (le != &fcb->extents) {
+            extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+            
+            if (ext->inserted) {
+                Status = add_extent_range(&ranges, ext->offset, get_extent_end(ext->offset, ext->data));
+                if (!NT_SUCCESS(Status)) {
+                    ERR("add_extent_range returned %08x\n", Status);
+                    goto free_ranges;
+                }
+            }
+            
+            if (ext->datalen >= sizeof(EXTENT_DATA) && ext->data->type == EXTENT_TYPE_PREALLOC)
+                prealloc = TRUE;
+            
+            if (ext->datalen >= sizeof(EXTENT_DATA) && ext->data->type == EXTENT_TYPE_INLINE)
+                extents_inline = TRUE;
+            
+            last_end = get_extent_end(ext->offset, ext->data);
+            
+            le = le->Flink;
         }
         
-        do {
-            if (tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type == searchkey.obj_type)
-                delete_tree_item(fcb->Vcb, &tp, rollback);
+        if (fcb->deleted) {
+            // delete existing EXTENT_DATA items
+            
+            searchkey.obj_id = fcb->inode;
+            searchkey.obj_type = TYPE_EXTENT_DATA;
+            searchkey.offset = 0;
             
-            b = find_next_item(fcb->Vcb, &tp, &next_tp, FALSE, Irp);
+            Status = find_item(fcb->Vcb, fcb->subvol, &tp, &searchkey, FALSE, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("error - find_item returned %08x\n", Status);
+                goto free_ranges;
+            }
             
-            if (b) {
-                tp = next_tp;
+            do {
+                if (tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type == searchkey.obj_type)
+                    delete_tree_item(fcb->Vcb, &tp, rollback);
                 
-                if (tp.item->key.obj_id > searchkey.obj_id || (tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type > searchkey.obj_type))
-                    break;
+                b = find_next_item(fcb->Vcb, &tp, &next_tp, FALSE, Irp);
+                
+                if (b) {
+                    tp = next_tp;
+                    
+                    if (tp.item->key.obj_id > searchkey.obj_id || (tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type > searchkey.obj_type))
+                        break;
+                }
+            } while (b);
+        } else {
+            UINT64 hole_end;
+            
+            // Anything after the last extent, i.e. the trailing hole or what's left from before a truncation,
+            // always gets redone, as we don't know what the size was before.
+            Status = add_extent_range(&ranges, last_end, 0xffffffffffffffff);
+            if (!NT_SUCCESS(Status)) {
+                ERR("add_extent_range returned %08x\n", Status);
+                goto free_ranges;
             }
-        } while (b);
-        
-        if (!fcb->deleted) {
-            // add new EXTENT_DATAs
             
-            last_end = 0;
+            if (extents_inline)
+                hole_end = last_end;
+            else
+                hole_end = max(last_end, sector_align(fcb->inode_item.st_size, fcb->Vcb->superblock.sector_size));
             
             le = fcb->extents.Flink;
-            while (le != &fcb->extents) {
-                extent* ext = CONTAINING_RECORD(le, extent, list_entry);
-                EXTENT_DATA* ed;
+            
+            while (!IsListEmpty(&ranges)) {
+                extent_range* er = CONTAINING_RECORD(RemoveHeadList(&ranges), extent_range, list_entry);
                 
-                if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_NO_HOLES) && ext->offset > last_end) {
-                    Status = insert_sparse_extent(fcb, last_end, ext->offset - last_end, Irp, rollback);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("insert_sparse_extent returned %08x\n", Status);
-                        goto end;
-                    }
-                }
-                    
-                ed = ExAllocatePoolWithTag(PagedPool, ext->datalen, ALLOC_TAG);
-                if (!ed) {
-                    ERR("out of memory\n");
-                    Status = STATUS_INSUFFICIENT_RESOURCES;
-                    goto end;
-                }
+                Status = rewrite_extent_range(fcb, er->start, er->end, hole_end, &le, Irp, rollback);
                 
-                RtlCopyMemory(ed, ext->data, ext->datalen);
+                ExFreePool(er);
                 
-                if (!insert_tree_item(fcb->Vcb, fcb->subvol, fcb->inode, TYPE_EXTENT_DATA, ext->offset, ed, ext->datalen, NULL, Irp, rollback)) {
-                    ERR("insert_tree_item failed\n");
-                    goto end;
+                if (!NT_SUCCESS(Status)) {
+                    ERR("rewrite_extent_range returned %08x\n", Status);
+                    goto free_ranges;
                 }
+            }
+            
+            le = fcb->extents.Flink;
+            while (le != &fcb->extents) {
+                extent* ext = CONTAINING_RECORD(le, extent, list_entry);
                 
-                if (ext->datalen >= sizeof(EXTENT_DATA) && ed->type == EXTENT_TYPE_PREALLOC)
-                    prealloc = TRUE;
-                
-                if (ext->datalen >= sizeof(EXTENT_DATA) && ed->type == EXTENT_TYPE_INLINE)
-                    extents_inline = TRUE;
-                
-                if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_NO_HOLES)) {
-                    if (ed->type == EXTENT_TYPE_INLINE)
-                        last_end = ext->offset + ed->decoded_size;
-                    else {
-                        EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
-                        
-                        last_end = ext->offset + ed2->num_bytes;
-                    }
-                }
+                ext->inserted = FALSE;
                 
                 le = le->Flink;
             }
             
-            if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_NO_HOLES) && !extents_inline &&
-                sector_align(fcb->inode_item.st_size, fcb->Vcb->superblock.sector_size) > last_end) {
-                Status = insert_sparse_extent(fcb, last_end, sector_align(fcb->inode_item.st_size, fcb->Vcb->superblock.sector_size) - last_end, Irp, rollback);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("insert_sparse_extent returned %08x\n", Status);
-                    goto end;
-                }
-            }
-            
             // update prealloc flag in INODE_ITEM
             
             if (!prealloc)
@@ -3477,6 +4486,18 @@ void flush_fcb(fcb* fcb, BOOL cache, PIRP Irp, LIST_ENTRY* rollback) {
                 fcb->inode_item.flags |= BTRFS_INODE_PREALLOC;
         }
         
+        Status = STATUS_SUCCESS;
+        
+free_ranges:
+        while (!IsListEmpty(&ranges)) {
+            extent_range* er = CONTAINING_RECORD(RemoveHeadList(&ranges), extent_range, list_entry);
+            
+            ExFreePool(er);
+        }
+        
+        if (!NT_SUCCESS(Status))
+            goto end;
+        
         fcb->extents_changed = FALSE;
     }
     
@@ -3678,6 +4699,14 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, PIRP Irp, LIST_ENTRY
         }
     }
     
+    if (Vcb->free_space_root) {
+        Status = remove_free_space_tree_chunk(Vcb, c, Irp, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("remove_free_space_tree_chunk returned %08x\n", Status);
+            return Status;
+        }
+    }
+    
     if (c->chunk_item->type & BLOCK_FLAG_RAID0)
         factor = c->chunk_item->num_stripes;
     else if (c->chunk_item->type & BLOCK_FLAG_RAID10)
@@ -3821,6 +4850,8 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, PIRP Irp, LIST_ENTRY
         ExFreePool(s);
     }
     
+    free_space_bitmaps(c);
+    
     ExDeleteResourceLite(&c->lock);
     ExDeleteResourceLite(&c->changed_extents_lock);
 
@@ -3880,6 +4911,13 @@ static NTSTATUS update_chunks(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollb
             }
         }
         
+        // The old superblock might still point to a log tree in this chunk, in which case it has to wait until
+        // the next commit. clear_log puts it back on chunks_changed when it releases the blocks.
+        if (used_minus_cache == 0 && chunk_has_log_blocks(Vcb, c)) {
+            TRACE("not dropping chunk %llx yet, as it contains log blocks\n", c->offset);
+            used_minus_cache = 1;
+        }
+        
         if (used_minus_cache == 0) {
             Status = drop_chunk(Vcb, c, Irp, rollback);
             if (!NT_SUCCESS(Status)) {
@@ -4141,7 +5179,7 @@ static NTSTATUS add_root_item_to_cache(device_extension* Vcb, UINT64 root, PIRP
             return STATUS_INTERNAL_ERROR;
         }
     } else {
-        tp.tree->write = TRUE;
+        mark_tree_dirty(tp.tree);
     }
     
     return STATUS_SUCCESS;
@@ -4149,21 +5187,24 @@ static NTSTATUS add_root_item_to_cache(device_extension* Vcb, UINT64 root, PIRP
 
 static NTSTATUS add_root_items_to_cache(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
     LIST_ENTRY* le;
+    UINT8 level;
     NTSTATUS Status;
     
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
-        
-        if (t->write && t->root != Vcb->chunk_root && t->root != Vcb->root_root) {
-            Status = add_root_item_to_cache(Vcb, t->root->id, Irp, rollback);
-            if (!NT_SUCCESS(Status)) {
-                ERR("add_root_item_to_cache returned %08x\n", Status);
-                return Status;
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
+            
+            if (t->root != Vcb->chunk_root && t->root != Vcb->root_root) {
+                Status = add_root_item_to_cache(Vcb, t->root->id, Irp, rollback);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("add_root_item_to_cache returned %08x\n", Status);
+                    return Status;
+                }
             }
+            
+            le = le->Flink;
         }
-        
-        le = le->Flink;
     }
     
     // make sure we always update the extent tree
@@ -4501,12 +5542,11 @@ static void convert_shared_data_refs(device_extension* Vcb, PIRP Irp, LIST_ENTRY
     LIST_ENTRY* le;
     NTSTATUS Status;
     
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
+    le = Vcb->dirty_trees[0].Flink;
+    while (le != &Vcb->dirty_trees[0]) {
+        tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
         
-        if (t->write && t->header.level == 0 &&
-            (t->header.flags & HEADER_FLAG_SHARED_BACKREF || !(t->header.flags & HEADER_FLAG_MIXED_BACKREF))) {
+        if ((t->header.flags & HEADER_FLAG_SHARED_BACKREF || !(t->header.flags & HEADER_FLAG_MIXED_BACKREF))) {
             LIST_ENTRY* le2;
             BOOL old = !(t->header.flags & HEADER_FLAG_MIXED_BACKREF);
             
@@ -4558,6 +5598,7 @@ static void convert_shared_data_refs(device_extension* Vcb, PIRP Irp, LIST_ENTRY
 NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     LIST_ENTRY* le;
+    UINT8 level;
     BOOL cache_changed = FALSE;
     
 #ifdef DEBUG_WRITE_LOOPS
@@ -4660,7 +5701,7 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
             return Status;
         }
         
-        Vcb->root_root->treeholder.tree->write = TRUE;
+        mark_tree_dirty(Vcb->root_root->treeholder.tree);
     }
     
     Status = add_root_items_to_cache(Vcb, Irp, rollback);
@@ -4688,17 +5729,31 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
             goto end;
         }
         
-        Status = update_chunk_usage(Vcb, Irp, rollback);
+        Status = run_delayed_refs(Vcb, Irp, rollback);
         if (!NT_SUCCESS(Status)) {
-            ERR("update_chunk_usage returned %08x\n", Status);
+            ERR("run_delayed_refs returned %08x\n", Status);
             goto end;
         }
         
-        Status = allocate_cache(Vcb, &cache_changed, Irp, rollback);
+        Status = update_chunk_usage(Vcb, Irp, rollback);
         if (!NT_SUCCESS(Status)) {
-            ERR("allocate_cache returned %08x\n", Status);
+            ERR("update_chunk_usage returned %08x\n", Status);
             goto end;
         }
+        
+        if (Vcb->free_space_root) {
+            Status = update_free_space_tree(Vcb, &cache_changed, Irp, rollback);
+            if (!NT_SUCCESS(Status)) {
+                ERR("update_free_space_tree returned %08x\n", Status);
+                goto end;
+            }
+        } else {
+            Status = allocate_cache(Vcb, &cache_changed, Irp, rollback);
+            if (!NT_SUCCESS(Status)) {
+                ERR("allocate_cache returned %08x\n", Status);
+                goto end;
+            }
+        }
 
 #ifdef DEBUG_WRITE_LOOPS
         loops++;
@@ -4706,7 +5761,7 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
         if (cache_changed)
             ERR("cache has changed, looping again\n");
 #endif        
-    } while (cache_changed || !trees_consistent(Vcb, rollback));
+    } while (cache_changed || !IsListEmpty(&Vcb->delayed_refs) || !trees_consistent(Vcb, rollback));
     
 #ifdef DEBUG_WRITE_LOOPS
     ERR("%u loops\n", loops);
@@ -4726,7 +5781,9 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
         goto end;
     }
     
-    Vcb->superblock.cache_generation = Vcb->superblock.generation;
+    // the free space tree replaces the old cache, which we leave alone
+    if (!Vcb->free_space_root)
+        Vcb->superblock.cache_generation = Vcb->superblock.generation;
     
     Status = write_superblocks(Vcb, Irp);
     if (!NT_SUCCESS(Status)) {
@@ -4734,33 +5791,33 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
         goto end;
     }
     
+    // fsync points the on-disk superblock at its log, so it needs a copy of what we've just written
+    if (Vcb->log_superblock)
+        RtlCopyMemory(Vcb->log_superblock, &Vcb->superblock, sizeof(superblock));
+    
     clean_space_cache(Vcb);
     
+    // the new superblock doesn't point to the log tree, so we can throw it away
+    clear_log(Vcb);
+    
     Vcb->superblock.generation++;
     
     Status = STATUS_SUCCESS;
     
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
-        
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        while (!IsListEmpty(&Vcb->dirty_trees[level])) {
+            tree* t;
+#ifdef DEBUG_PARANOID
+            KEY searchkey;
+            traverse_ptr tp;
+#endif
+            
+            le = RemoveHeadList(&Vcb->dirty_trees[level]);
+            t = CONTAINING_RECORD(le, tree, list_entry_dirty);
+            
 #ifdef DEBUG_PARANOID
-        KEY searchkey;
-        traverse_ptr tp;
-        
-        searchkey.obj_id = t->header.address;
-        searchkey.obj_type = TYPE_METADATA_ITEM;
-        searchkey.offset = 0xffffffffffffffff;
-        
-        Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE, Irp);
-        if (!NT_SUCCESS(Status)) {
-            ERR("error - find_item returned %08x\n", Status);
-            int3;
-        }
-        
-        if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
             searchkey.obj_id = t->header.address;
-            searchkey.obj_type = TYPE_EXTENT_ITEM;
+            searchkey.obj_type = TYPE_METADATA_ITEM;
             searchkey.offset = 0xffffffffffffffff;
             
             Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE, Irp);
@@ -4770,27 +5827,29 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
             }
             
             if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
-                ERR("error - could not find entry in extent tree for tree at %llx\n", t->header.address);
-                int3;
+                searchkey.obj_id = t->header.address;
+                searchkey.obj_type = TYPE_EXTENT_ITEM;
+                searchkey.offset = 0xffffffffffffffff;
+                
+                Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE, Irp);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("error - find_item returned %08x\n", Status);
+                    int3;
+                }
+                
+                if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
+                    ERR("error - could not find entry in extent tree for tree at %llx\n", t->header.address);
+                    int3;
+                }
             }
-        }
 #endif
-        
-        t->write = FALSE;
-        
-        le = le->Flink;
+            
+            t->write = FALSE;
+        }
     }
     
     Vcb->need_write = FALSE;
-    
-    while (!IsListEmpty(&Vcb->drop_roots)) {
-        LIST_ENTRY* le = RemoveHeadList(&Vcb->drop_roots);
-        root* r = CONTAINING_RECORD(le, root, list_entry);
-
-        ExDeleteResourceLite(&r->nonpaged->load_tree_lock);
-        ExFreePool(r->nonpaged);
-        ExFreePool(r);
-    }
+    RtlZeroMemory(&Vcb->dirty, sizeof(dirty_stats));
     
 end:
     TRACE("do_write returning %08x\n", Status);
@@ -4798,53 +5857,210 @@ end:
     return Status;
 }
 
-static void do_flush(device_extension* Vcb) {
+// Group commit: if a transaction is already being committed when we're asked for one, it may not include our
+// changes, so we wait for it to finish and then all go together in the next one. Whoever finds nothing running
+// does the work; everyone else sleeps until it's done. If the last commit was shared, the one doing the work first
+// waits for a bit - no longer than a commit usually takes, nor GROUP_COMMIT_MAX_WAIT - to give others time to join.
+NTSTATUS commit_transaction(device_extension* Vcb, UINT8 reason, PIRP Irp) {
+    group_commit* gc = &Vcb->commit;
+    NTSTATUS Status;
+    KIRQL irql;
+    UINT64 ticket, start_time, time;
     LIST_ENTRY rollback;
     
+    KeAcquireSpinLock(&gc->lock, &irql);
+    
+    ticket = gc->started + 1;
+    gc->joined++;
+    
+    while (TRUE) {
+        if (gc->done >= ticket) {
+            Status = gc->status;
+            KeReleaseSpinLock(&gc->lock, irql);
+            
+            return Status;
+        }
+        
+        if (!gc->running)
+            break;
+        
+        KeReleaseSpinLock(&gc->lock, irql);
+        
+        KeWaitForSingleObject(&gc->finished, Executive, KernelMode, FALSE, NULL);
+        
+        KeAcquireSpinLock(&gc->lock, &irql);
+    }
+    
+    gc->running = TRUE;
+    KeClearEvent(&gc->finished);
+    
+    if (gc->last_batch > 1) {
+        LARGE_INTEGER delay;
+        
+        KeReleaseSpinLock(&gc->lock, irql);
+        
+        delay.QuadPart = -(LONGLONG)min(gc->avg_time, GROUP_COMMIT_MAX_WAIT);
+        KeDelayExecutionThread(KernelMode, FALSE, &delay);
+        
+        KeAcquireSpinLock(&gc->lock, &irql);
+    }
+    
+    // anyone who turns up from now on needs the next commit
+    gc->started++;
+    gc->last_batch = gc->joined;
+    gc->joined = 0;
+    
+    KeReleaseSpinLock(&gc->lock, irql);
+    
+    TRACE("committing transaction for %u requests\n", gc->last_batch);
+    
+    start_time = KeQueryInterruptTime();
+    
     InitializeListHead(&rollback);
     
-    FsRtlEnterFileSystem();
-
     ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
-
-    if (Vcb->need_write && !Vcb->readonly)
-        do_write(Vcb, NULL, &rollback);
+    
+    if (Vcb->need_write && !Vcb->readonly) {
+        InterlockedIncrement64(&Vcb->commits.commits[reason]);
+        
+        Status = do_write(Vcb, Irp, &rollback);
+        if (!NT_SUCCESS(Status))
+            ERR("do_write returned %08x\n", Status);
+    } else
+        Status = STATUS_SUCCESS;
     
     free_trees(Vcb);
     
     clear_rollback(&rollback);
-
+    
     ExReleaseResourceLite(&Vcb->tree_lock);
+    
+    time = KeQueryInterruptTime() - start_time;
+    
+    KeAcquireSpinLock(&gc->lock, &irql);
+    
+    gc->avg_time = gc->avg_time == 0 ? time : ((gc->avg_time * 3) + time) / 4;
+    gc->done = gc->started;
+    gc->status = Status;
+    gc->running = FALSE;
+    KeSetEvent(&gc->finished, 0, FALSE);
+    
+    KeReleaseSpinLock(&gc->lock, irql);
+    
+    return Status;
+}
+
+// Works out whether we ought to commit now, and why. If factor is more than 1, we're seeing if writers have
+// got so far ahead of us that they need to wait.
+static UINT8 get_commit_reason(device_extension* Vcb, UINT32 factor) {
+    UINT64 since = Vcb->dirty.since;
+    
+    if (!Vcb->need_write || Vcb->readonly || since == 0)
+        return COMMIT_REASON_NONE;
+    
+    if ((UINT64)Vcb->dirty.trees * Vcb->superblock.node_size >= (UINT64)FLUSH_DIRTY_METADATA * factor)
+        return COMMIT_REASON_METADATA;
+    
+    if ((UINT32)Vcb->dirty.fcbs >= FLUSH_DIRTY_FCBS * factor)
+        return COMMIT_REASON_FCBS;
+    
+    if ((UINT32)Vcb->dirty.checksums >= FLUSH_DIRTY_CHECKSUMS * factor)
+        return COMMIT_REASON_CHECKSUMS;
+    
+    if (KeQueryInterruptTime() - since >= (UINT64)Vcb->options.flush_interval * factor * 10000000)
+        return COMMIT_REASON_AGE;
+    
+    return COMMIT_REASON_NONE;
+}
+
+void throttle_writes(device_extension* Vcb, PIRP Irp) {
+    UINT8 reason = get_commit_reason(Vcb, THROTTLE_FACTOR);
+    
+    if (reason == COMMIT_REASON_NONE)
+        return;
+    
+    TRACE("throttling writer (reason %u)\n", reason);
+    
+    InterlockedIncrement64(&Vcb->commits.throttled);
+    
+    commit_transaction(Vcb, reason, Irp);
+}
+
+void print_commit_stats(device_extension* Vcb) {
+    commit_stats* cs = &Vcb->commits;
+    
+    TRACE("commits: %llu for age, %llu for metadata, %llu for fcbs, %llu for checksums, %llu for fsync, %llu for deleting subvolumes; %llu writers throttled\n",
+          cs->commits[COMMIT_REASON_AGE], cs->commits[COMMIT_REASON_METADATA], cs->commits[COMMIT_REASON_FCBS],
+          cs->commits[COMMIT_REASON_CHECKSUMS], cs->commits[COMMIT_REASON_FSYNC], cs->commits[COMMIT_REASON_CLEANER], cs->throttled);
+}
+
+void print_delayed_ref_stats(device_extension* Vcb) {
+    delayed_ref_stats* rs = &Vcb->ref_stats;
+    
+    TRACE("delayed refs: %llu tree refs queued, %llu cancelled out, %llu written; %llu data refs cancelled out\n",
+          rs->queued, rs->cancelled, rs->applied, rs->data_cancelled);
+}
+
+static void do_flush(device_extension* Vcb, UINT8 reason) {
+    FsRtlEnterFileSystem();
+
+    commit_transaction(Vcb, reason, NULL);
 
     FsRtlExitFileSystem();
 }
 
+// Rather than waking up every flush_interval seconds, we sleep until the oldest change is that old, or until
+// something takes us over one of the limits. If nothing's changed, we sleep until something does.
 void STDCALL flush_thread(void* context) {
     DEVICE_OBJECT* devobj = context;
     device_extension* Vcb = devobj->DeviceExtension;
-    LARGE_INTEGER due_time;
+    LARGE_INTEGER timeout;
+    UINT64 interval = (UINT64)Vcb->options.flush_interval * 10000000;
     
     ObReferenceObject(devobj);
     
-    KeInitializeTimer(&Vcb->flush_thread_timer);
-    
-    due_time.QuadPart = (UINT64)Vcb->options.flush_interval * -10000000;
-    
-    KeSetTimer(&Vcb->flush_thread_timer, due_time, NULL);
-    
     while (TRUE) {
-        KeWaitForSingleObject(&Vcb->flush_thread_timer, Executive, KernelMode, FALSE, NULL);
+        UINT64 since = Vcb->dirty.since;
+        UINT8 reason;
+        
+        if (since == 0) {
+            if (IsListEmpty(&Vcb->drop_roots) || Vcb->readonly)
+                KeWaitForSingleObject(&Vcb->flush_thread_event, Executive, KernelMode, FALSE, NULL);
+            else {
+                timeout.QuadPart = -(LONGLONG)DROP_ROOT_INTERVAL;
+                
+                KeWaitForSingleObject(&Vcb->flush_thread_event, Executive, KernelMode, FALSE, &timeout);
+            }
+        } else {
+            UINT64 due = since + interval, now = KeQueryInterruptTime();
+            
+            timeout.QuadPart = now >= due ? 0 : -(LONGLONG)(due - now);
+            
+            KeWaitForSingleObject(&Vcb->flush_thread_event, Executive, KernelMode, FALSE, &timeout);
+        }
 
         if (!(devobj->Vpb->Flags & VPB_MOUNTED) || Vcb->removing)
             break;
-            
-        do_flush(Vcb);
         
-        KeSetTimer(&Vcb->flush_thread_timer, due_time, NULL);
+        reason = get_commit_reason(Vcb, 1);
+        since = Vcb->dirty.since;
+        
+        // If we're deleting a subvolume and nothing else is going on, commit anyway so it carries on. Otherwise it
+        // gets done a bit at a time along with everything else.
+        if (reason == COMMIT_REASON_NONE && since == 0 && !IsListEmpty(&Vcb->drop_roots) && !Vcb->readonly) {
+            Vcb->need_write = TRUE;
+            reason = COMMIT_REASON_CLEANER;
+        }
+        
+        if (reason != COMMIT_REASON_NONE)
+            do_flush(Vcb, reason);
+        
+        // if the commit failed, or there turned out to be nothing to write, don't try again for another flush_interval
+        if (since != 0 && Vcb->dirty.since == since && KeQueryInterruptTime() - since >= interval)
+            Vcb->dirty.since = KeQueryInterruptTime();
     }
     
     ObDereferenceObject(devobj);
-    KeCancelTimer(&Vcb->flush_thread_timer);
     
     KeSetEvent(&Vcb->flush_thread_finished, 0, FALSE);
     
@@ -23,6 +23,8 @@
 
 // #define DEBUG_SPACE_LISTS
 
+static void add_rollback_space(LIST_ENTRY* rollback, BOOL add, LIST_ENTRY* list, space** tree, UINT64 address, UINT64 length, chunk* c);
+
 static NTSTATUS remove_free_space_inode(device_extension* Vcb, UINT64 inode, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     fcb* fcb;
@@ -125,7 +127,535 @@ end:
     return Status;
 }
 
-NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 offset, UINT64 size) {
+static UINT32 space_priority(UINT64 address) {
+    return (UINT32)((address * 0x9e3779b97f4a7c15) >> 32);
+}
+
+static __inline UINT64 space_subtree_max(space* s) {
+    return s ? s->max_size : 0;
+}
+
+static void space_tree_fix(space* s) {
+    s->max_size = max(s->size, max(space_subtree_max(s->left), space_subtree_max(s->right)));
+}
+
+// Moves s above its parent, keeping the tree ordered by address.
+static void space_tree_rotate(space** tree, space* s) {
+    space* p = s->parent;
+    space* g = p->parent;
+    
+    if (p->left == s) {
+        p->left = s->right;
+        
+        if (p->left)
+            p->left->parent = p;
+        
+        s->right = p;
+    } else {
+        p->right = s->left;
+        
+        if (p->right)
+            p->right->parent = p;
+        
+        s->left = p;
+    }
+    
+    p->parent = s;
+    s->parent = g;
+    
+    if (!g)
+        *tree = s;
+    else if (g->left == p)
+        g->left = s;
+    else
+        g->right = s;
+    
+    space_tree_fix(p);
+    space_tree_fix(s);
+}
+
+// Call this after changing the address or size of an entry already in the tree. The address
+// mustn't move it past any of its neighbours.
+void space_tree_update(space* s) {
+    while (s) {
+        space_tree_fix(s);
+        s = s->parent;
+    }
+}
+
+void space_tree_insert(space** tree, space* s) {
+    space *p = NULL, **link = tree;
+    
+    while (*link) {
+        p = *link;
+        link = s->address < p->address ? &p->left : &p->right;
+    }
+    
+    s->parent = p;
+    s->left = s->right = NULL;
+    s->max_size = s->size;
+    s->priority = space_priority(s->address);
+    *link = s;
+    
+    space_tree_update(p);
+    
+    while (s->parent && s->parent->priority < s->priority) {
+        space_tree_rotate(tree, s);
+    }
+}
+
+void space_tree_remove(space** tree, space* s) {
+    space* child;
+    
+    while (s->left && s->right) {
+        space_tree_rotate(tree, s->left->priority > s->right->priority ? s->left : s->right);
+    }
+    
+    child = s->left ? s->left : s->right;
+    
+    if (child)
+        child->parent = s->parent;
+    
+    if (!s->parent)
+        *tree = child;
+    else if (s->parent->left == s)
+        s->parent->left = child;
+    else
+        s->parent->right = child;
+    
+    space_tree_update(s->parent);
+}
+
+// returns the entry with the highest address less than or equal to address
+space* space_tree_find(space* tree, UINT64 address) {
+    space* ret = NULL;
+    
+    while (tree) {
+        if (tree->address <= address) {
+            ret = tree;
+            tree = tree->right;
+        } else
+            tree = tree->left;
+    }
+    
+    return ret;
+}
+
+// returns the entry with the lowest address which is at least length bytes long
+space* space_tree_first_fit(space* tree, UINT64 length) {
+    if (!tree || tree->max_size < length)
+        return NULL;
+    
+    while (TRUE) {
+        if (tree->left && tree->left->max_size >= length)
+            tree = tree->left;
+        else if (tree->size >= length)
+            return tree;
+        else
+            tree = tree->right;
+    }
+}
+
+static __inline UINT64 space_bitmap_length(device_extension* Vcb) {
+    return (UINT64)Vcb->superblock.sector_size * Vcb->superblock.sector_size * 8;
+}
+
+static __inline ULONG lowest_set_bit(ULONG v) {
+#ifdef _MSC_VER
+    unsigned long index;
+    
+    _BitScanForward(&index, v);
+    
+    return index;
+#else
+    return __builtin_ctz(v);
+#endif
+}
+
+// Returns the index of the first bit within [start, end) which is set (or clear, if set is FALSE),
+// or end if there isn't one. Whole words are skipped at a time, and with SSE2 whole 128-bit blocks.
+static ULONG find_next_bit(ULONG* bits, ULONG start, ULONG end, BOOL set) {
+    ULONG i = start, v, invert = set ? 0 : 0xffffffff;
+    
+    if (i >= end)
+        return end;
+    
+    if (i % 32 != 0) {
+        v = (bits[i / 32] ^ invert) >> (i % 32);
+        
+        if (v != 0)
+            return min(i + lowest_set_bit(v), end);
+        
+        i = ((i / 32) + 1) * 32;
+    }
+    
+    if (have_sse2) {
+        __m128i skip = _mm_set1_epi32(invert);
+        
+        while (i + 128 <= end) {
+            __m128i x = _mm_loadu_si128((__m128i*)&bits[i / 32]);
+            
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, skip)) != 0xffff)
+                break;
+            
+            i += 128;
+        }
+    }
+    
+    while (i < end) {
+        v = bits[i / 32] ^ invert;
+        
+        if (v != 0)
+            return min(i + lowest_set_bit(v), end);
+        
+        i += 32;
+    }
+    
+    return end;
+}
+
+// Finds the first run of bits within [start, end) which are set (or clear, if set is FALSE), returning its
+// length, or 0 if there isn't one. Unlike RtlFindNextForwardRunClear, this doesn't need the bitmap to be
+// flipped first to look for set bits.
+ULONG find_bitmap_run(ULONG* bits, ULONG start, ULONG end, BOOL set, ULONG* runstart) {
+    ULONG i, j;
+    
+    i = find_next_bit(bits, start, end, set);
+    
+    if (i >= end)
+        return 0;
+    
+    j = find_next_bit(bits, i, end, !set);
+    
+    *runstart = i;
+    
+    return j - i;
+}
+
+static space_bitmap* find_space_bitmap(device_extension* Vcb, chunk* c, UINT64 address) {
+    LIST_ENTRY* le;
+    
+    le = c->bitmaps.Flink;
+    while (le != &c->bitmaps) {
+        space_bitmap* b = CONTAINING_RECORD(le, space_bitmap, list_entry);
+        
+        if (b->address > address)
+            return NULL;
+        
+        if (address < b->address + space_bitmap_length(Vcb))
+            return b;
+        
+        le = le->Flink;
+    }
+    
+    return NULL;
+}
+
+// returns the address of the first bitmap after address, or the end of the chunk if there isn't one
+static UINT64 next_space_bitmap(chunk* c, UINT64 address) {
+    LIST_ENTRY* le;
+    
+    le = c->bitmaps.Flink;
+    while (le != &c->bitmaps) {
+        space_bitmap* b = CONTAINING_RECORD(le, space_bitmap, list_entry);
+        
+        if (b->address > address)
+            return b->address;
+        
+        le = le->Flink;
+    }
+    
+    return c->offset + c->chunk_item->size;
+}
+
+void free_space_bitmaps(chunk* c) {
+    while (!IsListEmpty(&c->bitmaps)) {
+        space_bitmap* b = CONTAINING_RECORD(RemoveHeadList(&c->bitmaps), space_bitmap, list_entry);
+        
+        ExFreePool(b->bits);
+        ExFreePool(b);
+    }
+}
+
+// Moves all the free space in the region starting at address from space entries into a new bitmap.
+static space_bitmap* convert_to_bitmap(device_extension* Vcb, chunk* c, UINT64 address) {
+    space_bitmap *b, *b2;
+    UINT64 end = min(address + space_bitmap_length(Vcb), c->offset + c->chunk_item->size);
+    RTL_BITMAP bmph;
+    LIST_ENTRY* le;
+    space* s;
+    
+    b = ExAllocatePoolWithTag(PagedPool, sizeof(space_bitmap), ALLOC_TAG);
+    if (!b) {
+        ERR("out of memory\n");
+        return NULL;
+    }
+    
+    b->bits = ExAllocatePoolWithTag(PagedPool, Vcb->superblock.sector_size, ALLOC_TAG);
+    if (!b->bits) {
+        ERR("out of memory\n");
+        ExFreePool(b);
+        return NULL;
+    }
+    
+    RtlZeroMemory(b->bits, Vcb->superblock.sector_size);
+    RtlInitializeBitMap(&bmph, b->bits, Vcb->superblock.sector_size * 8);
+    
+    b->address = address;
+    b->free = 0;
+    
+    s = space_tree_find(c->space_tree, address);
+    le = s ? &s->list_entry : c->space.Flink;
+    
+    while (le != &c->space) {
+        LIST_ENTRY* le2 = le->Flink;
+        UINT64 start, send;
+        
+        s = CONTAINING_RECORD(le, space, list_entry);
+        
+        if (s->address >= end)
+            break;
+        
+        start = max(s->address, address);
+        send = min(s->address + s->size, end);
+        
+        if (send > start) {
+            ULONG sectors = (ULONG)((send - start) / Vcb->superblock.sector_size);
+            
+            RtlSetBits(&bmph, (ULONG)((start - address) / Vcb->superblock.sector_size), sectors);
+            b->free += sectors;
+            
+            if (s->address >= address && s->address + s->size <= end) {
+                RemoveEntryList(&s->list_entry);
+                space_tree_remove(&c->space_tree, s);
+                ExFreePool(s);
+            } else if (s->address < address && s->address + s->size > end) {
+                space* s2 = ExAllocatePoolWithTag(PagedPool, sizeof(space), ALLOC_TAG);
+                
+                if (!s2) {
+                    ERR("out of memory\n");
+                    ExFreePool(b->bits);
+                    ExFreePool(b);
+                    return NULL;
+                }
+                
+                s2->address = end;
+                s2->size = s->address + s->size - end;
+                
+                s->size = address - s->address;
+                space_tree_update(s);
+                
+                InsertHeadList(&s->list_entry, &s2->list_entry);
+                space_tree_insert(&c->space_tree, s2);
+                
+                le2 = s2->list_entry.Flink;
+            } else if (s->address < address) {
+                s->size = address - s->address;
+                space_tree_update(s);
+            } else {
+                s->size = s->address + s->size - end;
+                s->address = end;
+                space_tree_update(s);
+            }
+        }
+        
+        le = le2;
+    }
+    
+    le = c->bitmaps.Flink;
+    while (le != &c->bitmaps) {
+        b2 = CONTAINING_RECORD(le, space_bitmap, list_entry);
+        
+        if (b2->address > address)
+            break;
+        
+        le = le->Flink;
+    }
+    
+    InsertTailList(le, &b->list_entry);
+    
+    TRACE("chunk %llx: converted %llx to bitmap (%x sectors free)\n", c->offset, address, b->free);
+    
+    return b;
+}
+
+static void check_space_density(device_extension* Vcb, chunk* c, UINT64 address) {
+    UINT64 start, end;
+    UINT32 count = 0, threshold = Vcb->superblock.sector_size / sizeof(space);
+    LIST_ENTRY* le;
+    space* s;
+    
+    start = c->offset + (((address - c->offset) / space_bitmap_length(Vcb)) * space_bitmap_length(Vcb));
+    end = min(start + space_bitmap_length(Vcb), c->offset + c->chunk_item->size);
+    
+    if (find_space_bitmap(Vcb, c, start))
+        return;
+    
+    s = space_tree_find(c->space_tree, start);
+    le = s ? &s->list_entry : c->space.Flink;
+    
+    while (le != &c->space) {
+        s = CONTAINING_RECORD(le, space, list_entry);
+        
+        if (s->address >= end)
+            return;
+        
+        if (s->address + s->size > start) {
+            count++;
+            
+            // once the entries would take up more memory than the bitmap, switch over to it
+            if (count > threshold) {
+                convert_to_bitmap(Vcb, c, start);
+                return;
+            }
+        }
+        
+        le = le->Flink;
+    }
+}
+
+static void compact_space(device_extension* Vcb, chunk* c) {
+    UINT64 address;
+    
+    for (address = c->offset; address < c->offset + c->chunk_item->size; address += space_bitmap_length(Vcb)) {
+        check_space_density(Vcb, c, address);
+    }
+}
+
+static void space_bitmap_add(device_extension* Vcb, chunk* c, space_bitmap* b, UINT64 address, UINT64 length, LIST_ENTRY* rollback, const char* func) {
+    RTL_BITMAP bmph;
+    ULONG start, end, runstart, runlength;
+    UINT64 bend = min(b->address + space_bitmap_length(Vcb), c->offset + c->chunk_item->size);
+    
+    start = (ULONG)((address - b->address) / Vcb->superblock.sector_size);
+    end = start + (ULONG)(length / Vcb->superblock.sector_size);
+    
+    RtlInitializeBitMap(&bmph, b->bits, Vcb->superblock.sector_size * 8);
+    
+    while ((runlength = find_bitmap_run(b->bits, start, end, FALSE, &runstart)) > 0) {
+        RtlSetBits(&bmph, runstart, runlength);
+        b->free += runlength;
+        
+        if (rollback)
+            add_rollback_space(rollback, TRUE, &c->space, &c->space_tree, b->address + ((UINT64)runstart * Vcb->superblock.sector_size),
+                               (UINT64)runlength * Vcb->superblock.sector_size, c);
+        
+        start = runstart + runlength;
+    }
+    
+    // if the whole region is free, we're better off with a space entry
+    if ((UINT64)b->free * Vcb->superblock.sector_size == bend - b->address) {
+        RemoveEntryList(&b->list_entry);
+        ExFreePool(b->bits);
+        
+        _space_list_add2(&c->space, &c->space_tree, b->address, bend - b->address, c, NULL, func);
+        
+        ExFreePool(b);
+    }
+}
+
+static void space_bitmap_subtract(device_extension* Vcb, chunk* c, space_bitmap* b, UINT64 address, UINT64 length, LIST_ENTRY* rollback) {
+    RTL_BITMAP bmph;
+    ULONG start, end, runstart, runlength;
+    
+    start = (ULONG)((address - b->address) / Vcb->superblock.sector_size);
+    end = start + (ULONG)(length / Vcb->superblock.sector_size);
+    
+    RtlInitializeBitMap(&bmph, b->bits, Vcb->superblock.sector_size * 8);
+    
+    while ((runlength = find_bitmap_run(b->bits, start, end, TRUE, &runstart)) > 0) {
+        RtlClearBits(&bmph, runstart, runlength);
+        b->free -= runlength;
+        
+        if (rollback)
+            add_rollback_space(rollback, FALSE, &c->space, &c->space_tree, b->address + ((UINT64)runstart * Vcb->superblock.sector_size),
+                               (UINT64)runlength * Vcb->superblock.sector_size, c);
+        
+        start = runstart + runlength;
+    }
+    
+    if (b->free == 0) {
+        RemoveEntryList(&b->list_entry);
+        ExFreePool(b->bits);
+        ExFreePool(b);
+    }
+}
+
+BOOL find_space_in_bitmaps(device_extension* Vcb, chunk* c, UINT64 length, UINT64* address) {
+    ULONG sectors = (ULONG)(length / Vcb->superblock.sector_size);
+    LIST_ENTRY* le;
+    
+    le = c->bitmaps.Flink;
+    while (le != &c->bitmaps) {
+        space_bitmap* b = CONTAINING_RECORD(le, space_bitmap, list_entry);
+        
+        if (b->free >= sectors) {
+            ULONG start = 0, runstart, runlength;
+            
+            while ((runlength = find_bitmap_run(b->bits, start, Vcb->superblock.sector_size * 8, TRUE, &runstart)) > 0) {
+                if (runlength >= sectors) {
+                    *address = b->address + ((UINT64)runstart * Vcb->superblock.sector_size);
+                    return TRUE;
+                }
+                
+                start = runstart + runlength;
+            }
+        }
+        
+        le = le->Flink;
+    }
+    
+    return FALSE;
+}
+
+BOOL is_space_free(device_extension* Vcb, chunk* c, UINT64 address, UINT64 length) {
+    space_bitmap* b = find_space_bitmap(Vcb, c, address);
+    space* s;
+    
+    if (b) {
+        RTL_BITMAP bmph;
+        
+        if (address + length > b->address + space_bitmap_length(Vcb))
+            return FALSE;
+        
+        RtlInitializeBitMap(&bmph, b->bits, Vcb->superblock.sector_size * 8);
+        
+        return RtlAreBitsSet(&bmph, (ULONG)((address - b->address) / Vcb->superblock.sector_size), (ULONG)(length / Vcb->superblock.sector_size));
+    }
+    
+    s = space_tree_find(c->space_tree, address);
+    
+    return s && s->address + s->size >= address + length;
+}
+
+// returns how many bytes, up to length, are free starting at address, or 0 if address itself isn't free
+UINT64 free_space_at(device_extension* Vcb, chunk* c, UINT64 address, UINT64 length) {
+    space_bitmap* b = find_space_bitmap(Vcb, c, address);
+    space* s;
+    
+    if (b) {
+        ULONG start, end, runstart, runlength;
+        
+        start = (ULONG)((address - b->address) / Vcb->superblock.sector_size);
+        end = (ULONG)((min(address + length, b->address + space_bitmap_length(Vcb)) - b->address) / Vcb->superblock.sector_size);
+        
+        runlength = find_bitmap_run(b->bits, start, end, TRUE, &runstart);
+        
+        if (runlength == 0 || runstart != start)
+            return 0;
+        
+        return (UINT64)runlength * Vcb->superblock.sector_size;
+    }
+    
+    s = space_tree_find(c->space_tree, address);
+    
+    if (!s || s->address + s->size <= address)
+        return 0;
+    
+    return min(s->address + s->size - address, length);
+}
+
+NTSTATUS add_space_entry(LIST_ENTRY* list, space** tree, UINT64 offset, UINT64 size) {
     space* s;
     
     s = ExAllocatePoolWithTag(PagedPool, sizeof(space), ALLOC_TAG);
@@ -138,6 +668,15 @@ NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 offset,
     s->address = offset;
     s->size = size;
     
+    if (tree) {
+        space* s2 = space_tree_find(*tree, offset);
+        
+        InsertHeadList(s2 ? &s2->list_entry : list, &s->list_entry);
+        space_tree_insert(tree, s);
+        
+        return STATUS_SUCCESS;
+    }
+    
     if (IsListEmpty(list))
         InsertTailList(list, &s->list_entry);
     else {
@@ -154,34 +693,6 @@ NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 offset,
                 
                 if (s2->address > offset) {
                     InsertTailList(le, &s->list_entry);
-                    goto size;
-                }
-                
-                le = le->Flink;
-            }
-        }
-    }
-    
-size:
-    if (!list_size)
-        return STATUS_SUCCESS;
-    
-    if (IsListEmpty(list_size))
-        InsertTailList(list_size, &s->list_entry_size);
-    else {
-        space* s2 = CONTAINING_RECORD(list_size->Blink, space, list_entry_size);
-        
-        if (s2->size >= size)
-            InsertTailList(list_size, &s->list_entry_size);
-        else {
-            LIST_ENTRY* le;
-            
-            le = list_size->Flink;
-            while (le != list_size) {
-                s2 = CONTAINING_RECORD(le, space, list_entry_size);
-                
-                if (s2->size <= size) {
-                    InsertHeadList(le->Blink, &s->list_entry_size);
                     return STATUS_SUCCESS;
                 }
                 
@@ -196,53 +707,46 @@ size:
 static void load_free_space_bitmap(device_extension* Vcb, chunk* c, UINT64 offset, void* data) {
     RTL_BITMAP bmph;
     UINT32 i, *dwords = data;
-    ULONG runlength, index;
+    ULONG runlength, index, start;
     
-    // flip bits
-    for (i = 0; i < Vcb->superblock.sector_size / sizeof(UINT32); i++) {
-        dwords[i] = ~dwords[i];
-    }
-
-    RtlInitializeBitMap(&bmph, data, Vcb->superblock.sector_size * 8);
-
-    index = 0;
-    runlength = RtlFindFirstRunClear(&bmph, &index);
-            
-    while (runlength != 0) {
-        UINT64 addr, length;
+    // If the bitmap lines up with ours, we can keep it as it is rather than expanding it into space entries.
+    if (offset >= c->offset && (offset - c->offset) % space_bitmap_length(Vcb) == 0) {
+        space_bitmap* b = find_space_bitmap(Vcb, c, offset);
+        UINT64 end = min(offset + space_bitmap_length(Vcb), c->offset + c->chunk_item->size);
         
-        addr = offset + (index * Vcb->superblock.sector_size);
-        length = Vcb->superblock.sector_size * runlength;
+        if (!b)
+            b = convert_to_bitmap(Vcb, c, offset);
         
-        add_space_entry(&c->space, &c->space_size, addr, length);
-        index += runlength;
-       
-        runlength = RtlFindNextForwardRunClear(&bmph, index, &index);
-    }
-}
-
-static void order_space_entry(space* s, LIST_ENTRY* list_size) {
-    LIST_ENTRY* le;
-    
-    if (IsListEmpty(list_size)) {
-        InsertHeadList(list_size, &s->list_entry_size);
-        return;
+        if (b) {
+            ULONG valid = (ULONG)((end - offset) / Vcb->superblock.sector_size);
+            
+            for (i = 0; i < Vcb->superblock.sector_size / sizeof(UINT32); i++) {
+                b->bits[i] |= dwords[i];
+            }
+            
+            // clear anything past the end of the chunk
+            RtlInitializeBitMap(&bmph, b->bits, Vcb->superblock.sector_size * 8);
+            
+            if (valid < Vcb->superblock.sector_size * 8)
+                RtlClearBits(&bmph, valid, (Vcb->superblock.sector_size * 8) - valid);
+            
+            b->free = RtlNumberOfSetBits(&bmph);
+            
+            return;
+        }
     }
     
-    le = list_size->Flink;
+    start = 0;
     
-    while (le != list_size) {
-        space* s2 = CONTAINING_RECORD(le, space, list_entry_size);
+    while ((runlength = find_bitmap_run(data, start, Vcb->superblock.sector_size * 8, TRUE, &index)) > 0) {
+        UINT64 addr, length;
         
-        if (s2->size <= s->size) {
-            InsertHeadList(le->Blink, &s->list_entry_size);
-            return;
-        }
+        addr = offset + (index * Vcb->superblock.sector_size);
+        length = Vcb->superblock.sector_size * runlength;
         
-        le = le->Flink;
+        add_space_entry(&c->space, &c->space_tree, addr, length);
+        start = index + runlength;
     }
-    
-    InsertTailList(list_size, &s->list_entry_size);
 }
 
 static NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp) {
@@ -379,7 +883,7 @@ static NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, PI
         fse = (FREE_SPACE_ENTRY*)&data[off];
         
         if (fse->type == FREE_SPACE_EXTENT) {
-            Status = add_space_entry(&c->space, &c->space_size, fse->offset, fse->size);
+            Status = add_space_entry(&c->space, &c->space_tree, fse->offset, fse->size);
             if (!NT_SUCCESS(Status)) {
                 ERR("add_space_entry returned %08x\n", Status);
                 ExFreePool(data);
@@ -424,11 +928,10 @@ static NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, PI
                 s->size += s2->size;
                 
                 RemoveEntryList(&s2->list_entry);
-                RemoveEntryList(&s2->list_entry_size);
+                space_tree_remove(&c->space_tree, s2);
                 ExFreePool(s2);
                 
-                RemoveEntryList(&s->list_entry_size);
-                order_space_entry(s, &c->space_size);
+                space_tree_update(s);
                 
                 le2 = le;
             }
@@ -439,6 +942,8 @@ static NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, PI
     
     ExFreePool(data);
     
+    compact_space(Vcb, c);
+    
     return STATUS_SUCCESS;
     
 clearcache:
@@ -463,6 +968,107 @@ clearcache:
     return STATUS_NOT_FOUND;
 }
 
+static NTSTATUS load_free_space_tree(device_extension* Vcb, chunk* c, PIRP Irp) {
+    traverse_ptr tp, next_tp;
+    KEY searchkey;
+    FREE_SPACE_INFO* fsi;
+    ULONG *bits = NULL, bitslen = 0;
+    UINT64 end = c->offset + c->chunk_item->size;
+    BOOL b;
+    NTSTATUS Status;
+    
+    searchkey.obj_id = c->offset;
+    searchkey.obj_type = TYPE_FREE_SPACE_INFO;
+    searchkey.offset = c->chunk_item->size;
+    
+    Status = find_item(Vcb, Vcb->free_space_root, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("error - find_item returned %08x\n", Status);
+        return Status;
+    }
+    
+    if (keycmp(&tp.item->key, &searchkey)) {
+        WARN("could not find (%llx,%x,%llx) in free space tree\n", searchkey.obj_id, searchkey.obj_type, searchkey.offset);
+        return STATUS_NOT_FOUND;
+    }
+    
+    if (tp.item->size < sizeof(FREE_SPACE_INFO)) {
+        WARN("(%llx,%x,%llx) was %u bytes, expected %u\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, sizeof(FREE_SPACE_INFO));
+        return STATUS_NOT_FOUND;
+    }
+    
+    fsi = (FREE_SPACE_INFO*)tp.item->data;
+    
+    TRACE("chunk %llx: %x entries, flags %x\n", c->offset, fsi->count, fsi->flags);
+    
+    b = find_next_item(Vcb, &tp, &next_tp, FALSE, Irp);
+    
+    while (b) {
+        tp = next_tp;
+        
+        if (tp.item->key.obj_id >= end)
+            break;
+        
+        if (tp.item->key.obj_type == TYPE_FREE_SPACE_EXTENT) {
+            Status = add_space_entry(&c->space, &c->space_tree, tp.item->key.obj_id, tp.item->key.offset);
+            if (!NT_SUCCESS(Status)) {
+                ERR("add_space_entry returned %08x\n", Status);
+                goto end;
+            }
+        } else if (tp.item->key.obj_type == TYPE_FREE_SPACE_BITMAP) {
+            ULONG numbits = (ULONG)(tp.item->key.offset / Vcb->superblock.sector_size), runlength, index, start;
+            ULONG len = ((numbits + 31) / 32) * sizeof(ULONG);
+            
+            if (tp.item->size < (numbits + 7) / 8) {
+                ERR("(%llx,%x,%llx) was %u bytes, expected %u\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, (numbits + 7) / 8);
+                Status = STATUS_INTERNAL_ERROR;
+                goto end;
+            }
+            
+            // the item isn't necessarily a whole number of ULONGs long, so copy it somewhere that is
+            if (len > bitslen) {
+                if (bits)
+                    ExFreePool(bits);
+                
+                bits = ExAllocatePoolWithTag(PagedPool, len, ALLOC_TAG);
+                if (!bits) {
+                    ERR("out of memory\n");
+                    Status = STATUS_INSUFFICIENT_RESOURCES;
+                    goto end;
+                }
+                
+                bitslen = len;
+            }
+            
+            RtlZeroMemory(bits, len);
+            RtlCopyMemory(bits, tp.item->data, (numbits + 7) / 8);
+            
+            start = 0;
+            
+            while ((runlength = find_bitmap_run(bits, start, numbits, TRUE, &index)) > 0) {
+                Status = add_space_entry(&c->space, &c->space_tree, tp.item->key.obj_id + ((UINT64)index * Vcb->superblock.sector_size),
+                                         (UINT64)runlength * Vcb->superblock.sector_size);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("add_space_entry returned %08x\n", Status);
+                    goto end;
+                }
+                
+                start = index + runlength;
+            }
+        }
+        
+        b = find_next_item(Vcb, &tp, &next_tp, FALSE, Irp);
+    }
+    
+    Status = STATUS_SUCCESS;
+    
+end:
+    if (bits)
+        ExFreePool(bits);
+    
+    return Status;
+}
+
 NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp) {
     traverse_ptr tp, next_tp;
     KEY searchkey;
@@ -472,7 +1078,21 @@ NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp) {
     NTSTATUS Status;
 //     LIST_ENTRY* le;
     
-    if (Vcb->superblock.generation - 1 == Vcb->superblock.cache_generation) {
+    if (Vcb->free_space_root) {
+        Status = load_free_space_tree(Vcb, c, Irp);
+        
+        if (!NT_SUCCESS(Status) && Status != STATUS_NOT_FOUND) {
+            ERR("load_free_space_tree returned %08x\n", Status);
+            return Status;
+        }
+        
+        if (Status == STATUS_NOT_FOUND) {
+            // regenerate it from the extent tree, and make sure the missing entries get written at the next flush
+            if (!Vcb->readonly && !c->list_entry_changed.Flink)
+                InsertTailList(&Vcb->chunks_changed, &c->list_entry_changed);
+        } else
+            compact_space(Vcb, c);
+    } else if (Vcb->superblock.generation - 1 == Vcb->superblock.cache_generation) {
         Status = load_stored_free_space_cache(Vcb, c, Irp);
         
         if (!NT_SUCCESS(Status) && Status != STATUS_NOT_FOUND) {
@@ -514,7 +1134,7 @@ NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp) {
                     s->size = tp.item->key.obj_id - lastaddr;
                     InsertTailList(&c->space, &s->list_entry);
                     
-                    order_space_entry(s, &c->space_size);
+                    space_tree_insert(&c->space_tree, s);
                     
                     TRACE("(%llx,%llx)\n", s->address, s->size);
                 }
@@ -542,15 +1162,17 @@ NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp) {
             s->size = c->offset + c->chunk_item->size - lastaddr;
             InsertTailList(&c->space, &s->list_entry);
             
-            order_space_entry(s, &c->space_size);
+            space_tree_insert(&c->space_tree, s);
             
             TRACE("(%llx,%llx)\n", s->address, s->size);
         }
+        
+        compact_space(Vcb, c);
     }
     
-//     le = c->space_size.Flink;
-//     while (le != &c->space_size) {
-//         space* s = CONTAINING_RECORD(le, space, list_entry_size);
+//     le = c->space.Flink;
+//     while (le != &c->space) {
+//         space* s = CONTAINING_RECORD(le, space, list_entry);
 //         
 //         ERR("(%llx, %llx)\n", s->address, s->size);
 //         
@@ -561,6 +1183,46 @@ NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp) {
     return STATUS_SUCCESS;
 }
 
+// Rather than reading every chunk's free space at mount, which takes a long time on a big volume, we
+// wait until we want to allocate from it. Callers should have c->lock held exclusively.
+NTSTATUS load_cache_chunk(device_extension* Vcb, chunk* c, PIRP Irp) {
+    LARGE_INTEGER time1, time2, freq;
+    LIST_ENTRY* le;
+    NTSTATUS Status;
+    
+    if (c->cache_loaded)
+        return STATUS_SUCCESS;
+    
+    time1 = KeQueryPerformanceCounter(&freq);
+    
+    Status = load_free_space_cache(Vcb, c, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("load_free_space_cache returned %08x\n", Status);
+        return Status;
+    }
+    
+    protect_superblocks(Vcb, c);
+    
+    // Anything freed before we got here isn't in the extent tree any more, but mustn't be reused
+    // until the transaction has been committed.
+    le = c->deleting.Flink;
+    while (le != &c->deleting) {
+        space* s = CONTAINING_RECORD(le, space, list_entry);
+        
+        space_list_subtract(Vcb, c, FALSE, s->address, s->size, NULL);
+        
+        le = le->Flink;
+    }
+    
+    c->cache_loaded = TRUE;
+    
+    time2 = KeQueryPerformanceCounter(NULL);
+    
+    TRACE("loaded free space for chunk %llx in %llu us\n", c->offset, (time2.QuadPart - time1.QuadPart) * 1000000 / freq.QuadPart);
+    
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS insert_cache_extent(fcb* fcb, UINT64 start, UINT64 length, LIST_ENTRY* rollback) {
     LIST_ENTRY* le = fcb->Vcb->chunks.Flink;
     chunk* c;
@@ -616,10 +1278,9 @@ static NTSTATUS insert_cache_extent(fcb* fcb, UINT64 start, UINT64 length, LIST_
 static NTSTATUS allocate_cache_chunk(device_extension* Vcb, chunk* c, BOOL* changed, PIRP Irp, LIST_ENTRY* rollback) {
     LIST_ENTRY* le;
     NTSTATUS Status;
-    UINT64 num_entries, new_cache_size, i;
+    UINT64 num_entries, num_bitmaps, new_cache_size, i;
     UINT32 num_sectors;
     
-    // FIXME - also do bitmaps
     // FIXME - make sure this works when sector_size is not 4096
     
     *changed = FALSE;
@@ -647,7 +1308,19 @@ static NTSTATUS allocate_cache_chunk(device_extension* Vcb, chunk* c, BOOL* chan
         }
     }
     
-    new_cache_size = sizeof(UINT64) + (num_entries * sizeof(FREE_SPACE_ENTRY));
+    num_bitmaps = 0;
+    
+    le = c->bitmaps.Flink;
+    while (le != &c->bitmaps) {
+        num_bitmaps++;
+        
+        le = le->Flink;
+    }
+    
+    // each bitmap has an entry, followed later on by a sector of its own
+    num_entries += num_bitmaps;
+    
+    new_cache_size = sizeof(UINT64) + (num_entries * sizeof(FREE_SPACE_ENTRY)) + (num_bitmaps * Vcb->superblock.sector_size);
     
     num_sectors = sector_align(new_cache_size, Vcb->superblock.sector_size) / Vcb->superblock.sector_size;
     num_sectors = sector_align(num_sectors, CACHE_INCREMENTS);
@@ -662,6 +1335,9 @@ static NTSTATUS allocate_cache_chunk(device_extension* Vcb, chunk* c, BOOL* chan
         new_cache_size += sizeof(FREE_SPACE_ENTRY);
     }
     
+    if (num_bitmaps > 0)
+        new_cache_size = sector_align(new_cache_size, Vcb->superblock.sector_size) + (num_bitmaps * Vcb->superblock.sector_size);
+    
     new_cache_size = sector_align(new_cache_size, CACHE_INCREMENTS * Vcb->superblock.sector_size);
     
     TRACE("chunk %llx: cache_size = %llx, new_cache_size = %llx\n", c->offset, c->cache->inode_item.st_size, new_cache_size);
@@ -787,7 +1463,7 @@ static NTSTATUS allocate_cache_chunk(device_extension* Vcb, chunk* c, BOOL* chan
             return STATUS_INTERNAL_ERROR;
         }
         
-        tp.tree->write = TRUE;
+        mark_tree_dirty(tp.tree);
 
         // add new extent
         
@@ -839,7 +1515,7 @@ static NTSTATUS allocate_cache_chunk(device_extension* Vcb, chunk* c, BOOL* chan
                 return STATUS_INTERNAL_ERROR;
             }
             
-            tp.tree->write = TRUE;
+            mark_tree_dirty(tp.tree);
         }
 
         searchkey.obj_id = FREE_SPACE_CACHE_ID;
@@ -862,7 +1538,7 @@ static NTSTATUS allocate_cache_chunk(device_extension* Vcb, chunk* c, BOOL* chan
             return STATUS_INTERNAL_ERROR;
         }
         
-        tp.tree->write = TRUE;
+        mark_tree_dirty(tp.tree);
     }
     
     // FIXME - reduce inode allocation if cache is shrinking. Make sure to avoid infinite write loops
@@ -881,6 +1557,14 @@ NTSTATUS allocate_cache(device_extension* Vcb, BOOL* changed, PIRP Irp, LIST_ENT
         chunk* c = CONTAINING_RECORD(le, chunk, list_entry_changed);
 
         ExAcquireResourceExclusiveLite(&c->lock, TRUE);
+        
+        Status = load_cache_chunk(Vcb, c, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_cache_chunk(%llx) returned %08x\n", c->offset, Status);
+            ExReleaseResourceLite(&c->lock);
+            return Status;
+        }
+        
         Status = allocate_cache_chunk(Vcb, c, &b, Irp, rollback);
         ExReleaseResourceLite(&c->lock);
         
@@ -898,7 +1582,7 @@ NTSTATUS allocate_cache(device_extension* Vcb, BOOL* changed, PIRP Irp, LIST_ENT
     return STATUS_SUCCESS;
 }
 
-static void add_rollback_space(LIST_ENTRY* rollback, BOOL add, LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UINT64 length, chunk* c) {
+static void add_rollback_space(LIST_ENTRY* rollback, BOOL add, LIST_ENTRY* list, space** tree, UINT64 address, UINT64 length, chunk* c) {
     rollback_space* rs;
     
     rs = ExAllocatePoolWithTag(PagedPool, sizeof(rollback_space), ALLOC_TAG);
@@ -908,7 +1592,7 @@ static void add_rollback_space(LIST_ENTRY* rollback, BOOL add, LIST_ENTRY* list,
     }
     
     rs->list = list;
-    rs->list_size = list_size;
+    rs->tree = tree;
     rs->address = address;
     rs->length = length;
     rs->chunk = c;
@@ -916,7 +1600,7 @@ static void add_rollback_space(LIST_ENTRY* rollback, BOOL add, LIST_ENTRY* list,
     add_rollback(rollback, add ? ROLLBACK_ADD_SPACE : ROLLBACK_SUBTRACT_SPACE, rs);
 }
 
-void _space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func) {
+void _space_list_add2(LIST_ENTRY* list, space** tree, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func) {
     LIST_ENTRY* le;
     space *s, *s2;
     
@@ -936,16 +1620,25 @@ void _space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, U
         s->size = length;
         InsertTailList(list, &s->list_entry);
         
-        if (list_size)
-            InsertTailList(list_size, &s->list_entry_size);
+        if (tree)
+            space_tree_insert(tree, s);
         
         if (rollback)
-            add_rollback_space(rollback, TRUE, list, list_size, address, length, c);
+            add_rollback_space(rollback, TRUE, list, tree, address, length, c);
         
         return;
     }
     
     le = list->Flink;
+    
+    // entries before the last one starting at or before address can't touch the new one
+    if (tree) {
+        s2 = space_tree_find(*tree, address);
+        
+        if (s2)
+            le = &s2->list_entry;
+    }
+    
     while (le != list) {
         s2 = CONTAINING_RECORD(le, space, list_entry);
         
@@ -957,7 +1650,7 @@ void _space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, U
         if (address <= s2->address && address + length >= s2->address + s2->size) {
             if (address < s2->address) {
                 if (rollback)
-                    add_rollback_space(rollback, TRUE, list, list_size, address, s2->address - address, c);
+                    add_rollback_space(rollback, TRUE, list, tree, address, s2->address - address, c);
                 
                 s2->size += s2->address - address;
                 s2->address = address;
@@ -971,8 +1664,8 @@ void _space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, U
                         
                         RemoveEntryList(&s3->list_entry);
                         
-                        if (list_size)
-                            RemoveEntryList(&s3->list_entry_size);
+                        if (tree)
+                            space_tree_remove(tree, s3);
                         
                         ExFreePool(s3);
                     } else
@@ -982,7 +1675,7 @@ void _space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, U
             
             if (length > s2->size) {
                 if (rollback)
-                    add_rollback_space(rollback, TRUE, list, list_size, s2->address + s2->size, address + length - s2->address - s2->size, c);
+                    add_rollback_space(rollback, TRUE, list, tree, s2->address + s2->size, address + length - s2->address - s2->size, c);
                 
                 s2->size = length;
                 
@@ -994,8 +1687,8 @@ void _space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, U
                         
                         RemoveEntryList(&s3->list_entry);
                         
-                        if (list_size)
-                            RemoveEntryList(&s3->list_entry_size);
+                        if (tree)
+                            space_tree_remove(tree, s3);
                         
                         ExFreePool(s3);
                     } else
@@ -1003,10 +1696,8 @@ void _space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, U
                 }
             }
             
-            if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
-                order_space_entry(s2, list_size);
-            }
+            if (tree)
+                space_tree_update(s2);
             
             return;
         }
@@ -1014,7 +1705,7 @@ void _space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, U
         // new entry overlaps start of old one
         if (address < s2->address && address + length >= s2->address) {
             if (rollback)
-                add_rollback_space(rollback, TRUE, list, list_size, address, s2->address - address, c);
+                add_rollback_space(rollback, TRUE, list, tree, address, s2->address - address, c);
             
             s2->size += s2->address - address;
             s2->address = address;
@@ -1028,18 +1719,16 @@ void _space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, U
                     
                     RemoveEntryList(&s3->list_entry);
                     
-                    if (list_size)
-                        RemoveEntryList(&s3->list_entry_size);
+                    if (tree)
+                        space_tree_remove(tree, s3);
                     
                     ExFreePool(s3);
                 } else
                     break;
             }
             
-            if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
-                order_space_entry(s2, list_size);
-            }
+            if (tree)
+                space_tree_update(s2);
             
             return;
         }
@@ -1047,7 +1736,7 @@ void _space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, U
         // new entry overlaps end of old one
         if (address <= s2->address + s2->size && address + length > s2->address + s2->size) {
             if (rollback)
-                add_rollback_space(rollback, TRUE, list, list_size, address, s2->address + s2->size - address, c);
+                add_rollback_space(rollback, TRUE, list, tree, address, s2->address + s2->size - address, c);
             
             s2->size = address + length - s2->address;
             
@@ -1059,18 +1748,16 @@ void _space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, U
                     
                     RemoveEntryList(&s3->list_entry);
                     
-                    if (list_size)
-                        RemoveEntryList(&s3->list_entry_size);
+                    if (tree)
+                        space_tree_remove(tree, s3);
                     
                     ExFreePool(s3);
                 } else
                     break;
             }
             
-            if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
-                order_space_entry(s2, list_size);
-            }
+            if (tree)
+                space_tree_update(s2);
             
             return;
         }
@@ -1085,14 +1772,14 @@ void _space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, U
             }
             
             if (rollback)
-                add_rollback_space(rollback, TRUE, list, list_size, address, length, c);
+                add_rollback_space(rollback, TRUE, list, tree, address, length, c);
             
             s->address = address;
             s->size = length;
             InsertHeadList(s2->list_entry.Blink, &s->list_entry);
             
-            if (list_size)
-                order_space_entry(s, list_size);
+            if (tree)
+                space_tree_insert(tree, s);
             
             return;
         }
@@ -1104,10 +1791,8 @@ void _space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, U
     if (s2->address + s2->size == address) {
         s2->size += length;
         
-        if (list_size) {
-            RemoveEntryList(&s2->list_entry_size);
-            order_space_entry(s2, list_size);
-        }
+        if (tree)
+            space_tree_update(s2);
         
         return;
     }
@@ -1124,22 +1809,22 @@ void _space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, U
     s->size = length;
     InsertTailList(list, &s->list_entry);
     
-    if (list_size)
-        order_space_entry(s, list_size);
+    if (tree)
+        space_tree_insert(tree, s);
     
     if (rollback)
-        add_rollback_space(rollback, TRUE, list, list_size, address, length, c);
+        add_rollback_space(rollback, TRUE, list, tree, address, length, c);
 }
 
-static void space_list_merge(LIST_ENTRY* spacelist, LIST_ENTRY* spacelist_size, LIST_ENTRY* deleting) {
+static void space_list_merge(device_extension* Vcb, chunk* c) {
     LIST_ENTRY* le;
     
-    if (!IsListEmpty(deleting)) {
-        le = deleting->Flink;
-        while (le != deleting) {
+    if (!IsListEmpty(&c->deleting)) {
+        le = c->deleting.Flink;
+        while (le != &c->deleting) {
             space* s = CONTAINING_RECORD(le, space, list_entry);
             
-            space_list_add2(spacelist, spacelist_size, s->address, s->size, NULL);
+            space_list_add(Vcb, c, FALSE, s->address, s->size, NULL);
             
             le = le->Flink;
         }
@@ -1153,11 +1838,11 @@ static NTSTATUS update_chunk_cache(device_extension* Vcb, chunk* c, BTRFS_TIME*
     FREE_SPACE_ITEM* fsi;
     void* data;
     FREE_SPACE_ENTRY* fse;
-    UINT64 num_entries, num_sectors, *cachegen, i, off;
+    UINT64 num_entries, num_bitmaps, num_sectors, *cachegen, i, off;
     UINT32* checksums;
     LIST_ENTRY* le;
     
-    space_list_merge(&c->space, &c->space_size, &c->deleting);
+    space_list_merge(Vcb, c);
     
     data = ExAllocatePoolWithTag(NonPagedPool, c->cache->inode_item.st_size, ALLOC_TAG);
     if (!data) {
@@ -1189,6 +1874,53 @@ static NTSTATUS update_chunk_cache(device_extension* Vcb, chunk* c, BTRFS_TIME*
         
         le = le->Flink;
     }
+    
+    num_bitmaps = 0;
+    
+    le = c->bitmaps.Flink;
+    while (le != &c->bitmaps) {
+        space_bitmap* b = CONTAINING_RECORD(le, space_bitmap, list_entry);
+        
+        if ((off + sizeof(FREE_SPACE_ENTRY)) / Vcb->superblock.sector_size != off / Vcb->superblock.sector_size)
+            off = sector_align(off, Vcb->superblock.sector_size);
+        
+        fse = (FREE_SPACE_ENTRY*)((UINT8*)data + off);
+        
+        fse->offset = b->address;
+        fse->size = (UINT64)b->free * Vcb->superblock.sector_size; // free bytes in the bitmap, not the length it covers
+        fse->type = FREE_SPACE_BITMAP;
+        num_entries++;
+        num_bitmaps++;
+        
+        off += sizeof(FREE_SPACE_ENTRY);
+        
+        le = le->Flink;
+    }
+    
+    // the bitmaps themselves follow the entries, one per sector
+    
+    if (num_bitmaps > 0) {
+        off = sector_align(off, Vcb->superblock.sector_size);
+        
+        if (off + (num_bitmaps * Vcb->superblock.sector_size) > c->cache->inode_item.st_size) {
+            ERR("free space cache for %llx is too small for %llx bitmaps\n", c->offset, num_bitmaps);
+            ExFreePool(data);
+            return STATUS_INTERNAL_ERROR;
+        }
+        
+        le = c->bitmaps.Flink;
+        while (le != &c->bitmaps) {
+            space_bitmap* b = CONTAINING_RECORD(le, space_bitmap, list_entry);
+            
+            RtlCopyMemory((UINT8*)data + off, b->bits, Vcb->superblock.sector_size);
+            off += Vcb->superblock.sector_size;
+            
+            le = le->Flink;
+        }
+    }
+    
+    TRACE("chunk %llx: %llx space entries, %llx bitmaps, using %llx bytes\n", c->offset, num_entries - num_bitmaps, num_bitmaps,
+          ((num_entries - num_bitmaps) * sizeof(space)) + (num_bitmaps * (sizeof(space_bitmap) + Vcb->superblock.sector_size)));
 
     // update INODE_ITEM
     
@@ -1225,7 +1957,7 @@ static NTSTATUS update_chunk_cache(device_extension* Vcb, chunk* c, BTRFS_TIME*
     
     fsi->generation = Vcb->superblock.generation;
     fsi->num_entries = num_entries;
-    fsi->num_bitmaps = 0;
+    fsi->num_bitmaps = num_bitmaps;
     
     // set cache generation
     
@@ -1288,6 +2020,340 @@ NTSTATUS update_chunk_caches(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollba
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS append_space_entry(LIST_ENTRY* list, UINT64 address, UINT64 length) {
+    if (!IsListEmpty(list)) {
+        space* s = CONTAINING_RECORD(list->Blink, space, list_entry);
+        
+        if (s->address + s->size == address) {
+            s->size += length;
+            return STATUS_SUCCESS;
+        }
+    }
+    
+    return add_space_entry(list, NULL, address, length);
+}
+
+static void free_space_entries(LIST_ENTRY* list) {
+    while (!IsListEmpty(list)) {
+        space* s = CONTAINING_RECORD(RemoveHeadList(list), space, list_entry);
+        
+        ExFreePool(s);
+    }
+}
+
+// Works out what the free space tree ought to say about the chunk - everything free at the end of the
+// transaction, i.e. including what's been freed during it.
+static NTSTATUS get_chunk_free_space(device_extension* Vcb, chunk* c, LIST_ENTRY* list) {
+    LIST_ENTRY *le, *le2;
+    NTSTATUS Status;
+    
+    le = c->space.Flink;
+    le2 = c->bitmaps.Flink;
+    
+    while (le != &c->space || le2 != &c->bitmaps) {
+        space* s = le != &c->space ? CONTAINING_RECORD(le, space, list_entry) : NULL;
+        space_bitmap* b = le2 != &c->bitmaps ? CONTAINING_RECORD(le2, space_bitmap, list_entry) : NULL;
+        
+        if (b && (!s || b->address < s->address)) {
+            ULONG runlength, index, start = 0;
+            
+            while ((runlength = find_bitmap_run(b->bits, start, Vcb->superblock.sector_size * 8, TRUE, &index)) > 0) {
+                Status = append_space_entry(list, b->address + ((UINT64)index * Vcb->superblock.sector_size), (UINT64)runlength * Vcb->superblock.sector_size);
+                if (!NT_SUCCESS(Status))
+                    return Status;
+                
+                start = index + runlength;
+            }
+            
+            le2 = le2->Flink;
+        } else {
+            Status = append_space_entry(list, s->address, s->size);
+            if (!NT_SUCCESS(Status))
+                return Status;
+            
+            le = le->Flink;
+        }
+    }
+    
+    le = c->deleting.Flink;
+    while (le != &c->deleting) {
+        space* s = CONTAINING_RECORD(le, space, list_entry);
+        
+        space_list_add2(list, NULL, s->address, s->size, NULL);
+        
+        le = le->Flink;
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS delete_free_space_tree_item(device_extension* Vcb, UINT64 obj_id, UINT8 obj_type, UINT64 offset, PIRP Irp, LIST_ENTRY* rollback) {
+    KEY searchkey;
+    traverse_ptr tp;
+    NTSTATUS Status;
+    
+    searchkey.obj_id = obj_id;
+    searchkey.obj_type = obj_type;
+    searchkey.offset = offset;
+    
+    Status = find_item(Vcb, Vcb->free_space_root, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("error - find_item returned %08x\n", Status);
+        return Status;
+    }
+    
+    if (keycmp(&tp.item->key, &searchkey)) {
+        ERR("could not find (%llx,%x,%llx) in free space tree\n", obj_id, obj_type, offset);
+        return STATUS_INTERNAL_ERROR;
+    }
+    
+    delete_tree_item(Vcb, &tp, rollback);
+    
+    return STATUS_SUCCESS;
+}
+
+// Brings the free space tree's entries for a chunk into line with what we have in memory, only touching
+// the items which have actually changed. Chunks which were using bitmaps get converted back to extents.
+static NTSTATUS update_free_space_tree_chunk(device_extension* Vcb, chunk* c, BOOL* changed, PIRP Irp, LIST_ENTRY* rollback) {
+    LIST_ENTRY wanted, existing, bitmaps, *le, *le2;
+    traverse_ptr tp, next_tp;
+    KEY searchkey;
+    FREE_SPACE_INFO* fsi;
+    UINT32 count;
+    BOOL b, info_ok;
+    NTSTATUS Status;
+    
+    *changed = FALSE;
+    
+    InitializeListHead(&wanted);
+    InitializeListHead(&existing);
+    InitializeListHead(&bitmaps);
+    
+    ExAcquireResourceExclusiveLite(&c->lock, TRUE);
+    
+    Status = load_cache_chunk(Vcb, c, Irp);
+    if (NT_SUCCESS(Status))
+        Status = get_chunk_free_space(Vcb, c, &wanted);
+    
+    ExReleaseResourceLite(&c->lock);
+    
+    if (!NT_SUCCESS(Status)) {
+        ERR("get_chunk_free_space returned %08x\n", Status);
+        goto end;
+    }
+    
+    searchkey.obj_id = c->offset;
+    searchkey.obj_type = TYPE_FREE_SPACE_INFO;
+    searchkey.offset = c->chunk_item->size;
+    
+    Status = find_item(Vcb, Vcb->free_space_root, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("error - find_item returned %08x\n", Status);
+        goto end;
+    }
+    
+    count = 0;
+    le = wanted.Flink;
+    while (le != &wanted) {
+        count++;
+        le = le->Flink;
+    }
+    
+    info_ok = FALSE;
+    
+    if (!keycmp(&tp.item->key, &searchkey)) {
+        if (tp.item->size >= sizeof(FREE_SPACE_INFO)) {
+            fsi = (FREE_SPACE_INFO*)tp.item->data;
+            info_ok = fsi->count == count && fsi->flags == 0;
+        }
+        
+        if (!info_ok)
+            delete_tree_item(Vcb, &tp, rollback);
+    }
+    
+    if (!info_ok) {
+        fsi = ExAllocatePoolWithTag(PagedPool, sizeof(FREE_SPACE_INFO), ALLOC_TAG);
+        if (!fsi) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+        
+        fsi->count = count;
+        fsi->flags = 0;
+        
+        if (!insert_tree_item(Vcb, Vcb->free_space_root, c->offset, TYPE_FREE_SPACE_INFO, c->chunk_item->size, fsi, sizeof(FREE_SPACE_INFO), NULL, Irp, rollback)) {
+            ERR("insert_tree_item failed\n");
+            ExFreePool(fsi);
+            Status = STATUS_INTERNAL_ERROR;
+            goto end;
+        }
+        
+        *changed = TRUE;
+    }
+    
+    // gather what's already there
+    
+    searchkey.obj_type = TYPE_FREE_SPACE_EXTENT;
+    searchkey.offset = 0;
+    
+    Status = find_item(Vcb, Vcb->free_space_root, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("error - find_item returned %08x\n", Status);
+        goto end;
+    }
+    
+    do {
+        if (tp.item->key.obj_id >= c->offset + c->chunk_item->size)
+            break;
+        
+        if (tp.item->key.obj_id >= c->offset) {
+            if (tp.item->key.obj_type == TYPE_FREE_SPACE_EXTENT)
+                Status = add_space_entry(&existing, NULL, tp.item->key.obj_id, tp.item->key.offset);
+            else if (tp.item->key.obj_type == TYPE_FREE_SPACE_BITMAP)
+                Status = add_space_entry(&bitmaps, NULL, tp.item->key.obj_id, tp.item->key.offset);
+            
+            if (!NT_SUCCESS(Status)) {
+                ERR("add_space_entry returned %08x\n", Status);
+                goto end;
+            }
+        }
+        
+        b = find_next_item(Vcb, &tp, &next_tp, FALSE, Irp);
+        if (b)
+            tp = next_tp;
+    } while (b);
+    
+    while (!IsListEmpty(&bitmaps)) {
+        space* s = CONTAINING_RECORD(RemoveHeadList(&bitmaps), space, list_entry);
+        
+        Status = delete_free_space_tree_item(Vcb, s->address, TYPE_FREE_SPACE_BITMAP, s->size, Irp, rollback);
+        ExFreePool(s);
+        
+        if (!NT_SUCCESS(Status)) {
+            ERR("delete_free_space_tree_item returned %08x\n", Status);
+            goto end;
+        }
+        
+        *changed = TRUE;
+    }
+    
+    // Both lists are sorted, so we can walk them together. Anything in both stays as it is.
+    
+    le = existing.Flink;
+    le2 = wanted.Flink;
+    
+    while (le != &existing || le2 != &wanted) {
+        space* s = le != &existing ? CONTAINING_RECORD(le, space, list_entry) : NULL;
+        space* s2 = le2 != &wanted ? CONTAINING_RECORD(le2, space, list_entry) : NULL;
+        
+        if (s && s2 && s->address == s2->address && s->size == s2->size) {
+            le = le->Flink;
+            le2 = le2->Flink;
+        } else if (s && (!s2 || s->address <= s2->address)) {
+            Status = delete_free_space_tree_item(Vcb, s->address, TYPE_FREE_SPACE_EXTENT, s->size, Irp, rollback);
+            if (!NT_SUCCESS(Status)) {
+                ERR("delete_free_space_tree_item returned %08x\n", Status);
+                goto end;
+            }
+            
+            *changed = TRUE;
+            le = le->Flink;
+        } else {
+            if (!insert_tree_item(Vcb, Vcb->free_space_root, s2->address, TYPE_FREE_SPACE_EXTENT, s2->size, NULL, 0, NULL, Irp, rollback)) {
+                ERR("insert_tree_item failed\n");
+                Status = STATUS_INTERNAL_ERROR;
+                goto end;
+            }
+            
+            *changed = TRUE;
+            le2 = le2->Flink;
+        }
+    }
+    
+    Status = STATUS_SUCCESS;
+    
+end:
+    free_space_entries(&wanted);
+    free_space_entries(&existing);
+    free_space_entries(&bitmaps);
+    
+    return Status;
+}
+
+NTSTATUS update_free_space_tree(device_extension* Vcb, BOOL* changed, PIRP Irp, LIST_ENTRY* rollback) {
+    LIST_ENTRY* le = Vcb->chunks_changed.Flink;
+    NTSTATUS Status;
+    
+    *changed = FALSE;
+    
+    while (le != &Vcb->chunks_changed) {
+        BOOL b;
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry_changed);
+        
+        Status = update_free_space_tree_chunk(Vcb, c, &b, Irp, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("update_free_space_tree_chunk(%llx) returned %08x\n", c->offset, Status);
+            return Status;
+        }
+        
+        if (b)
+            *changed = TRUE;
+        
+        le = le->Flink;
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+// With the free space tree there's no cache to write, but what was freed during the transaction still
+// needs to become available once it's committed.
+void merge_deleted_space(device_extension* Vcb) {
+    LIST_ENTRY* le = Vcb->chunks_changed.Flink;
+    
+    while (le != &Vcb->chunks_changed) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry_changed);
+        
+        ExAcquireResourceExclusiveLite(&c->lock, TRUE);
+        space_list_merge(Vcb, c);
+        ExReleaseResourceLite(&c->lock);
+        
+        le = le->Flink;
+    }
+}
+
+NTSTATUS remove_free_space_tree_chunk(device_extension* Vcb, chunk* c, PIRP Irp, LIST_ENTRY* rollback) {
+    KEY searchkey;
+    traverse_ptr tp, next_tp;
+    BOOL b;
+    NTSTATUS Status;
+    
+    searchkey.obj_id = c->offset;
+    searchkey.obj_type = 0;
+    searchkey.offset = 0;
+    
+    Status = find_item(Vcb, Vcb->free_space_root, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("error - find_item returned %08x\n", Status);
+        return Status;
+    }
+    
+    do {
+        if (tp.item->key.obj_id >= c->offset + c->chunk_item->size)
+            break;
+        
+        if (tp.item->key.obj_id >= c->offset && (tp.item->key.obj_type == TYPE_FREE_SPACE_INFO ||
+            tp.item->key.obj_type == TYPE_FREE_SPACE_EXTENT || tp.item->key.obj_type == TYPE_FREE_SPACE_BITMAP))
+            delete_tree_item(Vcb, &tp, rollback);
+        
+        b = find_next_item(Vcb, &tp, &next_tp, FALSE, Irp);
+        if (b)
+            tp = next_tp;
+    } while (b);
+    
+    return STATUS_SUCCESS;
+}
+
 void _space_list_add(device_extension* Vcb, chunk* c, BOOL deleting, UINT64 address, UINT64 length, LIST_ENTRY* rollback, const char* func) {
     LIST_ENTRY* list;
     
@@ -1298,10 +2364,29 @@ void _space_list_add(device_extension* Vcb, chunk* c, BOOL deleting, UINT64 addr
     if (!c->list_entry_changed.Flink)
         InsertTailList(&Vcb->chunks_changed, &c->list_entry_changed);
     
-    _space_list_add2(list, deleting ? NULL : &c->space_size, address, length, c, rollback, func);
+    if (deleting || IsListEmpty(&c->bitmaps)) {
+        _space_list_add2(list, deleting ? NULL : &c->space_tree, address, length, c, rollback, func);
+        return;
+    }
+    
+    while (length > 0) {
+        space_bitmap* b = find_space_bitmap(Vcb, c, address);
+        UINT64 seglen;
+        
+        if (b) {
+            seglen = min(length, b->address + space_bitmap_length(Vcb) - address);
+            space_bitmap_add(Vcb, c, b, address, seglen, rollback, func);
+        } else {
+            seglen = min(length, next_space_bitmap(c, address) - address);
+            _space_list_add2(list, &c->space_tree, address, seglen, c, rollback, func);
+        }
+        
+        address += seglen;
+        length -= seglen;
+    }
 }
 
-void _space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func) {
+void _space_list_subtract2(LIST_ENTRY* list, space** tree, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func) {
     LIST_ENTRY *le, *le2;
     space *s, *s2;
     
@@ -1313,6 +2398,14 @@ void _space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 addre
         return;
     
     le = list->Flink;
+    
+    if (tree) {
+        s2 = space_tree_find(*tree, address);
+        
+        if (s2)
+            le = &s2->list_entry;
+    }
+    
     while (le != list) {
         s2 = CONTAINING_RECORD(le, space, list_entry);
         le2 = le->Flink;
@@ -1322,18 +2415,18 @@ void _space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 addre
         
         if (s2->address >= address && s2->address + s2->size <= address + length) { // remove entry entirely
             if (rollback)
-                add_rollback_space(rollback, FALSE, list, list_size, s2->address, s2->size, c);
+                add_rollback_space(rollback, FALSE, list, tree, s2->address, s2->size, c);
             
             RemoveEntryList(&s2->list_entry);
             
-            if (list_size)
-                RemoveEntryList(&s2->list_entry_size);
+            if (tree)
+                space_tree_remove(tree, s2);
             
             ExFreePool(s2);
         } else if (address + length > s2->address && address + length < s2->address + s2->size) {
             if (address > s2->address) { // cut out hole
                 if (rollback)
-                    add_rollback_space(rollback, FALSE, list, list_size, address, length, c);
+                    add_rollback_space(rollback, FALSE, list, tree, address, length, c);
                 
                 s = ExAllocatePoolWithTag(PagedPool, sizeof(space), ALLOC_TAG);
 
@@ -1349,35 +2442,30 @@ void _space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 addre
                 s2->size = s2->address + s2->size - address - length;
                 s2->address = address + length;
                 
-                if (list_size) {
-                    RemoveEntryList(&s2->list_entry_size);
-                    order_space_entry(s2, list_size);
-                    order_space_entry(s, list_size);
+                if (tree) {
+                    space_tree_update(s2);
+                    space_tree_insert(tree, s);
                 }
                 
                 return;
             } else { // remove start of entry
                 if (rollback)
-                    add_rollback_space(rollback, FALSE, list, list_size, s2->address, address + length - s2->address, c);
+                    add_rollback_space(rollback, FALSE, list, tree, s2->address, address + length - s2->address, c);
                 
                 s2->size -= address + length - s2->address;
                 s2->address = address + length;
                 
-                if (list_size) {
-                    RemoveEntryList(&s2->list_entry_size);
-                    order_space_entry(s2, list_size);
-                }
+                if (tree)
+                    space_tree_update(s2);
             }
         } else if (address > s2->address && address < s2->address + s2->size) { // remove end of entry
             if (rollback)
-                add_rollback_space(rollback, FALSE, list, list_size, address, s2->address + s2->size - address, c);
+                add_rollback_space(rollback, FALSE, list, tree, address, s2->address + s2->size - address, c);
             
             s2->size = address - s2->address;
             
-            if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
-                order_space_entry(s2, list_size);
-            }
+            if (tree)
+                space_tree_update(s2);
         }
         
         le = le2;
@@ -1392,5 +2480,27 @@ void _space_list_subtract(device_extension* Vcb, chunk* c, BOOL deleting, UINT64
     if (!c->list_entry_changed.Flink)
         InsertTailList(&Vcb->chunks_changed, &c->list_entry_changed);
     
-    _space_list_subtract2(list, deleting ? NULL : &c->space_size, address, length, c, rollback, func);
+    if (deleting) {
+        _space_list_subtract2(list, NULL, address, length, c, rollback, func);
+        return;
+    }
+    
+    while (length > 0) {
+        space_bitmap* b = find_space_bitmap(Vcb, c, address);
+        UINT64 seglen;
+        
+        if (b) {
+            seglen = min(length, b->address + space_bitmap_length(Vcb) - address);
+            space_bitmap_subtract(Vcb, c, b, address, seglen, rollback);
+        } else {
+            seglen = min(length, next_space_bitmap(c, address) - address);
+            _space_list_subtract2(list, &c->space_tree, address, seglen, c, rollback, func);
+            
+            // cutting holes in space entries is what fragments a chunk, so see if it's time to switch to a bitmap
+            check_space_density(Vcb, c, address);
+        }
+        
+        address += seglen;
+        length -= seglen;
+    }
 }
@@ -181,6 +181,7 @@ static NTSTATUS snapshot_tree_copy(device_extension* Vcb, UINT64 addr, root* sub
     Status = write_data(Vcb, t.new_address, buf, FALSE, Vcb->superblock.node_size, wtc, NULL, NULL);
     if (!NT_SUCCESS(Status)) {
         ERR("write_data returned %08x\n", Status);
+        free_write_data_stripes(wtc);
         goto end;
     }
     
@@ -409,7 +410,7 @@ static NTSTATUS do_create_snapshot(device_extension* Vcb, PFILE_OBJECT parent, f
         goto end;
     }
     
-    subvol->treeholder.tree->write = TRUE;
+    mark_tree_dirty(subvol->treeholder.tree);
     
     // create fileref for entry in other subvolume
     
@@ -1053,8 +1054,9 @@ static NTSTATUS get_inode_info(PFILE_OBJECT FileObject, void* data, ULONG length
     btrfs_inode_info* bii = data;
     fcb* fcb;
     ccb* ccb;
+    UINT64 zstd_size = 0;
     
-    if (length < sizeof(btrfs_inode_info))
+    if (length < offsetof(btrfs_inode_info, disk_size_zstd))
         return STATUS_BUFFER_OVERFLOW;
     
     if (!FileObject)
@@ -1113,6 +1115,8 @@ static NTSTATUS get_inode_info(PFILE_OBJECT FileObject, void* data, ULONG length
                             bii->disk_size[1] += ed2->size;
                         } else if (ext->data->compression == BTRFS_COMPRESSION_LZO) {
                             bii->disk_size[2] += ed2->size;
+                        } else if (ext->data->compression == BTRFS_COMPRESSION_ZSTD) {
+                            zstd_size += ed2->size;
                         }
                     }
                 }
@@ -1122,6 +1126,9 @@ static NTSTATUS get_inode_info(PFILE_OBJECT FileObject, void* data, ULONG length
         }
     }
     
+    if (length >= sizeof(btrfs_inode_info))
+        bii->disk_size_zstd = zstd_size;
+    
     ExReleaseResourceLite(fcb->Header.Resource);
     
     return STATUS_SUCCESS;
@@ -1242,6 +1249,326 @@ end:
     return Status;
 }
 
+static NTSTATUS read_compressed(device_extension* Vcb, PFILE_OBJECT FileObject, void* inbuf, ULONG inbuflen, void* outbuf, ULONG outbuflen, ULONG_PTR* retlen, PIRP Irp) {
+    btrfs_read_compressed* brc = inbuf;
+    btrfs_compressed_extent* bce = outbuf;
+    NTSTATUS Status;
+    fcb* fcb;
+    ccb* ccb;
+    LIST_ENTRY* le;
+    extent* ext = NULL;
+    EXTENT_DATA2* ed2;
+    UINT64 next;
+    UINT32* csum;
+    IO_STATUS_BLOCK iosb;
+    
+    if (!inbuf || inbuflen < sizeof(btrfs_read_compressed) || !outbuf || outbuflen < offsetof(btrfs_compressed_extent, data[0]))
+        return STATUS_INVALID_PARAMETER;
+    
+    if (!FileObject) {
+        ERR("FileObject was NULL\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    fcb = FileObject->FsContext;
+    
+    if (!fcb) {
+        ERR("FCB was NULL\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    ccb = FileObject->FsContext2;
+    
+    if (!ccb) {
+        ERR("ccb was NULL\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    if (!(ccb->access & FILE_READ_DATA)) {
+        WARN("insufficient privileges\n");
+        return STATUS_ACCESS_DENIED;
+    }
+    
+    if (fcb->type != BTRFS_TYPE_FILE || fcb->ads) {
+        WARN("FileObject did not point to a file\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+    ExAcquireResourceExclusiveLite(fcb->Header.Resource, TRUE);
+    
+    // make sure what's on disk is up to date
+    CcFlushCache(&fcb->nonpaged->segment_object, NULL, 0, &iosb);
+    
+    if (brc->offset >= fcb->inode_item.st_size) {
+        Status = STATUS_END_OF_FILE;
+        goto end;
+    }
+    
+    next = fcb->inode_item.st_size;
+    
+    le = fcb->extents.Flink;
+    while (le != &fcb->extents) {
+        extent* ext2 = CONTAINING_RECORD(le, extent, list_entry);
+        
+        if (!ext2->ignore) {
+            UINT64 len = ext2->data->type == EXTENT_TYPE_INLINE ? ext2->data->decoded_size : ((EXTENT_DATA2*)ext2->data->data)->num_bytes;
+            
+            if (ext2->offset > brc->offset) {
+                next = min(next, ext2->offset);
+                break;
+            }
+            
+            if (ext2->offset + len > brc->offset) {
+                ext = ext2;
+                break;
+            }
+        }
+        
+        le = le->Flink;
+    }
+    
+    *retlen = offsetof(btrfs_compressed_extent, data[0]);
+    
+    if (!ext) { // sparse
+        bce->offset = brc->offset;
+        bce->num_bytes = next - brc->offset;
+        bce->decoded_size = bce->num_bytes;
+        bce->extent_offset = 0;
+        bce->type = EXTENT_TYPE_REGULAR;
+        bce->compression = BTRFS_COMPRESSION_NONE;
+        bce->length = 0;
+        
+        Status = STATUS_SUCCESS;
+        goto end;
+    }
+    
+    ed2 = ext->data->type == EXTENT_TYPE_INLINE ? NULL : (EXTENT_DATA2*)ext->data->data;
+    
+    bce->offset = ext->offset;
+    bce->num_bytes = ed2 ? ed2->num_bytes : ext->data->decoded_size;
+    bce->decoded_size = ext->data->decoded_size;
+    
+    // The last extent is padded out to a whole sector - we don't count this, so the caller knows where the file ends.
+    if (ext->offset + bce->num_bytes > fcb->inode_item.st_size)
+        bce->num_bytes = fcb->inode_item.st_size - ext->offset;
+    bce->extent_offset = ed2 ? ed2->offset : 0;
+    bce->type = ext->data->type;
+    bce->compression = ext->data->compression;
+    bce->length = 0;
+    
+    // Inline extents are decompressed when they're loaded, and prealloc extents are never compressed
+    if (ext->data->type != EXTENT_TYPE_REGULAR || ext->data->compression == BTRFS_COMPRESSION_NONE) {
+        bce->compression = BTRFS_COMPRESSION_NONE;
+        Status = STATUS_SUCCESS;
+        goto end;
+    }
+    
+    bce->length = (UINT32)ed2->size;
+    
+    if (outbuflen < offsetof(btrfs_compressed_extent, data[0]) + bce->length) {
+        Status = STATUS_BUFFER_OVERFLOW;
+        goto end;
+    }
+    
+    if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
+        Status = load_csum(Vcb, ed2->address, ed2->size / Vcb->superblock.sector_size, &csum, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_csum returned %08x\n", Status);
+            goto end;
+        }
+    } else
+        csum = NULL;
+    
+    Status = read_data(Vcb, ed2->address, (UINT32)ed2->size, csum, FALSE, bce->data, NULL, Irp);
+    
+    if (csum)
+        ExFreePool(csum);
+    
+    if (!NT_SUCCESS(Status)) {
+        ERR("read_data returned %08x\n", Status);
+        goto end;
+    }
+    
+    *retlen += bce->length;
+    
+end:
+    ExReleaseResourceLite(fcb->Header.Resource);
+    ExReleaseResourceLite(&Vcb->tree_lock);
+    
+    return Status;
+}
+
+static NTSTATUS write_compressed_extent(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG length, PIRP Irp) {
+    btrfs_compressed_extent* bce = data;
+    NTSTATUS Status;
+    fcb* fcb;
+    ccb* ccb;
+    file_ref* fileref;
+    LIST_ENTRY rollback, changed_sector_list, *le;
+    LARGE_INTEGER time, offset;
+    BTRFS_TIME now;
+    IO_STATUS_BLOCK iosb;
+    UINT64 end_data;
+    
+    if (!data || length < offsetof(btrfs_compressed_extent, data[0]) || length - offsetof(btrfs_compressed_extent, data[0]) < bce->length)
+        return STATUS_INVALID_PARAMETER;
+    
+    // We only take whole extents, i.e. what FSCTL_BTRFS_READ_COMPRESSED returns for a file which hasn't been
+    // partially overwritten since. Anything else ought to be written the normal way.
+    if (bce->type != EXTENT_TYPE_REGULAR || bce->extent_offset != 0 || bce->num_bytes == 0 || bce->num_bytes > bce->decoded_size ||
+        (bce->compression != BTRFS_COMPRESSION_ZLIB && bce->compression != BTRFS_COMPRESSION_LZO && bce->compression != BTRFS_COMPRESSION_ZSTD) ||
+        bce->length == 0 || bce->length > bce->decoded_size || bce->decoded_size > COMPRESSED_EXTENT_SIZE) {
+        WARN("invalid compressed extent\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    if (bce->offset % Vcb->superblock.sector_size != 0 || bce->decoded_size % Vcb->superblock.sector_size != 0) {
+        WARN("compressed extent was not sector-aligned\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    // num_bytes can only be short of decoded_size if it's the end of the file, which it'll then become
+    if (sector_align(bce->num_bytes, Vcb->superblock.sector_size) != bce->decoded_size) {
+        WARN("compressed extent was not whole\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    if (!FileObject) {
+        ERR("FileObject was NULL\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    fcb = FileObject->FsContext;
+    
+    if (!fcb) {
+        ERR("FCB was NULL\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    ccb = FileObject->FsContext2;
+    
+    if (!ccb) {
+        ERR("ccb was NULL\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    if (!(ccb->access & FILE_WRITE_DATA)) {
+        WARN("insufficient privileges\n");
+        return STATUS_ACCESS_DENIED;
+    }
+    
+    fileref = ccb->fileref;
+    
+    if (!fileref) {
+        ERR("fileref was NULL\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    if (fcb->subvol->root_item.flags & BTRFS_SUBVOL_READONLY)
+        return STATUS_ACCESS_DENIED;
+    
+    if (Vcb->readonly)
+        return STATUS_MEDIA_WRITE_PROTECTED;
+    
+    InitializeListHead(&rollback);
+    InitializeListHead(&changed_sector_list);
+    
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+    ExAcquireResourceExclusiveLite(fcb->Header.Resource, TRUE);
+    
+    CcFlushCache(&fcb->nonpaged->segment_object, NULL, 0, &iosb);
+    
+    if (fcb->type != BTRFS_TYPE_FILE || fcb->ads) {
+        WARN("FileObject did not point to a file\n");
+        Status = STATUS_INVALID_PARAMETER;
+        goto end;
+    }
+    
+    // compressed extents always have checksums
+    if (fcb->inode_item.flags & BTRFS_INODE_NODATASUM) {
+        WARN("file has nodatasum set\n");
+        Status = STATUS_INVALID_PARAMETER;
+        goto end;
+    }
+    
+    // inline extents can't be mixed with regular ones
+    le = fcb->extents.Flink;
+    while (le != &fcb->extents) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+        
+        if (!ext->ignore && ext->data->type == EXTENT_TYPE_INLINE) {
+            WARN("file has inline extent\n");
+            Status = STATUS_INVALID_PARAMETER;
+            goto end;
+        }
+        
+        le = le->Flink;
+    }
+    
+    Status = write_compressed_raw(fcb, bce->offset, bce->decoded_size, bce->compression, bce->data, bce->length, &changed_sector_list, Irp, &rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("write_compressed_raw returned %08x\n", Status);
+        goto end;
+    }
+    
+    end_data = bce->offset + bce->num_bytes;
+    
+    if (end_data > fcb->inode_item.st_size) {
+        fcb->inode_item.st_size = end_data;
+        TRACE("setting st_size to %llx\n", end_data);
+        
+        fcb->Header.AllocationSize.QuadPart = sector_align(end_data, Vcb->superblock.sector_size);
+        fcb->Header.FileSize.QuadPart = fcb->Header.ValidDataLength.QuadPart = end_data;
+        
+        if (FileObject->PrivateCacheMap) {
+            CC_FILE_SIZES ccfs;
+            
+            ccfs.AllocationSize = fcb->Header.AllocationSize;
+            ccfs.FileSize = fcb->Header.FileSize;
+            ccfs.ValidDataLength = fcb->Header.ValidDataLength;
+            
+            CcSetFileSizes(FileObject, &ccfs);
+        }
+    }
+    
+    offset.QuadPart = bce->offset;
+    CcPurgeCacheSection(&fcb->nonpaged->segment_object, &offset, (ULONG)bce->decoded_size, FALSE);
+    
+    KeQuerySystemTime(&time);
+    win_time_to_unix(time, &now);
+    
+    fcb->inode_item.transid = Vcb->superblock.generation;
+    fcb->inode_item.sequence++;
+    fcb->inode_item.st_ctime = now;
+    fcb->inode_item.st_mtime = now;
+    
+    fcb->extents_changed = TRUE;
+    mark_fcb_dirty(fcb);
+    
+    send_notification_fcb(fileref, FILE_NOTIFY_CHANGE_LAST_WRITE, FILE_ACTION_MODIFIED);
+    
+    fcb->subvol->root_item.ctransid = Vcb->superblock.generation;
+    fcb->subvol->root_item.ctime = now;
+    
+    ExAcquireResourceExclusiveLite(&Vcb->checksum_lock, TRUE);
+    commit_checksum_changes(Vcb, &changed_sector_list);
+    ExReleaseResourceLite(&Vcb->checksum_lock);
+    
+    Status = STATUS_SUCCESS;
+    
+end:
+    if (!NT_SUCCESS(Status))
+        do_rollback(Vcb, &rollback);
+    else
+        clear_rollback(&rollback);
+    
+    ExReleaseResourceLite(fcb->Header.Resource);
+    ExReleaseResourceLite(&Vcb->tree_lock);
+    
+    return Status;
+}
+
 static NTSTATUS is_volume_mounted(device_extension* Vcb, PIRP Irp) {
     UINT64 i, num_devices;
     NTSTATUS Status;
@@ -2503,6 +2830,17 @@ NTSTATUS fsctl_request(PDEVICE_OBJECT DeviceObject, PIRP Irp, UINT32 type, BOOL
         case FSCTL_BTRFS_SET_INODE_INFO:
             Status = set_inode_info(IrpSp->FileObject, map_user_buffer(Irp), IrpSp->Parameters.FileSystemControl.OutputBufferLength);
             break;
+            
+        case FSCTL_BTRFS_READ_COMPRESSED:
+            Status = read_compressed(DeviceObject->DeviceExtension, IrpSp->FileObject, Irp->AssociatedIrp.SystemBuffer,
+                                     IrpSp->Parameters.FileSystemControl.InputBufferLength, map_user_buffer(Irp),
+                                     IrpSp->Parameters.FileSystemControl.OutputBufferLength, &Irp->IoStatus.Information, Irp);
+            break;
+            
+        case FSCTL_BTRFS_WRITE_COMPRESSED:
+            Status = write_compressed_extent(DeviceObject->DeviceExtension, IrpSp->FileObject, map_user_buffer(Irp),
+                                             IrpSp->Parameters.FileSystemControl.OutputBufferLength, Irp);
+            break;
 
         default:
             TRACE("unknown control code %x (DeviceType = %x, Access = %x, Function = %x, Method = %x)\n",
@@ -1012,7 +1012,7 @@ static NTSTATUS load_csum_from_disk(device_extension* Vcb, UINT32* csum, UINT64
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS load_csum(device_extension* Vcb, UINT64 start, UINT64 length, UINT32** pcsum, PIRP Irp) {
+NTSTATUS load_csum(device_extension* Vcb, UINT64 start, UINT64 length, UINT32** pcsum, PIRP Irp) {
     UINT32* csum = NULL;
     NTSTATUS Status;
     UINT64 end;
@@ -1080,7 +1080,7 @@ static NTSTATUS load_csum(device_extension* Vcb, UINT64 start, UINT64 length, UI
     
     ExReleaseResourceLite(&Vcb->checksum_lock);
     
-    runlength = RtlFindFirstRunClear(&bmp, &index);
+    runlength = find_bitmap_run(bmpbuf, 0, (ULONG)length, FALSE, &index);
             
     while (runlength != 0) {
         Status = load_csum_from_disk(Vcb, &csum[index], start + (index * Vcb->superblock.sector_size), runlength, Irp);
@@ -1089,7 +1089,7 @@ static NTSTATUS load_csum(device_extension* Vcb, UINT64 start, UINT64 length, UI
             goto end;
         }
        
-        runlength = RtlFindNextForwardRunClear(&bmp, index + runlength, &index);
+        runlength = find_bitmap_run(bmpbuf, index + runlength, (ULONG)length, FALSE, &index);
     }
     
     Status = STATUS_SUCCESS;
@@ -1178,7 +1178,7 @@ NTSTATUS STDCALL read_file(fcb* fcb, UINT8* data, UINT64 start, UINT64 length, U
                     
                     RtlCopyMemory(data + bytes_read, &ed->data[off], read);
                     
-                    // FIXME - can we have compressed inline extents?
+                    // compressed inline extents are decompressed when the fcb is loaded, in open_fcb
                     
                     bytes_read += read;
                     length -= read;
@@ -125,7 +125,8 @@ void BtrfsPropSheet::do_search(WCHAR* fn) {
                         sizes[1] += bii2.disk_size[0];
                         sizes[2] += bii2.disk_size[1];
                         sizes[3] += bii2.disk_size[2];
-                        totalsize += bii2.inline_length + bii2.disk_size[0] + bii2.disk_size[1] + bii2.disk_size[2];
+                        sizes[4] += bii2.disk_size_zstd;
+                        totalsize += bii2.inline_length + bii2.disk_size[0] + bii2.disk_size[1] + bii2.disk_size[2] + bii2.disk_size_zstd;
                     }
                     
                     CloseHandle(fh);
@@ -274,7 +275,7 @@ HRESULT __stdcall BtrfsPropSheet::Initialize(PCIDLIST_ABSOLUTE pidlFolder, IData
                         sizes[0] += bii2.inline_length;
                     }
                     
-                    for (j = 0; j < 3; j++) {
+                    for (j = 0; j < 4; j++) {
                         if (bii2.disk_size[j] > 0) {
                             totalsize += bii2.disk_size[j];
                             sizes[j + 1] += bii2.disk_size[j];
@@ -534,9 +535,9 @@ void BtrfsPropSheet::change_gid(HWND hDlg, UINT32 gid) {
 void BtrfsPropSheet::update_size_details_dialog(HWND hDlg) {
     WCHAR size[1024], old_text[1024];
     int i;
-    ULONG items[] = { IDC_SIZE_INLINE, IDC_SIZE_UNCOMPRESSED, IDC_SIZE_ZLIB, IDC_SIZE_LZO };
+    ULONG items[] = { IDC_SIZE_INLINE, IDC_SIZE_UNCOMPRESSED, IDC_SIZE_ZLIB, IDC_SIZE_LZO, IDC_SIZE_ZSTD };
     
-    for (i = 0; i < 4; i++) {
+    for (i = 0; i < 5; i++) {
         format_size(sizes[i], size, sizeof(size) / sizeof(WCHAR));
         
         GetDlgItemTextW(hDlg, items[i], old_text, sizeof(old_text) / sizeof(WCHAR));
@@ -87,7 +87,7 @@ public:
         mode = mode_set = 0;
         flags = flags_set = 0;
         
-        sizes[0] = sizes[1] = sizes[2] = sizes[3] = 0;
+        sizes[0] = sizes[1] = sizes[2] = sizes[3] = sizes[4] = 0;
         totalsize = 0;
         
         InterlockedIncrement(&objs_loaded);
@@ -158,6 +158,6 @@ private:
     STGMEDIUM stgm;
     BOOL stgm_set;
     BOOL flags_changed, perms_changed, uid_changed, gid_changed;
-    UINT64 sizes[4], totalsize;
+    UINT64 sizes[5], totalsize;
     std::deque<WCHAR*> search_list;
 };
@@ -56,6 +56,7 @@
 #define IDC_SIZE_ZLIB                   1021
 #define IDC_SIZE_ZLIB2                  1022
 #define IDC_SIZE_LZO                    1022
+#define IDC_SIZE_ZSTD                   1023
 
 // Next default values for new objects
 // 
@@ -0,0 +1,1432 @@
+/* Copyright (c) Mark Harmstone 2016
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// The log tree is how btrfs makes fsync cheap. Rather than committing the whole transaction, we write
+// the items of the file being synced into a separate set of trees, which only the superblock points to.
+// If we crash before the next commit, the log gets replayed when the volume is next mounted; if we don't,
+// the commit throws it away. Linux uses the same format, so either driver can replay the other's log.
+//
+// We only log what a file that's already on disk needs to get its data back - its INODE_ITEM, its
+// EXTENT_DATAs, and the checksums which haven't made it into the checksum tree yet. Anything touching
+// directories, i.e. new files, renames and deletions, needs a full commit.
+
+typedef struct {
+    KEY key;
+    UINT32 size;
+    UINT8* data;
+    LIST_ENTRY list_entry;
+} log_item;
+
+typedef struct {
+    root* subvol;
+    LIST_ENTRY items;
+    LIST_ENTRY list_entry;
+} log_root;
+
+typedef struct {
+    UINT64 address;
+    chunk* c;
+    LIST_ENTRY list_entry;
+} log_block;
+
+typedef struct {
+    UINT64 address;
+    UINT64 size;
+    LIST_ENTRY list_entry;
+} log_extent;
+
+typedef struct {
+    KEY key;
+    UINT64 address;
+} log_node;
+
+static void free_log_items(LIST_ENTRY* items) {
+    while (!IsListEmpty(items)) {
+        LIST_ENTRY* le = RemoveHeadList(items);
+        log_item* li = CONTAINING_RECORD(le, log_item, list_entry);
+
+        if (li->data)
+            ExFreePool(li->data);
+
+        ExFreePool(li);
+    }
+}
+
+// Takes ownership of data if it succeeds.
+static NTSTATUS add_log_item(LIST_ENTRY* items, UINT64 obj_id, UINT8 obj_type, UINT64 offset, void* data, UINT32 size) {
+    log_item* li;
+    LIST_ENTRY* le;
+
+    li = ExAllocatePoolWithTag(PagedPool, sizeof(log_item), ALLOC_TAG);
+    if (!li) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    li->key.obj_id = obj_id;
+    li->key.obj_type = obj_type;
+    li->key.offset = offset;
+    li->size = size;
+    li->data = data;
+
+    // items nearly always arrive in order, so look for our place from the end
+    le = items->Blink;
+    while (le != items) {
+        log_item* li2 = CONTAINING_RECORD(le, log_item, list_entry);
+
+        if (keycmp(&li2->key, &li->key) == -1)
+            break;
+
+        le = le->Blink;
+    }
+
+    InsertHeadList(le, &li->list_entry);
+
+    return STATUS_SUCCESS;
+}
+
+static void release_log_blocks(device_extension* Vcb, LIST_ENTRY* blocks) {
+    while (!IsListEmpty(blocks)) {
+        LIST_ENTRY* le = RemoveHeadList(blocks);
+        log_block* lb = CONTAINING_RECORD(le, log_block, list_entry);
+
+        ExAcquireResourceExclusiveLite(&lb->c->lock, TRUE);
+        space_list_add(Vcb, lb->c, FALSE, lb->address, Vcb->superblock.node_size, NULL);
+        ExReleaseResourceLite(&lb->c->lock);
+
+        ExFreePool(lb);
+    }
+}
+
+void clear_log(device_extension* Vcb) {
+    release_log_blocks(Vcb, &Vcb->log_blocks);
+
+    while (!IsListEmpty(&Vcb->log_roots)) {
+        LIST_ENTRY* le = RemoveHeadList(&Vcb->log_roots);
+        log_root* lr = CONTAINING_RECORD(le, log_root, list_entry);
+
+        free_log_items(&lr->items);
+        ExFreePool(lr);
+    }
+}
+
+// As log blocks aren't counted in c->used, update_chunks has to ask us before dropping a chunk which looks empty.
+BOOL chunk_has_log_blocks(device_extension* Vcb, chunk* c) {
+    LIST_ENTRY* le = Vcb->log_blocks.Flink;
+
+    while (le != &Vcb->log_blocks) {
+        log_block* lb = CONTAINING_RECORD(le, log_block, list_entry);
+
+        if (lb->c == c)
+            return TRUE;
+
+        le = le->Flink;
+    }
+
+    return FALSE;
+}
+
+// Log blocks don't get EXTENT_ITEMs, so all that stops them from being allocated again is that we take
+// them out of the free space lists until the log's no longer needed.
+static NTSTATUS alloc_log_block(device_extension* Vcb, LIST_ENTRY* blocks, UINT64* address, chunk** pc) {
+    LIST_ENTRY* le;
+    log_block* lb;
+
+    lb = ExAllocatePoolWithTag(PagedPool, sizeof(log_block), ALLOC_TAG);
+    if (!lb) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ExAcquireResourceExclusiveLite(&Vcb->chunk_lock, TRUE);
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+
+        if (c->chunk_item->type & BLOCK_FLAG_METADATA) {
+            ExAcquireResourceExclusiveLite(&c->lock, TRUE);
+
+            if ((c->chunk_item->size - c->used) >= Vcb->superblock.node_size && find_address_in_chunk(Vcb, c, Vcb->superblock.node_size, address)) {
+                space_list_subtract(Vcb, c, FALSE, *address, Vcb->superblock.node_size, NULL);
+
+                ExReleaseResourceLite(&c->lock);
+                ExReleaseResourceLite(&Vcb->chunk_lock);
+
+                lb->address = *address;
+                lb->c = c;
+                InsertTailList(blocks, &lb->list_entry);
+
+                *pc = c;
+
+                return STATUS_SUCCESS;
+            }
+
+            ExReleaseResourceLite(&c->lock);
+        }
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+
+    ExFreePool(lb);
+
+    // we don't allocate new chunks here - if we're that short of space, a full commit is what's needed
+    return STATUS_DISK_FULL;
+}
+
+static NTSTATUS pin_log_block(device_extension* Vcb, UINT64 address) {
+    chunk* c;
+    log_block* lb;
+
+    c = get_chunk_from_address(Vcb, address);
+    if (!c) {
+        ERR("get_chunk_from_address(%llx) failed\n", address);
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    lb = ExAllocatePoolWithTag(PagedPool, sizeof(log_block), ALLOC_TAG);
+    if (!lb) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ExAcquireResourceExclusiveLite(&c->lock, TRUE);
+
+    if (!c->cache_loaded) {
+        NTSTATUS Status = load_cache_chunk(Vcb, c, NULL);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_cache_chunk returned %08x\n", Status);
+            ExReleaseResourceLite(&c->lock);
+            ExFreePool(lb);
+            return Status;
+        }
+    }
+
+    space_list_subtract(Vcb, c, FALSE, address, Vcb->superblock.node_size, NULL);
+
+    ExReleaseResourceLite(&c->lock);
+
+    lb->address = address;
+    lb->c = c;
+    InsertTailList(&Vcb->log_blocks, &lb->list_entry);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS write_log_node(device_extension* Vcb, UINT8* data, UINT8 level, UINT32 num_items, BTRFS_UUID* chunk_tree_uuid, LIST_ENTRY* blocks,
+                               UINT64* address, PIRP Irp) {
+    tree_header* th = (tree_header*)data;
+    NTSTATUS Status;
+    UINT32 crc32;
+    chunk* c;
+
+    Status = alloc_log_block(Vcb, blocks, address, &c);
+    if (!NT_SUCCESS(Status)) {
+        WARN("alloc_log_block returned %08x\n", Status);
+        return Status;
+    }
+
+    th->fs_uuid = Vcb->superblock.uuid;
+    th->address = *address;
+    th->flags = HEADER_FLAG_MIXED_BACKREF;
+    th->chunk_tree_uuid = *chunk_tree_uuid;
+    th->generation = Vcb->superblock.generation;
+    th->tree_id = TREE_LOG_ID;
+    th->num_items = num_items;
+    th->level = level;
+
+    crc32 = calc_crc32c(0xffffffff, (UINT8*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
+    crc32 = ~crc32;
+    *((UINT32*)data) = crc32;
+
+    Status = write_data_complete(Vcb, *address, data, Vcb->superblock.node_size, Irp, c);
+    if (!NT_SUCCESS(Status))
+        ERR("write_data_complete returned %08x\n", Status);
+
+    return Status;
+}
+
+// Writes out a whole tree from a sorted list of items, from the leaves upwards.
+static NTSTATUS write_log_tree(device_extension* Vcb, LIST_ENTRY* items, BTRFS_UUID* chunk_tree_uuid, LIST_ENTRY* blocks, UINT64* address,
+                               UINT8* level, PIRP Irp) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    ULONG num_items = 0, num_nodes = 0, max_children, i, j;
+    log_node* nodes;
+    UINT8* data;
+    UINT8 lvl = 0;
+
+    le = items->Flink;
+    while (le != items) {
+        num_items++;
+        le = le->Flink;
+    }
+
+    nodes = ExAllocatePoolWithTag(PagedPool, sizeof(log_node) * max(num_items, 1), ALLOC_TAG);
+    if (!nodes) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    data = ExAllocatePoolWithTag(NonPagedPool, Vcb->superblock.node_size, ALLOC_TAG);
+    if (!data) {
+        ERR("out of memory\n");
+        ExFreePool(nodes);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    le = items->Flink;
+    do {
+        leaf_node* ln = (leaf_node*)(data + sizeof(tree_header));
+        UINT8* dataptr = data + Vcb->superblock.node_size;
+        UINT32 n = 0, space = Vcb->superblock.node_size - sizeof(tree_header);
+
+        RtlZeroMemory(data, Vcb->superblock.node_size);
+        RtlZeroMemory(&nodes[num_nodes].key, sizeof(KEY));
+
+        while (le != items) {
+            log_item* li = CONTAINING_RECORD(le, log_item, list_entry);
+
+            if (sizeof(leaf_node) + li->size > space) {
+                if (n == 0) {
+                    ERR("item (%llx,%x,%llx) is too large to log (%x bytes)\n", li->key.obj_id, li->key.obj_type, li->key.offset, li->size);
+                    Status = STATUS_INTERNAL_ERROR;
+                    goto end;
+                }
+
+                break;
+            }
+
+            if (n == 0)
+                nodes[num_nodes].key = li->key;
+
+            dataptr -= li->size;
+
+            ln[n].key = li->key;
+            ln[n].offset = (UINT32)(dataptr - (UINT8*)ln);
+            ln[n].size = li->size;
+
+            if (li->size > 0)
+                RtlCopyMemory(dataptr, li->data, li->size);
+
+            space -= sizeof(leaf_node) + li->size;
+            n++;
+
+            le = le->Flink;
+        }
+
+        Status = write_log_node(Vcb, data, 0, n, chunk_tree_uuid, blocks, &nodes[num_nodes].address, Irp);
+        if (!NT_SUCCESS(Status))
+            goto end;
+
+        num_nodes++;
+    } while (le != items);
+
+    max_children = (Vcb->superblock.node_size - sizeof(tree_header)) / sizeof(internal_node);
+
+    while (num_nodes > 1) {
+        ULONG new_num_nodes = 0;
+
+        lvl++;
+
+        if (lvl >= BTRFS_MAX_LEVEL) {
+            ERR("log tree would have more than %u levels\n", BTRFS_MAX_LEVEL);
+            Status = STATUS_INTERNAL_ERROR;
+            goto end;
+        }
+
+        for (i = 0; i < num_nodes; i += max_children) {
+            internal_node* in = (internal_node*)(data + sizeof(tree_header));
+            ULONG n = min(max_children, num_nodes - i);
+
+            RtlZeroMemory(data, Vcb->superblock.node_size);
+
+            for (j = 0; j < n; j++) {
+                in[j].key = nodes[i + j].key;
+                in[j].address = nodes[i + j].address;
+                in[j].generation = Vcb->superblock.generation;
+            }
+
+            // new_num_nodes is never more than i, so we can reuse the array
+            nodes[new_num_nodes].key = nodes[i].key;
+
+            Status = write_log_node(Vcb, data, lvl, n, chunk_tree_uuid, blocks, &nodes[new_num_nodes].address, Irp);
+            if (!NT_SUCCESS(Status))
+                goto end;
+
+            new_num_nodes++;
+        }
+
+        num_nodes = new_num_nodes;
+    }
+
+    *address = nodes[0].address;
+    *level = lvl;
+
+    Status = STATUS_SUCCESS;
+
+end:
+    ExFreePool(data);
+    ExFreePool(nodes);
+
+    return Status;
+}
+
+static NTSTATUS add_log_hole(fcb* fcb, LIST_ENTRY* items, UINT64 start, UINT64 length) {
+    EXTENT_DATA* ed;
+    EXTENT_DATA2* ed2;
+    NTSTATUS Status;
+
+    ed = ExAllocatePoolWithTag(PagedPool, sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2), ALLOC_TAG);
+    if (!ed) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ed->generation = fcb->Vcb->superblock.generation;
+    ed->decoded_size = length;
+    ed->compression = BTRFS_COMPRESSION_NONE;
+    ed->encryption = BTRFS_ENCRYPTION_NONE;
+    ed->encoding = BTRFS_ENCODING_NONE;
+    ed->type = EXTENT_TYPE_REGULAR;
+
+    ed2 = (EXTENT_DATA2*)ed->data;
+    ed2->address = 0;
+    ed2->size = 0;
+    ed2->offset = 0;
+    ed2->num_bytes = length;
+
+    Status = add_log_item(items, fcb->inode, TYPE_EXTENT_DATA, start, ed, sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2));
+    if (!NT_SUCCESS(Status))
+        ExFreePool(ed);
+
+    return Status;
+}
+
+// These are the items that flush_fcb would write for the file, plus its INODE_ITEM. Holes are logged explicitly
+// if the volume doesn't have NO_HOLES, as otherwise Linux would keep whatever was there in the last commit.
+static NTSTATUS get_fcb_log_items(fcb* fcb, LIST_ENTRY* items) {
+    device_extension* Vcb = fcb->Vcb;
+    NTSTATUS Status;
+    INODE_ITEM* ii;
+    LIST_ENTRY* le;
+    UINT64 last_end = 0;
+    BOOL extents_inline = FALSE;
+
+    ii = ExAllocatePoolWithTag(PagedPool, sizeof(INODE_ITEM), ALLOC_TAG);
+    if (!ii) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlCopyMemory(ii, &fcb->inode_item, sizeof(INODE_ITEM));
+
+    Status = add_log_item(items, fcb->inode, TYPE_INODE_ITEM, 0, ii, sizeof(INODE_ITEM));
+    if (!NT_SUCCESS(Status)) {
+        ExFreePool(ii);
+        return Status;
+    }
+
+    le = fcb->extents.Flink;
+    while (le != &fcb->extents) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+
+        if (!ext->ignore) {
+            EXTENT_DATA* ed = NULL;
+            UINT32 edsize;
+
+            if (!(Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_NO_HOLES) && ext->offset > last_end) {
+                Status = add_log_hole(fcb, items, last_end, ext->offset - last_end);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("add_log_hole returned %08x\n", Status);
+                    return Status;
+                }
+            }
+
+            if (ext->data->type == EXTENT_TYPE_INLINE) {
+                ed = compress_inline_extent(fcb, ext->data, &edsize);
+
+                extents_inline = TRUE;
+                last_end = ext->offset + ext->data->decoded_size;
+            } else {
+                EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ext->data->data;
+
+                last_end = ext->offset + ed2->num_bytes;
+            }
+
+            if (!ed) {
+                ed = ExAllocatePoolWithTag(PagedPool, ext->datalen, ALLOC_TAG);
+                if (!ed) {
+                    ERR("out of memory\n");
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
+
+                RtlCopyMemory(ed, ext->data, ext->datalen);
+                edsize = ext->datalen;
+            }
+
+            Status = add_log_item(items, fcb->inode, TYPE_EXTENT_DATA, ext->offset, ed, edsize);
+            if (!NT_SUCCESS(Status)) {
+                ExFreePool(ed);
+                return Status;
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    if (!(Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_NO_HOLES) && !extents_inline &&
+        sector_align(fcb->inode_item.st_size, Vcb->superblock.sector_size) > last_end) {
+        Status = add_log_hole(fcb, items, last_end, sector_align(fcb->inode_item.st_size, Vcb->superblock.sector_size) - last_end);
+        if (!NT_SUCCESS(Status)) {
+            ERR("add_log_hole returned %08x\n", Status);
+            return Status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS add_log_extent(LIST_ENTRY* extents, UINT64 address, UINT64 size) {
+    LIST_ENTRY* le;
+    log_extent* lext;
+
+    le = extents->Flink;
+    while (le != extents) {
+        lext = CONTAINING_RECORD(le, log_extent, list_entry);
+
+        if (lext->address == address)
+            return STATUS_SUCCESS;
+        else if (lext->address > address)
+            break;
+
+        le = le->Flink;
+    }
+
+    lext = ExAllocatePoolWithTag(PagedPool, sizeof(log_extent), ALLOC_TAG);
+    if (!lext) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    lext->address = address;
+    lext->size = size;
+
+    InsertTailList(le, &lext->list_entry);
+
+    return STATUS_SUCCESS;
+}
+
+// Checksums for data written since the last commit are only in sector_checksums, so we have to log them too.
+// The list is in the order the changes were made, so later entries override earlier ones.
+static NTSTATUS add_log_csums(device_extension* Vcb, LIST_ENTRY* items, UINT64 address, UINT64 size) {
+    NTSTATUS Status;
+    ULONG len = (ULONG)(size / Vcb->superblock.sector_size), runlength, index;
+    UINT32* checksums;
+    ULONG* bmparr;
+    RTL_BITMAP bmp;
+    LIST_ENTRY* le;
+
+    checksums = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * len, ALLOC_TAG);
+    if (!checksums) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    bmparr = ExAllocatePoolWithTag(PagedPool, sizeof(ULONG) * ((len/8)+1), ALLOC_TAG);
+    if (!bmparr) {
+        ERR("out of memory\n");
+        ExFreePool(checksums);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlInitializeBitMap(&bmp, bmparr, len);
+    RtlClearAllBits(&bmp);
+
+    le = Vcb->sector_checksums.Flink;
+    while (le != &Vcb->sector_checksums) {
+        changed_sector* cs = (changed_sector*)le;
+        UINT64 cs_end = cs->ol.key + ((UINT64)cs->length * Vcb->superblock.sector_size);
+
+        if (cs->ol.key < address + size && cs_end > address) {
+            UINT64 start = max(cs->ol.key, address);
+            UINT64 end = min(cs_end, address + size);
+            ULONG off = (ULONG)((start - address) / Vcb->superblock.sector_size);
+            ULONG num = (ULONG)((end - start) / Vcb->superblock.sector_size);
+
+            if (cs->deleted)
+                RtlClearBits(&bmp, off, num);
+            else {
+                RtlCopyMemory(&checksums[off], &cs->checksums[(start - cs->ol.key) / Vcb->superblock.sector_size], sizeof(UINT32) * num);
+                RtlSetBits(&bmp, off, num);
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    runlength = find_bitmap_run(bmparr, 0, len, TRUE, &index);
+
+    while (runlength != 0) {
+        do {
+            ULONG rl;
+            UINT32* data;
+
+            if (runlength * sizeof(UINT32) > MAX_CSUM_SIZE)
+                rl = MAX_CSUM_SIZE / sizeof(UINT32);
+            else
+                rl = runlength;
+
+            data = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * rl, ALLOC_TAG);
+            if (!data) {
+                ERR("out of memory\n");
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+                goto end;
+            }
+
+            RtlCopyMemory(data, &checksums[index], sizeof(UINT32) * rl);
+
+            Status = add_log_item(items, EXTENT_CSUM_ID, TYPE_EXTENT_CSUM, address + (index * Vcb->superblock.sector_size), data, sizeof(UINT32) * rl);
+            if (!NT_SUCCESS(Status)) {
+                ExFreePool(data);
+                goto end;
+            }
+
+            runlength -= rl;
+            index += rl;
+        } while (runlength > 0);
+
+        runlength = find_bitmap_run(bmparr, index, len, TRUE, &index);
+    }
+
+    Status = STATUS_SUCCESS;
+
+end:
+    ExFreePool(bmparr);
+    ExFreePool(checksums);
+
+    return Status;
+}
+
+static NTSTATUS write_log_root(device_extension* Vcb, log_root* lr, BTRFS_UUID* chunk_tree_uuid, LIST_ENTRY* blocks, LIST_ENTRY* root_items, PIRP Irp) {
+    NTSTATUS Status;
+    LIST_ENTRY extents, *le, *last = lr->items.Blink;
+    ROOT_ITEM* ri;
+    UINT64 address;
+    UINT8 level;
+    BOOL no_csum = FALSE;
+
+    InitializeListHead(&extents);
+
+    le = lr->items.Flink;
+    while (le != &lr->items) {
+        log_item* li = CONTAINING_RECORD(le, log_item, list_entry);
+
+        if (li->key.obj_type == TYPE_INODE_ITEM)
+            no_csum = ((INODE_ITEM*)li->data)->flags & BTRFS_INODE_NODATASUM ? TRUE : FALSE;
+        else if (li->key.obj_type == TYPE_EXTENT_DATA && !no_csum) {
+            EXTENT_DATA* ed = (EXTENT_DATA*)li->data;
+
+            if (ed->type == EXTENT_TYPE_REGULAR) {
+                EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
+
+                if (ed2->size != 0) {
+                    Status = add_log_extent(&extents, ed2->address, ed2->size);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("add_log_extent returned %08x\n", Status);
+                        goto end;
+                    }
+                }
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    // EXTENT_CSUM_ID sorts after any inode, so these all go on the end
+    ExAcquireResourceSharedLite(&Vcb->checksum_lock, TRUE);
+
+    le = extents.Flink;
+    while (le != &extents) {
+        log_extent* lext = CONTAINING_RECORD(le, log_extent, list_entry);
+
+        Status = add_log_csums(Vcb, &lr->items, lext->address, lext->size);
+        if (!NT_SUCCESS(Status)) {
+            ERR("add_log_csums returned %08x\n", Status);
+            ExReleaseResourceLite(&Vcb->checksum_lock);
+            goto end;
+        }
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->checksum_lock);
+
+    Status = write_log_tree(Vcb, &lr->items, chunk_tree_uuid, blocks, &address, &level, Irp);
+    if (!NT_SUCCESS(Status)) {
+        WARN("write_log_tree returned %08x\n", Status);
+        goto end;
+    }
+
+    ri = ExAllocatePoolWithTag(PagedPool, sizeof(ROOT_ITEM), ALLOC_TAG);
+    if (!ri) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    // Linux fills in the inode like this for its log roots
+    RtlZeroMemory(ri, sizeof(ROOT_ITEM));
+    ri->inode.generation = 1;
+    ri->inode.st_size = 3;
+    ri->inode.st_nlink = 1;
+    ri->inode.st_blocks = Vcb->superblock.node_size;
+    ri->inode.st_mode = __S_IFDIR | 0755;
+    ri->generation = Vcb->superblock.generation;
+    ri->block_number = address;
+    ri->root_level = level;
+    ri->generation2 = Vcb->superblock.generation;
+
+    Status = add_log_item(root_items, TREE_LOG_ID, TYPE_ROOT_ITEM, lr->subvol->id, ri, sizeof(ROOT_ITEM));
+    if (!NT_SUCCESS(Status))
+        ExFreePool(ri);
+
+end:
+    // take the checksums back off again, as they won't be the same next time
+    while (lr->items.Blink != last) {
+        log_item* li = CONTAINING_RECORD(RemoveTailList(&lr->items), log_item, list_entry);
+
+        ExFreePool(li->data);
+        ExFreePool(li);
+    }
+
+    while (!IsListEmpty(&extents)) {
+        log_extent* lext = CONTAINING_RECORD(RemoveHeadList(&extents), log_extent, list_entry);
+
+        ExFreePool(lext);
+    }
+
+    return Status;
+}
+
+static NTSTATUS log_fcb(device_extension* Vcb, fcb* fcb, PIRP Irp) {
+    NTSTATUS Status;
+    LIST_ENTRY items, blocks, root_items, *le;
+    log_root* lr = NULL;
+    KEY searchkey;
+    traverse_ptr tp;
+    BTRFS_UUID chunk_tree_uuid;
+    UINT64 address, i;
+    UINT8 level;
+
+    TRACE("logging (%llx, %llx)\n", fcb->subvol->id, fcb->inode);
+
+    // the log's tree headers need the chunk tree's UUID, which we can get from any tree
+    searchkey.obj_id = 0;
+    searchkey.obj_type = 0;
+    searchkey.offset = 0;
+
+    Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("error - find_item returned %08x\n", Status);
+        return Status;
+    }
+
+    chunk_tree_uuid = tp.tree->header.chunk_tree_uuid;
+
+    InitializeListHead(&items);
+    InitializeListHead(&blocks);
+    InitializeListHead(&root_items);
+
+    Status = get_fcb_log_items(fcb, &items);
+    if (!NT_SUCCESS(Status)) {
+        ERR("get_fcb_log_items returned %08x\n", Status);
+        free_log_items(&items);
+        return Status;
+    }
+
+    le = Vcb->log_roots.Flink;
+    while (le != &Vcb->log_roots) {
+        log_root* lr2 = CONTAINING_RECORD(le, log_root, list_entry);
+
+        if (lr2->subvol == fcb->subvol) {
+            lr = lr2;
+            break;
+        }
+
+        le = le->Flink;
+    }
+
+    if (!lr) {
+        lr = ExAllocatePoolWithTag(PagedPool, sizeof(log_root), ALLOC_TAG);
+        if (!lr) {
+            ERR("out of memory\n");
+            free_log_items(&items);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        lr->subvol = fcb->subvol;
+        InitializeListHead(&lr->items);
+        InsertTailList(&Vcb->log_roots, &lr->list_entry);
+    }
+
+    // replace anything we logged for the inode before
+    le = lr->items.Flink;
+    while (le != &lr->items) {
+        LIST_ENTRY* le2 = le->Flink;
+        log_item* li = CONTAINING_RECORD(le, log_item, list_entry);
+
+        if (li->key.obj_id == fcb->inode) {
+            RemoveEntryList(&li->list_entry);
+
+            if (li->data)
+                ExFreePool(li->data);
+
+            ExFreePool(li);
+        } else if (li->key.obj_id > fcb->inode)
+            break;
+
+        le = le2;
+    }
+
+    le = lr->items.Flink;
+    while (!IsListEmpty(&items)) {
+        log_item* li = CONTAINING_RECORD(RemoveHeadList(&items), log_item, list_entry);
+
+        while (le != &lr->items && keycmp(&CONTAINING_RECORD(le, log_item, list_entry)->key, &li->key) == -1) {
+            le = le->Flink;
+        }
+
+        InsertTailList(le, &li->list_entry);
+    }
+
+    // Every fsync writes out the whole log again - it only lasts until the next commit, so it shouldn't get big.
+
+    le = Vcb->log_roots.Flink;
+    while (le != &Vcb->log_roots) {
+        log_root* lr2 = CONTAINING_RECORD(le, log_root, list_entry);
+
+        Status = write_log_root(Vcb, lr2, &chunk_tree_uuid, &blocks, &root_items, Irp);
+        if (!NT_SUCCESS(Status)) {
+            WARN("write_log_root returned %08x\n", Status);
+            goto end;
+        }
+
+        le = le->Flink;
+    }
+
+    Status = write_log_tree(Vcb, &root_items, &chunk_tree_uuid, &blocks, &address, &level, Irp);
+    if (!NT_SUCCESS(Status)) {
+        WARN("write_log_tree returned %08x\n", Status);
+        goto end;
+    }
+
+    Vcb->log_superblock->log_tree_addr = address;
+    Vcb->log_superblock->log_root_level = level;
+
+    for (i = 0; i < Vcb->superblock.num_devices; i++) {
+        if (Vcb->devices[i].devobj) {
+            Status = write_superblock(Vcb, Vcb->log_superblock, &Vcb->devices[i]);
+            if (!NT_SUCCESS(Status)) {
+                ERR("write_superblock returned %08x\n", Status);
+
+                // we don't know which log the disk points to now, so keep both of them until the next commit
+                while (!IsListEmpty(&blocks)) {
+                    InsertTailList(&Vcb->log_blocks, RemoveHeadList(&blocks));
+                }
+
+                goto end;
+            }
+        }
+    }
+
+    // nothing points to the old log any more
+    release_log_blocks(Vcb, &Vcb->log_blocks);
+
+    while (!IsListEmpty(&blocks)) {
+        InsertTailList(&Vcb->log_blocks, RemoveHeadList(&blocks));
+    }
+
+    Status = STATUS_SUCCESS;
+
+end:
+    release_log_blocks(Vcb, &blocks);
+    free_log_items(&root_items);
+
+    return Status;
+}
+
+NTSTATUS fsync_fcb(device_extension* Vcb, fcb* fcb, PIRP Irp) {
+    NTSTATUS Status;
+
+    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
+
+    if (!Vcb->need_write) {
+        ExReleaseResourceLite(&Vcb->tree_lock);
+        return STATUS_SUCCESS;
+    }
+
+    // We can only log a file on its own if its directory entries are already on disk.
+    // This also rules out streams, and the volume itself.
+    if (fcb->subvol && fcb->subvol != Vcb->root_root && fcb->subvol->treeholder.address != 0 && !fcb->ads && fcb->type == BTRFS_TYPE_FILE &&
+        !fcb->created && !fcb->deleted && (!fcb->fileref || (!fcb->fileref->created && !fcb->fileref->deleted && !fcb->fileref->dirty))) {
+        Status = log_fcb(Vcb, fcb, Irp);
+        if (NT_SUCCESS(Status)) {
+            ExReleaseResourceLite(&Vcb->tree_lock);
+            return Status;
+        }
+
+        WARN("log_fcb returned %08x, committing transaction instead\n", Status);
+    }
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    // let anyone else who's flushing at the same time share the commit with us
+    Status = commit_transaction(Vcb, COMMIT_REASON_FSYNC, Irp);
+    if (!NT_SUCCESS(Status))
+        ERR("commit_transaction returned %08x\n", Status);
+
+    return Status;
+}
+
+// Reads a whole log tree into memory, pinning its blocks so that nothing overwrites them until the replay's been committed.
+// This recurses, but no further than BTRFS_MAX_LEVEL.
+static NTSTATUS read_log_tree(device_extension* Vcb, UINT64 address, UINT8 level, LIST_ENTRY* items, PIRP Irp) {
+    NTSTATUS Status;
+    UINT8* buf;
+    tree_header* th;
+    UINT32 i;
+
+    if (level >= BTRFS_MAX_LEVEL) {
+        ERR("log tree at %llx has level %u, maximum is %u\n", address, level, BTRFS_MAX_LEVEL - 1);
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    buf = ExAllocatePoolWithTag(PagedPool, Vcb->superblock.node_size, ALLOC_TAG);
+    if (!buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Status = read_data(Vcb, address, Vcb->superblock.node_size, NULL, TRUE, buf, NULL, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("read_data returned %08x\n", Status);
+        goto end;
+    }
+
+    th = (tree_header*)buf;
+
+    // the log is written during the transaction after the one the superblock's from
+    if (th->address != address || th->tree_id != TREE_LOG_ID || th->level != level || th->generation != Vcb->superblock.generation) {
+        ERR("log tree at %llx was invalid (address %llx, tree %llx, level %u, generation %llx)\n", address, th->address, th->tree_id, th->level, th->generation);
+        Status = STATUS_INTERNAL_ERROR;
+        goto end;
+    }
+
+    Status = pin_log_block(Vcb, address);
+    if (!NT_SUCCESS(Status)) {
+        ERR("pin_log_block returned %08x\n", Status);
+        goto end;
+    }
+
+    if (level == 0) {
+        leaf_node* ln = (leaf_node*)(buf + sizeof(tree_header));
+
+        if ((th->num_items * sizeof(leaf_node)) + sizeof(tree_header) > Vcb->superblock.node_size) {
+            ERR("log tree at %llx has more items than expected (%x)\n", address, th->num_items);
+            Status = STATUS_INTERNAL_ERROR;
+            goto end;
+        }
+
+        for (i = 0; i < th->num_items; i++) {
+            UINT8* data = NULL;
+
+            if (sizeof(tree_header) + ln[i].offset + ln[i].size > Vcb->superblock.node_size) {
+                ERR("item (%llx,%x,%llx) in log tree at %llx ran past end of node\n", ln[i].key.obj_id, ln[i].key.obj_type, ln[i].key.offset, address);
+                Status = STATUS_INTERNAL_ERROR;
+                goto end;
+            }
+
+            if (ln[i].size > 0) {
+                data = ExAllocatePoolWithTag(PagedPool, ln[i].size, ALLOC_TAG);
+                if (!data) {
+                    ERR("out of memory\n");
+                    Status = STATUS_INSUFFICIENT_RESOURCES;
+                    goto end;
+                }
+
+                RtlCopyMemory(data, buf + sizeof(tree_header) + ln[i].offset, ln[i].size);
+            }
+
+            Status = add_log_item(items, ln[i].key.obj_id, ln[i].key.obj_type, ln[i].key.offset, data, ln[i].size);
+            if (!NT_SUCCESS(Status)) {
+                if (data)
+                    ExFreePool(data);
+
+                goto end;
+            }
+        }
+    } else {
+        internal_node* in = (internal_node*)(buf + sizeof(tree_header));
+
+        if ((th->num_items * sizeof(internal_node)) + sizeof(tree_header) > Vcb->superblock.node_size) {
+            ERR("log tree at %llx has more items than expected (%x)\n", address, th->num_items);
+            Status = STATUS_INTERNAL_ERROR;
+            goto end;
+        }
+
+        for (i = 0; i < th->num_items; i++) {
+            Status = read_log_tree(Vcb, in[i].address, level - 1, items, Irp);
+            if (!NT_SUCCESS(Status))
+                goto end;
+        }
+    }
+
+    Status = STATUS_SUCCESS;
+
+end:
+    ExFreePool(buf);
+
+    return Status;
+}
+
+static NTSTATUS replay_inode_item(fcb* fcb, log_item* li, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    INODE_ITEM* ii = (INODE_ITEM*)li->data;
+    LIST_ENTRY* le;
+    UINT64 end = 0, size;
+    UINT32 nlink;
+
+    if (li->size < sizeof(INODE_ITEM)) {
+        ERR("(%llx,%x,%llx) was %x bytes, expected %x\n", li->key.obj_id, li->key.obj_type, li->key.offset, li->size, sizeof(INODE_ITEM));
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    // as with Linux, anything past the logged size goes - the EXTENT_DATAs take care of the rest
+
+    le = fcb->extents.Flink;
+    while (le != &fcb->extents) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+
+        if (!ext->ignore) {
+            if (ext->data->type == EXTENT_TYPE_INLINE)
+                end = max(end, ext->offset + ext->data->decoded_size);
+            else
+                end = max(end, ext->offset + ((EXTENT_DATA2*)ext->data->data)->num_bytes);
+        }
+
+        le = le->Flink;
+    }
+
+    size = sector_align(ii->st_size, fcb->Vcb->superblock.sector_size);
+    end = sector_align(end, fcb->Vcb->superblock.sector_size);
+
+    if (end > size) {
+        Status = excise_extents(fcb->Vcb, fcb, size, end, Irp, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("excise_extents returned %08x\n", Status);
+            return Status;
+        }
+    }
+
+    // we don't log INODE_REFs, so the link count on disk is the right one
+    nlink = fcb->inode_item.st_nlink;
+    RtlCopyMemory(&fcb->inode_item, ii, sizeof(INODE_ITEM));
+    fcb->inode_item.st_nlink = nlink;
+
+    fcb->Header.AllocationSize.QuadPart = sector_align(fcb->inode_item.st_size, fcb->Vcb->superblock.sector_size);
+    fcb->Header.FileSize.QuadPart = fcb->inode_item.st_size;
+    fcb->Header.ValidDataLength.QuadPart = fcb->inode_item.st_size;
+
+    fcb->extents_changed = TRUE;
+    mark_fcb_dirty(fcb);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS replay_extent_ref(fcb* fcb, UINT64 offset, EXTENT_DATA2* ed2, PIRP Irp, LIST_ENTRY* rollback) {
+    device_extension* Vcb = fcb->Vcb;
+    NTSTATUS Status;
+    chunk* c;
+    LIST_ENTRY* le;
+    KEY searchkey;
+    traverse_ptr tp;
+    BOOL found = FALSE, no_csum = fcb->inode_item.flags & BTRFS_INODE_NODATASUM ? TRUE : FALSE;
+
+    c = get_chunk_from_address(Vcb, ed2->address);
+    if (!c) {
+        ERR("get_chunk_from_address(%llx) failed\n", ed2->address);
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    ExAcquireResourceExclusiveLite(&c->changed_extents_lock, TRUE);
+
+    le = c->changed_extents.Flink;
+    while (le != &c->changed_extents) {
+        changed_extent* ce = CONTAINING_RECORD(le, changed_extent, list_entry);
+
+        if (ce->address == ed2->address) {
+            found = TRUE;
+            break;
+        }
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&c->changed_extents_lock);
+
+    if (!found) {
+        searchkey.obj_id = ed2->address;
+        searchkey.obj_type = TYPE_EXTENT_ITEM;
+        searchkey.offset = 0xffffffffffffffff;
+
+        Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("error - find_item returned %08x\n", Status);
+            return Status;
+        }
+
+        found = tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type == searchkey.obj_type;
+    }
+
+    if (found) {
+        Status = update_changed_extent_ref(Vcb, c, ed2->address, ed2->size, fcb->subvol->id, fcb->inode, offset - ed2->offset, 1, no_csum, ed2->size, Irp);
+        if (!NT_SUCCESS(Status))
+            ERR("update_changed_extent_ref returned %08x\n", Status);
+
+        return Status;
+    }
+
+    // The extent was written after the last commit, so as far as the free space cache is concerned it's still free.
+
+    ExAcquireResourceExclusiveLite(&c->lock, TRUE);
+
+    if (!c->cache_loaded) {
+        Status = load_cache_chunk(Vcb, c, NULL);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_cache_chunk returned %08x\n", Status);
+            ExReleaseResourceLite(&c->lock);
+            return Status;
+        }
+    }
+
+    increase_chunk_usage(c, ed2->size);
+    space_list_subtract(Vcb, c, FALSE, ed2->address, ed2->size, rollback);
+
+    ExReleaseResourceLite(&c->lock);
+
+    ExAcquireResourceExclusiveLite(&c->changed_extents_lock, TRUE);
+
+    add_changed_extent_ref(c, ed2->address, ed2->size, fcb->subvol->id, fcb->inode, offset - ed2->offset, 1, no_csum);
+
+    ExReleaseResourceLite(&c->changed_extents_lock);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS replay_extent_data(fcb* fcb, log_item* li, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    EXTENT_DATA* ed = (EXTENT_DATA*)li->data;
+    EXTENT_DATA2* ed2 = NULL;
+    EXTENT_DATA* newed;
+    ULONG edsize;
+    UINT64 len, st_blocks;
+
+    if (li->size < sizeof(EXTENT_DATA)) {
+        ERR("(%llx,%x,%llx) was %x bytes, expected at least %x\n", li->key.obj_id, li->key.obj_type, li->key.offset, li->size, sizeof(EXTENT_DATA));
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    if (ed->type == EXTENT_TYPE_REGULAR || ed->type == EXTENT_TYPE_PREALLOC) {
+        if (li->size < sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2)) {
+            ERR("(%llx,%x,%llx) was %x bytes, expected at least %x\n", li->key.obj_id, li->key.obj_type, li->key.offset, li->size,
+                sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2));
+            return STATUS_INTERNAL_ERROR;
+        }
+
+        ed2 = (EXTENT_DATA2*)ed->data;
+        len = ed2->num_bytes;
+    } else
+        len = ed->decoded_size;
+
+    // the INODE_ITEM we've just replayed already has the right st_blocks
+    st_blocks = fcb->inode_item.st_blocks;
+
+    Status = excise_extents(fcb->Vcb, fcb, li->key.offset, sector_align(li->key.offset + len, fcb->Vcb->superblock.sector_size), Irp, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("excise_extents returned %08x\n", Status);
+        return Status;
+    }
+
+    fcb->inode_item.st_blocks = st_blocks;
+
+    // flush_fcb puts any holes back in for us
+    if (ed2 && ed2->size == 0)
+        goto end;
+
+    if (ed->type == EXTENT_TYPE_INLINE && ed->compression != BTRFS_COMPRESSION_NONE) {
+        // compressed inline extents are kept decompressed in memory - see open_fcb
+        if (ed->decoded_size > fcb->Vcb->superblock.node_size) {
+            ERR("(%llx,%x,%llx) had decoded_size of %llx, expected no more than %x\n", li->key.obj_id, li->key.obj_type, li->key.offset,
+                ed->decoded_size, fcb->Vcb->superblock.node_size);
+            return STATUS_INTERNAL_ERROR;
+        }
+
+        edsize = sizeof(EXTENT_DATA) - 1 + (ULONG)ed->decoded_size;
+
+        newed = ExAllocatePoolWithTag(PagedPool, edsize, ALLOC_TAG);
+        if (!newed) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        RtlCopyMemory(newed, ed, sizeof(EXTENT_DATA) - 1);
+        newed->compression = BTRFS_COMPRESSION_NONE;
+
+        Status = decompress(ed->compression, ed->data, li->size - (sizeof(EXTENT_DATA) - 1), newed->data, ed->decoded_size);
+        if (!NT_SUCCESS(Status)) {
+            ERR("decompress returned %08x\n", Status);
+            ExFreePool(newed);
+            return Status;
+        }
+    } else {
+        edsize = li->size;
+
+        newed = ExAllocatePoolWithTag(PagedPool, edsize, ALLOC_TAG);
+        if (!newed) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        RtlCopyMemory(newed, ed, edsize);
+    }
+
+    if (ed2) {
+        Status = replay_extent_ref(fcb, li->key.offset, ed2, Irp, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("replay_extent_ref returned %08x\n", Status);
+            ExFreePool(newed);
+            return Status;
+        }
+    }
+
+    if (!add_extent_to_fcb(fcb, li->key.offset, newed, edsize, FALSE, rollback)) {
+        ERR("add_extent_to_fcb failed\n");
+        ExFreePool(newed);
+        return STATUS_INTERNAL_ERROR;
+    }
+
+end:
+    fcb->extents_changed = TRUE;
+    mark_fcb_dirty(fcb);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS replay_log_root(device_extension* Vcb, root* subvol, LIST_ENTRY* items, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    LIST_ENTRY changed_sector_list, *le;
+    fcb* fcb = NULL;
+    UINT64 inode = 0;
+
+    InitializeListHead(&changed_sector_list);
+
+    le = items->Flink;
+    while (le != items) {
+        log_item* li = CONTAINING_RECORD(le, log_item, list_entry);
+
+        if (li->key.obj_id == EXTENT_CSUM_ID && li->key.obj_type == TYPE_EXTENT_CSUM) {
+            changed_sector* sc;
+
+            if (li->size == 0 || li->size % sizeof(UINT32) != 0) {
+                ERR("(%llx,%x,%llx) had invalid size %x\n", li->key.obj_id, li->key.obj_type, li->key.offset, li->size);
+                Status = STATUS_INTERNAL_ERROR;
+                goto end;
+            }
+
+            sc = ExAllocatePoolWithTag(PagedPool, sizeof(changed_sector), ALLOC_TAG);
+            if (!sc) {
+                ERR("out of memory\n");
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+                goto end;
+            }
+
+            sc->ol.key = li->key.offset;
+            sc->length = li->size / sizeof(UINT32);
+            sc->checksums = (UINT32*)li->data;
+            sc->deleted = FALSE;
+
+            li->data = NULL;
+
+            InsertTailList(&changed_sector_list, &sc->ol.list_entry);
+        } else if (li->key.obj_type == TYPE_INODE_ITEM || li->key.obj_type == TYPE_EXTENT_DATA) {
+            if (li->key.obj_id != inode) {
+                if (fcb) {
+                    free_fcb(fcb);
+                    fcb = NULL;
+                }
+
+                inode = li->key.obj_id;
+
+                Status = open_fcb(Vcb, subvol, inode, 0, NULL, NULL, &fcb, Irp);
+                if (Status == STATUS_INVALID_PARAMETER) {
+                    WARN("not replaying log for inode %llx in subvol %llx, as it's not on disk\n", inode, subvol->id);
+                    fcb = NULL;
+                } else if (!NT_SUCCESS(Status)) {
+                    ERR("open_fcb returned %08x\n", Status);
+                    fcb = NULL;
+                    goto end;
+                } else if (fcb->type != BTRFS_TYPE_FILE) {
+                    WARN("not replaying log for inode %llx in subvol %llx, as it's not a file\n", inode, subvol->id);
+                    free_fcb(fcb);
+                    fcb = NULL;
+                }
+            }
+
+            if (fcb) {
+                if (li->key.obj_type == TYPE_INODE_ITEM)
+                    Status = replay_inode_item(fcb, li, Irp, rollback);
+                else
+                    Status = replay_extent_data(fcb, li, Irp, rollback);
+
+                if (!NT_SUCCESS(Status))
+                    goto end;
+            }
+        } else
+            WARN("not replaying (%llx,%x,%llx) in subvol %llx\n", li->key.obj_id, li->key.obj_type, li->key.offset, subvol->id);
+
+        le = le->Flink;
+    }
+
+    ExAcquireResourceExclusiveLite(&Vcb->checksum_lock, TRUE);
+    commit_checksum_changes(Vcb, &changed_sector_list);
+    ExReleaseResourceLite(&Vcb->checksum_lock);
+
+    Status = STATUS_SUCCESS;
+
+end:
+    if (fcb)
+        free_fcb(fcb);
+
+    while (!IsListEmpty(&changed_sector_list)) {
+        changed_sector* sc = (changed_sector*)RemoveHeadList(&changed_sector_list);
+
+        ExFreePool(sc->checksums);
+        ExFreePool(sc);
+    }
+
+    return Status;
+}
+
+NTSTATUS replay_log(device_extension* Vcb, PIRP Irp) {
+    NTSTATUS Status;
+    LIST_ENTRY root_items, items, rollback, *le;
+
+    WARN("replaying log tree at %llx\n", Vcb->superblock.log_tree_addr);
+
+    InitializeListHead(&root_items);
+    InitializeListHead(&rollback);
+
+    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
+
+    Status = read_log_tree(Vcb, Vcb->superblock.log_tree_addr, Vcb->superblock.log_root_level, &root_items, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("read_log_tree returned %08x\n", Status);
+        goto end;
+    }
+
+    le = root_items.Flink;
+    while (le != &root_items) {
+        log_item* li = CONTAINING_RECORD(le, log_item, list_entry);
+
+        if (li->key.obj_id == TREE_LOG_ID && li->key.obj_type == TYPE_ROOT_ITEM) {
+            ROOT_ITEM* ri = (ROOT_ITEM*)li->data;
+            root* subvol = NULL;
+            LIST_ENTRY* le2;
+
+            if (li->size < offsetof(ROOT_ITEM, generation2)) {
+                ERR("(%llx,%x,%llx) was %x bytes, expected at least %x\n", li->key.obj_id, li->key.obj_type, li->key.offset, li->size,
+                    offsetof(ROOT_ITEM, generation2));
+                Status = STATUS_INTERNAL_ERROR;
+                goto end;
+            }
+
+            le2 = Vcb->roots.Flink;
+            while (le2 != &Vcb->roots) {
+                root* r = CONTAINING_RECORD(le2, root, list_entry);
+
+                if (r->id == li->key.offset) {
+                    subvol = r;
+                    break;
+                }
+
+                le2 = le2->Flink;
+            }
+
+            if (!subvol)
+                WARN("not replaying log for subvol %llx, as it's not on disk\n", li->key.offset);
+            else {
+                InitializeListHead(&items);
+
+                Status = read_log_tree(Vcb, ri->block_number, ri->root_level, &items, Irp);
+                if (!NT_SUCCESS(Status))
+                    ERR("read_log_tree returned %08x\n", Status);
+                else {
+                    Status = replay_log_root(Vcb, subvol, &items, Irp, &rollback);
+                    if (!NT_SUCCESS(Status))
+                        ERR("replay_log_root returned %08x\n", Status);
+                }
+
+                free_log_items(&items);
+
+                if (!NT_SUCCESS(Status))
+                    goto end;
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    // Committing writes a superblock without the log in it, and then unpins the log's blocks.
+
+    Vcb->superblock.log_tree_addr = 0;
+    Vcb->superblock.log_root_level = 0;
+
+    Status = do_write(Vcb, Irp, &rollback);
+    if (!NT_SUCCESS(Status))
+        ERR("do_write returned %08x\n", Status);
+
+    free_trees(Vcb);
+
+end:
+    if (NT_SUCCESS(Status))
+        clear_rollback(&rollback);
+    else
+        do_rollback(Vcb, &rollback);
+
+    free_log_items(&root_items);
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    return Status;
+}
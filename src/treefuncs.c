@@ -50,6 +50,12 @@ NTSTATUS STDCALL _load_tree(device_extension* Vcb, UINT64 addr, root* r, tree**
     }
     
     th = (tree_header*)buf;
+    
+    if (th->level >= BTRFS_MAX_LEVEL) {
+        ERR("tree at %llx has level %u, maximum is %u\n", addr, th->level, BTRFS_MAX_LEVEL - 1);
+        ExFreePool(buf);
+        return STATUS_INTERNAL_ERROR;
+    }
 
 #ifdef DEBUG_PARANOID
     if (th->tree_id != r->id) {
@@ -284,6 +290,9 @@ static tree* free_tree2(tree* t, const char* func, const char* file, unsigned in
     InterlockedDecrement(&t->Vcb->open_trees);
     RemoveEntryList(&t->list_entry);
     
+    if (t->write)
+        RemoveEntryList(&t->list_entry_dirty);
+    
     if (r) {
         r->treeholder.tree = NULL;
 //             ExReleaseResourceLite(&r->nonpaged->load_tree_lock);
@@ -922,7 +931,7 @@ BOOL STDCALL insert_tree_item(device_extension* Vcb, root* r, UINT64 obj_id, UIN
 //     ERR("size now %x\n", tp.tree->size);
     
     if (!tp.tree->write) {
-        tp.tree->write = TRUE;
+        mark_tree_dirty(tp.tree);
         Vcb->need_write = TRUE;
     }
     
@@ -999,7 +1008,7 @@ void STDCALL delete_tree_item(device_extension* Vcb, traverse_ptr* tp, LIST_ENTR
     tp->item->ignore = TRUE;
     
     if (!tp->tree->write) {
-        tp->tree->write = TRUE;
+        mark_tree_dirty(tp->tree);
         Vcb->need_write = TRUE;
     }
     
@@ -1044,6 +1053,7 @@ void clear_rollback(LIST_ENTRY* rollback) {
             case ROLLBACK_SUBTRACT_SPACE:
             case ROLLBACK_INSERT_EXTENT:
             case ROLLBACK_DELETE_EXTENT:
+            case ROLLBACK_DELAYED_REF:
                 ExFreePool(ri->ptr);
                 break;
 
@@ -1166,10 +1176,17 @@ void do_rollback(device_extension* Vcb, LIST_ENTRY* rollback) {
                 if (rs->chunk)
                     ExAcquireResourceExclusiveLite(&rs->chunk->lock, TRUE);
                 
-                if (ri->type == ROLLBACK_ADD_SPACE)
-                    space_list_subtract2(rs->list, rs->list_size, rs->address, rs->length, NULL);
-                else
-                    space_list_add2(rs->list, rs->list_size, rs->address, rs->length, NULL);
+                if (rs->chunk) {
+                    if (ri->type == ROLLBACK_ADD_SPACE)
+                        space_list_subtract(Vcb, rs->chunk, rs->list == &rs->chunk->deleting, rs->address, rs->length, NULL);
+                    else
+                        space_list_add(Vcb, rs->chunk, rs->list == &rs->chunk->deleting, rs->address, rs->length, NULL);
+                } else {
+                    if (ri->type == ROLLBACK_ADD_SPACE)
+                        space_list_subtract2(rs->list, rs->tree, rs->address, rs->length, NULL);
+                    else
+                        space_list_add2(rs->list, rs->tree, rs->address, rs->length, NULL);
+                }
                 
                 if (rs->chunk) {
                     LIST_ENTRY* le2 = le->Blink;
@@ -1183,9 +1200,9 @@ void do_rollback(device_extension* Vcb, LIST_ENTRY* rollback) {
                             
                             if (rs2->chunk == rs->chunk) {
                                 if (ri2->type == ROLLBACK_ADD_SPACE)
-                                    space_list_subtract2(rs2->list, rs2->list_size, rs2->address, rs2->length, NULL);
+                                    space_list_subtract(Vcb, rs2->chunk, rs2->list == &rs2->chunk->deleting, rs2->address, rs2->length, NULL);
                                 else
-                                    space_list_add2(rs2->list, rs2->list_size, rs2->address, rs2->length, NULL);
+                                    space_list_add(Vcb, rs2->chunk, rs2->list == &rs2->chunk->deleting, rs2->address, rs2->length, NULL);
                                 
                                 ExFreePool(rs2);
                                 RemoveEntryList(&ri2->list_entry);
@@ -1203,6 +1220,18 @@ void do_rollback(device_extension* Vcb, LIST_ENTRY* rollback) {
                 
                 break;
             }
+            
+            case ROLLBACK_DELAYED_REF:
+            {
+                delayed_ref* dr = ri->ptr;
+                
+                Status = add_delayed_ref(Vcb, dr->address, dr->level, dr->root, -dr->count, NULL);
+                if (!NT_SUCCESS(Status))
+                    ERR("add_delayed_ref returned %08x\n", Status);
+                
+                ExFreePool(dr);
+                break;
+            }
         }
         
         ExFreePool(ri);
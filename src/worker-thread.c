@@ -66,7 +66,15 @@ void do_write_job(device_extension* Vcb, PIRP Irp) {
 
 static void do_job(drv_thread* thread, LIST_ENTRY* le) {
     thread_job* tj = CONTAINING_RECORD(le, thread_job, list_entry);
-    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(tj->Irp);
+    PIO_STACK_LOCATION IrpSp;
+    
+    // the caller owns tj, and may free it as soon as func has done its work
+    if (tj->func) {
+        tj->func(tj->context);
+        return;
+    }
+    
+    IrpSp = IoGetCurrentIrpStackLocation(tj->Irp);
     
     if (IrpSp->MajorFunction == IRP_MJ_READ) {
         do_read_job(tj->Irp);
@@ -106,6 +114,7 @@ void STDCALL worker_thread(void* context) {
             
             le = thread->jobs.Flink;
             RemoveEntryList(le);
+            CONTAINING_RECORD(le, thread_job, list_entry)->started = TRUE;
             
             KeReleaseSpinLock(&thread->spin_lock, irql);
             
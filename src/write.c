@@ -45,42 +45,26 @@ static NTSTATUS STDCALL write_data_completion(PDEVICE_OBJECT DeviceObject, PIRP
 static void remove_fcb_extent(fcb* fcb, extent* ext, LIST_ENTRY* rollback);
 
 BOOL find_address_in_chunk(device_extension* Vcb, chunk* c, UINT64 length, UINT64* address) {
-    LIST_ENTRY* le;
     space* s;
     
     TRACE("(%p, %llx, %llx, %p)\n", Vcb, c->offset, length, address);
     
-    if (IsListEmpty(&c->space_size))
-        return FALSE;
-    
-    le = c->space_size.Flink;
-    while (le != &c->space_size) {
-        s = CONTAINING_RECORD(le, space, list_entry_size);
+    if (!c->cache_loaded) {
+        NTSTATUS Status = load_cache_chunk(Vcb, c, NULL);
         
-        if (s->size == length) {
-            *address = s->address;
-            return TRUE;
-        } else if (s->size < length) {
-            if (le == c->space_size.Flink)
-                return FALSE;
-            
-            s = CONTAINING_RECORD(le->Blink, space, list_entry_size);
-            
-            *address = s->address;
-            return TRUE;
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_cache_chunk returned %08x\n", Status);
+            return FALSE;
         }
-        
-        le = le->Flink;
     }
     
-    s = CONTAINING_RECORD(c->space_size.Blink, space, list_entry_size);
+    s = space_tree_first_fit(c->space_tree, length);
     
-    if (s->size > length) {
-        *address = s->address;
-        return TRUE;
-    }
+    if (!s)
+        return find_space_in_bitmaps(Vcb, c, length, address);
     
-    return FALSE;
+    *address = s->address;
+    return TRUE;
 }
 
 chunk* get_chunk_from_address(device_extension* Vcb, UINT64 address) {
@@ -420,7 +404,8 @@ chunk* alloc_chunk(device_extension* Vcb, UINT64 flags) {
     c->used = c->oldused = 0;
     c->cache = NULL;
     InitializeListHead(&c->space);
-    InitializeListHead(&c->space_size);
+    c->space_tree = NULL;
+    InitializeListHead(&c->bitmaps);
     InitializeListHead(&c->deleting);
     InitializeListHead(&c->changed_extents);
     
@@ -436,10 +421,12 @@ chunk* alloc_chunk(device_extension* Vcb, UINT64 flags) {
     s->address = c->offset;
     s->size = c->chunk_item->size;
     InsertTailList(&c->space, &s->list_entry);
-    InsertTailList(&c->space_size, &s->list_entry_size);
+    space_tree_insert(&c->space_tree, s);
     
     protect_superblocks(Vcb, c);
     
+    c->cache_loaded = TRUE;
+    
     for (i = 0; i < num_stripes; i++) {
         stripes[i].device->devitem.bytes_used += stripe_size;
         
@@ -1030,19 +1017,22 @@ NTSTATUS STDCALL write_data(device_extension* Vcb, UINT64 address, void* data, B
         c = get_chunk_from_address(Vcb, address);
         if (!c) {
             ERR("could not get chunk for address %llx\n", address);
-            return STATUS_INTERNAL_ERROR;
+            Status = STATUS_INTERNAL_ERROR;
+            goto fail;
         }
     }
     
     if (c->chunk_item->type & BLOCK_FLAG_RAID6) {
         FIXME("RAID6 not yet supported\n");
-        return STATUS_NOT_IMPLEMENTED;
+        Status = STATUS_NOT_IMPLEMENTED;
+        goto fail;
     }
     
     stripes = ExAllocatePoolWithTag(PagedPool, sizeof(write_stripe) * c->chunk_item->num_stripes, ALLOC_TAG);
     if (!stripes) {
         ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto fail;
     }
     
     RtlZeroMemory(stripes, sizeof(write_stripe) * c->chunk_item->num_stripes);
@@ -1053,8 +1043,7 @@ NTSTATUS STDCALL write_data(device_extension* Vcb, UINT64 address, void* data, B
         Status = prepare_raid0_write(c, address, data, length, stripes);
         if (!NT_SUCCESS(Status)) {
             ERR("prepare_raid0_write returned %08x\n", Status);
-            ExFreePool(stripes);
-            return Status;
+            goto fail;
         }
         
         if (need_free)
@@ -1065,8 +1054,7 @@ NTSTATUS STDCALL write_data(device_extension* Vcb, UINT64 address, void* data, B
         Status = prepare_raid10_write(c, address, data, length, stripes);
         if (!NT_SUCCESS(Status)) {
             ERR("prepare_raid10_write returned %08x\n", Status);
-            ExFreePool(stripes);
-            return Status;
+            goto fail;
         }
         
         if (need_free)
@@ -1077,8 +1065,7 @@ NTSTATUS STDCALL write_data(device_extension* Vcb, UINT64 address, void* data, B
         Status = prepare_raid5_write(Irp, c, address, data, length, stripes);
         if (!NT_SUCCESS(Status)) {
             ERR("prepare_raid5_write returned %08x\n", Status);
-            ExFreePool(stripes);
-            return Status;
+            goto fail;
         }
         
         if (need_free)
@@ -1124,6 +1111,7 @@ NTSTATUS STDCALL write_data(device_extension* Vcb, UINT64 address, void* data, B
             
                 if (!stripe->Irp) {
                     ERR("IoAllocateIrp failed\n");
+                    ExFreePool(stripe);
                     Status = STATUS_INTERNAL_ERROR;
                     goto end;
                 }
@@ -1132,6 +1120,7 @@ NTSTATUS STDCALL write_data(device_extension* Vcb, UINT64 address, void* data, B
                 
                 if (!stripe->Irp) {
                     ERR("IoMakeAssociatedIrp failed\n");
+                    ExFreePool(stripe);
                     Status = STATUS_INTERNAL_ERROR;
                     goto end;
                 }
@@ -1149,6 +1138,8 @@ NTSTATUS STDCALL write_data(device_extension* Vcb, UINT64 address, void* data, B
                                                         stripes[i].end - stripes[i].start - stripes[i].skip_start - stripes[i].skip_end, FALSE, FALSE, NULL);
                 if (!stripe->Irp->MdlAddress) {
                     ERR("IoAllocateMdl failed\n");
+                    IoFreeIrp(stripe->Irp);
+                    ExFreePool(stripe);
                     Status = STATUS_INTERNAL_ERROR;
                     goto end;
                 }
@@ -1173,18 +1164,179 @@ NTSTATUS STDCALL write_data(device_extension* Vcb, UINT64 address, void* data, B
     Status = STATUS_SUCCESS;
     
 end:
+    // The stripes we've added to wtc get freed by our caller, along with their buffers. Anything we didn't get as far
+    // as adding is ours to free - bearing in mind that mirrors share their buffers.
+    if (!NT_SUCCESS(Status) && need_free2) {
+        UINT32 j, k;
+        
+        for (j = i; j < c->chunk_item->num_stripes; j++) {
+            if (stripes[j].data) {
+                BOOL dupe = FALSE;
+                
+                for (k = 0; k < j; k++) {
+                    if (stripes[k].data == stripes[j].data) {
+                        dupe = TRUE;
+                        break;
+                    }
+                }
+                
+                if (!dupe)
+                    ExFreePool(stripes[j].data);
+            }
+        }
+    }
+    
+    ExFreePool(stripes);
+    
+    return Status;
+    
+fail:
+    if (stripes)
+        ExFreePool(stripes);
+    
+    if (need_free)
+        ExFreePool(data);
+    
+    return Status;
+}
+
+// Checksums are worked out in runs of this many sectors, which for big writes get shared out among the worker threads
+#define CSUM_RUN_SECTORS 256
 
-    if (stripes) ExFreePool(stripes);
+typedef struct {
+    UINT8* data;
+    UINT32* csum;
+    ULONG sector_size;
+    ULONG num_sectors;
+    LONG next_run;
+    LONG refcount;
+    KEVENT event;
+} csum_batch;
+
+static void calc_csum_runs(csum_batch* cb) {
+    ULONG num_runs = (cb->num_sectors + CSUM_RUN_SECTORS - 1) / CSUM_RUN_SECTORS;
+    LONG i;
     
-    if (!NT_SUCCESS(Status)) {
-        free_write_data_stripes(wtc);
-        ExFreePool(wtc);
+    while ((i = InterlockedIncrement(&cb->next_run) - 1) < (LONG)num_runs) {
+        ULONG start = i * CSUM_RUN_SECTORS;
+        
+        calc_sector_crc32c(cb->data + ((UINT64)start * cb->sector_size), cb->sector_size, min(CSUM_RUN_SECTORS, cb->num_sectors - start), &cb->csum[start]);
     }
+}
+
+static void calc_csum_job(void* context) {
+    csum_batch* cb = context;
     
-    return Status;
+    calc_csum_runs(cb);
+    
+    if (InterlockedDecrement(&cb->refcount) == 0)
+        KeSetEvent(&cb->event, 0, FALSE);
 }
 
-NTSTATUS STDCALL write_data_complete(device_extension* Vcb, UINT64 address, void* data, UINT32 length, PIRP Irp, chunk* c) {
+// As in write_compressed_batch, we do our share of the work too, and take back anything the threads haven't started on.
+static void calc_csum(device_extension* Vcb, UINT8* data, ULONG num_sectors, UINT32* csum) {
+    csum_batch cb;
+    thread_job* jobs;
+    ULONG i, num_jobs, submitted = 0;
+    
+    num_jobs = min((num_sectors - 1) / CSUM_RUN_SECTORS, Vcb->threads.num_threads);
+    
+    if (num_jobs == 0) {
+        calc_sector_crc32c(data, Vcb->superblock.sector_size, num_sectors, csum);
+        return;
+    }
+    
+    cb.data = data;
+    cb.csum = csum;
+    cb.sector_size = Vcb->superblock.sector_size;
+    cb.num_sectors = num_sectors;
+    cb.next_run = 0;
+    cb.refcount = 1;
+    KeInitializeEvent(&cb.event, NotificationEvent, FALSE);
+    
+    jobs = ExAllocatePoolWithTag(NonPagedPool, sizeof(thread_job) * num_jobs, ALLOC_TAG);
+    
+    if (jobs) {
+        for (i = 0; i < num_jobs; i++) {
+            jobs[i].func = calc_csum_job;
+            jobs[i].context = &cb;
+            
+            InterlockedIncrement(&cb.refcount);
+            
+            if (!add_thread_func_job(Vcb, &jobs[i])) {
+                InterlockedDecrement(&cb.refcount);
+                break;
+            }
+            
+            submitted++;
+        }
+    }
+    
+    calc_csum_runs(&cb);
+    
+    for (i = 0; i < submitted; i++) {
+        if (cancel_thread_job(Vcb, &jobs[i]))
+            InterlockedDecrement(&cb.refcount);
+    }
+    
+    if (InterlockedDecrement(&cb.refcount) != 0)
+        KeWaitForSingleObject(&cb.event, Executive, KernelMode, FALSE, NULL);
+    
+    if (jobs)
+        ExFreePool(jobs);
+}
+
+// A write only fails if some of the data didn't make it to any disk. With SINGLE, DUP and RAID1 one good copy is
+// enough, and with RAID10 one good copy of each stripe.
+static NTSTATUS get_write_status(chunk* c, write_data_context* wtc) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    UINT16 group_size, j = 0;
+    BOOL group_ok = TRUE, group_used = FALSE;
+    LIST_ENTRY* le;
+    
+    if (c->chunk_item->type & (BLOCK_FLAG_RAID0 | BLOCK_FLAG_RAID5))
+        group_size = 1;
+    else if (c->chunk_item->type & BLOCK_FLAG_RAID10)
+        group_size = c->chunk_item->sub_stripes;
+    else
+        group_size = c->chunk_item->num_stripes;
+    
+    le = wtc->stripes.Flink;
+    while (le != &wtc->stripes) {
+        write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
+        
+        if (j % group_size == 0) {
+            Status = STATUS_SUCCESS;
+            group_ok = FALSE;
+            group_used = FALSE;
+        }
+        
+        if (stripe->status != WriteDataStatus_Ignore) {
+            group_used = TRUE;
+            
+            if (stripe->status == WriteDataStatus_Success)
+                group_ok = TRUE;
+            else {
+                WARN("write to device %llx failed (%08x)\n", stripe->device->devitem.dev_id, stripe->iosb.Status);
+                
+                if (NT_SUCCESS(Status))
+                    Status = NT_SUCCESS(stripe->iosb.Status) ? STATUS_INTERNAL_ERROR : stripe->iosb.Status;
+            }
+        }
+        
+        j++;
+        
+        if (j % group_size == 0 && group_used && !group_ok)
+            return Status;
+        
+        le = le->Flink;
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+// If csum is set, the data's checksums get calculated into it while the device is busy with the write.
+static NTSTATUS write_data_csum(device_extension* Vcb, UINT64 address, void* data, UINT32 length, UINT32* csum, PIRP Irp, chunk* c) {
     write_data_context* wtc;
     NTSTATUS Status;
 // #ifdef DEBUG_PARANOID
@@ -1222,22 +1374,16 @@ NTSTATUS STDCALL write_data_complete(device_extension* Vcb, UINT64 address, void
             le = le->Flink;
         }
         
+        if (csum)
+            calc_csum(Vcb, data, length / Vcb->superblock.sector_size, csum);
+        
         KeWaitForSingleObject(&wtc->Event, Executive, KernelMode, FALSE, NULL);
         
-        le = wtc->stripes.Flink;
-        while (le != &wtc->stripes) {
-            write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
-            
-            if (stripe->status != WriteDataStatus_Ignore && !NT_SUCCESS(stripe->iosb.Status)) {
-                Status = stripe->iosb.Status;
-                break;
-            }
-            
-            le = le->Flink;
-        }
+        Status = get_write_status(c ? c : get_chunk_from_address(Vcb, address), wtc);
         
         free_write_data_stripes(wtc);
-    }
+    } else if (csum)
+        calc_csum(Vcb, data, length / Vcb->superblock.sector_size, csum);
 
     ExFreePool(wtc);
 
@@ -1251,43 +1397,25 @@ NTSTATUS STDCALL write_data_complete(device_extension* Vcb, UINT64 address, void
 //     ExFreePool(buf2);
 // #endif
 
-    return STATUS_SUCCESS;
+    return Status;
+}
+
+NTSTATUS STDCALL write_data_complete(device_extension* Vcb, UINT64 address, void* data, UINT32 length, PIRP Irp, chunk* c) {
+    return write_data_csum(Vcb, address, data, length, NULL, Irp, c);
 }
 
 static NTSTATUS STDCALL write_data_completion(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID conptr) {
     write_data_stripe* stripe = conptr;
     write_data_context* context = (write_data_context*)stripe->context;
-    LIST_ENTRY* le;
-    
-    // FIXME - we need a lock here
-    
-    if (stripe->status == WriteDataStatus_Cancelling) {
-        stripe->status = WriteDataStatus_Cancelled;
-        goto end;
-    }
     
     stripe->iosb = Irp->IoStatus;
     
-    if (NT_SUCCESS(Irp->IoStatus.Status)) {
+    // We don't cancel the other stripes if this one fails - if it's a mirror, they might be the only good copy.
+    if (NT_SUCCESS(Irp->IoStatus.Status))
         stripe->status = WriteDataStatus_Success;
-    } else {
-        le = context->stripes.Flink;
-        
+    else
         stripe->status = WriteDataStatus_Error;
-        
-        while (le != &context->stripes) {
-            write_data_stripe* s2 = CONTAINING_RECORD(le, write_data_stripe, list_entry);
-            
-            if (s2->status == WriteDataStatus_Pending) {
-                s2->status = WriteDataStatus_Cancelling;
-                IoCancelIrp(s2->Irp);
-            }
-            
-            le = le->Flink;
-        }
-    }
     
-end:
     if (InterlockedDecrement(&context->stripes_left) == 0)
         KeSetEvent(&context->Event, 0, FALSE);
 
@@ -1348,6 +1476,8 @@ static changed_extent* get_changed_extent_item(chunk* c, UINT64 address, UINT64
         
         if (ce->address == address && ce->size == size)
             return ce;
+        else if (ce->address > address)
+            break;
         
         le = le->Flink;
     }
@@ -1367,7 +1497,8 @@ static changed_extent* get_changed_extent_item(chunk* c, UINT64 address, UINT64
     InitializeListHead(&ce->refs);
     InitializeListHead(&ce->old_refs);
     
-    InsertTailList(&c->changed_extents, &ce->list_entry);
+    // keep the list in address order, so that update_chunk_usage goes through the extent tree in one pass
+    InsertTailList(le, &ce->list_entry);
     
     return ce;
 }
@@ -1564,6 +1695,7 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT
                         newext->datalen = sizeof(EXTENT_DATA) - 1 + size;
                         newext->unique = ext->unique;
                         newext->ignore = FALSE;
+                        newext->inserted = TRUE;
                         InsertHeadList(&ext->list_entry, &newext->list_entry);
                         
                         remove_fcb_extent(fcb, ext, rollback);
@@ -1605,6 +1737,7 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT
                         newext->datalen = sizeof(EXTENT_DATA) - 1 + size;
                         newext->unique = ext->unique;
                         newext->ignore = FALSE;
+                        newext->inserted = TRUE;
                         InsertHeadList(&ext->list_entry, &newext->list_entry);
                         
                         remove_fcb_extent(fcb, ext, rollback);
@@ -1646,6 +1779,7 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT
                         newext1->datalen = sizeof(EXTENT_DATA) - 1 + size;
                         newext1->unique = FALSE;
                         newext1->ignore = FALSE;
+                        newext1->inserted = TRUE;
                         
                         size = ext->offset + len - end_data;
                         
@@ -1682,6 +1816,7 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT
                         newext2->datalen = sizeof(EXTENT_DATA) - 1 + size;
                         newext2->unique = FALSE;
                         newext2->ignore = FALSE;
+                        newext2->inserted = TRUE;
                         
                         InsertHeadList(&ext->list_entry, &newext1->list_entry);
                         InsertHeadList(&newext1->list_entry, &newext2->list_entry);
@@ -1753,6 +1888,7 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT
                         newext->datalen = sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2);
                         newext->unique = ext->unique;
                         newext->ignore = FALSE;
+                        newext->inserted = TRUE;
                         InsertHeadList(&ext->list_entry, &newext->list_entry);
                         
                         remove_fcb_extent(fcb, ext, rollback);
@@ -1797,6 +1933,7 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT
                         newext->datalen = sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2);
                         newext->unique = ext->unique;
                         newext->ignore = FALSE;
+                        newext->inserted = TRUE;
                         InsertHeadList(&ext->list_entry, &newext->list_entry);
                         
                         remove_fcb_extent(fcb, ext, rollback);
@@ -1889,12 +2026,14 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT
                         newext1->datalen = sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2);
                         newext1->unique = FALSE;
                         newext1->ignore = FALSE;
+                        newext1->inserted = TRUE;
                         
                         newext2->offset = end_data;
                         newext2->data = nedb;
                         newext2->datalen = sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2);
                         newext2->unique = FALSE;
                         newext2->ignore = FALSE;
+                        newext2->inserted = TRUE;
                         
                         InsertHeadList(&ext->list_entry, &newext1->list_entry);
                         InsertHeadList(&newext1->list_entry, &newext2->list_entry);
@@ -1919,41 +2058,39 @@ end:
     return Status;
 }
 
-static NTSTATUS do_write_data(device_extension* Vcb, UINT64 address, void* data, UINT64 length, LIST_ENTRY* changed_sector_list, PIRP Irp) {
+static NTSTATUS do_write_data(device_extension* Vcb, UINT64 address, void* data, UINT64 length, LIST_ENTRY* changed_sector_list, PIRP Irp, chunk* c) {
     NTSTATUS Status;
     changed_sector* sc;
-    int i;
     
-    Status = write_data_complete(Vcb, address, data, length, Irp, NULL);
+    if (!changed_sector_list)
+        return write_data_complete(Vcb, address, data, (UINT32)length, Irp, c);
+    
+    sc = ExAllocatePoolWithTag(PagedPool, sizeof(changed_sector), ALLOC_TAG);
+    if (!sc) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    sc->ol.key = address;
+    sc->length = length / Vcb->superblock.sector_size;
+    sc->deleted = FALSE;
+    
+    sc->checksums = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * sc->length, ALLOC_TAG);
+    if (!sc->checksums) {
+        ERR("out of memory\n");
+        ExFreePool(sc);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    Status = write_data_csum(Vcb, address, data, (UINT32)length, sc->checksums, Irp, c);
     if (!NT_SUCCESS(Status)) {
-        ERR("write_data returned %08x\n", Status);
+        ERR("write_data_csum returned %08x\n", Status);
+        ExFreePool(sc->checksums);
+        ExFreePool(sc);
         return Status;
     }
-    
-    if (changed_sector_list) {
-        sc = ExAllocatePoolWithTag(PagedPool, sizeof(changed_sector), ALLOC_TAG);
-        if (!sc) {
-            ERR("out of memory\n");
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
-        
-        sc->ol.key = address;
-        sc->length = length / Vcb->superblock.sector_size;
-        sc->deleted = FALSE;
-        
-        sc->checksums = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * sc->length, ALLOC_TAG);
-        if (!sc->checksums) {
-            ERR("out of memory\n");
-            ExFreePool(sc);
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
-        
-        for (i = 0; i < sc->length; i++) {
-            sc->checksums[i] = ~calc_crc32c(0xffffffff, (UINT8*)data + (i * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
-        }
 
-        insert_into_ordered_list(changed_sector_list, &sc->ol);
-    }
+    insert_into_ordered_list(changed_sector_list, &sc->ol);
     
     return STATUS_SUCCESS;
 }
@@ -1973,7 +2110,7 @@ static void add_insert_extent_rollback(LIST_ENTRY* rollback, fcb* fcb, extent* e
     add_rollback(rollback, ROLLBACK_INSERT_EXTENT, re);
 }
 
-static BOOL add_extent_to_fcb(fcb* fcb, UINT64 offset, EXTENT_DATA* ed, ULONG edsize, BOOL unique, LIST_ENTRY* rollback) {
+BOOL add_extent_to_fcb(fcb* fcb, UINT64 offset, EXTENT_DATA* ed, ULONG edsize, BOOL unique, LIST_ENTRY* rollback) {
     extent* ext;
     LIST_ENTRY* le;
     
@@ -1988,6 +2125,7 @@ static BOOL add_extent_to_fcb(fcb* fcb, UINT64 offset, EXTENT_DATA* ed, ULONG ed
     ext->datalen = edsize;
     ext->unique = unique;
     ext->ignore = FALSE;
+    ext->inserted = TRUE;
     
     le = fcb->extents.Flink;
     while (le != &fcb->extents) {
@@ -2030,7 +2168,7 @@ static void remove_fcb_extent(fcb* fcb, extent* ext, LIST_ENTRY* rollback) {
     }
 }
 
-static void add_changed_extent_ref(chunk* c, UINT64 address, UINT64 size, UINT64 root, UINT64 objid, UINT64 offset, UINT32 count, BOOL no_csum) {
+void add_changed_extent_ref(chunk* c, UINT64 address, UINT64 size, UINT64 root, UINT64 objid, UINT64 offset, UINT32 count, BOOL no_csum) {
     changed_extent* ce;
     changed_extent_ref* cer;
     LIST_ENTRY* le;
@@ -2072,9 +2210,8 @@ static void add_changed_extent_ref(chunk* c, UINT64 address, UINT64 size, UINT64
     ce->count += count;
 }
 
-BOOL insert_extent_chunk(device_extension* Vcb, fcb* fcb, chunk* c, UINT64 start_data, UINT64 length, BOOL prealloc, void* data,
-                         LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback, UINT8 compression, UINT64 decoded_size) {
-    UINT64 address;
+static BOOL insert_extent_chunk_address(device_extension* Vcb, fcb* fcb, chunk* c, UINT64 address, UINT64 start_data, UINT64 length, BOOL prealloc, void* data,
+                                        LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback, UINT8 compression, UINT64 decoded_size) {
     NTSTATUS Status;
     EXTENT_DATA* ed;
     EXTENT_DATA2* ed2;
@@ -2084,11 +2221,6 @@ BOOL insert_extent_chunk(device_extension* Vcb, fcb* fcb, chunk* c, UINT64 start
 //     KEY searchkey;
 // #endif
     
-    TRACE("(%p, (%llx, %llx), %llx, %llx, %llx, %u, %p, %p, %p)\n", Vcb, fcb->subvol->id, fcb->inode, c->offset, start_data, length, prealloc, data, changed_sector_list, rollback);
-    
-    if (!find_address_in_chunk(Vcb, c, length, &address))
-        return FALSE;
-    
 // #ifdef DEBUG_PARANOID
 //     searchkey.obj_id = address;
 //     searchkey.obj_type = TYPE_EXTENT_ITEM;
@@ -2104,7 +2236,7 @@ BOOL insert_extent_chunk(device_extension* Vcb, fcb* fcb, chunk* c, UINT64 start
 // #endif
     
     if (data) {
-        Status = do_write_data(Vcb, address, data, length, changed_sector_list, Irp);
+        Status = do_write_data(Vcb, address, data, length, changed_sector_list, Irp, NULL);
         if (!NT_SUCCESS(Status)) {
             ERR("do_write_data returned %08x\n", Status);
             return FALSE;
@@ -2141,6 +2273,7 @@ BOOL insert_extent_chunk(device_extension* Vcb, fcb* fcb, chunk* c, UINT64 start
     space_list_subtract(Vcb, c, FALSE, address, length, rollback);
     
     fcb->inode_item.st_blocks += decoded_size;
+    fcb->alloc_hint = address + length;
     
     fcb->extents_changed = TRUE;
     mark_fcb_dirty(fcb);
@@ -2154,6 +2287,223 @@ BOOL insert_extent_chunk(device_extension* Vcb, fcb* fcb, chunk* c, UINT64 start
     return TRUE;
 }
 
+BOOL insert_extent_chunk(device_extension* Vcb, fcb* fcb, chunk* c, UINT64 start_data, UINT64 length, BOOL prealloc, void* data,
+                         LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback, UINT8 compression, UINT64 decoded_size) {
+    UINT64 address;
+    
+    TRACE("(%p, (%llx, %llx), %llx, %llx, %llx, %u, %p, %p, %p)\n", Vcb, fcb->subvol->id, fcb->inode, c->offset, start_data, length, prealloc, data, changed_sector_list, rollback);
+    
+    if (!find_address_in_chunk(Vcb, c, length, &address))
+        return FALSE;
+    
+    return insert_extent_chunk_address(Vcb, fcb, c, address, start_data, length, prealloc, data, changed_sector_list, Irp, rollback, compression, decoded_size);
+}
+
+static BOOL find_cluster_in_chunk(device_extension* Vcb, chunk* c, UINT64 length, alloc_cluster* clusters, UINT64* address, UINT64* end) {
+    LIST_ENTRY* le;
+    space* s;
+    BOOL found = FALSE;
+    
+    s = space_tree_first_fit(c->space_tree, length);
+    if (!s)
+        goto bitmaps;
+    
+    le = &s->list_entry;
+    while (le != &c->space) {
+        UINT64 start, send;
+        BOOL moved;
+        UINT8 i;
+        
+        s = CONTAINING_RECORD(le, space, list_entry);
+        
+        if (s->size < length) {
+            le = le->Flink;
+            continue;
+        }
+        
+        start = s->address;
+        send = s->address + s->size;
+        
+        // skip over the parts of this entry which other CPUs' clusters are using
+        
+        do {
+            moved = FALSE;
+            
+            for (i = 0; i < ALLOC_CLUSTERS; i++) {
+                if (clusters[i].end <= clusters[i].address)
+                    continue;
+                
+                if (clusters[i].address <= start && clusters[i].end > start) {
+                    start = clusters[i].end;
+                    moved = TRUE;
+                } else if (clusters[i].address > start && clusters[i].address < send)
+                    send = clusters[i].address;
+            }
+        } while (moved && start < send);
+        
+        if (send > start && send - start >= length) {
+            if (send - start >= ALLOC_CLUSTER_SIZE) {
+                *address = start;
+                *end = send;
+                return TRUE;
+            } else if (!found) {
+                *address = start;
+                *end = send;
+                found = TRUE;
+            }
+        }
+        
+        le = le->Flink;
+    }
+    
+    if (found)
+        return TRUE;
+    
+bitmaps:
+    // Free space in bitmaps isn't in the space list, so it can't be used for a whole cluster - but it can still
+    // satisfy this allocation.
+    if (!find_space_in_bitmaps(Vcb, c, length, address))
+        return FALSE;
+    
+    *end = *address + length;
+    
+    return TRUE;
+}
+
+static BOOL insert_extent_at(device_extension* Vcb, fcb* fcb, UINT64 address, UINT64 start_data, UINT64 length, BOOL prealloc, void* data,
+                             LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback, UINT8 compression, UINT64 decoded_size) {
+    chunk* c;
+    BOOL ret = FALSE;
+    
+    c = get_chunk_from_address(Vcb, address);
+    
+    if (!c || c->chunk_item->type != Vcb->data_flags || address + length > c->offset + c->chunk_item->size)
+        return FALSE;
+    
+    ExAcquireResourceExclusiveLite(&c->lock, TRUE);
+    
+    if (!c->cache_loaded) {
+        NTSTATUS Status = load_cache_chunk(Vcb, c, Irp);
+        
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_cache_chunk returned %08x\n", Status);
+            ExReleaseResourceLite(&c->lock);
+            return FALSE;
+        }
+    }
+    
+    if (is_space_free(Vcb, c, address, length))
+        ret = insert_extent_chunk_address(Vcb, fcb, c, address, start_data, length, prealloc, data, changed_sector_list, Irp, rollback, compression, decoded_size);
+    
+    ExReleaseResourceLite(&c->lock);
+    
+    return ret;
+}
+
+static void advance_cluster(device_extension* Vcb, ULONG idx, UINT64 address, UINT64 length) {
+    KIRQL irql;
+    alloc_cluster* cl = &Vcb->clusters[idx];
+    
+    KeAcquireSpinLock(&Vcb->clusters_lock, &irql);
+    
+    if (address >= cl->address && address < cl->end)
+        cl->address = min(address + length, cl->end);
+    
+    KeReleaseSpinLock(&Vcb->clusters_lock, irql);
+}
+
+// Rather than having every writer start at the beginning of the chunk list and fight over the first chunk's lock,
+// we try to continue from the end of the file's previous extent, then from the current CPU's cluster, and only then
+// look for a new cluster. Clusters aren't removed from the free space lists - they're only a hint to writers on
+// other CPUs to keep out of each other's way.
+BOOL insert_extent_clustered(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT64 length, BOOL prealloc, void* data, LIST_ENTRY* changed_sector_list,
+                             PIRP Irp, LIST_ENTRY* rollback, UINT8 compression, UINT64 decoded_size) {
+    ULONG idx = KeGetCurrentProcessorNumber() % ALLOC_CLUSTERS;
+    alloc_cluster clusters[ALLOC_CLUSTERS];
+    UINT64 address, end;
+    KIRQL irql;
+    LIST_ENTRY* le;
+    UINT8 pass;
+    
+    TRACE("(%p, (%llx, %llx), %llx, %llx, %u, %p, %p, %p)\n", Vcb, fcb->subvol->id, fcb->inode, start_data, length, prealloc, data, changed_sector_list, rollback);
+    
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, TRUE);
+    
+    if (fcb->alloc_hint != 0) {
+        address = fcb->alloc_hint;
+        
+        if (insert_extent_at(Vcb, fcb, address, start_data, length, prealloc, data, changed_sector_list, Irp, rollback, compression, decoded_size)) {
+            advance_cluster(Vcb, idx, address, length);
+            ExReleaseResourceLite(&Vcb->chunk_lock);
+            return TRUE;
+        }
+    }
+    
+    KeAcquireSpinLock(&Vcb->clusters_lock, &irql);
+    address = Vcb->clusters[idx].address;
+    end = Vcb->clusters[idx].end;
+    KeReleaseSpinLock(&Vcb->clusters_lock, irql);
+    
+    if (end > address && end - address >= length) {
+        if (insert_extent_at(Vcb, fcb, address, start_data, length, prealloc, data, changed_sector_list, Irp, rollback, compression, decoded_size)) {
+            advance_cluster(Vcb, idx, address, length);
+            ExReleaseResourceLite(&Vcb->chunk_lock);
+            return TRUE;
+        }
+    }
+    
+    // Look for a new cluster. On the first pass we skip any chunks which somebody else is writing to,
+    // or whose free space we haven't loaded yet.
+    
+    for (pass = 0; pass < 2; pass++) {
+        le = Vcb->chunks.Flink;
+        while (le != &Vcb->chunks) {
+            chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+            
+            if (c->chunk_item->type == Vcb->data_flags && (c->chunk_item->size - c->used) >= length && (pass > 0 || c->cache_loaded)) {
+                if (ExAcquireResourceExclusiveLite(&c->lock, pass > 0)) {
+                    if (!c->cache_loaded) {
+                        NTSTATUS Status = load_cache_chunk(Vcb, c, Irp);
+                        
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("load_cache_chunk returned %08x\n", Status);
+                            ExReleaseResourceLite(&c->lock);
+                            le = le->Flink;
+                            continue;
+                        }
+                    }
+                    
+                    KeAcquireSpinLock(&Vcb->clusters_lock, &irql);
+                    RtlCopyMemory(clusters, Vcb->clusters, sizeof(clusters));
+                    KeReleaseSpinLock(&Vcb->clusters_lock, irql);
+                    
+                    clusters[idx].address = clusters[idx].end = 0;
+                    
+                    if (find_cluster_in_chunk(Vcb, c, length, clusters, &address, &end) &&
+                        insert_extent_chunk_address(Vcb, fcb, c, address, start_data, length, prealloc, data, changed_sector_list, Irp, rollback, compression, decoded_size)) {
+                        KeAcquireSpinLock(&Vcb->clusters_lock, &irql);
+                        Vcb->clusters[idx].address = address + length;
+                        Vcb->clusters[idx].end = max(address + length, min(end, address + ALLOC_CLUSTER_SIZE));
+                        KeReleaseSpinLock(&Vcb->clusters_lock, irql);
+                        
+                        ExReleaseResourceLite(&c->lock);
+                        ExReleaseResourceLite(&Vcb->chunk_lock);
+                        return TRUE;
+                    }
+                    
+                    ExReleaseResourceLite(&c->lock);
+                }
+            }
+            
+            le = le->Flink;
+        }
+    }
+    
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+    
+    return FALSE;
+}
+
 static BOOL extend_data(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT64 length, void* data,
                         LIST_ENTRY* changed_sector_list, extent* ext, chunk* c, PIRP Irp, LIST_ENTRY* rollback) {
     EXTENT_DATA* ed;
@@ -2161,7 +2511,7 @@ static BOOL extend_data(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT
     extent* newext;
     UINT64 addr, origsize;
     NTSTATUS Status;
-    LIST_ENTRY* le;
+    LIST_ENTRY *le, csums;
     
     TRACE("(%p, (%llx, %llx), %llx, %llx, %p, %p, %p, %p)\n", Vcb, fcb->subvol->id, fcb->inode, start_data,
                                                               length, data, changed_sector_list, ext, c, rollback);
@@ -2171,9 +2521,27 @@ static BOOL extend_data(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT
     origsize = ed2orig->size;
     addr = ed2orig->address + ed2orig->size;
     
-    Status = write_data_complete(Vcb, addr, data, length, Irp, c);
+    ed = ExAllocatePoolWithTag(PagedPool, ext->datalen, ALLOC_TAG);
+    if (!ed) {
+        ERR("out of memory\n");
+        return FALSE;
+    }
+    
+    newext = ExAllocatePoolWithTag(PagedPool, sizeof(extent), ALLOC_TAG);
+    if (!newext) {
+        ERR("out of memory\n");
+        ExFreePool(ed);
+        return FALSE;
+    }
+    
+    // the checksums only go on changed_sector_list once we know we're not going to fail
+    InitializeListHead(&csums);
+    
+    Status = do_write_data(Vcb, addr, data, length, changed_sector_list ? &csums : NULL, Irp, c);
     if (!NT_SUCCESS(Status)) {
-        ERR("write_data returned %08x\n", Status);
+        ERR("do_write_data returned %08x\n", Status);
+        ExFreePool(newext);
+        ExFreePool(ed);
         return FALSE;
     }
     
@@ -2187,25 +2555,13 @@ static BOOL extend_data(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT
             if (ed2b->address == ed2orig->address) {
                 ed2b->size = origsize + length;
                 ext2->data->decoded_size = origsize + length;
+                ext2->inserted = TRUE; // so flush_fcb rewrites the item with the new size
             }
         }
                 
         le = le->Flink;
     }
     
-    ed = ExAllocatePoolWithTag(PagedPool, ext->datalen, ALLOC_TAG);
-    if (!ed) {
-        ERR("out of memory\n");
-        return FALSE;
-    }
-    
-    newext = ExAllocatePoolWithTag(PagedPool, sizeof(extent), ALLOC_TAG);
-    if (!newext) {
-        ERR("out of memory\n");
-        ExFreePool(ed);
-        return FALSE;
-    }
-    
     RtlCopyMemory(ed, ext->data, ext->datalen);
 
     ed2 = (EXTENT_DATA2*)ed->data;
@@ -2215,6 +2571,7 @@ static BOOL extend_data(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT
     RtlCopyMemory(newext, ext, sizeof(extent));
     newext->offset = ext->offset + ed2orig->num_bytes;
     newext->data = ed;
+    newext->inserted = TRUE;
     
     InsertHeadList(&ext->list_entry, &newext->list_entry);
     
@@ -2225,31 +2582,20 @@ static BOOL extend_data(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT
 
     if (!NT_SUCCESS(Status)) {
         ERR("update_changed_extent_ref returned %08x\n", Status);
-        return FALSE;
-    }
-    
-    if (changed_sector_list) {
-        int i;
-        changed_sector* sc = ExAllocatePoolWithTag(PagedPool, sizeof(changed_sector), ALLOC_TAG);
-        if (!sc) {
-            ERR("out of memory\n");
-            return FALSE;
-        }
         
-        sc->ol.key = addr;
-        sc->length = length / Vcb->superblock.sector_size;
-        sc->deleted = FALSE;
-        
-        sc->checksums = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * sc->length, ALLOC_TAG);
-        if (!sc->checksums) {
-            ERR("out of memory\n");
+        while (!IsListEmpty(&csums)) {
+            changed_sector* sc = CONTAINING_RECORD(RemoveHeadList(&csums), changed_sector, ol.list_entry);
+            
+            ExFreePool(sc->checksums);
             ExFreePool(sc);
-            return FALSE;
         }
         
-        for (i = 0; i < sc->length; i++) {
-            sc->checksums[i] = ~calc_crc32c(0xffffffff, (UINT8*)data + (i * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
-        }
+        return FALSE;
+    }
+    
+    while (!IsListEmpty(&csums)) {
+        changed_sector* sc = CONTAINING_RECORD(RemoveHeadList(&csums), changed_sector, ol.list_entry);
+        
         insert_into_ordered_list(changed_sector_list, &sc->ol);
     }
     
@@ -2269,7 +2615,7 @@ static BOOL try_extend_data(device_extension* Vcb, fcb* fcb, UINT64 start_data,
     EXTENT_DATA2* ed2;
     chunk* c;
     LIST_ENTRY* le;
-    space* s;
+    UINT64 freelen;
     extent* ext = NULL;
     
     le = fcb->extents.Flink;
@@ -2351,23 +2697,23 @@ static BOOL try_extend_data(device_extension* Vcb, fcb* fcb, UINT64 start_data,
     
     ExAcquireResourceExclusiveLite(&c->lock, TRUE);
     
-    le = c->space.Flink;
-    while (le != &c->space) {
-        s = CONTAINING_RECORD(le, space, list_entry);
+    if (!c->cache_loaded) {
+        NTSTATUS Status = load_cache_chunk(Vcb, c, Irp);
         
-        if (s->address == ed2->address + ed2->size) {
-            UINT64 newlen = min(min(s->size, length), MAX_EXTENT_SIZE - ed2->size);
-            
-            success = extend_data(Vcb, fcb, start_data, newlen, data, changed_sector_list, ext, c, Irp, rollback);
-            
-            if (success)
-                *written += newlen;
-            
-            break;
-        } else if (s->address > ed2->address + ed2->size)
-            break;
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_cache_chunk returned %08x\n", Status);
+            ExReleaseResourceLite(&c->lock);
+            return FALSE;
+        }
+    }
+    
+    freelen = free_space_at(Vcb, c, ed2->address + ed2->size, min(length, MAX_EXTENT_SIZE - ed2->size));
+    
+    if (freelen > 0) {
+        success = extend_data(Vcb, fcb, start_data, freelen, data, changed_sector_list, ext, c, Irp, rollback);
         
-        le = le->Flink;
+        if (success)
+            *written += freelen;
     }
     
     ExReleaseResourceLite(&c->lock);
@@ -2376,7 +2722,6 @@ static BOOL try_extend_data(device_extension* Vcb, fcb* fcb, UINT64 start_data,
 }
 
 static NTSTATUS insert_prealloc_extent(fcb* fcb, UINT64 start, UINT64 length, LIST_ENTRY* rollback) {
-    LIST_ENTRY* le;
     chunk* c;
     UINT64 flags, origlength = length;
     NTSTATUS Status;
@@ -2390,28 +2735,8 @@ static NTSTATUS insert_prealloc_extent(fcb* fcb, UINT64 start, UINT64 length, LI
     do {
         UINT64 extlen = min(MAX_EXTENT_SIZE, length);
         
-        ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, TRUE);
-        
-        le = fcb->Vcb->chunks.Flink;
-        while (le != &fcb->Vcb->chunks) {
-            c = CONTAINING_RECORD(le, chunk, list_entry);
-            
-            ExAcquireResourceExclusiveLite(&c->lock, TRUE);
-            
-            if (c->chunk_item->type == flags && (c->chunk_item->size - c->used) >= extlen) {
-                if (insert_extent_chunk(fcb->Vcb, fcb, c, start, extlen, !page_file, NULL, NULL, NULL, rollback, BTRFS_COMPRESSION_NONE, extlen)) {
-                    ExReleaseResourceLite(&c->lock);
-                    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
-                    goto cont;
-                }
-            }
-            
-            ExReleaseResourceLite(&c->lock);
-
-            le = le->Flink;
-        }
-        
-        ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+        if (insert_extent_clustered(fcb->Vcb, fcb, start, extlen, !page_file, NULL, NULL, NULL, rollback, BTRFS_COMPRESSION_NONE, extlen))
+            goto cont;
         
         ExAcquireResourceExclusiveLite(&fcb->Vcb->chunk_lock, TRUE);
         
@@ -2456,7 +2781,6 @@ end:
 // }
 
 NTSTATUS insert_extent(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT64 length, void* data, LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback) {
-    LIST_ENTRY* le;
     chunk* c;
     UINT64 flags, orig_length = length, written = 0;
     
@@ -2485,41 +2809,18 @@ NTSTATUS insert_extent(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT6
         // Rather than necessarily writing the whole extent at once, we deal with it in blocks of 128 MB.
         // First, see if we can write the extent part to an existing chunk.
         
-        ExAcquireResourceSharedLite(&Vcb->chunk_lock, TRUE);
-        
-        le = Vcb->chunks.Flink;
-        while (le != &Vcb->chunks) {
-            c = CONTAINING_RECORD(le, chunk, list_entry);
+        if (insert_extent_clustered(Vcb, fcb, start_data, newlen, FALSE, data, changed_sector_list, Irp, rollback, BTRFS_COMPRESSION_NONE, newlen)) {
+            written += newlen;
             
-            ExAcquireResourceExclusiveLite(&c->lock, TRUE);
+            if (written == orig_length)
+                return STATUS_SUCCESS;
             
-            if (c->chunk_item->type == flags && (c->chunk_item->size - c->used) >= newlen) {
-                if (insert_extent_chunk(Vcb, fcb, c, start_data, newlen, FALSE, data, changed_sector_list, Irp, rollback, BTRFS_COMPRESSION_NONE, newlen)) {
-                    written += newlen;
-                    
-                    if (written == orig_length) {
-                        ExReleaseResourceLite(&c->lock);
-                        ExReleaseResourceLite(&Vcb->chunk_lock);
-                        return STATUS_SUCCESS;
-                    } else {
-                        done = TRUE;
-                        start_data += newlen;
-                        length -= newlen;
-                        data = &((UINT8*)data)[newlen];
-                        break;
-                    }
-                }
-            }
-            
-            ExReleaseResourceLite(&c->lock);
-
-            le = le->Flink;
+            start_data += newlen;
+            length -= newlen;
+            data = &((UINT8*)data)[newlen];
+            continue;
         }
         
-        ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
-        
-        if (done) continue;
-        
         // Otherwise, see if we can put it in a new chunk.
         
         ExAcquireResourceExclusiveLite(&fcb->Vcb->chunk_lock, TRUE);
@@ -2560,11 +2861,33 @@ NTSTATUS insert_extent(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT6
     return STATUS_DISK_FULL;
 }
 
+// The entries have to stay in the order they were made, as a later one can override an earlier one for the same
+// sectors - so rather than sorting them in, we splice the whole list on to the end in one go.
 void commit_checksum_changes(device_extension* Vcb, LIST_ENTRY* changed_sector_list) {
-    while (!IsListEmpty(changed_sector_list)) {
-        LIST_ENTRY* le = RemoveHeadList(changed_sector_list);
-        InsertTailList(&Vcb->sector_checksums, le);
+    LIST_ENTRY* le;
+    LONG count = 0, total;
+    
+    if (IsListEmpty(changed_sector_list))
+        return;
+    
+    le = changed_sector_list->Flink;
+    while (le != changed_sector_list) {
+        changed_sector* cs = (changed_sector*)le;
+        
+        count += cs->length;
+        
+        le = le->Flink;
     }
+    
+    changed_sector_list->Flink->Blink = Vcb->sector_checksums.Blink;
+    Vcb->sector_checksums.Blink->Flink = changed_sector_list->Flink;
+    changed_sector_list->Blink->Flink = &Vcb->sector_checksums;
+    Vcb->sector_checksums.Blink = changed_sector_list->Blink;
+    
+    InitializeListHead(changed_sector_list);
+    
+    total = InterlockedExchangeAdd(&Vcb->dirty.checksums, count) + count;
+    volume_dirtied(Vcb, total >= FLUSH_DIRTY_CHECKSUMS && total - count < FLUSH_DIRTY_CHECKSUMS);
 }
 
 NTSTATUS truncate_file(fcb* fcb, UINT64 end, PIRP Irp, LIST_ENTRY* rollback) {
@@ -2592,6 +2915,66 @@ NTSTATUS truncate_file(fcb* fcb, UINT64 end, PIRP Irp, LIST_ENTRY* rollback) {
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS convert_inline_extent(fcb* fcb, extent* ext, PIRP Irp, LIST_ENTRY* rollback) {
+    EXTENT_DATA* ed = ext->data;
+    LIST_ENTRY changed_sector_list;
+    BOOL nocsum = fcb->inode_item.flags & BTRFS_INODE_NODATASUM;
+    UINT64 origlength, length;
+    UINT8* data;
+    UINT64 offset = ext->offset;
+    NTSTATUS Status;
+    
+    TRACE("giving inline file proper extents\n");
+    
+    origlength = ed->decoded_size;
+    
+    if (!nocsum)
+        InitializeListHead(&changed_sector_list);
+    
+    length = sector_align(origlength, fcb->Vcb->superblock.sector_size);
+    
+    data = ExAllocatePoolWithTag(PagedPool, length, ALLOC_TAG);
+    if (!data) {
+        ERR("could not allocate %llx bytes for data\n", length);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    if (length > origlength)
+        RtlZeroMemory(data + origlength, length - origlength);
+    
+    RtlCopyMemory(data, ed->data, origlength);
+    
+    fcb->inode_item.st_blocks -= origlength;
+    
+    remove_fcb_extent(fcb, ext, rollback);
+    
+    if (write_fcb_compressed(fcb)) {
+        Status = write_compressed(fcb, offset, offset + length, data, nocsum ? NULL : &changed_sector_list, Irp, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("write_compressed returned %08x\n", Status);
+            ExFreePool(data);
+            return Status;
+        }
+    } else {
+        Status = insert_extent(fcb->Vcb, fcb, offset, length, data, nocsum ? NULL : &changed_sector_list, Irp, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("insert_extent returned %08x\n", Status);
+            ExFreePool(data);
+            return Status;
+        }
+    }
+    
+    ExFreePool(data);
+    
+    if (!nocsum) {
+        ExAcquireResourceExclusiveLite(&fcb->Vcb->checksum_lock, TRUE);
+        commit_checksum_changes(fcb->Vcb, &changed_sector_list);
+        ExReleaseResourceLite(&fcb->Vcb->checksum_lock);
+    }
+    
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS extend_file(fcb* fcb, file_ref* fileref, UINT64 end, BOOL prealloc, PIRP Irp, LIST_ENTRY* rollback) {
     UINT64 oldalloc, newalloc;
     BOOL cur_inline;
@@ -2631,63 +3014,15 @@ NTSTATUS extend_file(fcb* fcb, file_ref* fileref, UINT64 end, BOOL prealloc, PIR
             cur_inline = ed->type == EXTENT_TYPE_INLINE;
         
             if (cur_inline && end > fcb->Vcb->options.max_inline) {
-                LIST_ENTRY changed_sector_list;
-                BOOL nocsum = fcb->inode_item.flags & BTRFS_INODE_NODATASUM;
-                UINT64 origlength, length;
-                UINT8* data;
-                UINT64 offset = ext->offset;
-                
-                TRACE("giving inline file proper extents\n");
-                
-                origlength = ed->decoded_size;
-                
                 cur_inline = FALSE;
                 
-                if (!nocsum)
-                    InitializeListHead(&changed_sector_list);
-                
-                length = sector_align(origlength, fcb->Vcb->superblock.sector_size);
-                
-                data = ExAllocatePoolWithTag(PagedPool, length, ALLOC_TAG);
-                if (!data) {
-                    ERR("could not allocate %llx bytes for data\n", length);
-                    return STATUS_INSUFFICIENT_RESOURCES;
-                }
-                
-                if (length > origlength)
-                    RtlZeroMemory(data + origlength, length - origlength);
-                
-                RtlCopyMemory(data, ed->data, origlength);
-                
-                fcb->inode_item.st_blocks -= origlength;
-                
-                remove_fcb_extent(fcb, ext, rollback);
-                
-                if (write_fcb_compressed(fcb)) {
-                    Status = write_compressed(fcb, offset, offset + length, data, nocsum ? NULL : &changed_sector_list, Irp, rollback);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("write_compressed returned %08x\n", Status);
-                        ExFreePool(data);
-                        return Status;
-                    }
-                } else {
-                    Status = insert_extent(fcb->Vcb, fcb, offset, length, data, nocsum ? NULL : &changed_sector_list, Irp, rollback);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("insert_extent returned %08x\n", Status);
-                        ExFreePool(data);
-                        return Status;
-                    }
+                Status = convert_inline_extent(fcb, ext, Irp, rollback);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("convert_inline_extent returned %08x\n", Status);
+                    return Status;
                 }
                 
-                oldalloc = ext->offset + length;
-                
-                ExFreePool(data);
-                
-                if (!nocsum) {
-                    ExAcquireResourceExclusiveLite(&fcb->Vcb->checksum_lock, TRUE);
-                    commit_checksum_changes(fcb->Vcb, &changed_sector_list);
-                    ExReleaseResourceLite(&fcb->Vcb->checksum_lock);
-                }
+                oldalloc = ext->offset + sector_align(ed->decoded_size, fcb->Vcb->superblock.sector_size);
             }
             
             if (cur_inline) {
@@ -2848,7 +3183,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, UINT64 start_data,
         
         ned->type = EXTENT_TYPE_REGULAR;
         
-        Status = do_write_data(fcb->Vcb, ed2->address + ed2->offset, (UINT8*)data + ext->offset - start_data, ed2->num_bytes, changed_sector_list, Irp);
+        Status = do_write_data(fcb->Vcb, ed2->address + ed2->offset, (UINT8*)data + ext->offset - start_data, ed2->num_bytes, changed_sector_list, Irp, NULL);
         if (!NT_SUCCESS(Status)) {
             ERR("do_write_data returned %08x\n", Status);
             return Status;
@@ -2861,6 +3196,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, UINT64 start_data,
         newext->datalen = ext->datalen;
         newext->unique = ext->unique;
         newext->ignore = FALSE;
+        newext->inserted = TRUE;
         InsertHeadList(&ext->list_entry, &newext->list_entry);
 
         add_insert_extent_rollback(rollback, fcb, newext);
@@ -2911,7 +3247,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, UINT64 start_data,
         ned2->offset += end_data - ext->offset;
         ned2->num_bytes -= end_data - ext->offset;
         
-        Status = do_write_data(fcb->Vcb, ed2->address + ed2->offset, (UINT8*)data + ext->offset - start_data, end_data - ext->offset, changed_sector_list, Irp);
+        Status = do_write_data(fcb->Vcb, ed2->address + ed2->offset, (UINT8*)data + ext->offset - start_data, end_data - ext->offset, changed_sector_list, Irp, NULL);
         if (!NT_SUCCESS(Status)) {
             ERR("do_write_data returned %08x\n", Status);
             return Status;
@@ -2924,6 +3260,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, UINT64 start_data,
         newext1->datalen = ext->datalen;
         newext1->unique = FALSE;
         newext1->ignore = FALSE;
+        newext1->inserted = TRUE;
         InsertHeadList(&ext->list_entry, &newext1->list_entry);
         
         add_insert_extent_rollback(rollback, fcb, newext1);
@@ -2933,6 +3270,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, UINT64 start_data,
         newext2->datalen = ext->datalen;
         newext2->unique = FALSE;
         newext2->ignore = FALSE;
+        newext2->inserted = TRUE;
         InsertHeadList(&newext1->list_entry, &newext2->list_entry);
         
         add_insert_extent_rollback(rollback, fcb, newext2);
@@ -2999,7 +3337,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, UINT64 start_data,
         ned2->offset += start_data - ext->offset;
         ned2->num_bytes = ext->offset + ed2->num_bytes - start_data;
         
-        Status = do_write_data(fcb->Vcb, ed2->address + ned2->offset, data, ned2->num_bytes, changed_sector_list, Irp);
+        Status = do_write_data(fcb->Vcb, ed2->address + ned2->offset, data, ned2->num_bytes, changed_sector_list, Irp, NULL);
         if (!NT_SUCCESS(Status)) {
             ERR("do_write_data returned %08x\n", Status);
             return Status;
@@ -3012,6 +3350,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, UINT64 start_data,
         newext1->datalen = ext->datalen;
         newext1->unique = FALSE;
         newext1->ignore = FALSE;
+        newext1->inserted = TRUE;
         InsertHeadList(&ext->list_entry, &newext1->list_entry);
         
         add_insert_extent_rollback(rollback, fcb, newext1);
@@ -3021,6 +3360,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, UINT64 start_data,
         newext2->datalen = ext->datalen;
         newext2->unique = FALSE;
         newext2->ignore = FALSE;
+        newext2->inserted = TRUE;
         InsertHeadList(&newext1->list_entry, &newext2->list_entry);
         
         add_insert_extent_rollback(rollback, fcb, newext2);
@@ -3113,7 +3453,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, UINT64 start_data,
         ned2->num_bytes -= end_data - ext->offset;
         
         ned2 = (EXTENT_DATA2*)nedb->data;
-        Status = do_write_data(fcb->Vcb, ed2->address + ned2->offset, data, end_data - start_data, changed_sector_list, Irp);
+        Status = do_write_data(fcb->Vcb, ed2->address + ned2->offset, data, end_data - start_data, changed_sector_list, Irp, NULL);
         if (!NT_SUCCESS(Status)) {
             ERR("do_write_data returned %08x\n", Status);
             return Status;
@@ -3126,6 +3466,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, UINT64 start_data,
         newext1->datalen = ext->datalen;
         newext1->unique = FALSE;
         newext1->ignore = FALSE;
+        newext1->inserted = TRUE;
         InsertHeadList(&ext->list_entry, &newext1->list_entry);
         
         add_insert_extent_rollback(rollback, fcb, newext1);
@@ -3135,6 +3476,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, UINT64 start_data,
         newext2->datalen = ext->datalen;
         newext2->unique = FALSE;
         newext2->ignore = FALSE;
+        newext2->inserted = TRUE;
         InsertHeadList(&newext1->list_entry, &newext2->list_entry);
         
         add_insert_extent_rollback(rollback, fcb, newext2);
@@ -3144,6 +3486,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, UINT64 start_data,
         newext3->datalen = ext->datalen;
         newext3->unique = FALSE;
         newext3->ignore = FALSE;
+        newext3->inserted = TRUE;
         InsertHeadList(&newext2->list_entry, &newext3->list_entry);
         
         add_insert_extent_rollback(rollback, fcb, newext3);
@@ -3230,40 +3573,12 @@ NTSTATUS do_write_file(fcb* fcb, UINT64 start, UINT64 end_data, void* data, LIST
                                     
                     TRACE("doing non-COW write to %llx\n", writeaddr);
                     
-                    Status = write_data_complete(fcb->Vcb, writeaddr, (UINT8*)data + written, write_len, Irp, NULL);
+                    Status = do_write_data(fcb->Vcb, writeaddr, (UINT8*)data + written, write_len, changed_sector_list, Irp, NULL);
                     if (!NT_SUCCESS(Status)) {
-                        ERR("write_data_complete returned %08x\n", Status);
+                        ERR("do_write_data returned %08x\n", Status);
                         return Status;
                     }
                     
-                    if (changed_sector_list) {
-                        unsigned int i;
-                        changed_sector* sc;
-                        
-                        sc = ExAllocatePoolWithTag(PagedPool, sizeof(changed_sector), ALLOC_TAG);
-                        if (!sc) {
-                            ERR("out of memory\n");
-                            return STATUS_INSUFFICIENT_RESOURCES;
-                        }
-                        
-                        sc->ol.key = writeaddr;
-                        sc->length = write_len / fcb->Vcb->superblock.sector_size;
-                        sc->deleted = FALSE;
-                        
-                        sc->checksums = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * sc->length, ALLOC_TAG);
-                        if (!sc->checksums) {
-                            ERR("out of memory\n");
-                            ExFreePool(sc);
-                            return STATUS_INSUFFICIENT_RESOURCES;
-                        }
-                        
-                        for (i = 0; i < sc->length; i++) {
-                            sc->checksums[i] = ~calc_crc32c(0xffffffff, (UINT8*)data + written + (i * fcb->Vcb->superblock.sector_size), fcb->Vcb->superblock.sector_size);
-                        }
-    
-                        insert_into_ordered_list(changed_sector_list, &sc->ol);
-                    }
-                    
                     written += write_len;
                     length -= write_len;
                     
@@ -3344,25 +3659,22 @@ nextitem:
 
 NTSTATUS write_compressed(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
-    UINT64 i;
+    UINT64 e2;
+    BOOL compressed;
     
-    for (i = 0; i < sector_align(end_data - start_data, COMPRESSED_EXTENT_SIZE) / COMPRESSED_EXTENT_SIZE; i++) {
-        UINT64 s2, e2;
-        BOOL compressed;
+    // If the first 128 KB of a file is incompressible, we set the nocompress flag so we don't
+    // bother with the rest of it. We do this bit on its own, so we know before compressing anything else.
+    if (start_data == 0 && end_data >= COMPRESSED_EXTENT_SIZE && !fcb->Vcb->options.compress_force) {
+        e2 = COMPRESSED_EXTENT_SIZE;
         
-        s2 = start_data + (i * COMPRESSED_EXTENT_SIZE);
-        e2 = min(s2 + COMPRESSED_EXTENT_SIZE, end_data);
-        
-        Status = write_compressed_bit(fcb, s2, e2, (UINT8*)data + (i * COMPRESSED_EXTENT_SIZE), &compressed, changed_sector_list, Irp, rollback);
+        Status = write_compressed_bit(fcb, 0, e2, data, &compressed, changed_sector_list, Irp, rollback);
         
         if (!NT_SUCCESS(Status)) {
             ERR("write_compressed_bit returned %08x\n", Status);
             return Status;
         }
         
-        // If the first 128 KB of a file is incompressible, we set the nocompress flag so we don't
-        // bother with the rest of it.
-        if (s2 == 0 && e2 == COMPRESSED_EXTENT_SIZE && !compressed && !fcb->Vcb->options.compress_force) {
+        if (!compressed) {
             fcb->inode_item.flags |= BTRFS_INODE_NOCOMPRESS;
             mark_fcb_dirty(fcb);
             
@@ -3378,6 +3690,17 @@ NTSTATUS write_compressed(fcb* fcb, UINT64 start_data, UINT64 end_data, void* da
             
             return STATUS_SUCCESS;
         }
+        
+        if (e2 == end_data)
+            return STATUS_SUCCESS;
+    } else
+        e2 = start_data;
+    
+    // compress the rest on all the CPUs at once
+    Status = write_compressed_parallel(fcb, e2, end_data, (UINT8*)data + (e2 - start_data), changed_sector_list, Irp, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("write_compressed_parallel returned %08x\n", Status);
+        return Status;
     }
     
     return STATUS_SUCCESS;
@@ -3627,7 +3950,32 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
         if (fileref)
             mark_fileref_dirty(fileref);
     } else {
-        BOOL compress = write_fcb_compressed(fcb);
+        BOOL compress;
+        
+        // Linux can leave us an inline extent bigger than max_inline - usually one which was compressed, which we keep
+        // decompressed in memory. If it's not staying inline, it has to become a proper extent before we write to it,
+        // or it might not fit in a leaf when it's written back.
+        if (!make_inline) {
+            LIST_ENTRY* le = fcb->extents.Flink;
+            
+            while (le != &fcb->extents) {
+                extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+                
+                if (!ext->ignore && ext->datalen >= sizeof(EXTENT_DATA) && ext->data->type == EXTENT_TYPE_INLINE) {
+                    Status = convert_inline_extent(fcb, ext, Irp, rollback);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("convert_inline_extent returned %08x\n", Status);
+                        goto end;
+                    }
+                    
+                    break;
+                }
+                
+                le = le->Flink;
+            }
+        }
+        
+        compress = write_fcb_compressed(fcb);
         
         if (make_inline) {
             start_data = 0;
@@ -3966,6 +4314,11 @@ NTSTATUS STDCALL drv_write(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp) {
     
 //     ERR("recursive = %s\n", Irp != IoGetTopLevelIrp() ? "TRUE" : "FALSE");
     
+    // If the flush thread can't keep up, make the writer wait for a commit. We don't do this for paging I/O,
+    // as it might be coming from the commit itself.
+    if (top_level && !(Irp->Flags & IRP_PAGING_IO))
+        throttle_writes(Vcb, Irp);
+    
     try {
         if (IrpSp->MinorFunction & IRP_MN_COMPLETE) {
             CcMdlWriteComplete(IrpSp->FileObject, &IrpSp->Parameters.Write.ByteOffset, Irp->MdlAddress);
@@ -11,6 +11,13 @@
 
 local uLong adler32_combine_ OF((uLong adler1, uLong adler2, z_off64_t len2));
 
+// added by WinBtrfs - SSE2 is always available on amd64, and is safe to use in the kernel there
+#if defined(_M_AMD64) || defined(__x86_64__)
+#include <emmintrin.h>
+#define ADLER32_SSE2
+local uLong adler32_sse2 OF((uLong adler, const Bytef *buf, uInt len));
+#endif
+
 #define BASE 65521      /* largest prime smaller than 65536 */
 #define NMAX 5552
 /* NMAX is the largest n such that 255n(n+1)/2 + (n+1)(BASE-1) <= 2^32-1 */
@@ -101,6 +108,11 @@ uLong ZEXPORT adler32(adler, buf, len)
         return adler | (sum2 << 16);
     }
 
+#ifdef ADLER32_SSE2
+    if (len >= 64)
+        return adler32_sse2(adler | (sum2 << 16), buf, len);
+#endif
+
     /* do length NMAX blocks -- requires just one modulo operation */
     while (len >= NMAX) {
         len -= NMAX;
@@ -132,6 +144,85 @@ uLong ZEXPORT adler32(adler, buf, len)
     return adler | (sum2 << 16);
 }
 
+#ifdef ADLER32_SSE2
+/* ========================================================================= */
+/* added by WinBtrfs - does 32 bytes at a time. Over a block of n bytes, sum2
+   goes up by n times the starting value of adler plus each byte times its
+   distance from the end, which we can do with a multiply-add. */
+local uLong adler32_sse2(adler, buf, len)
+    uLong adler;
+    const Bytef *buf;
+    uInt len;
+{
+    unsigned long s1 = adler & 0xffff;
+    unsigned long s2 = (adler >> 16) & 0xffff;
+    unsigned blocks = len / 32;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i taps1 = _mm_setr_epi16(32, 31, 30, 29, 28, 27, 26, 25);
+    const __m128i taps2 = _mm_setr_epi16(24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i taps3 = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    const __m128i taps4 = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+
+    len -= blocks * 32;
+
+    while (blocks) {
+        unsigned n = NMAX / 32;     /* so we still only need one modulo */
+        __m128i v_ps, v_s1, v_s2;
+
+        if (n > blocks)
+            n = blocks;
+        blocks -= n;
+
+        /* v_ps is the sum of s1 at the start of each block */
+        v_ps = _mm_set_epi32(0, 0, 0, (int)(s1 * n));
+        v_s2 = _mm_set_epi32(0, 0, 0, (int)s2);
+        v_s1 = zero;
+
+        do {
+            const __m128i bytes1 = _mm_loadu_si128((const __m128i*)buf);
+            const __m128i bytes2 = _mm_loadu_si128((const __m128i*)(buf + 16));
+
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpacklo_epi8(bytes1, zero), taps1));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpackhi_epi8(bytes1, zero), taps2));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpacklo_epi8(bytes2, zero), taps3));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpackhi_epi8(bytes2, zero), taps4));
+
+            buf += 32;
+        } while (--n);
+
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+        /* add up the four lanes */
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(2, 3, 0, 1)));
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+        s1 += (unsigned)_mm_cvtsi128_si32(v_s1);
+
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+        s2 = (unsigned)_mm_cvtsi128_si32(v_s2);
+
+        MOD(s1);
+        MOD(s2);
+    }
+
+    if (len) {
+        while (len--) {
+            s1 += *buf++;
+            s2 += s1;
+        }
+        MOD(s1);
+        MOD(s2);
+    }
+
+    return s1 | (s2 << 16);
+}
+#endif
+
 /* ========================================================================= */
 local uLong adler32_combine_(adler1, adler2, len2)
     uLong adler1;
@@ -1258,15 +1258,30 @@ local uInt longest_match(s, cur_match)
         scan += 2, match++;
         Assert(*scan == *match, "match[2]?");
 
-        /* We check for insufficient lookahead only every 8th comparison;
-         * the 256th check will be made at strstart+258.
+        /* added by WinBtrfs - compare eight bytes at a time, and when they
+         * differ work out which byte it was from the XOR. This gives the same
+         * length as comparing a byte at a time would.
          */
-        do {
-        } while (*++scan == *++match && *++scan == *++match &&
-                 *++scan == *++match && *++scan == *++match &&
-                 *++scan == *++match && *++scan == *++match &&
-                 *++scan == *++match && *++scan == *++match &&
-                 scan < strend);
+        scan++, match++;
+        for (;;) {
+            z_word sw, mw;
+
+            if (scan + sizeof(z_word) > strend) {
+                while (scan < strend && *scan == *match)
+                    scan++, match++;
+                break;
+            }
+
+            zmemcpy((Bytef *)&sw, scan, sizeof(z_word));
+            zmemcpy((Bytef *)&mw, match, sizeof(z_word));
+
+            if (sw != mw) {
+                scan += first_diff_byte(sw ^ mw);
+                break;
+            }
+
+            scan += sizeof(z_word), match += sizeof(z_word);
+        }
 
         Assert(scan <= s->window+(unsigned)(s->window_size-1), "wild scan");
 
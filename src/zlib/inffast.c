@@ -21,6 +21,10 @@
    - Pentium III (Anderson)
    - M68060 (Nikl)
  */
+// added by WinBtrfs - post-increment means out points to where the next byte goes, which makes the block copies
+// below simpler
+#define POSTINC
+
 #ifdef POSTINC
 #  define OFF 0
 #  define PUP(a) *(a)++
@@ -218,9 +222,8 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                         from += wsize - op;
                         if (op < len) {         /* some from window */
                             len -= op;
-                            do {
-                                PUP(out) = PUP(from);
-                            } while (--op);
+                            zmemcpy(out, from, op);
+                            out += op;
                             from = out - dist;  /* rest from output */
                         }
                     }
@@ -229,9 +232,8 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                         op -= wnext;
                         if (op < len) {         /* some from end of window */
                             len -= op;
-                            do {
-                                PUP(out) = PUP(from);
-                            } while (--op);
+                            zmemcpy(out, from, op);
+                            out += op;
                             from = window - OFF;
                             if (wnext < len) {  /* some from start of window */
                                 op = wnext;
@@ -247,9 +249,8 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                         from += wnext - op;
                         if (op < len) {         /* some from window */
                             len -= op;
-                            do {
-                                PUP(out) = PUP(from);
-                            } while (--op);
+                            zmemcpy(out, from, op);
+                            out += op;
                             from = out - dist;  /* rest from output */
                         }
                     }
@@ -267,6 +268,23 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                 }
                 else {
                     from = out - dist;          /* copy direct from output */
+                    /* added by WinBtrfs - if the match is at least eight bytes
+                       back, copy eight bytes at a time. This can go up to
+                       seven bytes past the end of the match, which is fine as
+                       there's always at least 258 bytes of room here, and
+                       they'll be overwritten later. */
+                    if (dist >= sizeof(z_word) &&
+                        len + sizeof(z_word) - 1 <= (unsigned)(end - out) + 257) {
+                        unsigned char FAR *stop = out + len;
+
+                        do {
+                            zmemcpy(out, from, sizeof(z_word));
+                            out += sizeof(z_word);
+                            from += sizeof(z_word);
+                        } while (out < stop);
+                        out = stop;
+                        continue;
+                    }
                     do {                        /* minimum length is three */
                         PUP(out) = PUP(from);
                         PUP(out) = PUP(from);
@@ -48,6 +48,42 @@ typedef unsigned short ush;
 typedef ush FAR ushf;
 typedef unsigned long  ulg;
 
+// added by WinBtrfs - for comparing and copying eight bytes at a time
+#ifdef _MSC_VER
+typedef unsigned __int64 z_word;
+#else
+typedef unsigned long long z_word;
+#endif
+
+// added by WinBtrfs - the index of the lowest non-zero byte of x, which mustn't be zero. This assumes
+// little-endian, which all the architectures Windows runs on are.
+#if defined(_MSC_VER) && (defined(_M_AMD64) || defined(_M_ARM64))
+#include <intrin.h>
+#pragma intrinsic(_BitScanForward64)
+#define first_diff_byte(x) z_bsf64(x)
+static __inline unsigned z_bsf64(z_word x) {
+    unsigned long i;
+
+    _BitScanForward64(&i, x);
+
+    return i >> 3;
+}
+#elif defined(__GNUC__)
+#define first_diff_byte(x) (__builtin_ctzll(x) >> 3)
+#else
+#define first_diff_byte(x) z_first_diff_byte(x)
+static __inline unsigned z_first_diff_byte(z_word x) {
+    unsigned n = 0;
+
+    while (!(x & 0xff)) {
+        x >>= 8;
+        n++;
+    }
+
+    return n;
+}
+#endif
+
 extern z_const char * const z_errmsg[10]; /* indexed by 2-zlib_error */
 /* (size given to avoid silly warnings with Visual C++) */
 